@@ -28,7 +28,7 @@
 #include <n3n/ethernet.h>            // for macaddr_str, macstr_t
 #include <n3n/initfuncs.h>           // for n3n_initfuncs()
 #include <n3n/logging.h>             // for traceEvent
-#include <n3n/mainloop.h>            // for mainloop_register_fd
+#include <n3n/mainloop.h>            // for mainloop_runonce
 #include <n3n/tests.h>               // for test_hashing
 #include <n3n/random.h>              // for n3n_rand_seeds, n3n_rand_seeds_s...
 #include <n3n/transform.h>           // for n3n_transform_lookup_id
@@ -51,6 +51,7 @@
 #include "uthash.h"                  // for UT_hash_handle, HASH_ADD, HASH_C...
 
 // FIXME, including private headers
+#include "../src/edge_utils.h"       // for edge_register_tap, edge_load_pe...
 #include "../src/peer_info.h"        // for peer_info, peer_info_t
 #include "../src/resolve.h"          // for resolve_check
 
@@ -754,6 +755,12 @@ int main (int argc, char* argv[]) {
 
     n3n_config(argc, argv, "edge", &conf);
 
+    // all probes of a traversal round are sent at once from the main loop
+    if(conf.nat_probe_ports > NAT_PROBE_PORTS_MAX) {
+        traceEvent(TRACE_WARNING, "limiting nat_probe_ports to %u", NAT_PROBE_PORTS_MAX);
+        conf.nat_probe_ports = NAT_PROBE_PORTS_MAX;
+    }
+
     // --- additional crypto setup; REVISIT: move to edge_init()?
     // payload
     if(conf.transop_id == N2N_TRANSFORM_ID_NULL) {
@@ -918,7 +925,7 @@ int main (int argc, char* argv[]) {
             if(eee->conf.tuntap_ip_mode == TUNTAP_IP_MODE_SN_ASSIGN) {
                 last_action = now;
                 eee->sn_wait = 1;
-                send_register_super(eee);
+                send_register_super_all(eee);
                 runlevel++;
                 traceEvent(
                     TRACE_INFO,
@@ -959,10 +966,9 @@ int main (int argc, char* argv[]) {
                            eee->conf.mtu,
                            eee->conf.metric) < 0)
                 exit(1);
-#ifndef _WIN32
-            // TODO: this internal fn should not be called publicly
-            mainloop_register_fd(eee->device.fd, fd_info_proto_tuntap);
-#endif
+            edge_register_tap(eee);
+            // Now that traffic can flow, try the peers from the last run
+            edge_load_peer_cache(eee);
             in_addr_t addr = eee->conf.tuntap_v4.net_addr;
             struct in_addr *tmp = (struct in_addr *)&addr;
             traceEvent(TRACE_NORMAL, "created local tap device IPv4: %s/%u, MAC: %s",
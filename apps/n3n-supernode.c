@@ -521,8 +521,6 @@ int main (int argc, char * argv[]) {
         sss_node.conf.sn_min_auto_ip_net.net_bitlen
     );
 
-    calculate_shared_secrets(&sss_node);
-
     traceEvent(TRACE_DEBUG, "traceLevel is %d", getTraceLevel());
 
     struct sockaddr_in *sa = (struct sockaddr_in *)sss_node.conf.bind_address;
@@ -635,6 +633,9 @@ int main (int argc, char * argv[]) {
     }
 #endif
 
+    // after the sessiondir is set up, so the secrets saved there are used
+    calculate_shared_secrets(&sss_node);
+
     sn_init(&sss_node);
 
     traceEvent(TRACE_NORMAL, "supernode started");
@@ -17,4 +17,13 @@
  */
 
 
+#ifndef _CURVE25519_H_
+#define _CURVE25519_H_
+
+/* q = n * p, with the scalar n clamped; 64 bit limbs where the compiler has a 128 bit type */
 void curve25519 (unsigned char *q, const unsigned char *n, const unsigned char *p);
+
+/* the same, portable but slower reference code */
+void curve25519_ref (unsigned char *q, const unsigned char *n, const unsigned char *p);
+
+#endif
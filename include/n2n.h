@@ -110,6 +110,12 @@ int tuntap_read (struct tuntap_dev *tuntap, unsigned char *buf, int len);
 int tuntap_write (struct tuntap_dev *tuntap, unsigned char *buf, int len);
 void tuntap_close (struct tuntap_dev *tuntap);
 void tuntap_get_address (struct tuntap_dev *tuntap);
+#ifdef __linux__
+#define TUNTAP_EVENT_ADDRESS    0x01    /* ip_addr has changed */
+#define TUNTAP_EVENT_LINK       0x02    /* link_up has changed */
+#define TUNTAP_EVENT_GONE       0x04    /* the interface was removed */
+int tuntap_monitor_read (struct tuntap_dev *tuntap);
+#endif
 
 /* Utils */
 char* inaddrtoa (ipstr_t out, struct in_addr addr);
@@ -147,8 +153,15 @@ int quick_edge_init (char *device_name, char *community_name,
                      char *supernode_ip_address_port,
                      bool *keep_on_running);
 int comm_init (struct sn_community *comm, char *cmn);
+bool sn_community_allowed (struct n3n_runtime_data *sss, const char *name);
+struct sn_community *sn_community_add (struct n3n_runtime_data *sss, const char *name);
 void sn_init (struct n3n_runtime_data *sss);
 void sn_term (struct n3n_runtime_data *sss);
 int assign_one_ip_subnet (struct n3n_runtime_data *sss, struct sn_community *comm);
+int subnet_available (struct n3n_runtime_data *sss, struct sn_community *comm,
+                      uint32_t net_id, uint32_t mask);
+void update_node_supernode_association (struct sn_community *comm, n2n_mac_t *edgeMac,
+                                        const struct sockaddr *sender_sock, socklen_t sock_size,
+                                        time_t now);
 
 #endif /* _N2N_H_ */
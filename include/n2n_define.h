@@ -31,6 +31,30 @@
 #define PURGE_REGISTRATION_FREQUENCY     30
 #define RE_REG_AND_PURGE_FREQUENCY       10
 #define REGISTRATION_TIMEOUT             60
+#define PEER_CACHE_SAVE_INTERVAL         60 /* sec, how often the edge saves its known peers to the sessiondir */
+#define PEER_CACHE_MAX_AGE            86400 /* sec, cached peers with no p2p traffic for longer are not tried */
+#define PEER_PROBE_INTERVAL              10 /* sec, how often the round trip time to p2p peers is measured */
+#define RELAY_INFO_INTERVAL              20 /* sec, how often a relaying edge advertises its direct peers */
+#define RELAY_INFO_TIMEOUT               60 /* sec, advertisements not renewed for longer are dropped */
+#define RELAY_MAX_RATE_DFL             1024 /* KiB/s, default cap on traffic relayed for other edges */
+#define RELAY_MAX_LOSS                  500 /* permille, peers losing more probes are not relayed through or to */
+#define NAT_PUNCH_INTERVAL                3 /* sec, minimum time between two traversal rounds towards a peer */
+#define NAT_PUNCH_MAX_ROUNDS              8 /* traversal rounds towards a peer before leaving it to the supernode */
+#define NAT_PROBE_PORTS_DFL              32 /* ports probed per traversal round */
+#define NAT_PROBE_PORTS_MAX             256 /* larger settings are limited to this, all are sent at once */
+#define NAT_MAX_PORT_DELTA              256 /* larger port allocation steps are taken as random */
+#define PEER_INFO_PUSH_INTERVAL          10 /* sec, minimum time between two PEER_INFO pushes for the same flow */
+#define PEER_INFO_PUSH_SLOTS              4 /* flows per edge remembered for PEER_INFO_PUSH_INTERVAL */
+#define PEER_INFO_PUSH_RATE_DFL          20 /* flows per second and community the supernode pushes PEER_INFO for */
+#define REGISTER_SOURCE_RATE_DFL         20 /* new registrations and undecryptable datagrams per second and source address */
+#define NEIGH_CACHE_TIMEOUT             120 /* sec, how long a neighbour binding is used to answer ARP and solicitations */
+#define MCAST_REPORT_INTERVAL            20 /* sec, how often a snooping edge reports its multicast groups to the supernode */
+#define MCAST_QUERY_INTERVAL             60 /* sec, how often a snooping edge asks its local hosts for their groups */
+#define MCAST_GROUP_TIMEOUT             150 /* sec, groups and members not reported for longer are dropped */
+#define MCAST_LEAVE_DELAY                10 /* sec, for other local members to answer the query sent after a leave */
+#define MCAST_QUERY_RESPONSE             10 /* sec, local hosts are asked to answer a query within this time */
+#define BCAST_PEERS_INTERVAL             10 /* sec, how often an edge tells the supernode the peers it sends broadcasts to */
+#define BCAST_PEERS_TIMEOUT              30 /* sec, the supernode sends to all edges again if not told for longer */
 
 #define SOCKET_TIMEOUT_INTERVAL_SECS     10
 #define REGISTER_SUPER_INTERVAL_DFL      20 /* sec, usually UDP NAT entries in a firewall expire after 30 seconds */
@@ -38,6 +62,7 @@
                                              * and when we send out packets to query selection-relevant informations from supernodes. */
 #ifdef HAVE_BRIDGING_SUPPORT
 #define HOSTINFO_TIMEOUT                300 /* sec, how long after last seen will the hostinfo be deleted */
+#define LAYER3_FLOOD_INTERVAL             1 /* sec, layer 3 mode sends one packet to an unknown destination to all edges this often */
 #endif
 #define NUMBER_SN_PINGS_INITIAL          15 /* number of supernodes to concurrently ping during bootstrap and immediately afterwards */
 #define NUMBER_SN_PINGS_REGULAR           5 /* number of supernodes to concurrently ping during regular edge operation */
@@ -49,6 +74,7 @@
 #define LAST_SEEN_SN_NEW                 (LAST_SEEN_SN_INACTIVE - 3 * RE_REG_AND_PURGE_FREQUENCY) /* sec, indicates supernodes with unsure status, must be tested to check if they are active */
 
 #define IFACE_UPDATE_INTERVAL            (30) /* sec. How long it usually takes to get an IP lease. */
+#define TUNTAP_REOPEN_INTERVAL            (3) /* sec. How long to wait before reopening a failed TAP device. */
 
 #define SORT_COMMUNITIES_INTERVAL        90 /* sec. until supernode sorts communities' hash list again */
 
@@ -124,6 +150,9 @@ enum n3n_event_topic {
 
 #define N2N_SN_LPORT_DEFAULT 7654
 #define N2N_SN_PKTBUF_SIZE   2048
+#define N2N_SN_FQ_MAX_PKTS   128   /* PACKET copies queued per community while the socket is congested */
+#define N2N_SN_FQ_QUANTUM    N2N_SN_PKTBUF_SIZE  /* bytes a community may send per round */
+#define N2N_SN_ADMIT_SOURCES 1024  /* source addresses tracked for the registration rate limit */
 
 
 /* The way TUNTAP allocated IP. */
@@ -149,13 +178,22 @@ enum n3n_event_topic {
 #define N2N_PRIVATE_PUBLIC_KEY_SIZE 32
 #define N2N_USER_KEY_LINE_STARTER  '*'
 #define N2N_NO_REG_COOKIE          0x00000000
+#define N2N_PROBE_REG_COOKIE       0x00000100 /* round trip time probe to a known peer, ranks lowest */
 #define N2N_FORWARDED_REG_COOKIE   0x00001000
 #define N2N_PORT_REG_COOKIE        0x00004000
 #define N2N_REGULAR_REG_COOKIE     0x00010000
 #define N2N_MCAST_REG_COOKIE       0x00400000
 #define N2N_LOCAL_REG_COOKIE       0x01000000
 #define N2N_DESC_SIZE              16
+#define N2N_RELAY_INFO_MAX_PEERS   64  /* direct peers listed in one RELAY_INFO */
+#define N2N_MCAST_MAX_GROUPS       64  /* multicast groups listed in one MCAST_GROUPS */
+#define N2N_MCAST_GROUPS_OVERFLOW  0x01  /* MCAST_GROUPS flag, more groups joined than can be listed */
+#define N2N_BCAST_MAX_PEERS        64  /* peers listed in one BCAST_PEERS */
 #define N2N_PKT_BUF_SIZE           2048
+#define N2N_RX_QUEUE_CONTROL       16  /* control datagrams read ahead of processing */
+#define N2N_RX_QUEUE_DATA          32  /* PACKET datagrams read ahead of processing */
+#define N2N_RX_QUEUE_BUDGET        64  /* datagrams read from the socket in one go */
+#define N2N_RX_QUEUE_ADMIT          8  /* registrations of unknown edges read ahead of processing */
 #define N2N_SOCKBUF_SIZE           64  /* string representation of INET or INET6 sockets */
 
 #define N2N_MULTICAST_PORT         1968
@@ -169,6 +207,13 @@ enum n3n_event_topic {
 
 #define SN_SELECTION_CRITERION_DATA_TYPE    uint64_t
 #define SN_SELECTION_CRITERION_BUF_SIZE     16
+#define SN_SELECTION_RTT_HYSTERESIS_DIV     8     /* only switch to a supernode with an rtt lower by 1/8 ... */
+#define SN_SELECTION_RTT_HYSTERESIS_MIN     2000  /* ... and by at least this many usec */
+#define SN_SELECTION_LOAD_WINDOW            5     /* seconds over which the supernode load is measured */
+#define SN_SELECTION_LOAD_SMOOTHING         4     /* each window contributes 1/4 to the reported load */
+#define SN_SELECTION_LOAD_BUSY_WEIGHT       10    /* load points per permille of loop utilisation */
+#define SN_SELECTION_LOAD_PKTS_PER_POINT    10    /* relayed packets per second for one load point */
+#define SN_SELECTION_LOAD_BYTES_PER_POINT   10240 /* relayed bytes per second for one load point */
 
 #define N2N_TRANSFORM_ID_USER_START         64
 #define N2N_TRANSFORM_ID_MAX                65535
@@ -108,9 +108,12 @@ enum PACK_STRUCT n3n_msg_type {
     MSG_TYPE_FEDERATION =         9,  /* UNUSED */
     MSG_TYPE_PEER_INFO =         10,  /* Send info on a peer (sn to edge) */
     MSG_TYPE_QUERY_PEER =        11,  /* ask supernode for info on a peer */
-    MSG_TYPE_RE_REGISTER_SUPER = 12   /* ask edge to re-register with sn */
+    MSG_TYPE_RE_REGISTER_SUPER = 12,  /* ask edge to re-register with sn */
+    MSG_TYPE_RELAY_INFO =        13,  /* Peers an edge can relay to (edge to edges via sn) */
+    MSG_TYPE_MCAST_GROUPS =      14,  /* Multicast groups joined behind an edge (edge to sn) */
+    MSG_TYPE_BCAST_PEERS =       15   /* Peers an edge sends broadcasts to directly (edge to sn) */
 };
-#define MSG_TYPE_MAX_TYPE        12
+#define MSG_TYPE_MAX_TYPE        15
 
 #if defined(_MSC_VER) || defined(__MINGW32__)
 #pragma pack(pop)
@@ -135,10 +138,16 @@ typedef struct tuntap_dev {
 #ifndef _WIN32
     int fd;
     devstr_t dev_name;
+#endif
+#ifdef __linux__
+    int nl_fd;          /* netlink socket reporting link and address changes */
+    int if_index;
+    bool link_up;
 #endif
     in_addr_t ip_addr;
     n2n_mac_t mac_addr;
     uint16_t mtu;
+    bool layer3;        /* TUN instead of TAP, IP packets without ethernet header (Linux only) */
 #ifdef _WIN32
     HANDLE device_handle;
     char            *device_name;
@@ -160,9 +169,11 @@ typedef u_short sa_family_t;
 typedef char n2n_sn_name_t[N2N_EDGE_SN_HOST_SIZE];
 
 // This one bit higher than the largest used flag value.  It is used in the
-// header encryption detection heuristic and is not a flag itself
-#define N2N_FLAGS_OPTIONS_MAX            0x0080
+// header encryption detection heuristic and is not a flag itself.  As a
+// supernode never gets N2N_FLAGS_RELAYED, the heuristic also refuses that one
+#define N2N_FLAGS_OPTIONS_MAX            0x0100
 
+#define N2N_FLAGS_RELAYED                0x0080  /* PACKET forwarded by a relaying edge */
 #define N2N_FLAGS_SOCKET                 0x0040
 #define N2N_FLAGS_FROM_SUPERNODE         0x0020
 
@@ -292,6 +303,7 @@ typedef struct n2n_REGISTER_SUPER_ACK {
                                      * even if we cannot store them all. */
 
     uint32_t key_time;              /**< key time for dynamic key, used between federatred supernodes only */
+    uint32_t load;                  /**< load of answering supernode, zero if not reported */
 } n2n_REGISTER_SUPER_ACK_t;
 
 
@@ -340,6 +352,33 @@ typedef struct n2n_QUERY_PEER {
 
 } n2n_QUERY_PEER_t;
 
+typedef struct n2n_RELAY_INFO_peer {
+    n2n_mac_t mac;                  /**< MAC of a peer with a direct p2p path */
+    uint32_t rtt;                   /**< Measured round trip time to it, usec */
+} n2n_RELAY_INFO_peer_t;
+
+/* Linked with n2n_relay_info via enum n3n_msg_type. From edge to edges via supernode. */
+typedef struct n2n_RELAY_INFO {
+    n2n_mac_t srcMac;               /**< MAC of the relaying edge */
+    uint8_t num_peers;              /**< Number of entries following */
+    n2n_RELAY_INFO_peer_t peers[N2N_RELAY_INFO_MAX_PEERS];
+} n2n_RELAY_INFO_t;
+
+/* Linked with n2n_mcast_groups via enum n3n_msg_type. From edge to supernode. */
+typedef struct n2n_MCAST_GROUPS {
+    n2n_mac_t srcMac;               /**< MAC of the reporting edge */
+    uint8_t flags;                  /**< N2N_MCAST_GROUPS_OVERFLOW if the list is not complete */
+    uint8_t num_groups;             /**< Number of entries following */
+    n2n_mac_t groups[N2N_MCAST_MAX_GROUPS];     /**< Ethernet addresses of the groups joined */
+} n2n_MCAST_GROUPS_t;
+
+/* Linked with n2n_bcast_peers via enum n3n_msg_type. From edge to supernode. */
+typedef struct n2n_BCAST_PEERS {
+    n2n_mac_t srcMac;               /**< MAC of the edge sending the broadcasts */
+    uint8_t num_peers;              /**< Number of entries following */
+    n2n_mac_t peers[N2N_BCAST_MAX_PEERS];       /**< MACs of the peers it sends them to directly */
+} n2n_BCAST_PEERS_t;
+
 typedef struct n2n_buf n2n_buf_t;
 
 #ifdef HAVE_BRIDGING_SUPPORT
@@ -423,6 +462,8 @@ typedef struct n2n_edge_conf {
     n2n_desc_t dev_desc;                             /**< The device description (hint) */
     bool allow_routing;                              /**< Accept packet no to interface address. */
     bool allow_multicast;                            /**< Multicast ethernet addresses. */
+    bool neigh_proxy;                                /**< Answer ARP and neighbour solicitations from a cache. */
+    bool mcast_snooping;                             /**< Tell the supernode the multicast groups joined behind us. */
     bool pmtu_discovery;                             /**< Enable the Path MTU discovery. */
     bool allow_p2p;                                  /**< Allow P2P connection */
     n2n_private_public_key_t *public_key;            /**< edge's public key (for user/password based authentication) */
@@ -453,6 +494,13 @@ typedef struct n2n_edge_conf {
     uint32_t groupid;
     bool connect_tcp;                                /** connection to supernode 0 = UDP; 1 = TCP */
     uint8_t sn_selection_strategy;                  /**< encodes currently chosen supernode selection strategy. */
+    bool sn_parallel;                                /**< register with all supernodes at once when looking for one */
+    bool p2p_broadcast;                              /**< send broadcasts to the p2p peers directly */
+    bool relay_for_peers;                            /**< forward packets between peers that have no direct path */
+    bool relay_via_peers;                            /**< reach peers without a direct path through a relaying edge */
+    uint32_t relay_max_rate;                         /**< KiB/s forwarded for other edges, 0 = unlimited */
+    bool nat_traversal;                              /**< probe many ports for peers the simple hole punch fails for */
+    uint32_t nat_probe_ports;                        /**< ports probed per traversal round */
     bool background;
     uint8_t number_max_sn_pings;                    /**< Number of maximum concurrently allowed supernode pings. */
     char device_mac[N2N_MACNAMSIZ];
@@ -464,9 +512,17 @@ typedef struct n2n_edge_conf {
     devstr_t tuntap_dev_name;
     struct n2n_ip_subnet tuntap_v4;
     uint8_t tuntap_ip_mode;                          /**< Interface IP address allocated mode, eg. DHCP. */
+    bool tuntap_layer3;                              /**< use a TUN interface and route by IP address */
 
     // Supernode specific config
     bool spoofing_protection;                                /* false if overriding MAC/IP spoofing protection (cli option '-M') */
+    uint32_t sn_peer_info_push;                              /* flows per second and community to push PEER_INFO for, 0 = off */
+    uint32_t sn_community_max_rate;                          /* KiB/s of PACKET data relayed per community, 0 = unlimited */
+    uint32_t sn_community_max_pps;                           /* PACKETs per second relayed per community, 0 = unlimited */
+    uint32_t sn_edge_max_rate;                               /* KiB/s of PACKET data relayed per edge, 0 = unlimited */
+    uint32_t sn_edge_max_pps;                                /* PACKETs per second relayed per edge, 0 = unlimited */
+    uint32_t sn_register_max_pps;                            /* registrations of unknown edges per second, 0 = unlimited */
+    uint32_t sn_register_source_max_pps;                     /* the same plus undecryptable datagrams per source address, 0 = unlimited */
     char *community_file;
     n2n_version_t version;                                  /* version string sent to edges along with PEER_INFO a.k.a. PONG */
     n2n_mac_t sn_mac_addr;
@@ -487,14 +543,64 @@ struct n2n_edge_stats {
     uint32_t tx_multicast_drop;
     uint32_t rx_multicast_drop;
     uint32_t tx_tuntap_error;
+    uint32_t tx_relay;          /* Sent through a relaying edge. */
+    uint32_t rx_relay;          /* Received through a relaying edge. */
+    uint32_t relay_fwd;         /* Forwarded for other edges. */
+    uint32_t relay_drop;        /* Not forwarded: no direct path, TTL or rate limit. */
+    uint32_t nat_punch;         /* Peers the multi-port traversal was started for. */
+    uint32_t nat_probe;         /* REGISTERs sent by the multi-port traversal. */
+    uint32_t nat_punch_ok;      /* Peers reached directly after the multi-port traversal. */
+    uint32_t neigh_proxy;       /* ARP requests and neighbour solicitations answered from the cache. */
+    uint32_t neigh_miss;        /* Those still sent to the community. */
+    uint32_t tx_bcast_p2p;      /* Broadcast copies sent to p2p peers directly. */
+    uint32_t tx_layer3_drop;    /* Layer 3 packets dropped while waiting for a route. */
+    uint32_t rx_ctrl;           /* Control datagrams queued ahead of the data. */
+    uint32_t rx_ctrl_peak;      /* Most control datagrams queued at once. */
+    uint32_t rx_data;           /* PACKET datagrams queued. */
+    uint32_t rx_data_peak;      /* Most PACKET datagrams queued at once. */
+    uint32_t rx_data_drop;      /* PACKET datagrams dropped while the socket stayed full. */
+    uint32_t rx_admit;          /* Registrations of unknown edges queued behind the known edges' traffic. */
+    uint32_t rx_admit_peak;     /* Most of those queued at once. */
+    uint32_t rx_admit_drop;     /* Those dropped, the queue was full. */
     uint32_t sn_errors;         /* Number of errors encountered. */
     uint32_t sn_reg;            /* Number of REGISTER_SUPER requests received. */
     uint32_t sn_reg_nak;        /* Number of REGISTER_SUPER requests declined. */
     uint32_t sn_fwd;            /* Number of messages forwarded. */
     uint32_t sn_broadcast;      /* Number of messages broadcast to a community. */
+    uint32_t sn_peer_info_push; /* Number of PEER_INFO sent unasked to edges of a relayed flow. */
+    uint32_t sn_bcast_skip;     /* Broadcast copies not sent, the sender reached the edge directly. */
+    uint32_t sn_rate_drop;      /* PACKETs over the community or edge rate limit. */
+    uint32_t sn_fq_queued;      /* PACKET copies queued while the socket was congested. */
+    uint32_t sn_fq_drop;        /* PACKET copies not queued, the community's queue was full. */
+    uint32_t sn_reg_rate_drop;  /* Registrations of unknown edges over the overall limit. */
+    uint32_t sn_reg_source_drop;/* Registrations dropped, their source was over its limit. */
     uint32_t sn_drop;
 };
 
+/* Token buckets for a byte and a packet rate, one second deep */
+struct token_bucket {
+    uint64_t bytes;         /* bytes that may still be sent, in millionths */
+    uint64_t pkts;          /* packets that may still be sent, in millionths */
+    uint64_t refill;        /* usec, last time the buckets were topped up */
+};
+
+/* Relayed data waiting for a congested socket, served deficit round robin */
+struct fair_queue {
+    struct fq_packet *head;
+    struct fq_packet *tail;
+    uint32_t len;           /* packets queued */
+    uint32_t deficit;       /* bytes the queue may still send this round */
+};
+
+/* Supernode relay load, measured over a window of SN_SELECTION_LOAD_WINDOW */
+struct sn_load {
+    uint64_t window_start;  /* usec, start of the current window */
+    uint64_t busy;          /* usec spent handling packets in this window */
+    uint64_t bytes;         /* bytes relayed in this window */
+    uint32_t pkts;          /* packets relayed in this window */
+    uint32_t value;         /* smoothed load figure reported to edges */
+};
+
 typedef struct n2n_tcp_connection {
     int socket_fd;                                        /* file descriptor for tcp socket */
     socklen_t sock_len;                                   /* amount of actually used space (of the following) */
@@ -521,6 +627,7 @@ struct n3n_runtime_data {
     struct peer_info                 *curr_sn;                           /**< Currently active supernode. */
     uint8_t sn_wait;                                                     /**< Whether we are waiting for a supernode response. */
     uint8_t sn_pong;                                                     /**< Whether we have seen a PONG since last time reset. */
+    bool sn_search;                                                      /**< REGISTER_SUPER went to all supernodes, the first to answer wins */
     bool resolution_request;                                             /**< Flag an immediate DNS resolution request */
     int close_socket_counter;                                            /**< counter for close-event before re-opening */
     size_t sup_attempts;                                                 /**< Number of remaining attempts to this supernode. */
@@ -547,6 +654,15 @@ struct n3n_runtime_data {
 #ifdef HAVE_BRIDGING_SUPPORT
     struct host_info *               known_hosts;                        /**< hosts we know. */
 #endif
+    struct relay_info *              relays;                             /**< Advertisements of relaying edges. */
+    struct relay_route *             relay_routes;                       /**< Best relay for each peer without a direct path. */
+    struct token_bucket relay_limit;                                     /**< Rate limiter state for relay_max_rate. */
+    struct ip_routes *               ip_routes;                          /**< Edges to send IP packets to in layer 3 mode. */
+    struct neigh_entry *             neigh_cache;                        /**< IP to MAC bindings of the hosts behind other edges. */
+    struct mcast_group *             mcast_groups;                       /**< Multicast groups joined by the local hosts. */
+    time_t last_mcast_report;                                            /**< Last time the groups were sent to the supernode, 0 to send soon. */
+    time_t last_mcast_query;                                             /**< Last time the local hosts were asked for their groups, 0 to ask soon. */
+    time_t last_bcast_peers;                                             /**< Last time the broadcast peers were sent to the supernode. */
 /* Timers */
     time_t last_register_req;                                            /**< Check if time to re-register with super*/
     time_t last_p2p;                                                     /**< Last time p2p traffic was received. */
@@ -555,10 +671,12 @@ struct n3n_runtime_data {
     time_t last_sn_fwd;       /* Time when last message was forwarded. */
     time_t last_sn_reg;       /* Time when last REGISTER_SUPER was received. */
     time_t start_time;                                                   /**< For calculating uptime */
+    time_t tuntap_reopen;                                                /**< When to retry opening a failed TAP device, or zero */
 
 
 
     struct n2n_edge_stats stats;                                         /**< Statistics */
+    struct rx_queue *                rx_queue;                           /**< Datagrams read from the UDP socket, control first. */
 
     n3n_resolve_parameter_t          *resolve_parameter;                 /**< Pointer to name resolver's parameter block */
 
@@ -574,6 +692,12 @@ struct n3n_runtime_data {
     struct sn_community_regular_expression *rules;
     struct sn_community                    *federation;
     n2n_private_public_key_t private_key;                     /* private federation key derived from federation name */
+    struct sn_load load;                                      /* relay load reported for supernode selection */
+    uint32_t fq_backlog;                                      /* PACKET copies waiting in the communities' fair queues */
+    struct sn_community *fq_next;                             /* community to continue the fair queuing with */
+    struct token_bucket reg_limit;                            /* registrations of unknown edges */
+    struct admit_table *admit;                                /* registration limits per source address */
+    struct sn_worker *worker;                                 /* background thread for the costly control work */
 };
 
 typedef struct node_supernode_association {
@@ -594,6 +718,7 @@ typedef struct sn_user {
     n2n_private_public_key_t shared_secret;
     struct speck_context_t *shared_secret_ctx;
     n2n_desc_t name;
+    bool reload_unseen;                     /* not (yet) found in the community list being loaded */
 
     UT_hash_handle hh;
 } sn_user_t;
@@ -613,6 +738,20 @@ struct sn_community {
     sn_user_t                     *allowed_users;         /* list of allowed users */
     int64_t number_enc_packets;                           /* Number of encrypted packets handled so far, required for sorting from time to time */
     n2n_ip_subnet_t auto_ip_net;                          /* Address range of auto ip address service. */
+    time_t peer_info_push_second;                         /* Second the PEER_INFO pushes are currently counted for. */
+    uint32_t peer_info_push_count;                        /* Flows PEER_INFO was pushed for in that second. */
+    struct mcast_group *mcast_groups;                     /* Multicast groups joined by snooping edges. */
+    uint32_t max_rate;                                    /* KiB/s relayed from community.list, 0 = supernode default */
+    uint32_t max_pps;                                     /* PACKETs per second relayed, 0 = supernode default */
+    uint32_t edge_max_rate;                               /* KiB/s relayed per edge, 0 = supernode default */
+    uint32_t edge_max_pps;                                /* PACKETs per second relayed per edge, 0 = supernode default */
+    struct token_bucket limit;                            /* Rate limiter state for max_rate and max_pps. */
+    struct fair_queue fq;                                 /* PACKETs waiting for the congested socket. */
+    uint32_t rate_drop;                                   /* PACKETs over the community's or an edge's limit. */
+    uint32_t fq_queued;                                   /* PACKET copies that had to wait in fq. */
+    uint32_t fq_drop;                                     /* PACKET copies dropped with fq full. */
+    bool reload_unseen;                                   /* not (yet) found in the community list being loaded */
+    bool reload_had_users;                                /* had allowed_users before the reload */
 
     UT_hash_handle hh;                                    /* makes this structure hashable */
 };
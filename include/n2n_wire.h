@@ -175,4 +175,37 @@ int decode_QUERY_PEER (n2n_QUERY_PEER_t * pkt,
                        size_t * rem,
                        size_t * idx);
 
+int encode_RELAY_INFO (uint8_t * base,
+                       size_t * idx,
+                       const n2n_common_t * common,
+                       const n2n_RELAY_INFO_t * pkt);
+
+int decode_RELAY_INFO (n2n_RELAY_INFO_t * pkt,
+                       const n2n_common_t * cmn, /* info on how to interpret it */
+                       const uint8_t * base,
+                       size_t * rem,
+                       size_t * idx);
+
+int encode_MCAST_GROUPS (uint8_t * base,
+                         size_t * idx,
+                         const n2n_common_t * common,
+                         const n2n_MCAST_GROUPS_t * pkt);
+
+int decode_MCAST_GROUPS (n2n_MCAST_GROUPS_t * pkt,
+                         const n2n_common_t * cmn, /* info on how to interpret it */
+                         const uint8_t * base,
+                         size_t * rem,
+                         size_t * idx);
+
+int encode_BCAST_PEERS (uint8_t * base,
+                        size_t * idx,
+                        const n2n_common_t * common,
+                        const n2n_BCAST_PEERS_t * pkt);
+
+int decode_BCAST_PEERS (n2n_BCAST_PEERS_t * pkt,
+                        const n2n_common_t * cmn, /* info on how to interpret it */
+                        const uint8_t * base,
+                        size_t * rem,
+                        size_t * idx);
+
 #endif /* #if !defined( N2N_WIRE_H_ ) */
@@ -26,6 +26,9 @@ enum __attribute__((__packed__)) fd_info_proto {
     fd_info_proto_v3udp,
     fd_info_proto_v3tcp,
     fd_info_proto_http,
+    fd_info_proto_event,
+    fd_info_proto_resolve,
+    fd_info_proto_tuntap_monitor,
 };
 
 // Place debug info from the slots into the strbuf
@@ -43,5 +46,9 @@ int mainloop_runonce (struct n3n_runtime_data *);
 void mainloop_register_fd (int, enum fd_info_proto);
 void mainloop_unregister_fd (int);
 
+// Change the protocol used to handle an already registered file handle.
+// returns false if the file handle is not registered with the mainloop
+bool mainloop_set_proto (int, enum fd_info_proto);
+
 
 #endif
@@ -15,6 +15,7 @@
 
 int load_allowed_sn_community (struct n3n_runtime_data *sss);
 void calculate_shared_secrets (struct n3n_runtime_data *sss);
+void calculate_dynamic_keys (struct n3n_runtime_data *sss);
 void sn_init_conf_defaults (struct n3n_runtime_data *sss, char *sessionname);
 
 int run_sn_loop (struct n3n_runtime_data *sss);
@@ -34,6 +34,12 @@ int sn_selection_criterion_bad (SN_SELECTION_CRITERION_DATA_TYPE *selection_crit
 int sn_selection_criterion_good (SN_SELECTION_CRITERION_DATA_TYPE *selection_criterion);
 int sn_selection_criterion_calculate (struct n3n_runtime_data *eee, peer_info_t *peer, SN_SELECTION_CRITERION_DATA_TYPE *data);
 
+int sn_selection_criterion_better (struct n3n_runtime_data *eee, peer_info_t *candidate);
+
+/* round trip time and load measurement */
+uint64_t sn_selection_usec_now (void);
+void sn_selection_rtt_sample (peer_info_t *peer, uint64_t *sent);
+
 /* common data's functions */
 int sn_selection_criterion_common_data_default (struct n3n_runtime_data *eee);
 
@@ -42,6 +48,7 @@ int sn_selection_sort (peer_info_t **peer_list);
 
 /* gathering data function */
 SN_SELECTION_CRITERION_DATA_TYPE sn_selection_criterion_gather_data (struct n3n_runtime_data *sss);
+void sn_selection_load_update (struct n3n_runtime_data *sss, uint64_t busy_since);
 
 /* management port output function */
 extern char * sn_selection_criterion_str (struct n3n_runtime_data *eee, selection_criterion_str_t out, peer_info_t *peer);
@@ -9,6 +9,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 
 #include "connslot.h"
 
@@ -25,6 +29,71 @@ void connslot_tests() {
     slots_free(p);
 }
 
+#ifndef _WIN32
+static void send_str(int fd, const char *s) {
+    ssize_t sent = write(fd, s, strlen(s));
+    assert(sent == (ssize_t)strlen(s));
+}
+
+// A request split across reads, with a second one pipelined behind it
+void connslot_http_tests() {
+    int sv[2];
+    char buf[200];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+    conn_t conn;
+    assert(conn_init(&conn, 1000, 1000) == 0);
+    conn_accept(&conn, sv[0], CONN_PROTO_HTTP);
+    assert(conn_wants(&conn) == CONN_EVENT_READ);
+
+    send_str(sv[1], "POST /a HTTP/1.1\r\nContent-");
+    conn_read(&conn, sv[0]);
+    assert(conn.state == CONN_READING);
+
+    send_str(sv[1], "Length: 3\r\n\r\nabcGET /b HTTP/1.1\r\n");
+    send_str(sv[1], "connection: close\r\n\r\n");
+    while (conn.state == CONN_READING) {
+        conn_read(&conn, sv[0]);
+    }
+    assert(conn.state == CONN_READY);
+    assert(conn.http.keepalive);
+    assert(!strcmp(conn.request->str, "POST /a HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc"));
+    // The next request must wait until this one is answered
+    assert(conn_wants(&conn) == 0);
+
+    sb_printf(conn.reply_header, "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n");
+    conn.reply = conn.request;
+    sb_zero(conn.reply);
+    assert(conn_wants(&conn) == CONN_EVENT_WRITE);
+    conn_write(&conn, sv[0]);
+
+    // Sending the reply moves on to the pipelined request, some of which
+    // might still be in the socket
+    while (conn.state == CONN_READING) {
+        assert(conn_wants(&conn) == CONN_EVENT_READ);
+        conn_read(&conn, sv[0]);
+    }
+    assert(conn.state == CONN_READY);
+    assert(!conn.http.keepalive);
+    assert(!strcmp(conn.request->str, "GET /b HTTP/1.1\r\nconnection: close\r\n\r\n"));
+
+    sb_printf(conn.reply_header, "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n");
+    conn.reply = conn.request;
+    sb_zero(conn.reply);
+    conn_write(&conn, sv[0]);
+    assert(conn.state == CONN_CLOSED);
+
+    ssize_t size = read(sv[1], buf, sizeof(buf));
+    assert(size == 2 * 38);
+
+    conn_close(&conn, sv[0]);
+    close(sv[1]);
+    free(conn.request);
+    free(conn.reply_header);
+    free(conn.pipeline);
+}
+#endif
+
 int main() {
     printf("Running conslot tests\n");
 
@@ -33,4 +102,7 @@ int main() {
     printf("sizeof(slots_t) = %li\n", sizeof(slots_t));
 
     connslot_tests();
+#ifndef _WIN32
+    connslot_http_tests();
+#endif
 }
@@ -18,6 +18,7 @@
 #include <stdio.h>      // for remove
 #include <stdlib.h>     // for free, abort, malloc, strtoul
 #include <string.h>     // for memmem, memcpy, strlen, strncpy
+#include <strings.h>    // for strncasecmp
 #ifndef _WIN32
 #include <sys/socket.h> // for socket, bind, listen, setsockopt
 #include <sys/stat.h>   // for chmod
@@ -66,12 +67,17 @@ void conn_zero(conn_t *conn) {
     conn->state = CONN_EMPTY;
     conn->proto = CONN_PROTO_UNK;
     conn->reply = NULL;
+    conn->priv = NULL;
     conn->reply_sendpos = 0;
     conn->activity = 0;
+    memset(&conn->http, 0, sizeof(conn->http));
 
     if (conn->request) {
         sb_zero(conn->request);
     }
+    if (conn->pipeline) {
+        sb_zero(conn->pipeline);
+    }
     if (conn->reply_header) {
         sb_zero(conn->reply_header);
     }
@@ -80,6 +86,7 @@ void conn_zero(conn_t *conn) {
 int conn_init(conn_t *conn, size_t request_max, size_t reply_header_max) {
     conn->request = sb_malloc(48, request_max);
     conn->reply_header = sb_malloc(48, reply_header_max);
+    conn->pipeline = NULL;  // Only allocated if a client pipelines requests
 
     conn_zero(conn);
 
@@ -104,49 +111,143 @@ void conn_accept(conn_t *conn, int fd, enum conn_proto proto) {
     conn->proto = proto;
 }
 
+// Case insensitive search for a token within one header line
+static bool http_line_has(const char *p, const char *end, const char *token) {
+    size_t len = strlen(token);
+    for (; p + len <= end; p++) {
+        if (!strncasecmp(p, token, len)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Look for the end of the HTTP header and, once it has arrived, parse the
+// fields that decide the request length and the connection persistence.
+// Returns false if the header is not yet complete
+static bool conn_http_header(conn_t *conn) {
+    char *str = conn->request->str;
+    unsigned int len = sb_len(conn->request);
+
+    // Only search the bytes that have arrived since the last attempt,
+    // backing up enough to find a terminator split across two reads
+    unsigned int start = conn->http.scan_pos;
+    start = (start > 3) ? start - 3 : 0;
+    conn->http.scan_pos = len;
+
+    char *p = memmem(&str[start], len - start, "\r\n\r\n", 4);
+    if (!p) {
+        // As yet, we dont have an entire header
+        return false;
+    }
+
+    unsigned int body_pos = p - str + 4;
+    char *header_end = p + 2;   // Includes the CRLF of the last field
+    unsigned long content_length = 0;
+
+    // The request line decides the default persistence
+    char *line = str;
+    char *eol = memmem(line, header_end - line, "\r\n", 2);
+    conn->http.keepalive = http_line_has(line, eol, "HTTP/1.1");
+
+    while ((line = eol + 2) < header_end) {
+        eol = memmem(line, header_end - line, "\r\n", 2);
+
+        if (!strncasecmp(line, "Content-Length:", 15)) {
+            content_length = strtoul(line + 15, NULL, 10);
+        } else if (!strncasecmp(line, "Connection:", 11)) {
+            if (http_line_has(line + 11, eol, "close")) {
+                conn->http.keepalive = false;
+            } else if (http_line_has(line + 11, eol, "keep-alive")) {
+                conn->http.keepalive = true;
+            }
+        }
+    }
+
+    if (content_length >= conn->request->capacity_max - body_pos) {
+        // This request could never fit in the buffer
+        conn->state = CONN_ERROR;
+        return false;
+    }
+
+    conn->http.expected = body_pos + content_length;
+    return true;
+}
+
+// A whole request has arrived.  Move any bytes beyond it aside, so that the
+// application sees exactly one terminated request
+static void conn_http_ready(conn_t *conn) {
+    unsigned int expected = conn->http.expected;
+    unsigned int more = sb_len(conn->request) - expected;
+
+    if (more) {
+        if (!conn->pipeline) {
+            conn->pipeline = sb_malloc(48, conn->request->capacity_max);
+        }
+        if (!conn->pipeline ||
+            !sb_reappend(&conn->pipeline, &conn->request->str[expected], more) ||
+            sb_overflowed(conn->pipeline)) {
+            conn->state = CONN_ERROR;
+            return;
+        }
+        conn->request->wr_pos = expected;
+    }
+
+    if (!sb_avail(conn->request)) {
+        if (!sb_realloc(&conn->request, conn->request->capacity + 1)) {
+            conn->state = CONN_ERROR;
+            return;
+        }
+    }
+    conn->request->str[expected] = 0;
+    conn->state = CONN_READY;
+}
+
+// The reply to the current request has been sent, so either close the
+// connection or start on the next request
+static void conn_http_done(conn_t *conn) {
+    if (!conn->http.keepalive) {
+        conn->state = CONN_CLOSED;
+        return;
+    }
+
+    memset(&conn->http, 0, sizeof(conn->http));
+    sb_zero(conn->request);
+    conn->reply = NULL;
+    conn->state = CONN_EMPTY;
+
+    if (!conn->pipeline || !sb_len(conn->pipeline)) {
+        return;
+    }
+
+    // A pipelined request is waiting
+    if (!sb_reappend(
+            &conn->request,
+            conn->pipeline->str,
+            sb_len(conn->pipeline))) {
+        conn->state = CONN_ERROR;
+        return;
+    }
+    sb_zero(conn->pipeline);
+    conn->state = CONN_READING;
+    conn_check_ready(conn);
+}
+
 void conn_check_ready(conn_t *conn) {
     unsigned int expected_length;
 
     switch (conn->proto) {
         case CONN_PROTO_HTTP:
-            if (sb_len(conn->request)<4) {
-                // Not enough bytes to match the end of header check
+            if (!conn->http.expected && !conn_http_header(conn)) {
                 return;
             }
-
-            // retrieve the cached expected length, if any
-            expected_length = conn->request->rd_pos;
-
-            if (expected_length == 0) {
-                char *p = memmem(conn->request->str, sb_len(conn->request), "\r\n\r\n", 4);
-                if (!p) {
-                    // As yet, we dont have an entire header
-                    return;
-                }
-
-                int body_pos = p - conn->request->str + 4;
-
-                // Determine if we need to read a body
-                p = memmem(
-                        conn->request->str,
-                        body_pos,
-                        "Content-Length:",
-                        15
-                );
-
-                if (!p) {
-                    // We have an end of header, and the header has no content length field
-                    // so assume there is no body to read
-                    conn->state = CONN_READY;
-                    return;
-                }
-
-                p+=15; // Skip the field name
-                unsigned int content_length = strtoul(p, NULL, 10);
-                expected_length = body_pos + content_length;
-                // FIXME: what if Content-Length: is larger than unsigned int?
+            if (sb_len(conn->request) < conn->http.expected) {
+                // Dont have enough length
+                return;
             }
-            break;
+            conn_http_ready(conn);
+            return;
+
         case CONN_PROTO_BE16LEN:
             if (sb_len(conn->request)<2) {
                 // Not enough bytes to have the header
@@ -156,16 +257,16 @@ void conn_check_ready(conn_t *conn) {
             expected_length = ntohs(*(uint16_t *)&conn->request->str) + 2;
             break;
 
+        case CONN_PROTO_STREAM:
+            // Nothing is expected from the remote, so never become ready and
+            // dont let the request buffer fill up
+            sb_zero(conn->request);
+            return;
+
         default:
             return;
     }
 
-
-    // By this point we must have an expected_length
-
-    // cache the calculated total length in the conn
-    conn->request->rd_pos = expected_length;
-
     if (sb_len(conn->request) < expected_length) {
         // Dont have enough length
         return;
@@ -173,7 +274,6 @@ void conn_check_ready(conn_t *conn) {
 
     // Do have enough length
     conn->state = CONN_READY;
-    conn->request->rd_pos = 0;
     return;
 }
 
@@ -215,9 +315,14 @@ ssize_t conn_read(conn_t *conn, int fd) {
 ssize_t conn_write(conn_t *conn, int fd) {
     ssize_t sent;
 
-    if (fd == -1) {
+    if (fd == -1 || !conn_iswriter(conn)) {
         return 0;
     }
+
+    if (conn->proto == CONN_PROTO_HTTP && conn->state == CONN_READY) {
+        // Once the reply has started, the request has been answered
+        conn->state = CONN_EMPTY;
+    }
 #ifndef _WIN32
     int nr = 0;
     unsigned int reply_pos = 0;
@@ -279,6 +384,10 @@ ssize_t conn_write(conn_t *conn, int fd) {
         conn->reply_sendpos = 0;
         sb_zero(conn->reply_header);
         sb_zero(conn->reply);
+
+        if (conn->proto == CONN_PROTO_HTTP && !conn->http.partial) {
+            conn_http_done(conn);
+        }
     }
 
     // This will truncate the time to a int - usually 32bits
@@ -302,6 +411,32 @@ bool conn_iswriter(conn_t *conn) {
     return false;
 }
 
+int conn_wants(conn_t *conn) {
+    int events = 0;
+
+    switch (conn->state) {
+        case CONN_ERROR:
+        case CONN_CLOSED:
+            // Let the owner notice the dead connection on its read path
+            return CONN_EVENT_READ;
+        default:
+            break;
+    }
+
+    if (conn_iswriter(conn)) {
+        events |= CONN_EVENT_WRITE;
+    }
+
+    if (conn->proto == CONN_PROTO_HTTP) {
+        if (events || conn->http.partial || conn->state == CONN_READY) {
+            // Dont read the next request until this one is answered, any
+            // pipelined requests can wait in the socket buffers
+            return events;
+        }
+    }
+    return events | CONN_EVENT_READ;
+}
+
 void conn_close(conn_t *conn, int fd) {
     closesocket(fd);
     conn_zero(conn);
@@ -309,6 +444,11 @@ void conn_close(conn_t *conn, int fd) {
 }
 
 bool conn_closeidle(conn_t *conn, int fd, int now, int timeout) {
+    if (conn->proto == CONN_PROTO_STREAM) {
+        // A stream is expected to be quiet for long periods
+        return false;
+    }
+
     int delta_t = now - conn->activity;
     if (delta_t > timeout) {
         // TODO: metrics timeouts ++
@@ -387,6 +527,8 @@ void slots_free(slots_t *slots) {
 
         free(conn->request);
         conn->request = NULL;
+        free(conn->pipeline);
+        conn->pipeline = NULL;
         free(conn->reply_header);
         conn->reply_header = NULL;
 
@@ -597,10 +739,19 @@ int slots_fdset(slots_t *slots, fd_set *readers, fd_set *writers) {
         if (slots->conn[i].fd == -1) {
             continue;
         }
-        nr_open++;
         int fd = slots->conn[i].fd;
-        FD_SET(fd, readers);
-        if (conn_iswriter(&slots->conn[i])) {
+        if (slots->conn[i].state == CONN_CLOSED ||
+            slots->conn[i].state == CONN_ERROR) {
+            // This connection finished while the application was using it
+            conn_close(&slots->conn[i], fd);
+            continue;
+        }
+        nr_open++;
+        int events = conn_wants(&slots->conn[i]);
+        if (events & CONN_EVENT_READ) {
+            FD_SET(fd, readers);
+        }
+        if (events & CONN_EVENT_WRITE) {
             FD_SET(fd, writers);
         }
         fdmax = (fd > fdmax)? fd : fdmax;
@@ -673,6 +824,44 @@ int slots_closeidle(slots_t *slots) {
     return nr_closed;
 }
 
+/*
+ * Handle the readiness events for one slot, as reported by select(), poll()
+ * or epoll().  Afterwards, conn_wants() gives the events to wait for next.
+ * Returns 1 if the slot has a request ready, -1 if it was closed or zero
+ */
+int slots_conn_event(slots_t *slots, int slotnr, int events) {
+    conn_t *conn = &slots->conn[slotnr];
+
+    if (events & CONN_EVENT_READ) {
+        conn_read(conn, conn->fd);
+        // possibly sets state to CONN_READY
+    }
+
+    if ((events & CONN_EVENT_WRITE) &&
+        conn->state != CONN_ERROR && conn->state != CONN_CLOSED) {
+        conn_write(conn, conn->fd);
+        // a finished reply could expose a pipelined CONN_READY request
+    }
+
+    switch (conn->state) {
+        case CONN_READY:
+            // we reach state CONN_READY once there is a full request buf
+            // TODO:
+            // - parse request
+            // - possibly callback to generate reply
+            return 1;
+        case CONN_ERROR:
+            // Slots with errors are dead to us
+            /* fallsthrough */
+        case CONN_CLOSED:
+            slots->nr_open--;
+            conn_close(conn, conn->fd);
+            return -1;
+        default:
+            return 0;
+    }
+}
+
 int slots_fdset_loop(slots_t *slots, fd_set *readers, fd_set *writers) {
     for (int i=0; i<SLOTS_LISTEN; i++) {
         if (slots->listen[i] == -1) {
@@ -704,36 +893,23 @@ int slots_fdset_loop(slots_t *slots, fd_set *readers, fd_set *writers) {
         if (slots->conn[i].fd == -1) {
             continue;
         }
-        nr_open++;
 
+        int events = 0;
         if (FD_ISSET(slots->conn[i].fd, readers)) {
-            conn_read(&slots->conn[i], slots->conn[i].fd);
-            // possibly sets state to CONN_READY
+            events |= CONN_EVENT_READ;
+        }
+        if (FD_ISSET(slots->conn[i].fd, writers)) {
+            events |= CONN_EVENT_WRITE;
         }
 
-        switch (slots->conn[i].state) {
-            case CONN_READY:
-                // After a read, we could be CONN_EMPTY or CONN_READY
-                // we reach state CONN_READY once there is a full request buf
-                nr_ready++;
-                // TODO:
-                // - parse request
-                // - possibly callback to generate reply
-                break;
-            case CONN_ERROR:
-                // Slots with errors are dead to us
-                /* fallsthrough */
-            case CONN_CLOSED:
-                slots->nr_open--;
-                conn_close(&slots->conn[i], slots->conn[i].fd);
+        switch (slots_conn_event(slots, i, events)) {
+            case -1:
                 continue;
-            default:
+            case 1:
+                nr_ready++;
                 break;
         }
-
-        if (FD_ISSET(slots->conn[i].fd, writers)) {
-            conn_write(&slots->conn[i], slots->conn[i].fd);
-        }
+        nr_open++;
     }
 
     // Since we scan all the slots, we have an accurate nr_open count
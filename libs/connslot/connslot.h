@@ -37,17 +37,35 @@ enum __attribute__((__packed__)) conn_proto {
     CONN_PROTO_UNK = 0,
     CONN_PROTO_HTTP = 1,
     CONN_PROTO_BE16LEN = 2,
+    CONN_PROTO_STREAM = 3,      // Output only, any received data is discarded
+};
+
+// Readiness events, as returned by conn_wants() and passed to
+// slots_conn_event().  These map directly onto a poll() or epoll() interest
+// set, so event loops other than select() can drive the slots
+#define CONN_EVENT_READ 0x01
+#define CONN_EVENT_WRITE 0x02
+
+// Incremental HTTP request parsing state
+struct conn_http {
+    unsigned int scan_pos;  // request bytes already searched for header end
+    unsigned int expected;  // total request length, zero until header seen
+    bool keepalive;         // connection is reused once the reply is sent
+    bool partial;           // reply is being generated in pieces
 };
 
 typedef struct conn {
     strbuf_t *request;      // Request from remote
     strbuf_t *reply_header; // not shared reply data
     strbuf_t *reply;        // shared reply data (const struct)
+    strbuf_t *pipeline;     // received bytes beyond the current request
+    void *priv;             // application data, cleared when conn is closed
     int activity;           // truncated timestamp of last txn
     int fd;
     unsigned int reply_sendpos;
     enum conn_state state;
     enum conn_proto proto;
+    struct conn_http http;
 } conn_t;
 
 #define SLOTS_LISTEN 2
@@ -66,6 +84,7 @@ void conn_check_ready(conn_t *);
 ssize_t conn_read(conn_t *, int);
 ssize_t conn_write(conn_t *, int);
 bool conn_iswriter(conn_t *);
+int conn_wants(conn_t *);
 void conn_close(conn_t *, int);
 bool conn_closeidle(conn_t *, int, int, int);
 void conn_dump(strbuf_t **, conn_t *);
@@ -80,6 +99,7 @@ void slots_listen_close(slots_t *);
 int slots_fdset(slots_t *, fd_set *, fd_set *);
 int slots_accept(slots_t *, int, enum conn_proto);
 int slots_closeidle(slots_t *);
+int slots_conn_event(slots_t *, int, int);
 int slots_fdset_loop(slots_t *, fd_set *, fd_set *);
 void slots_dump(strbuf_t **, slots_t *);
 #endif
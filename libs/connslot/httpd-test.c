@@ -14,6 +14,9 @@
 #include <sys/select.h>
 #include <sys/socket.h>
 #endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -60,6 +63,42 @@ void send_str(int fd, char *s) {
 }
 #endif
 
+void httpd_reply(slots_t *slots, int i, strbuf_t **reply) {
+    strbuf_t **pp;
+    // TODO:
+    // - parse request
+
+    // generate reply
+
+    if (strncmp("POST /echo ",slots->conn[i].request->str,10) == 0) {
+        slots->conn[i].reply = slots->conn[i].request;
+    } else if (strncmp("POST /jsonrpc ",slots->conn[i].request->str,13) == 0) {
+        do_jsonrpc(slots->conn[i].request, reply);
+        slots->conn[i].reply = *reply;
+    } else {
+        sb_zero(*reply);
+        sb_printf(*reply, "Hello World\n");
+        slots->conn[i].reply = *reply;
+    }
+
+    pp = &slots->conn[i].reply_header;
+    sb_reprintf(pp, "HTTP/1.1 200 OK\r\n");
+    sb_reprintf(pp, "x-slot: %i\r\n", i);
+    sb_reprintf(pp, "x-open: %i\r\n", slots->nr_open);
+    int len = sb_len(slots->conn[i].reply);
+    sb_reprintf(pp, "Content-Length: %i\r\n\r\n", len);
+
+    // TODO: detect reply_header realloc failure
+    //   // We filled up the reply_header strbuf
+    //   send_str(slots->conn[i].fd, "HTTP/1.0 500 \r\n\r\n");
+    //   slots->conn[i].state = CONN_EMPTY;
+    //   // TODO: we might have corrupted the ->reply_header ?
+    //   continue;
+
+    // Try to immediately start sending the reply
+    conn_write(&slots->conn[i], slots->conn[i].fd);
+}
+
 #define NR_SLOTS 5
 void httpd_test(int port) {
     slots_t *slots = slots_malloc(NR_SLOTS, 1000, 1000);
@@ -80,7 +119,6 @@ void httpd_test(int port) {
 #endif
 
     strbuf_t *reply = sb_malloc(48,1000);
-    sb_printf(reply, "Hello World\n");
 
 #ifndef _WIN32
     signal(SIGPIPE, SIG_IGN);
@@ -132,47 +170,127 @@ void httpd_test(int port) {
                 continue;
             }
 
-            if (slots->conn[i].state == CONN_READY) {
-                strbuf_t **pp;
-                // TODO:
-                // - parse request
+            // A reply that is sent at once can expose a pipelined request
+            while (slots->conn[i].state == CONN_READY) {
+                httpd_reply(slots, i, &reply);
+            }
+        }
+    }
+}
 
-                // generate reply
+#ifdef __linux__
+// Update the epoll interest set to match what the slot is waiting for
+static void epoll_rearm(int epfd, slots_t *slots, int slotnr, int op) {
+    int wants = conn_wants(&slots->conn[slotnr]);
+    struct epoll_event ev = {
+        .events = 0,
+        .data.u32 = slotnr,
+    };
+    if (wants & CONN_EVENT_READ) {
+        ev.events |= EPOLLIN;
+    }
+    if (wants & CONN_EVENT_WRITE) {
+        ev.events |= EPOLLOUT;
+    }
+    epoll_ctl(epfd, op, slots->conn[slotnr].fd, &ev);
+}
 
-                if (strncmp("POST /echo ",slots->conn[i].request->str,10) == 0) {
-                    slots->conn[i].reply = slots->conn[i].request;
-                } else if (strncmp("POST /jsonrpc ",slots->conn[i].request->str,13) == 0) {
-                    // TODO: helper to extract http body
-                    sb_reappend(&slots->conn[i].request, "\0", 1);
+// The same server, driven by epoll instead of select
+#define LISTEN_TAG 0x80000000
+void httpd_test_epoll(int port) {
+    slots_t *slots = slots_malloc(NR_SLOTS, 1000, 1000);
+    if (!slots) {
+        abort();
+    }
+
+    if (slots_listen_tcp(slots, port, true)!=0) {
+        perror("slots_listen_tcp");
+        exit(1);
+    }
+
+    int epfd = epoll_create1(0);
+    if (epfd == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.u32 = LISTEN_TAG,
+    };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, slots->listen[0], &ev);
+    bool listening = true;
+
+    strbuf_t *reply = sb_malloc(48,1000);
+
+    signal(SIGPIPE, SIG_IGN);
 
-                    do_jsonrpc(slots->conn[i].request, &reply);
-                    slots->conn[i].reply = reply;
-                } else {
-                    slots->conn[i].reply = reply;
+    struct epoll_event events[NR_SLOTS + 1];
+    int running = 1;
+    while (running) {
+        int nr = epoll_wait(epfd, events, NR_SLOTS + 1, 5000);
+
+        if (nr == -1) {
+            perror("epoll_wait");
+            exit(1);
+        }
+        if (nr == 0) {
+            // Must be a timeout, closed fds are removed from epoll for us
+            slots_closeidle(slots);
+        }
+
+        for (int n=0; n<nr; n++) {
+            int slotnr;
+
+            if (events[n].data.u32 == LISTEN_TAG) {
+                slotnr = slots_accept(slots, slots->listen[0], CONN_PROTO_HTTP);
+                if (slotnr == -2) {
+                    // No free slot, so stop listening until one closes and
+                    // leave the connection waiting in the backlog
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, slots->listen[0], NULL);
+                    listening = false;
                 }
+                if (slotnr < 0) {
+                    continue;
+                }
+                epoll_rearm(epfd, slots, slotnr, EPOLL_CTL_ADD);
+                continue;
+            }
 
-                pp = &slots->conn[i].reply_header;
-                sb_reprintf(pp, "HTTP/1.1 200 OK\r\n");
-                sb_reprintf(pp, "x-slot: %i\r\n", i);
-                sb_reprintf(pp, "x-open: %i\r\n", slots->nr_open);
-                int len = sb_len(slots->conn[i].reply);
-                sb_reprintf(pp, "Content-Length: %i\r\n\r\n", len);
-
-                // TODO: detect reply_header realloc failure
-                //   // We filled up the reply_header strbuf
-                //   send_str(slots->conn[i].fd, "HTTP/1.0 500 \r\n\r\n");
-                //   slots->conn[i].state = CONN_EMPTY;
-                //   // TODO: we might have corrupted the ->reply_header ?
-                //   continue;
-
-                // Try to immediately start sending the reply
-                conn_write(&slots->conn[i], slots->conn[i].fd);
+            slotnr = events[n].data.u32;
+            int flags = 0;
+            if (events[n].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                flags |= CONN_EVENT_READ;
             }
+            if (events[n].events & EPOLLOUT) {
+                flags |= CONN_EVENT_WRITE;
+            }
+
+            if (slots_conn_event(slots, slotnr, flags) == -1) {
+                continue;
+            }
+
+            while (slots->conn[slotnr].state == CONN_READY) {
+                httpd_reply(slots, slotnr, &reply);
+            }
+
+            if (slots->conn[slotnr].state == CONN_CLOSED) {
+                slots->nr_open--;
+                conn_close(&slots->conn[slotnr], slots->conn[slotnr].fd);
+                continue;
+            }
+            epoll_rearm(epfd, slots, slotnr, EPOLL_CTL_MOD);
+        }
+
+        if (!listening && slots->nr_open < slots->nr_slots) {
+            epoll_ctl(epfd, EPOLL_CTL_ADD, slots->listen[0], &ev);
+            listening = true;
         }
     }
 }
+#endif
 
-int main() {
+int main(int argc, char **argv) {
 #ifdef _WIN32
     WSADATA wsaData;
     if (WSAStartup(MAKEWORD(2, 2), &wsaData ) != 0) {
@@ -184,5 +302,11 @@ int main() {
     int port = 8080;
     printf("Running http test server on port %i\n", port);
 
+#ifdef __linux__
+    if (argc > 1 && !strcmp(argv[1], "epoll")) {
+        httpd_test_epoll(port);
+        return 0;
+    }
+#endif
     httpd_test(port);
 }
@@ -39,6 +39,37 @@ char *json_find_field(char *haystack, char *field) {
     return p;
 }
 
+// Find the end of the dictionary or array starting at p
+static char *json_skip_container(char *p) {
+    char open;
+    char close;
+
+    if (*p == '{') {
+        open = '{';
+        close = '}';
+    } else if (*p == '[') {
+        open = '[';
+        close = ']';
+    } else {
+        return NULL;
+    }
+
+    char *e = p+1;
+    int depth = 1;
+    while (depth) {
+        if (*e == '\0') {
+            return NULL;
+        }
+        if (*e == open) {
+            depth++;
+        } else if (*e == close) {
+            depth--;
+        }
+        e++;
+    }
+    return e;
+}
+
 char *json_extract_val(char *p) {
     // modifies the source string
     char *e;
@@ -71,33 +102,11 @@ char *json_extract_val(char *p) {
         return p;
     }
 
-    char open;
-    char close;
-
     // A dictionary, an array or an error
-    if (*p == '{') {
-        open = '{';
-        close = '}';
-    } else if (*p == '[') {
-        open = '[';
-        close = ']';
-    } else {
+    e = json_skip_container(p);
+    if (!e) {
         return NULL;
     }
-
-    e = p+1;
-    int depth = 1;
-    while (depth) {
-        if (*e == '\0') {
-            return NULL;
-        }
-        if (*e == open) {
-            depth++;
-        } else if (*e == close) {
-            depth--;
-        }
-        e++;
-    }
     *e = '\0';
     return p;
 }
@@ -106,10 +115,16 @@ int jsonrpc_parse(char *p, jsonrpc_t *json) {
     if (!json) {
         return -1;
     }
+    while (isspace(*p)) {p++;}
+
     if (p[0] != '{') {
         json->method = NULL;
         json->params = NULL;
         json->id = NULL;
+        if (p[0] == '[') {
+            // The caller needs to walk through the batch
+            return JSONRPC_BATCH;
+        }
         return -2;
     }
     p++;
@@ -134,3 +149,56 @@ int jsonrpc_parse(char *p, jsonrpc_t *json) {
     return 0;
 }
 
+
+/*
+ * Walk a batch request, as detected by jsonrpc_parse().  Before the first
+ * call, *pp should point just after the opening '[' of the body.  Each call
+ * returns the next member of the array (null terminated) or NULL once there
+ * are no more.  Members that are not objects are returned too, so that the
+ * caller can answer them with an error - jsonrpc_parse() will refuse them.
+ */
+char *jsonrpc_batch_next(char **pp) {
+    char *p = *pp;
+    char *e;
+    if (!p) {
+        return NULL;
+    }
+
+    while (isspace(*p) || *p == ',') {p++;}
+
+    if (*p == ']' || *p == '\0') {
+        // The end of the array
+        *pp = NULL;
+        return NULL;
+    }
+
+    if (*p == '{' || *p == '[') {
+        e = json_skip_container(p);
+    } else if (*p == '"') {
+        e = p+1;
+        while (*e && *e != '"') {
+            if (*e == '\\' && e[1]) {
+                e++;
+            }
+            e++;
+        }
+        e = *e ? e+1 : NULL;
+    } else {
+        // A number or a literal
+        e = p;
+        while (*e && *e != ',' && *e != ']' && !isspace(*e)) {e++;}
+    }
+
+    if (!e) {
+        // Something we cannot find the end of
+        *pp = NULL;
+        return NULL;
+    }
+
+    if (*e) {
+        // Terminate this member, overwriting the separator after it
+        *e++ = '\0';
+    }
+    *pp = e;
+    return p;
+}
@@ -13,7 +13,11 @@ typedef struct jsonrpc {
     char *params;
 } jsonrpc_t;
 
+// Returned by jsonrpc_parse() when the body is a batch array
+#define JSONRPC_BATCH 1
+
 int jsonrpc_parse(char *, jsonrpc_t *);
+char *jsonrpc_batch_next(char **);
 char *json_find_field(char *, char *);
 char *json_extract_val(char *);
 #endif
@@ -143,6 +143,36 @@ static struct n3n_conf_option section_connection[] = {
                 "management API or as the username when user-password edge "
                 "authentication is used",
     },
+    {
+        .name = "nat_probe_ports",
+        .type = n3n_conf_uint32,
+        .offset = offsetof(n2n_edge_conf_t, nat_probe_ports),
+        .desc = "Ports probed per NAT traversal round",
+        .help = "Defaulting to 32, the number of REGISTERs sent to different "
+                "ports of a peer in each round of the multi-port NAT "
+                "traversal, at most 256.  See also nat_traversal.",
+    },
+    {
+        .name = "nat_traversal",
+        .type = n3n_conf_bool,
+        .offset = offsetof(n2n_edge_conf_t, nat_traversal),
+        .desc = "Probe many ports to reach peers behind symmetric NATs",
+        .help = "Defaulting to false, when the simple hole punch to a peer "
+                "fails, this sends REGISTERs to the ports the peer's NAT is "
+                "predicted to allocate next and to random ports, for up to "
+                "8 rounds.  This helps with NATs that use a new port for "
+                "every destination.",
+    },
+    {
+        .name = "p2p_broadcast",
+        .type = n3n_conf_bool,
+        .offset = offsetof(n2n_edge_conf_t, p2p_broadcast),
+        .desc = "Send broadcasts to the p2p peers directly",
+        .help = "Defaulting to false, broadcast and multicast packets are "
+                "sent straight to the peers with a working p2p connection. "
+                "The supernode is told about these peers, and only sends "
+                "its copy on to the other edges.",
+    },
     {
         .name = "pmtu_discovery",
         .type = n3n_conf_bool,
@@ -182,6 +212,45 @@ static struct n3n_conf_option section_connection[] = {
                 "networks, you may not be awwre of all the nat levels, so "
                 "this value should be set with caution.",
     },
+    {
+        .name = "relay_for_peers",
+        .type = n3n_conf_bool,
+        .offset = offsetof(n2n_edge_conf_t, relay_for_peers),
+        .desc = "Relay packets for peers without a direct path",
+        .help = "Defaulting to false, this offers the edge as a relay to "
+                "the other edges of the community.  It advertises the peers "
+                "it has a direct p2p path to, and forwards the packets that "
+                "other edges send it for them.  See also relay_max_rate.",
+    },
+    {
+        .name = "relay_max_rate",
+        .type = n3n_conf_uint32,
+        .offset = offsetof(n2n_edge_conf_t, relay_max_rate),
+        .desc = "Cap on the traffic relayed for other edges",
+        .help = "In KiB per second, defaulting to 1024.  Packets over the "
+                "cap are dropped.  Zero means no limit.",
+    },
+    {
+        .name = "relay_via_peers",
+        .type = n3n_conf_bool,
+        .offset = offsetof(n2n_edge_conf_t, relay_via_peers),
+        .desc = "Reach peers through a relaying edge",
+        .help = "Defaulting to false, when there is no direct p2p path to a "
+                "peer, this sends its packets through the edge with the "
+                "lowest round trip time that has advertised a direct path "
+                "to it, instead of through the supernode.  Only edges with "
+                "relay_for_peers set are used.",
+    },
+    {
+        .name = "supernode_parallel",
+        .type = n3n_conf_bool,
+        .offset = offsetof(n2n_edge_conf_t, sn_parallel),
+        .desc = "Register with all supernodes at once",
+        .help = "Defaulting to true, when the edge starts or loses its "
+                "supernode it sends the registration to all the known "
+                "supernodes and uses the first one to answer, instead of "
+                "trying them one after the other.  Ignored with connect_tcp.",
+    },
     {
         .name = "supernode_selection",
         .type = n3n_conf_sn_selection,
@@ -250,6 +319,27 @@ static struct n3n_conf_option section_filter[] = {
                 "dropped if they are not for the IP address of the edge "
                 "interface.  This setting is also used to enable bridging.",
     },
+    {
+        .name = "multicast_snooping",
+        .type = n3n_conf_bool,
+        .offset = offsetof(n2n_edge_conf_t, mcast_snooping),
+        .desc = "Only receive the multicast groups joined",
+        .help = "The edge watches the IGMP and MLD reports of the local "
+                "hosts and tells the supernode which multicast groups they "
+                "joined.  The supernode then only sends this edge the "
+                "frames of these groups, besides broadcasts and the groups "
+                "nobody reported.",
+    },
+    {
+        .name = "neigh_proxy",
+        .type = n3n_conf_bool,
+        .offset = offsetof(n2n_edge_conf_t, neigh_proxy),
+        .desc = "Answer ARP and IPv6 neighbour discovery locally",
+        .help = "The edge remembers the IP and MAC addresses seen in the "
+                "packets from the other edges and answers the ARP requests "
+                "and neighbour solicitations of the local host for them, "
+                "instead of broadcasting these to the whole community.",
+    },
     {
         .name = "rule",
         .type = n3n_conf_filter_rule,
@@ -344,6 +434,42 @@ static struct n3n_conf_option section_supernode[] = {
                 "and User/Password based authentication details. "
                 "See the documentation for the file format description.",
     },
+    {
+        .name = "community_max_pps",
+        .type = n3n_conf_uint32,
+        .offset = offsetof(n2n_edge_conf_t, sn_community_max_pps),
+        .desc = "Cap on the packets relayed per community",
+        .help = "In PACKETs per second, defaulting to zero for no limit.  "
+                "Packets over the cap are dropped.  A community.list entry "
+                "can set its own max_pps.",
+    },
+    {
+        .name = "community_max_rate",
+        .type = n3n_conf_uint32,
+        .offset = offsetof(n2n_edge_conf_t, sn_community_max_rate),
+        .desc = "Cap on the traffic relayed per community",
+        .help = "In KiB per second, defaulting to zero for no limit.  "
+                "Packets over the cap are dropped.  A community.list entry "
+                "can set its own max_rate.",
+    },
+    {
+        .name = "edge_max_pps",
+        .type = n3n_conf_uint32,
+        .offset = offsetof(n2n_edge_conf_t, sn_edge_max_pps),
+        .desc = "Cap on the packets relayed per edge",
+        .help = "In PACKETs per second sent by one edge, defaulting to zero "
+                "for no limit.  A community.list entry can set its own "
+                "edge_max_pps.",
+    },
+    {
+        .name = "edge_max_rate",
+        .type = n3n_conf_uint32,
+        .offset = offsetof(n2n_edge_conf_t, sn_edge_max_rate),
+        .desc = "Cap on the traffic relayed per edge",
+        .help = "In KiB per second sent by one edge, defaulting to zero for "
+                "no limit.  A community.list entry can set its own "
+                "edge_max_rate.",
+    },
     {
         .name = "federation",
         .type = n3n_conf_strncpy,
@@ -372,6 +498,38 @@ static struct n3n_conf_option section_supernode[] = {
         .help = "Multiple federated supernodes can be specified, each one as"
                 "a host:port string, which will be resolved if needed.",
     },
+    {
+        .name = "peer_info_push",
+        .type = n3n_conf_uint32,
+        .offset = offsetof(n2n_edge_conf_t, sn_peer_info_push),
+        .desc = "Help edges of relayed flows to go p2p",
+        .help = "When the supernode forwards a packet between two of its "
+                "edges, it sends each one a PEER_INFO with the other's "
+                "socket, so they can start hole punching straight away.  "
+                "This is the number of flows per second and community to do "
+                "this for, defaulting to 20.  Zero disables it.",
+    },
+    {
+        .name = "register_max_pps",
+        .type = n3n_conf_uint32,
+        .offset = offsetof(n2n_edge_conf_t, sn_register_max_pps),
+        .desc = "Cap on the registrations of new edges",
+        .help = "In REGISTER_SUPERs per second from edges not registered "
+                "yet, defaulting to zero for no limit.  Those over the cap "
+                "are dropped, the edges retry.",
+    },
+    {
+        .name = "register_source_max_pps",
+        .type = n3n_conf_uint32,
+        .offset = offsetof(n2n_edge_conf_t, sn_register_source_max_pps),
+        .desc = "Cap on the registrations of new edges per source address",
+        .help = "In REGISTER_SUPERs per second from edges not registered "
+                "yet, counting datagrams no community's header key "
+                "decrypts as well.  Once a source address, or IPv6 /64, "
+                "is over the cap, further registrations from it are "
+                "dropped.  The traffic of edges already registered is not "
+                "limited.  Defaults to 20, zero means no limit.",
+    },
     {
         .name = "spoofing_protection",
         .type = n3n_conf_bool,
@@ -418,6 +576,17 @@ static struct n3n_conf_option section_tuntap[] = {
                 "address is set by the edge and an external process is "
                 "expected to set it.",
     },
+    {
+        .name = "layer3",
+        .type = n3n_conf_bool,
+        .offset = offsetof(n2n_edge_conf_t, tuntap_layer3),
+        .desc = "Use a layer 3 TUN interface",
+        .help = "Defaulting to false, this creates a TUN interface that "
+                "carries bare IPv4 packets instead of a TAP interface.  The "
+                "edge then finds the edge to send a packet to from its IP "
+                "address, so no ARP broadcasts are needed.  Edges in the "
+                "same community can mix both modes.  Linux only.",
+    },
     {
         .name = "macaddr",
         .type = n3n_conf_strncpy,
@@ -18,6 +18,10 @@
  *
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE                  // for sendmmsg
+#endif
+
 #ifdef _WIN32
 #include "win32/defs.h"
 #endif
@@ -47,13 +51,19 @@
 
 #include "edge_utils.h"
 #include "header_encryption.h"       // for packet_header_encrypt, packet_he...
+#include "ip_routes.h"               // for ip_routes_lookup, ip_routes_add
 #include "management.h"              // for mgmt_event_post
+#include "mcast_groups.h"            // for mcast_snoop_frame, mcast_groups_...
 #include "minmax.h"                  // for MIN, MAX
 #include "n2n.h"                     // for n3n_runtime_data, n2n_edge_...
 #include "n2n_wire.h"                // for fill_sockaddr, decod...
+#include "neigh_cache.h"             // for neigh_cache_learn_frame, neigh_p...
 #include "pearson.h"                 // for pearson_hash_128, pearson_hash_64
 #include "peer_info.h"               // for peer_info, clear_peer_list, ...
+#include "relay.h"                   // for relay_find, relay_routes_update
 #include "resolve.h"                 // for resolve_create_thread, resolve_c...
+#include "rx_queue.h"                // for rx_queue_fill, rx_queue_pop
+#include "shaper.h"                  // for token_bucket_take
 #include "sn_selection.h"            // for sn_selection_criterion_common_da...
 #include "speck.h"                   // for speck_128_decrypt, speck_128_enc...
 #include "uthash.h"                  // for UT_hash_handle, HASH_COUNT, HASH...
@@ -157,6 +167,86 @@ static struct n3n_metrics_items_llu32 edge_utils_metrics_items2 = {
             .val2 = "multicast_drop",
             .offset = offsetof(struct n2n_edge_stats, rx_multicast_drop),
         },
+        {
+            .val1 = "tx",
+            .val2 = "relay",
+            .offset = offsetof(struct n2n_edge_stats, tx_relay),
+        },
+        {
+            .val1 = "rx",
+            .val2 = "relay",
+            .offset = offsetof(struct n2n_edge_stats, rx_relay),
+        },
+        {
+            .val1 = "tx",
+            .val2 = "relay_fwd",
+            .offset = offsetof(struct n2n_edge_stats, relay_fwd),
+        },
+        {
+            .val1 = "tx",
+            .val2 = "relay_drop",
+            .offset = offsetof(struct n2n_edge_stats, relay_drop),
+        },
+        {
+            .val1 = "tx",
+            .val2 = "nat_punch",
+            .offset = offsetof(struct n2n_edge_stats, nat_punch),
+        },
+        {
+            .val1 = "tx",
+            .val2 = "nat_probe",
+            .offset = offsetof(struct n2n_edge_stats, nat_probe),
+        },
+        {
+            .val1 = "rx",
+            .val2 = "nat_punch_ok",
+            .offset = offsetof(struct n2n_edge_stats, nat_punch_ok),
+        },
+        {
+            .val1 = "tx",
+            .val2 = "neigh_proxy",
+            .offset = offsetof(struct n2n_edge_stats, neigh_proxy),
+        },
+        {
+            .val1 = "tx",
+            .val2 = "neigh_miss",
+            .offset = offsetof(struct n2n_edge_stats, neigh_miss),
+        },
+        {
+            .val1 = "tx",
+            .val2 = "bcast_p2p",
+            .offset = offsetof(struct n2n_edge_stats, tx_bcast_p2p),
+        },
+        {
+            .val1 = "tx",
+            .val2 = "layer3_drop",
+            .offset = offsetof(struct n2n_edge_stats, tx_layer3_drop),
+        },
+        {
+            .val1 = "rx",
+            .val2 = "queue_ctrl",
+            .offset = offsetof(struct n2n_edge_stats, rx_ctrl),
+        },
+        {
+            .val1 = "rx",
+            .val2 = "queue_ctrl_peak",
+            .offset = offsetof(struct n2n_edge_stats, rx_ctrl_peak),
+        },
+        {
+            .val1 = "rx",
+            .val2 = "queue_data",
+            .offset = offsetof(struct n2n_edge_stats, rx_data),
+        },
+        {
+            .val1 = "rx",
+            .val2 = "queue_data_peak",
+            .offset = offsetof(struct n2n_edge_stats, rx_data_peak),
+        },
+        {
+            .val1 = "rx",
+            .val2 = "queue_data_drop",
+            .offset = offsetof(struct n2n_edge_stats, rx_data_drop),
+        },
         { },
     },
 };
@@ -173,6 +263,53 @@ static struct n3n_metrics_module edge_metrics_module2 = {
     .type = n3n_metrics_type_llu32,
 };
 
+static void edge_metrics_peers_callback (strbuf_t **reply, const struct n3n_metrics_module *module) {
+    struct n3n_runtime_data *eee = module->data;
+    struct peer_info *peer, *tmp_peer;
+    macstr_t mac_buf;
+
+    HASH_ITER(hh, eee->known_peers, peer, tmp_peer) {
+        // The helper finds the values relative to the module data
+        struct n3n_metrics_module peer_module = *module;
+        peer_module.data = peer;
+        macaddr_str(mac_buf, peer->mac_addr);
+
+        n3n_metrics_render_u32tags(
+            reply,
+            &peer_module,
+            "peer_rtt_usec",
+            offsetof(struct peer_info, rtt),
+            1,  // number of tag+val pairs
+            "mac",
+            mac_buf
+        );
+        n3n_metrics_render_u32tags(
+            reply,
+            &peer_module,
+            "peer_rtt_var_usec",
+            offsetof(struct peer_info, rtt_var),
+            1,  // number of tag+val pairs
+            "mac",
+            mac_buf
+        );
+        n3n_metrics_render_u32tags(
+            reply,
+            &peer_module,
+            "peer_loss_permille",
+            offsetof(struct peer_info, loss),
+            1,  // number of tag+val pairs
+            "mac",
+            mac_buf
+        );
+    }
+}
+
+static struct n3n_metrics_module edge_metrics_module_peers = {
+    .name = "edge",
+    .cb = &edge_metrics_peers_callback,
+    .type = n3n_metrics_type_cb,
+};
+
 /* ************************************** */
 
 int edge_verify_conf (const n2n_edge_conf_t *conf) {
@@ -190,6 +327,11 @@ int edge_verify_conf (const n2n_edge_conf_t *conf) {
        ((conf->encrypt_key != NULL) && (conf->transop_id == N2N_TRANSFORM_ID_NULL)))
         return -4;
 
+#ifndef __linux__
+    if(conf->tuntap_layer3)
+        return -6;
+#endif
+
     return 0;
 }
 
@@ -533,6 +675,25 @@ struct n3n_runtime_data* edge_init (const n2n_edge_conf_t *conf, int *rv) {
     eee->pending_peers    = NULL;
     reset_sup_attempts(eee);
 
+#ifdef __linux__
+    // No netlink socket until tuntap_open() has made one, zero is stdin
+    eee->device.nl_fd = -1;
+#endif
+    eee->device.layer3 = conf->tuntap_layer3;
+    if(eee->device.layer3) {
+        eee->ip_routes = calloc(1, sizeof(struct ip_routes));
+        if(!eee->ip_routes) {
+            traceEvent(TRACE_ERROR, "cannot allocate memory");
+            goto edge_init_error;
+        }
+    }
+
+    eee->rx_queue = calloc(1, sizeof(struct rx_queue));
+    if(!eee->rx_queue) {
+        traceEvent(TRACE_ERROR, "cannot allocate memory");
+        goto edge_init_error;
+    }
+
     sn_selection_criterion_common_data_default(eee);
 
     // always initialize compression transforms so we can at least decompress
@@ -641,6 +802,11 @@ struct n3n_runtime_data* edge_init (const n2n_edge_conf_t *conf, int *rv) {
         traceEvent(TRACE_NORMAL, "successfully created resolver thread");
     }
 
+    int resolve_fd = resolve_notify_fd(eee->resolve_parameter);
+    if(resolve_fd != -1) {
+        mainloop_register_fd(resolve_fd, fd_info_proto_resolve);
+    }
+
     eee->network_traffic_filter = create_network_traffic_filter();
     network_traffic_filter_add_rule(eee->network_traffic_filter, eee->conf.network_traffic_filter_rules);
 
@@ -649,8 +815,11 @@ struct n3n_runtime_data* edge_init (const n2n_edge_conf_t *conf, int *rv) {
     return(eee);
 
 edge_init_error:
-    if(eee)
+    if(eee) {
+        free(eee->ip_routes);
+        free(eee->rx_queue);
         free(eee);
+    }
     *rv = rc;
     return(NULL);
 }
@@ -705,6 +874,85 @@ static void register_with_local_peers (struct n3n_runtime_data * eee) {
 
 /* ************************************** */
 
+/** Try harder to reach a pending peer the simple hole punch failed for.
+ *
+ *    Called each time the supernode tells us, again, where a still pending
+ *    peer can be found.  The first call only notes the time, the simple punch
+ *    to the reported socket is sent by the caller.  When the peer is still
+ *    pending later on, its NAT probably uses a new port for every destination
+ *    and the one reported is not the one it uses towards us.
+ *
+ *    If the supernode saw the peer's port move by a steady step, the next
+ *    ports along that step are probed first, as a NAT allocating ports in
+ *    sequence will have used one of them for us.  The rest of the round goes
+ *    to random ports, which together with the peer probing ours gives a
+ *    fair chance of meeting somewhere in between.
+ *
+ *    observed must be the socket just reported, before it is stored in peer.
+ */
+static void punch_nat (struct n3n_runtime_data *eee,
+                       struct peer_info *peer,
+                       const n2n_sock_t *observed,
+                       time_t now) {
+
+    n2n_sock_t sock;
+    int32_t delta;
+    int64_t port;
+    uint32_t i;
+    macstr_t mac_buf;
+
+    if(!eee->conf.nat_traversal || !eee->conf.allow_p2p || eee->conf.connect_tcp) {
+        return;
+    }
+
+    if((observed->family == peer->sock.family)
+       && !memcmp(observed->addr.v6, peer->sock.addr.v6,
+                  (observed->family == AF_INET) ? IPV4_SIZE : IPV6_SIZE)
+       && (observed->port != peer->sock.port)) {
+        delta = (int32_t)observed->port - (int32_t)peer->sock.port;
+        peer->punch_delta = (abs(delta) <= NAT_MAX_PORT_DELTA) ? delta : 0;
+    }
+
+    if(!peer->punch_last) {
+        peer->punch_last = now;
+        return;
+    }
+
+    if(((now - peer->punch_last) < NAT_PUNCH_INTERVAL)
+       || (peer->punch_round >= NAT_PUNCH_MAX_ROUNDS)) {
+        return;
+    }
+
+    if(!peer->punch_round) {
+        ++(eee->stats.nat_punch);
+    }
+    peer->punch_round++;
+    peer->punch_last = now;
+
+    traceEvent(TRACE_INFO, "multi-port traversal round %u to %s, port step %d",
+               peer->punch_round,
+               macaddr_str(mac_buf, peer->mac_addr),
+               peer->punch_delta);
+
+    sock = *observed;
+    for(i = 0; i < eee->conf.nat_probe_ports; i++) {
+        if(peer->punch_delta && (i < eee->conf.nat_probe_ports / 2)) {
+            // continue from where the previous rounds left off
+            port = (int64_t)observed->port + (int64_t)peer->punch_delta * ((peer->punch_round - 1) * (eee->conf.nat_probe_ports / 2) + i + 1);
+            if((port < 1024) || (port > 65535)) {
+                // ran off the range a NAT allocates from, no wrapping around
+                continue;
+            }
+            sock.port = port;
+        } else {
+            sock.port = 1024 + n3n_rand() % (65536 - 1024);
+        }
+        send_register(eee, &sock, peer->mac_addr, N2N_PORT_REG_COOKIE);
+        ++(eee->stats.nat_probe);
+    }
+}
+
+
 /** Start the registration process.
  *
  *    If the peer is already in pending_peers, ignore the request.
@@ -790,6 +1038,9 @@ static void register_with_new_peer (struct n3n_runtime_data *eee,
         }
         register_with_local_peers(eee);
     } else{
+        if(from_supernode) {
+            punch_nat(eee, scan, peer, time(NULL));
+        }
         scan->sock = *peer;
     }
     scan->last_seen = time(NULL);
@@ -814,6 +1065,15 @@ static void check_peer_registration_needed (struct n3n_runtime_data *eee,
 
     struct peer_info *scan;
 
+    if(eee->ip_routes && dev_addr && dev_addr->net_addr) {
+        ip_routes_add(eee->ip_routes, dev_addr->net_addr, 32, mac, time(NULL));
+    }
+    if(eee->conf.neigh_proxy && !eee->device.layer3 && dev_addr && dev_addr->net_addr) {
+        uint32_t net_addr = htonl(dev_addr->net_addr);
+
+        neigh_cache_learn(&eee->neigh_cache, AF_INET, (uint8_t *)&net_addr, mac, time(NULL));
+    }
+
     HASH_FIND_PEER(eee->known_peers, mac, scan);
 
     /* If we were not able to find it by MAC, we try to find it by socket. */
@@ -879,6 +1139,14 @@ static void peer_set_p2p_confirmed (struct n3n_runtime_data * eee,
     if(scan) {
         HASH_DEL(eee->pending_peers, scan);
 
+        if(scan->punch_round) {
+            ++(eee->stats.nat_punch_ok);
+            traceEvent(TRACE_NORMAL, "multi-port traversal reached %s [%s] in round %u",
+                       macaddr_str(mac_buf, mac),
+                       sock_to_cstr(sockbuf, peer),
+                       scan->punch_round);
+        }
+
         scan_tmp = find_peer_by_sock(peer, eee->known_peers);
         if(scan_tmp != NULL) {
             HASH_DEL(eee->known_peers, scan_tmp);
@@ -1164,6 +1432,62 @@ static void sendto_sock (struct n3n_runtime_data *eee, const void * buf,
 }
 
 
+/** Send the same datagram to several UDP sockets.
+ *
+ *    On Linux, this takes a single sendmmsg() call for up to
+ *    N2N_BCAST_MAX_PEERS destinations.
+ */
+static void sendto_sock_batch (struct n3n_runtime_data *eee, const void * buf,
+                               size_t len, const n2n_sock_t **dests, int num) {
+
+#ifdef __linux__
+    struct sockaddr_in addrs[N2N_BCAST_MAX_PEERS];
+    struct mmsghdr msgs[N2N_BCAST_MAX_PEERS];
+    struct iovec iov;
+    int i, n = 0;
+
+    if((eee->sock < 0) || eee->conf.connect_tcp) {
+        return;
+    }
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+
+    for(i = 0; (i < num) && (n < N2N_BCAST_MAX_PEERS); i++) {
+        if(dests[i]->family != AF_INET) {
+            // only the plain IPv4 sockets take the fast path
+            sendto_sock(eee, buf, len, dests[i]);
+            continue;
+        }
+        memset(&addrs[n], 0, sizeof(addrs[n]));
+        fill_sockaddr((struct sockaddr *)&addrs[n], sizeof(addrs[n]), dests[i]);
+        memset(&msgs[n], 0, sizeof(msgs[n]));
+        msgs[n].msg_hdr.msg_name = &addrs[n];
+        msgs[n].msg_hdr.msg_namelen = sizeof(addrs[n]);
+        msgs[n].msg_hdr.msg_iov = &iov;
+        msgs[n].msg_hdr.msg_iovlen = 1;
+        n++;
+    }
+
+    i = 0;
+    while(i < n) {
+        int sent = sendmmsg(eee->sock, &msgs[i], n - i, 0);
+        if(sent <= 0) {
+            traceEvent(TRACE_WARNING, "sendmmsg() failed (%d) %s", errno, strerror(errno));
+            return;
+        }
+        i += sent;
+    }
+#else
+    int i;
+
+    for(i = 0; i < num; i++) {
+        sendto_sock(eee, buf, len, dests[i]);
+    }
+#endif
+}
+
+
 /* ************************************** */
 
 
@@ -1217,6 +1541,7 @@ void send_query_peer (struct n3n_runtime_data * eee,
     int n_o_top_sn = 0;
     int n_o_rest_sn = 0;
     int n_o_skip_sn = 0;
+    uint64_t ping_sent;
 
     cmn.ttl = N2N_DEFAULT_TTL;
     cmn.pc = MSG_TYPE_QUERY_PEER;
@@ -1260,6 +1585,7 @@ void send_query_peer (struct n3n_runtime_data * eee,
         // skip a random number of supernodes between top and remaining
         n_o_skip_sn = HASH_COUNT(eee->conf.supernodes) - n_o_pings;
         n_o_skip_sn = (n_o_skip_sn < 0) ? 0 : n3n_rand_sqr(n_o_skip_sn);
+        ping_sent = sn_selection_usec_now();
         HASH_ITER(hh, eee->conf.supernodes, peer, tmp) {
             if(n_o_top_sn) {
                 n_o_top_sn--;
@@ -1275,6 +1601,7 @@ void send_query_peer (struct n3n_runtime_data * eee,
                 // done with the remaining (do not send anymore)
                 break;
             }
+            peer->ping_sent = ping_sent;
             sendto_sock(eee, pktbuf, idx, &(peer->sock));
         }
     }
@@ -1282,8 +1609,8 @@ void send_query_peer (struct n3n_runtime_data * eee,
 
 /* ******************************************************** */
 
-/** Send a REGISTER_SUPER packet to the current supernode. */
-void send_register_super (struct n3n_runtime_data *eee) {
+/** Send a REGISTER_SUPER packet to the given supernode. */
+static void send_register_super_to (struct n3n_runtime_data *eee, struct peer_info *sn) {
 
     uint8_t pktbuf[N2N_PKT_BUF_SIZE] = {0};
     uint8_t hash_buf[16] = {0};
@@ -1307,9 +1634,10 @@ void send_register_super (struct n3n_runtime_data *eee) {
     }
     memcpy(cmn.community, eee->conf.community_name, N2N_COMMUNITY_SIZE);
 
-    eee->curr_sn->last_cookie = n3n_rand();
+    sn->last_cookie = n3n_rand();
+    sn->reg_sent = sn_selection_usec_now();
 
-    reg.cookie = eee->curr_sn->last_cookie;
+    reg.cookie = sn->last_cookie;
     reg.dev_addr.net_addr = ntohl(eee->device.ip_addr);
     reg.dev_addr.net_bitlen = eee->conf.tuntap_v4.net_bitlen;
     memcpy(reg.dev_desc, eee->conf.dev_desc, N2N_DESC_SIZE);
@@ -1321,7 +1649,7 @@ void send_register_super (struct n3n_runtime_data *eee) {
     encode_REGISTER_SUPER(pktbuf, &idx, &cmn, &reg);
 
     traceEvent(TRACE_DEBUG, "send REGISTER_SUPER to [%s]",
-               sock_to_cstr(sockbuf, &(eee->curr_sn->sock)));
+               sock_to_cstr(sockbuf, &(sn->sock)));
 
     if(eee->conf.header_encryption == HEADER_ENCRYPTION_ENABLED) {
         packet_header_encrypt(pktbuf, idx, idx,
@@ -1335,11 +1663,38 @@ void send_register_super (struct n3n_runtime_data *eee) {
         }
     }
 
-    sendto_sock(eee, pktbuf, idx, &(eee->curr_sn->sock));
+    sendto_sock(eee, pktbuf, idx, &(sn->sock));
+}
+
+
+/** Send a REGISTER_SUPER packet to the current supernode. */
+void send_register_super (struct n3n_runtime_data *eee) {
+    send_register_super_to(eee, eee->curr_sn);
+}
+
+
+/** Send a REGISTER_SUPER packet to all supernodes, the first one to answer
+ *  becomes the current supernode (see edge_sn_search_done) */
+void send_register_super_all (struct n3n_runtime_data *eee) {
+
+    struct peer_info *scan, *tmp;
+
+    if(eee->conf.connect_tcp || !eee->conf.sn_parallel || (HASH_COUNT(eee->conf.supernodes) <= 1)) {
+        send_register_super(eee);
+        return;
+    }
+
+    traceEvent(TRACE_INFO, "registering with all %d supernodes",
+               HASH_COUNT(eee->conf.supernodes));
+
+    eee->sn_search = true;
+    HASH_ITER(hh, eee->conf.supernodes, scan, tmp) {
+        send_register_super_to(eee, scan);
+    }
 }
 
 
-static void send_unregister_super (struct n3n_runtime_data *eee) {
+static void send_unregister_super (struct n3n_runtime_data *eee, struct peer_info *sn) {
 
     uint8_t pktbuf[N2N_PKT_BUF_SIZE] = {0};
     size_t idx;
@@ -1364,14 +1719,14 @@ static void send_unregister_super (struct n3n_runtime_data *eee) {
     encode_UNREGISTER_SUPER(pktbuf, &idx, &cmn, &unreg);
 
     traceEvent(TRACE_DEBUG, "send UNREGISTER_SUPER to [%s]",
-               sock_to_cstr(sockbuf, &(eee->curr_sn->sock)));
+               sock_to_cstr(sockbuf, &(sn->sock)));
 
     if(eee->conf.header_encryption == HEADER_ENCRYPTION_ENABLED)
         packet_header_encrypt(pktbuf, idx, idx,
                               eee->conf.header_encryption_ctx_dynamic, eee->conf.header_iv_ctx_dynamic,
                               time_stamp());
 
-    sendto_sock(eee, pktbuf, idx, &(eee->curr_sn->sock));
+    sendto_sock(eee, pktbuf, idx, &(sn->sock));
 
 }
 
@@ -1391,9 +1746,10 @@ static void sort_supernodes (struct n3n_runtime_data *eee, time_t now) {
         sn_selection_sort(&(eee->conf.supernodes));
     }
 
-    if(eee->curr_sn != eee->conf.supernodes) {
+    if((eee->curr_sn != eee->conf.supernodes)
+       && sn_selection_criterion_better(eee, eee->conf.supernodes)) {
         // we have not been connected to the best/top one
-        send_unregister_super(eee);
+        send_unregister_super(eee, eee->curr_sn);
         eee->curr_sn = eee->conf.supernodes;
         reset_sup_attempts(eee);
         supernode_connect(eee);
@@ -1428,6 +1784,33 @@ static void sort_supernodes (struct n3n_runtime_data *eee, time_t now) {
     eee->sn_pong = 0;
 }
 
+
+// The first supernode answering a REGISTER_SUPER sent to all of them becomes
+// the current supernode, the other ones are told to forget about the edge
+// again and stay available as standby
+static void edge_sn_search_done (struct n3n_runtime_data *eee, struct peer_info *sn) {
+
+    struct peer_info *scan, *tmp;
+
+    eee->sn_search = false;
+
+    if(sn != eee->curr_sn) {
+        traceEvent(TRACE_NORMAL, "supernode [%s] answered first",
+                   peer_info_get_hostname(sn));
+        eee->curr_sn = sn;
+    }
+
+    HASH_ITER(hh, eee->conf.supernodes, scan, tmp) {
+        if(scan == sn) {
+            sn_selection_criterion_good(&(scan->selection_criterion));
+            continue;
+        }
+        sn_selection_criterion_default(&(scan->selection_criterion));
+        send_unregister_super(eee, scan);
+    }
+    sn_selection_sort(&(eee->conf.supernodes));
+}
+
 /** Send a REGISTER packet to another edge. */
 static void send_register (struct n3n_runtime_data * eee,
                            const n2n_sock_t * remote_peer,
@@ -1527,95 +1910,401 @@ static void send_register_ack (struct n3n_runtime_data * eee,
 
 /* ************************************** */
 
-static char gratuitous_arp[] = {
-    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, /* dest MAC */
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* src MAC */
-    0x08, 0x06, /* ARP */
-    0x00, 0x01, /* ethernet */
-    0x08, 0x00, /* IP */
-    0x06, /* hw Size */
-    0x04, /* protocol Size */
-    0x00, 0x02, /* ARP reply */
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* src MAC */
-    0x00, 0x00, 0x00, 0x00, /* src IP */
-    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, /* target MAC */
-    0x00, 0x00, 0x00, 0x00 /* target IP */
-};
-
-// build a gratuitous ARP packet */
-static int build_gratuitous_arp (struct n3n_runtime_data * eee, char *buffer, uint16_t buffer_len) {
+/* Fold the outcome of a probe into the smoothed loss of a peer */
+static void peer_probe_result (struct peer_info *peer, bool lost) {
 
-    if(buffer_len < sizeof(gratuitous_arp)) return(-1);
+    peer->loss = (7 * peer->loss + (lost ? 1000 : 0)) / 8;
+}
 
-    memcpy(buffer, gratuitous_arp, sizeof(gratuitous_arp));
-    memcpy(&buffer[6], eee->device.mac_addr, 6);
-    memcpy(&buffer[22], eee->device.mac_addr, 6);
-    memcpy(&buffer[28], &(eee->device.ip_addr), 4);
-    memcpy(&buffer[38], &(eee->device.ip_addr), 4);
 
-    return(sizeof(gratuitous_arp));
-}
+/** Measure the round trip time to the peers we talk to directly.
+ *
+ *    The probe is a REGISTER with its own cookie, so the REGISTER_ACK that
+ *    answers it can be told apart.  A probe still unanswered when the next
+ *    one is due counts as lost.
+ */
+static void probe_known_peers (struct n3n_runtime_data *eee, time_t *p_last_probe, time_t now) {
 
-/** Called from update_supernode_reg to periodically send gratuitous ARP
- *    broadcasts. */
-static void send_grat_arps (struct n3n_runtime_data * eee) {
+    struct peer_info *peer, *tmp_peer;
+    uint64_t sent;
 
-    uint8_t buffer[48];
-    size_t len;
+    if(!eee->conf.allow_p2p) {
+        return;
+    }
 
-    traceEvent(TRACE_DEBUG, "sending gratuitous ARP...");
-    len = build_gratuitous_arp(eee, (char*)buffer, sizeof(buffer));
+    if((now - *p_last_probe) < PEER_PROBE_INTERVAL) {
+        return;
+    }
+    *p_last_probe = now;
 
-    edge_send_packet2net(eee, buffer, len);
-    edge_send_packet2net(eee, buffer, len); /* Two is better than one :-) */
+    sent = sn_selection_usec_now();
+    HASH_ITER(hh, eee->known_peers, peer, tmp_peer) {
+        if(peer->ping_sent) {
+            peer_probe_result(peer, true);
+        }
+        peer->ping_sent = sent;
+        send_register(eee, &(peer->sock), peer->mac_addr, N2N_PROBE_REG_COOKIE);
+    }
 }
 
 /* ************************************** */
 
-/** @brief Check to see if we should re-register with the supernode.
+/** Tell the other edges which peers we can relay to.
  *
- *    This is frequently called by the main loop.
+ *    The RELAY_INFO goes to the supernode, which passes it on to all the
+ *    edges of the community.  The routes built from the advertisements of
+ *    others are refreshed at the same time, so they follow the changing
+ *    round trip times and lose the relays that went away.
  */
-void update_supernode_reg (struct n3n_runtime_data * eee, time_t now) {
+static void send_relay_info (struct n3n_runtime_data *eee, time_t *p_last_relay_info, time_t now) {
 
-    struct peer_info *peer, *tmp_peer;
-    int cnt = 0;
-    int off = 0;
+    uint8_t pktbuf[N2N_PKT_BUF_SIZE];
+    size_t idx;
+    n2n_common_t cmn = {0};
+    n2n_RELAY_INFO_t ri;
 
-    if((eee->sn_wait && (now > (eee->last_register_req + (eee->conf.register_interval / 10))))
-       ||(eee->sn_wait == 2)) { /* immediately re-register in case of RE_REGISTER_SUPER */
-        /* fall through */
-        traceEvent(TRACE_DEBUG, "update_supernode_reg: doing fast retry.");
-    } else if(now < (eee->last_register_req + eee->conf.register_interval))
-        return; /* Too early */
+    if((now - *p_last_relay_info) < RELAY_INFO_INTERVAL) {
+        return;
+    }
+    *p_last_relay_info = now;
 
-    // determine time offset to apply on last_register_req for
-    // all edges's next re-registration does not happen all at once
-    if(eee->sn_wait == 2) {
-        // remaining 1/4 is greater than 1/10 fast retry allowance;
-        // '%' might be expensive but does not happen all too often
-        off = n3n_rand() % ((eee->conf.register_interval * 3) / 4);
+    if(eee->conf.relay_via_peers) {
+        relay_routes_update(&eee->relay_routes, &eee->relays, eee->known_peers,
+                            eee->device.mac_addr, now);
     }
 
-    check_join_multicast_group(eee);
+    if(!eee->conf.relay_for_peers || !eee->conf.allow_p2p || eee->conf.connect_tcp) {
+        return;
+    }
 
-    if(0 == eee->sup_attempts) {
-        /* Give up on that supernode and try the next one. */
-        sn_selection_criterion_bad(&(eee->curr_sn->selection_criterion));
-        sn_selection_sort(&(eee->conf.supernodes));
-        eee->curr_sn = eee->conf.supernodes;
-        traceEvent(
-            TRACE_WARNING,
-            "supernode not responding, now trying [%s]",
-            peer_info_get_hostname(eee->curr_sn)
-        );
-        reset_sup_attempts(eee);
-        // trigger out-of-schedule DNS resolution
-        eee->resolution_request = true;
+    if(!eee->last_sup) {
+        return;
+    }
 
-        // in some multi-NATed scenarios communication gets stuck on losing connection to supernode
-        // closing and re-opening the socket allows for re-establishing communication
-        // this can only be done, if working on some unprivileged port and/or having sufficent
+    memset(&ri, 0, sizeof(ri));
+    memcpy(ri.srcMac, eee->device.mac_addr, N2N_MAC_SIZE);
+    if(!relay_info_build(&ri, eee->known_peers)) {
+        return;
+    }
+
+    cmn.ttl = N2N_DEFAULT_TTL;
+    cmn.pc = MSG_TYPE_RELAY_INFO;
+    cmn.flags = 0;
+    memcpy(cmn.community, eee->conf.community_name, N2N_COMMUNITY_SIZE);
+
+    idx = 0;
+    encode_RELAY_INFO(pktbuf, &idx, &cmn, &ri);
+
+    if(eee->conf.header_encryption == HEADER_ENCRYPTION_ENABLED) {
+        packet_header_encrypt(pktbuf, idx, idx,
+                              eee->conf.header_encryption_ctx_dynamic, eee->conf.header_iv_ctx_dynamic,
+                              time_stamp());
+    }
+
+    traceEvent(TRACE_DEBUG, "send RELAY_INFO with %u peers to supernode", (unsigned int)ri.num_peers);
+
+    sendto_sock(eee, pktbuf, idx, &(eee->curr_sn->sock));
+}
+
+
+/** Keep the supernode up to date with the multicast groups joined behind us.
+ *
+ *    The local hosts are asked for their groups from time to time, like a
+ *    multicast router on their link would, as there might be none.  The
+ *    complete list goes to the supernode every MCAST_REPORT_INTERVAL, or
+ *    sooner after a new group was joined.  If there are more groups than fit
+ *    in one MCAST_GROUPS, none are listed and the overflow flag asks the
+ *    supernode to send us all multicast frames instead.
+ */
+static void send_mcast_groups (struct n3n_runtime_data *eee, time_t now) {
+
+    uint8_t pktbuf[N2N_PKT_BUF_SIZE];
+    size_t idx;
+    n2n_common_t cmn = {0};
+    n2n_MCAST_GROUPS_t mg;
+    bool overflow;
+
+    if(!eee->conf.mcast_snooping || !eee->conf.allow_multicast || eee->device.layer3) {
+        return;
+    }
+
+    if((now - eee->last_mcast_query) >= MCAST_QUERY_INTERVAL) {
+        eee->last_mcast_query = now;
+
+        idx = mcast_igmp_query(pktbuf, sizeof(pktbuf), eee->device.mac_addr, eee->device.ip_addr);
+        tuntap_write(&(eee->device), pktbuf, idx);
+        idx = mcast_mld_query(pktbuf, sizeof(pktbuf), eee->device.mac_addr);
+        tuntap_write(&(eee->device), pktbuf, idx);
+    }
+
+    if((now - eee->last_mcast_report) < MCAST_REPORT_INTERVAL) {
+        return;
+    }
+
+    if(!eee->last_sup) {
+        return;
+    }
+    eee->last_mcast_report = now;
+
+    mcast_groups_purge(&eee->mcast_groups, now - MCAST_GROUP_TIMEOUT);
+
+    memset(&mg, 0, sizeof(mg));
+    memcpy(mg.srcMac, eee->device.mac_addr, N2N_MAC_SIZE);
+    mg.num_groups = mcast_groups_list(eee->mcast_groups, mg.groups, N2N_MCAST_MAX_GROUPS, &overflow);
+    if(overflow) {
+        mg.flags = N2N_MCAST_GROUPS_OVERFLOW;
+    }
+
+    cmn.ttl = N2N_DEFAULT_TTL;
+    cmn.pc = MSG_TYPE_MCAST_GROUPS;
+    cmn.flags = 0;
+    memcpy(cmn.community, eee->conf.community_name, N2N_COMMUNITY_SIZE);
+
+    idx = 0;
+    encode_MCAST_GROUPS(pktbuf, &idx, &cmn, &mg);
+
+    if(eee->conf.header_encryption == HEADER_ENCRYPTION_ENABLED) {
+        packet_header_encrypt(pktbuf, idx, idx,
+                              eee->conf.header_encryption_ctx_dynamic, eee->conf.header_iv_ctx_dynamic,
+                              time_stamp());
+    }
+
+    traceEvent(TRACE_DEBUG, "send MCAST_GROUPS with %u groups%s to supernode",
+               (unsigned int)mg.num_groups,
+               (mg.flags & N2N_MCAST_GROUPS_OVERFLOW) ? " (overflow)" : "");
+
+    sendto_sock(eee, pktbuf, idx, &(eee->curr_sn->sock));
+}
+
+
+/** Tell the supernode which peers we send our broadcasts to directly.
+ *
+ *    Only the peers with a working p2p connection are picked, and the same
+ *    ones are used until the next BCAST_PEERS, so the supernode skips
+ *    exactly the edges that got the broadcast from us.
+ */
+static void send_bcast_peers (struct n3n_runtime_data *eee, time_t now) {
+
+    uint8_t pktbuf[N2N_PKT_BUF_SIZE];
+    size_t idx;
+    n2n_common_t cmn = {0};
+    n2n_BCAST_PEERS_t bp;
+    struct peer_info *peer, *tmp_peer;
+
+    if(!eee->conf.p2p_broadcast || !eee->conf.allow_p2p || eee->conf.connect_tcp) {
+        return;
+    }
+
+    if((now - eee->last_bcast_peers) < BCAST_PEERS_INTERVAL) {
+        return;
+    }
+
+    if(!eee->last_sup) {
+        return;
+    }
+    eee->last_bcast_peers = now;
+
+    memset(&bp, 0, sizeof(bp));
+    memcpy(bp.srcMac, eee->device.mac_addr, N2N_MAC_SIZE);
+    HASH_ITER(hh, eee->known_peers, peer, tmp_peer) {
+        peer->bcast_direct = (bp.num_peers < N2N_BCAST_MAX_PEERS) && relay_peer_usable(peer);
+        if(peer->bcast_direct) {
+            memcpy(bp.peers[bp.num_peers++], peer->mac_addr, N2N_MAC_SIZE);
+        }
+    }
+
+    cmn.ttl = N2N_DEFAULT_TTL;
+    cmn.pc = MSG_TYPE_BCAST_PEERS;
+    cmn.flags = 0;
+    memcpy(cmn.community, eee->conf.community_name, N2N_COMMUNITY_SIZE);
+
+    idx = 0;
+    encode_BCAST_PEERS(pktbuf, &idx, &cmn, &bp);
+
+    if(eee->conf.header_encryption == HEADER_ENCRYPTION_ENABLED) {
+        packet_header_encrypt(pktbuf, idx, idx,
+                              eee->conf.header_encryption_ctx_dynamic, eee->conf.header_iv_ctx_dynamic,
+                              time_stamp());
+    }
+
+    traceEvent(TRACE_DEBUG, "send BCAST_PEERS with %u peers to supernode", (unsigned int)bp.num_peers);
+
+    sendto_sock(eee, pktbuf, idx, &(eee->curr_sn->sock));
+}
+
+
+/** Forward a PACKET from a peer to another peer we have a direct path to.
+ *
+ *    The header gets the RELAYED flag and the socket we see the sender at,
+ *    so the destination neither mistakes us for the sender nor stops trying
+ *    to reach it directly.  The payload is passed on as it is and the header
+ *    is encrypted again with the time stamp of the sender.
+ */
+static void relay_packet (struct n3n_runtime_data *eee,
+                          const n2n_common_t *cmn,
+                          n2n_PACKET_t *pkt,
+                          const n2n_sock_t *sender,
+                          const uint8_t *udp_buf,
+                          size_t udp_size,
+                          size_t idx,
+                          uint64_t stamp) {
+
+    uint8_t pktbuf[N2N_PKT_BUF_SIZE];
+    size_t encx = 0;
+    n2n_common_t cmn2;
+    struct peer_info *peer;
+    macstr_t mac_buf1, mac_buf2;
+
+    if(cmn->ttl < 1) {
+        traceEvent(TRACE_DEBUG, "dropped PACKET to relay with expired TTL");
+        ++(eee->stats.relay_drop);
+        return;
+    }
+
+    HASH_FIND_PEER(eee->known_peers, pkt->dstMac, peer);
+    if(!peer || !relay_peer_usable(peer)) {
+        traceEvent(TRACE_DEBUG, "dropped PACKET to relay to %s, no direct path",
+                   macaddr_str(mac_buf1, pkt->dstMac));
+        ++(eee->stats.relay_drop);
+        return;
+    }
+
+    if(!token_bucket_take(&eee->relay_limit, eee->conf.relay_max_rate, 0,
+                          udp_size, sn_selection_usec_now())) {
+        traceEvent(TRACE_DEBUG, "dropped PACKET to relay, rate limit reached");
+        ++(eee->stats.relay_drop);
+        return;
+    }
+
+    memcpy(&cmn2, cmn, sizeof(cmn2));
+    --(cmn2.ttl);
+    cmn2.flags |= N2N_FLAGS_RELAYED | N2N_FLAGS_SOCKET;
+    memcpy(&pkt->sock, sender, sizeof(n2n_sock_t));
+
+    encode_PACKET(pktbuf, &encx, &cmn2, pkt);
+    uint16_t headerIdx = encx;
+
+    if(encx + (udp_size - idx) > sizeof(pktbuf)) {
+        ++(eee->stats.relay_drop);
+        return;
+    }
+    encode_buf(pktbuf, &encx, udp_buf + idx, udp_size - idx);
+
+    if(eee->conf.header_encryption == HEADER_ENCRYPTION_ENABLED)
+        // in case of user-password auth, also encrypt the iv of payload assuming ChaCha20 and SPECK having the same iv size
+        packet_header_encrypt(pktbuf, headerIdx + (NULL != eee->conf.shared_secret) * MIN(encx - headerIdx, N2N_SPECK_IVEC_SIZE), encx,
+                              eee->conf.header_encryption_ctx_dynamic, eee->conf.header_iv_ctx_dynamic,
+                              stamp);
+
+    traceEvent(TRACE_DEBUG, "relay PACKET of %u bytes from %s to %s",
+               (unsigned int)encx,
+               macaddr_str(mac_buf1, pkt->srcMac),
+               macaddr_str(mac_buf2, pkt->dstMac));
+
+    ++(eee->stats.relay_fwd);
+    sendto_sock(eee, pktbuf, encx, &peer->sock);
+}
+
+/* ************************************** */
+
+static char gratuitous_arp[] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, /* dest MAC */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* src MAC */
+    0x08, 0x06, /* ARP */
+    0x00, 0x01, /* ethernet */
+    0x08, 0x00, /* IP */
+    0x06, /* hw Size */
+    0x04, /* protocol Size */
+    0x00, 0x02, /* ARP reply */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* src MAC */
+    0x00, 0x00, 0x00, 0x00, /* src IP */
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, /* target MAC */
+    0x00, 0x00, 0x00, 0x00 /* target IP */
+};
+
+// build a gratuitous ARP packet */
+static int build_gratuitous_arp (struct n3n_runtime_data * eee, char *buffer, uint16_t buffer_len) {
+
+    if(buffer_len < sizeof(gratuitous_arp)) return(-1);
+
+    memcpy(buffer, gratuitous_arp, sizeof(gratuitous_arp));
+    memcpy(&buffer[6], eee->device.mac_addr, 6);
+    memcpy(&buffer[22], eee->device.mac_addr, 6);
+    memcpy(&buffer[28], &(eee->device.ip_addr), 4);
+    memcpy(&buffer[38], &(eee->device.ip_addr), 4);
+
+    return(sizeof(gratuitous_arp));
+}
+
+/** Called from update_supernode_reg to periodically send gratuitous ARP
+ *    broadcasts. */
+static void send_grat_arps (struct n3n_runtime_data * eee) {
+
+    uint8_t buffer[48];
+    size_t len;
+
+    if(eee->device.layer3) {
+        // the other edges learn our address from our packets and REGISTERs
+        return;
+    }
+
+    traceEvent(TRACE_DEBUG, "sending gratuitous ARP...");
+    len = build_gratuitous_arp(eee, (char*)buffer, sizeof(buffer));
+
+    edge_send_packet2net(eee, buffer, len);
+    edge_send_packet2net(eee, buffer, len); /* Two is better than one :-) */
+}
+
+/* ************************************** */
+
+/** @brief Check to see if we should re-register with the supernode.
+ *
+ *    This is frequently called by the main loop.
+ */
+void update_supernode_reg (struct n3n_runtime_data * eee, time_t now) {
+
+    struct peer_info *peer, *tmp_peer;
+    int cnt = 0;
+    int off = 0;
+    // look for any answering supernode until the first registration or
+    // after losing the current one
+    bool search = !eee->last_sup || eee->sn_search;
+
+    if((eee->sn_wait && (now > (eee->last_register_req + (eee->conf.register_interval / 10))))
+       ||(eee->sn_wait == 2)) { /* immediately re-register in case of RE_REGISTER_SUPER */
+        /* fall through */
+        traceEvent(TRACE_DEBUG, "update_supernode_reg: doing fast retry.");
+    } else if(now < (eee->last_register_req + eee->conf.register_interval))
+        return; /* Too early */
+
+    // determine time offset to apply on last_register_req for
+    // all edges's next re-registration does not happen all at once
+    if(eee->sn_wait == 2) {
+        // remaining 1/4 is greater than 1/10 fast retry allowance;
+        // '%' might be expensive but does not happen all too often
+        off = n3n_rand() % ((eee->conf.register_interval * 3) / 4);
+    }
+
+    check_join_multicast_group(eee);
+
+    if(0 == eee->sup_attempts) {
+        /* Give up on that supernode and try the next one. */
+        sn_selection_criterion_bad(&(eee->curr_sn->selection_criterion));
+        sn_selection_sort(&(eee->conf.supernodes));
+        eee->curr_sn = eee->conf.supernodes;
+        traceEvent(
+            TRACE_WARNING,
+            "supernode not responding, now trying [%s]",
+            peer_info_get_hostname(eee->curr_sn)
+        );
+        reset_sup_attempts(eee);
+        search = true;
+        // trigger out-of-schedule DNS resolution
+        eee->resolution_request = true;
+
+        // in some multi-NATed scenarios communication gets stuck on losing connection to supernode
+        // closing and re-opening the socket allows for re-establishing communication
+        // this can only be done, if working on some unprivileged port and/or having sufficent
         // privileges. as we are not able to check for sufficent privileges here, we only do it
         // If bind_address is null then we definitely dont have a local port
         // set.  Since we have converted to using a sockaddr struct for the
@@ -1663,7 +2352,11 @@ void update_supernode_reg (struct n3n_runtime_data * eee, time_t now) {
             (unsigned int)eee->sup_attempts
         );
 
-        send_register_super(eee);
+        if(search) {
+            send_register_super_all(eee);
+        } else {
+            send_register_super(eee);
+        }
     }
 
     register_with_local_peers(eee);
@@ -1682,10 +2375,135 @@ void update_supernode_reg (struct n3n_runtime_data * eee, time_t now) {
 
 /* ************************************** */
 
+/** Answer an ARP request for our address in layer 3 mode.
+ *
+ *    The TUN interface does not see ARP, but edges still using TAP need
+ *    our MAC address to send us anything.
+ */
+static void layer3_arp_reply (struct n3n_runtime_data *eee, const uint8_t *frame, size_t len) {
+
+    uint8_t reply[ETH_FRAMESIZE + 28];
+
+    // for our address
+    if((len < ETH_FRAMESIZE + 28)
+       || memcmp(&frame[ETH_FRAMESIZE + 24], &(eee->device.ip_addr), 4)) {
+        return;
+    }
+
+    if(neigh_arp_reply(reply, sizeof(reply), frame, len, eee->device.mac_addr)) {
+        edge_send_packet2net(eee, reply, sizeof(reply));
+    }
+}
+
+
+/** Prepare a received ethernet frame for a layer 3 TUN interface.
+ *
+ *    Learns the route back to the sender of an IPv4 packet or ARP.  Packets sent
+ *    to all edges because the sender had no route yet are only kept by the
+ *    edge they are addressed to or, with allow_routing, by edges that may
+ *    route them on to a host outside the community's subnet.  Returns -1 if
+ *    there is nothing to write to the interface.
+ */
+static int layer3_rx_frame (struct n3n_runtime_data *eee,
+                            const n2n_mac_t srcMac,
+                            const uint8_t *frame,
+                            size_t len,
+                            time_t now) {
+
+    ether_hdr_t eh;
+    uint32_t dst, src, bcast, mask;
+
+    memcpy(&eh, frame, sizeof(ether_hdr_t));
+
+    if(ntohs(eh.type) == 0x0806) {
+        if(len >= ETH_FRAMESIZE + 28) {
+            // the sender's address, also from gratuitous ARPs
+            memcpy(&src, &frame[ETH_FRAMESIZE + 14], sizeof(src));
+            if(src) {
+                ip_routes_add(eee->ip_routes, ntohl(src), 32, srcMac, now);
+            }
+        }
+        layer3_arp_reply(eee, frame, len);
+        return -1;
+    }
+
+    if((ntohs(eh.type) != 0x0800) || (len < ETH_FRAMESIZE + IP4_MIN_SIZE)) {
+        return -1;
+    }
+
+    memcpy(&dst, &frame[ETH_FRAMESIZE + IP4_DSTOFFSET], sizeof(dst));
+    memcpy(&src, &frame[ETH_FRAMESIZE + IP4_SRCOFFSET], sizeof(src));
+
+    if(is_multi_broadcast(eh.dhost) && (dst != eee->device.ip_addr)) {
+        mask = htonl(bitlen2mask(eee->conf.tuntap_v4.net_bitlen));
+        bcast = eee->device.ip_addr | ~mask;
+        // let IP broadcast and multicast through
+        if((dst == bcast) || (dst == INADDR_BROADCAST) || IN_MULTICAST(ntohl(dst))) {
+            // keep
+        } else if(eee->conf.allow_routing && ((dst & mask) != (eee->device.ip_addr & mask))) {
+            // possibly for a host behind us, our reply teaches the sender the route
+        } else {
+            return -1;
+        }
+    }
+
+    ip_routes_add(eee->ip_routes, ntohl(src), 32, srcMac, now);
+
+    return 0;
+}
+
+
+/** Give a packet read from a layer 3 TUN interface an ethernet header.
+ *
+ *    The IP packet starts ETH_FRAMESIZE bytes into frame.  It goes to the edge
+ *    with the longest matching route.  If there is none yet, one packet every
+ *    LAYER3_FLOOD_INTERVAL goes to all edges, much like the ARP request a TAP
+ *    interface would have sent, and the others are dropped until the reply
+ *    brings the route.  A pending route to the broadcast MAC keeps the time of
+ *    the last one.  Returns -1 if the packet cannot be sent.
+ */
+static int layer3_tx_frame (struct n3n_runtime_data *eee, uint8_t *frame, size_t len) {
+
+    ether_hdr_t eh;
+    struct ip_route *route;
+    uint32_t dst, bcast;
+    time_t now;
+
+    if((len < ETH_FRAMESIZE + IP4_MIN_SIZE) || ((frame[ETH_FRAMESIZE] >> 4) != 4)) {
+        traceEvent(TRACE_DEBUG, "layer3: dropping non IPv4 packet");
+        return -1;
+    }
+
+    memcpy(&dst, &frame[ETH_FRAMESIZE + IP4_DSTOFFSET], sizeof(dst));
+    route = ip_routes_lookup(eee->ip_routes, ntohl(dst));
+
+    bcast = eee->device.ip_addr | htonl(~bitlen2mask(eee->conf.tuntap_v4.net_bitlen));
+    if((!route || is_broadcast(route->mac_addr))
+       && (dst != bcast) && (dst != INADDR_BROADCAST) && !IN_MULTICAST(ntohl(dst))) {
+        now = time(NULL);
+        if(route && ((now - route->last_seen) < LAYER3_FLOOD_INTERVAL)) {
+            traceEvent(TRACE_DEBUG, "layer3: no route yet, dropping packet");
+            ++(eee->stats.tx_layer3_drop);
+            return -1;
+        }
+        ip_routes_add(eee->ip_routes, ntohl(dst), 32, broadcast_mac, now);
+        route = NULL;
+    }
+
+    memcpy(eh.dhost, route ? route->mac_addr : broadcast_mac, N2N_MAC_SIZE);
+    memcpy(eh.shost, eee->device.mac_addr, N2N_MAC_SIZE);
+    eh.type = htons(0x0800);
+    memcpy(frame, &eh, sizeof(ether_hdr_t));
+
+    return 0;
+}
+
+
 /** A PACKET has arrived containing an encapsulated ethernet datagram - usually
  *    encrypted. */
 static int handle_PACKET (struct n3n_runtime_data * eee,
                           const uint8_t from_supernode,
+                          const bool relayed,
                           const n2n_PACKET_t * pkt,
                           const n2n_sock_t * orig_sender,
                           uint8_t * payload,
@@ -1710,6 +2528,8 @@ static int handle_PACKET (struct n3n_runtime_data * eee,
 
         ++(eee->stats.rx_sup);
         eee->last_sup = now;
+    } else if(relayed) {
+        ++(eee->stats.rx_relay);
     } else {
         ++(eee->stats.rx_p2p);
         eee->last_p2p=now;
@@ -1796,6 +2616,12 @@ static int handle_PACKET (struct n3n_runtime_data * eee,
         return(-1);
     }
 
+    if(eee->conf.mcast_snooping && is_multicast && mcast_is_suppressible_report(eth_payload, eth_size)) {
+        // our local hosts must send their own reports for us to see
+        traceEvent(TRACE_DEBUG, "not passing on a multicast membership report");
+        return 0;
+    }
+
     if((!eee->conf.allow_routing) && (!is_multicast)) {
         /* Check if it is a routed packet */
 
@@ -1843,6 +2669,17 @@ static int handle_PACKET (struct n3n_runtime_data * eee,
         return(0);
     }
 
+    if(eee->device.layer3) {
+        if(layer3_rx_frame(eee, pkt->srcMac, eth_payload, eth_size, now) != 0) {
+            return 0;
+        }
+        // the TUN interface takes the bare IP packet
+        eth_payload += ETH_FRAMESIZE;
+        eth_size -= ETH_FRAMESIZE;
+    } else if(eee->conf.neigh_proxy) {
+        neigh_cache_learn_frame(&eee->neigh_cache, eth_payload, eth_size, now);
+    }
+
     /* Write ethernet packet to tap device. */
     traceEvent(TRACE_DEBUG, "sending data of size %u to TAP", (unsigned int)eth_size);
     data_sent_len = tuntap_write(&(eee->device), eth_payload, eth_size);
@@ -1925,7 +2762,7 @@ static int check_query_peer_info (struct n3n_runtime_data *eee, time_t now, n2n_
 
 /* ************************************** */
 
-/* @return 1 if destination is a peer, 0 if destination is supernode */
+/* @return 1 if destination is a peer, 2 if it is a relaying peer, 0 if destination is supernode */
 static int find_peer_destination (struct n3n_runtime_data * eee,
                                   n2n_mac_t mac_address,
                                   n2n_sock_t * destination) {
@@ -1963,6 +2800,20 @@ static int find_peer_destination (struct n3n_runtime_data * eee,
         }
     }
 
+    if((retval == 0) && eee->conf.relay_via_peers) {
+        scan = relay_find(eee->relay_routes, eee->known_peers, mac_address);
+        if(scan) {
+            memcpy(destination, &scan->sock, sizeof(n2n_sock_t));
+            traceEvent(TRACE_DEBUG, "p2p peer %s not found, relaying through %s",
+                       macaddr_str(mac_buf, mac_address),
+                       sock_to_cstr(sockbuf, destination));
+            retval = 2;
+
+            // keep trying to get a direct path
+            check_query_peer_info(eee, now, mac_address);
+        }
+    }
+
     if(retval == 0) {
         memcpy(destination, &(eee->curr_sn->sock), sizeof(struct sockaddr_in));
         traceEvent(TRACE_DEBUG, "p2p peer %s not found, using supernode",
@@ -2000,7 +2851,9 @@ static int send_packet (struct n3n_runtime_data * eee,
                pktlen, macaddr_str(mac_buf, dstMac),
                sock_to_cstr(sockbuf, &destination));
 
-    if(is_p2p)
+    if(is_p2p == 2)
+        ++(eee->stats.tx_relay);
+    else if(is_p2p)
         ++(eee->stats.tx_p2p);
     else
         ++(eee->stats.tx_sup);
@@ -2011,9 +2864,24 @@ static int send_packet (struct n3n_runtime_data * eee,
         // if no supernode around, foward the broadcast to all known peers
         if(eee->sn_wait) {
             HASH_ITER(hh, eee->known_peers, peer, tmp_peer) {
-                sendto_sock(eee, pktbuf, pktlen, &peer->sock);
+                sendto_sock(eee, pktbuf, pktlen, &peer->sock);
+            }
+            return 0;
+        }
+
+        // the peers the supernode knows we reach directly get it from us,
+        // the supernode only sends its copy to the others
+        if(eee->conf.p2p_broadcast) {
+            const n2n_sock_t *dests[N2N_BCAST_MAX_PEERS];
+            int num = 0;
+
+            HASH_ITER(hh, eee->known_peers, peer, tmp_peer) {
+                if(peer->bcast_direct && (num < N2N_BCAST_MAX_PEERS)) {
+                    dests[num++] = &peer->sock;
+                }
             }
-            return 0;
+            sendto_sock_batch(eee, pktbuf, pktlen, dests, num);
+            eee->stats.tx_bcast_p2p += num;
         }
         // fall through otherwise
     }
@@ -2171,6 +3039,170 @@ void edge_send_packet2net (struct n3n_runtime_data * eee,
 
 /* ************************************** */
 
+#ifndef _WIN32
+/** Stop using the TAP device, it will be reopened by the mainloop after
+ *  the given time
+ */
+static void edge_close_tap (struct n3n_runtime_data *eee, time_t reopen) {
+    mainloop_unregister_fd(eee->device.fd);
+#ifdef __linux__
+    if(eee->device.nl_fd != -1) {
+        mainloop_unregister_fd(eee->device.nl_fd);
+    }
+#endif
+    tuntap_close(&(eee->device));
+    eee->tuntap_reopen = reopen;
+}
+
+static void edge_reopen_tap (struct n3n_runtime_data *eee, time_t now) {
+    if(!eee->tuntap_reopen || now < eee->tuntap_reopen) {
+        return;
+    }
+
+    if(tuntap_open(&(eee->device),
+                   eee->conf.tuntap_dev_name,
+                   eee->conf.tuntap_ip_mode,
+                   eee->conf.tuntap_v4,
+                   eee->conf.device_mac,
+                   eee->conf.mtu,
+                   eee->conf.metric) < 0) {
+        traceEvent(TRACE_WARNING, "TAP reopen failed, retry later.");
+        eee->tuntap_reopen = now + TUNTAP_REOPEN_INTERVAL;
+        return;
+    }
+
+    traceEvent(TRACE_NORMAL, "TAP device reopened");
+    eee->tuntap_reopen = 0;
+    edge_register_tap(eee);
+}
+#endif
+
+/* ************************************** */
+
+// The known peers are remembered in the sessiondir so that a restarted edge
+// can try them directly, instead of waiting for traffic and the supernode
+// to introduce them again
+
+static void edge_peer_cache_path (struct n3n_runtime_data *eee, char *buf, size_t size) {
+    snprintf(buf, size, "%s/peers", eee->conf.sessiondir);
+}
+
+void edge_save_peer_cache (struct n3n_runtime_data *eee) {
+    char path[1024];
+
+    // An empty list is not worth losing the last useful cache for
+    if(!eee->conf.sessiondir || !eee->known_peers) {
+        return;
+    }
+
+    edge_peer_cache_path(eee, path, sizeof(path));
+
+    int count = peer_list_save(path, eee->known_peers);
+    if(count < 0) {
+        traceEvent(TRACE_WARNING, "cannot save peer cache %s", path);
+        return;
+    }
+    traceEvent(TRACE_DEBUG, "saved %i peers to %s", count, path);
+}
+
+void edge_load_peer_cache (struct n3n_runtime_data *eee) {
+    struct peer_info *cache = NULL;
+    struct peer_info *peer, *tmp_peer;
+    struct peer_info *scan;
+    macstr_t mac_buf;
+    n2n_sock_str_t sockbuf;
+    char path[1024];
+
+    if(!eee->conf.sessiondir || !eee->conf.allow_p2p) {
+        return;
+    }
+
+    edge_peer_cache_path(eee, path, sizeof(path));
+
+    time_t now = time(NULL);
+    int count = peer_list_load(path, &cache, now - PEER_CACHE_MAX_AGE);
+    if(count <= 0) {
+        return;
+    }
+
+    traceEvent(TRACE_NORMAL, "trying %i cached peers", count);
+
+    HASH_ITER(hh, cache, peer, tmp_peer) {
+        HASH_DEL(cache, peer);
+
+        HASH_FIND_PEER(eee->pending_peers, peer->mac_addr, scan);
+        if(!scan) {
+            HASH_FIND_PEER(eee->known_peers, peer->mac_addr, scan);
+        }
+        if(scan) {
+            peer_info_free(peer);
+            continue;
+        }
+
+        traceEvent(TRACE_INFO, "cached peer %s [%s]",
+                   macaddr_str(mac_buf, peer->mac_addr),
+                   sock_to_cstr(sockbuf, &peer->sock));
+
+        // Pending until the REGISTER_ACK arrives, just like a peer the
+        // supernode told us about
+        peer->timeout = eee->conf.register_interval;
+        peer->last_seen = now;
+        HASH_ADD_PEER(eee->pending_peers, peer);
+
+        if(peer->preferred_sock.family == AF_INET) {
+            send_register(eee, &peer->preferred_sock, peer->mac_addr, N2N_LOCAL_REG_COOKIE);
+        }
+        send_register(eee, &peer->sock, peer->mac_addr, N2N_REGULAR_REG_COOKIE);
+    }
+}
+
+/* ************************************** */
+
+/** Add the TAP device to the mainloop */
+void edge_register_tap (struct n3n_runtime_data *eee) {
+#ifndef _WIN32
+    mainloop_register_fd(eee->device.fd, fd_info_proto_tuntap);
+#endif
+#ifdef __linux__
+    if(eee->device.nl_fd != -1) {
+        mainloop_register_fd(eee->device.nl_fd, fd_info_proto_tuntap_monitor);
+    }
+#endif
+}
+
+/** Handle the link and address change notifications for the TAP device */
+void edge_read_from_tap_monitor (struct n3n_runtime_data *eee) {
+#ifdef __linux__
+    int events = tuntap_monitor_read(&eee->device);
+
+    if(events == -1) {
+        // Go back to polling for address changes
+        mainloop_unregister_fd(eee->device.nl_fd);
+        close(eee->device.nl_fd);
+        eee->device.nl_fd = -1;
+        return;
+    }
+
+    if(events & TUNTAP_EVENT_ADDRESS) {
+        struct in_addr addr = { .s_addr = eee->device.ip_addr };
+        traceEvent(TRACE_NORMAL, "TAP address is now %s", inet_ntoa(addr));
+        // let the supernode know straight away
+        eee->sn_wait = 2;
+    }
+
+    if(events & TUNTAP_EVENT_LINK) {
+        traceEvent(TRACE_NORMAL, "TAP link is %s", eee->device.link_up ? "up" : "down");
+    }
+
+    if(events & TUNTAP_EVENT_GONE) {
+        traceEvent(TRACE_WARNING, "TAP device was removed, recreating it.");
+        edge_close_tap(eee, time(NULL));
+    }
+#endif
+}
+
+/* ************************************** */
+
 /** Read a single packet from the TAP interface, process it and write out the
  *    corresponding packet to the cooked socket.
  */
@@ -2181,7 +3213,15 @@ void edge_read_from_tap (struct n3n_runtime_data * eee) {
     macstr_t mac_buf;
     ssize_t len;
 
-    len = tuntap_read( &(eee->device), eth_pkt, N2N_PKT_BUF_SIZE );
+    if(eee->device.layer3) {
+        // leave room for the ethernet header added below
+        len = tuntap_read( &(eee->device), eth_pkt + ETH_FRAMESIZE, N2N_PKT_BUF_SIZE - ETH_FRAMESIZE );
+        if(len > 0) {
+            len += ETH_FRAMESIZE;
+        }
+    } else {
+        len = tuntap_read( &(eee->device), eth_pkt, N2N_PKT_BUF_SIZE );
+    }
     if((len <= 0) || (len > N2N_PKT_BUF_SIZE)) {
         // TODO:
         // - how often does this actually happen
@@ -2197,10 +3237,9 @@ void edge_read_from_tap (struct n3n_runtime_data * eee) {
         traceEvent(TRACE_WARNING, "TAP I/O operation aborted, restart later.");
         eee->stats.tx_tuntap_error++;
 
+#ifdef _WIN32
+        // The windows TAP is read by its own thread, so it can just wait
         sleep(3);
-#ifndef _WIN32
-        mainloop_unregister_fd(eee->device.fd);
-#endif
         tuntap_close(&(eee->device));
         tuntap_open(&(eee->device),
                     eee->conf.tuntap_dev_name,
@@ -2210,13 +3249,18 @@ void edge_read_from_tap (struct n3n_runtime_data * eee) {
                     eee->conf.mtu,
                     eee->conf.metric
         );
-#ifndef _WIN32
-        mainloop_register_fd(eee->device.fd, fd_info_proto_tuntap);
+#else
+        // Dont stall all the other traffic, the mainloop will reopen it
+        edge_close_tap(eee, time(NULL) + TUNTAP_REOPEN_INTERVAL);
 #endif
         return;
 
     }
 
+    if(eee->device.layer3 && (layer3_tx_frame(eee, eth_pkt, len) != 0)) {
+        return;
+    }
+
     const uint8_t * mac = eth_pkt;
     traceEvent(TRACE_DEBUG, "Rx TAP packet (%4d) for %s",
                (signed int)len, macaddr_str(mac_buf, mac));
@@ -2235,6 +3279,42 @@ void edge_read_from_tap (struct n3n_runtime_data * eee) {
         return;
     }
 
+    if(eee->conf.mcast_snooping && !eee->device.layer3 && is_multi_broadcast(mac)) {
+        time_t now = time(NULL);
+        int snooped = mcast_snoop_frame(&eee->mcast_groups, eth_pkt, len, now,
+                                        now - MCAST_GROUP_TIMEOUT + MCAST_LEAVE_DELAY);
+
+        if(snooped & MCAST_SNOOP_JOINED) {
+            // no need to wait for the group's traffic
+            eee->last_mcast_report = 0;
+        }
+        if(snooped & MCAST_SNOOP_LEFT) {
+            // find out if other local hosts are still members
+            eee->last_mcast_query = 0;
+        }
+
+        if(((now - eee->last_mcast_query) <= MCAST_QUERY_RESPONSE) && mcast_is_query_answer(eth_pkt, len)) {
+            // it answers the query we sent, the other edges ask their own hosts
+            traceEvent(TRACE_DEBUG, "not sending the answer to our multicast query");
+            return;
+        }
+    }
+
+    if(eee->conf.neigh_proxy && !eee->device.layer3 && is_multi_broadcast(mac)
+       && neigh_is_request(eth_pkt, len)) {
+        uint8_t reply[NEIGH_REPLY_SIZE];
+        size_t reply_len = neigh_proxy_answer(eee->neigh_cache, reply, sizeof(reply), eth_pkt, len);
+
+        if(reply_len) {
+            // the local host gets its answer without a broadcast to the community
+            traceEvent(TRACE_DEBUG, "answered neighbour discovery from cache");
+            eee->stats.neigh_proxy++;
+            tuntap_write(&(eee->device), reply, reply_len);
+            return;
+        }
+        eee->stats.neigh_miss++;
+    }
+
     if(eee->network_traffic_filter) {
         if(eee->network_traffic_filter->filter_packet_from_tap(eee->network_traffic_filter, eee, eth_pkt,
                                                                len) == N2N_DROP) {
@@ -2250,14 +3330,69 @@ void edge_read_from_tap (struct n3n_runtime_data * eee) {
 /* ************************************** */
 
 
-/** handle a datagram from the main UDP socket to the internet. */
+/** Decrypt the header of a datagram from the main UDP socket in place.
+ *
+ *  Returns -1 if the datagram is to be dropped.
+ */
+static int edge_header_decrypt (struct n3n_runtime_data *eee,
+                                uint8_t *udp_buf,
+                                size_t udp_size,
+                                struct rx_header *hdr) {
+
+    if(eee->conf.header_encryption == HEADER_ENCRYPTION_ENABLED) {
+        // match with static (1) or dynamic (2) ctx?
+        // check dynamic first as it is identical to static in normal header encryption mode
+        if(packet_header_decrypt(udp_buf, udp_size,
+                                 (char *)eee->conf.community_name,
+                                 eee->conf.header_encryption_ctx_dynamic, eee->conf.header_iv_ctx_dynamic,
+                                 &hdr->stamp)) {
+            hdr->header_enc = 2;     /* not accurate with normal header encryption but does not matter */
+        }
+        if(!hdr->header_enc) {
+            // check static now (very likely to be REGISTER_SUPER_ACK, REGISTER_SUPER_NAK or invalid)
+            if(eee->conf.shared_secret) {
+                // hash the still encrypted packet to eventually be able to check it later (required for REGISTER_SUPER_ACK with user/pw auth)
+                pearson_hash_128(hdr->hash_buf, udp_buf, MAX(0, (int)udp_size - (int)N2N_REG_SUP_HASH_CHECK_LEN));
+            }
+            hdr->header_enc = packet_header_decrypt(udp_buf, MAX(0, (int)udp_size - (int)N2N_REG_SUP_HASH_CHECK_LEN),
+                                                    (char *)eee->conf.community_name,
+                                                    eee->conf.header_encryption_ctx_static, eee->conf.header_iv_ctx_static,
+                                                    &hdr->stamp);
+        }
+        if(!hdr->header_enc) {
+            traceEvent(TRACE_DEBUG, "failed to decrypt header");
+            return -1;
+        }
+        // time stamp verification follows in the packet specific section as it requires to determine the
+        // sender from the hash list by its MAC, or the packet might be from the supernode, this all depends
+        // on packet type, path taken (via supernode) and packet structure (MAC is not always in the same place)
+    }
+
+    return 0;
+}
+
+
+/* sorts a datagram read into the rx_queue, see rx_queue_fill() */
+static int edge_rx_classify (void *arg, struct rx_entry *entry) {
+
+    if(edge_header_decrypt((struct n3n_runtime_data *)arg, entry->buf, entry->size, &entry->hdr) < 0) {
+        return -1;
+    }
+
+    return rx_queue_class(entry->buf, entry->size);
+}
+
+
+/** handle a datagram from the main UDP socket to the internet, its header
+ *  already decrypted. */
 void process_udp (struct n3n_runtime_data *eee,
                   const struct sockaddr *sender_sock,
                   const SOCKET in_sock,
                   uint8_t *udp_buf,
                   size_t udp_size,
                   time_t now,
-                  int type) {
+                  int type,
+                  const struct rx_header *hdr) {
 
     n2n_common_t cmn;          /* common fields in the packet header */
     n2n_sock_str_t sockbuf1;
@@ -2273,8 +3408,8 @@ void process_udp (struct n3n_runtime_data *eee,
     struct peer_info *sn = NULL;
     n2n_sock_t sender;
     n2n_sock_t *          orig_sender = NULL;
-    uint32_t header_enc = 0;
-    uint64_t stamp = 0;
+    uint32_t header_enc = hdr->header_enc;
+    uint64_t stamp = hdr->stamp;
     int skip_add = 0;
 
     /* REVISIT: when UDP/IPv6 is supported we will need a flag to indicate which
@@ -2302,34 +3437,7 @@ void process_udp (struct n3n_runtime_data *eee,
     traceEvent(TRACE_DEBUG, "Rx VPN packet of size %d from [%s]",
                (signed int)udp_size, sock_to_cstr(sockbuf1, &sender));
 
-    if(eee->conf.header_encryption == HEADER_ENCRYPTION_ENABLED) {
-        // match with static (1) or dynamic (2) ctx?
-        // check dynamic first as it is identical to static in normal header encryption mode
-        if(packet_header_decrypt(udp_buf, udp_size,
-                                 (char *)eee->conf.community_name,
-                                 eee->conf.header_encryption_ctx_dynamic, eee->conf.header_iv_ctx_dynamic,
-                                 &stamp)) {
-            header_enc = 2;     /* not accurate with normal header encryption but does not matter */
-        }
-        if(!header_enc) {
-            // check static now (very likely to be REGISTER_SUPER_ACK, REGISTER_SUPER_NAK or invalid)
-            if(eee->conf.shared_secret) {
-                // hash the still encrypted packet to eventually be able to check it later (required for REGISTER_SUPER_ACK with user/pw auth)
-                pearson_hash_128(hash_buf, udp_buf, MAX(0, (int)udp_size - (int)N2N_REG_SUP_HASH_CHECK_LEN));
-            }
-            header_enc = packet_header_decrypt(udp_buf, MAX(0, (int)udp_size - (int)N2N_REG_SUP_HASH_CHECK_LEN),
-                                               (char *)eee->conf.community_name,
-                                               eee->conf.header_encryption_ctx_static, eee->conf.header_iv_ctx_static,
-                                               &stamp);
-        }
-        if(!header_enc) {
-            traceEvent(TRACE_DEBUG, "failed to decrypt header");
-            return;
-        }
-        // time stamp verification follows in the packet specific section as it requires to determine the
-        // sender from the hash list by its MAC, or the packet might be from the supernode, this all depends
-        // on packet type, path taken (via supernode) and packet structure (MAC is not always in the same place)
-    }
+    memcpy(hash_buf, hdr->hash_buf, sizeof(hash_buf));
 
     rem = udp_size; /* Counts down bytes of packet to protect against buffer overruns. */
     idx = 0; /* marches through packet header as parts are decoded. */
@@ -2387,6 +3495,7 @@ void process_udp (struct n3n_runtime_data *eee,
         case MSG_TYPE_PACKET: {
             /* process PACKET - most frequent so first in list. */
             n2n_PACKET_t pkt;
+            bool relayed;
 
             decode_PACKET(&pkt, &cmn, udp_buf, &rem, &idx);
 
@@ -2409,7 +3518,18 @@ void process_udp (struct n3n_runtime_data *eee,
                 return;
             }
 
-            if(!from_supernode) {
+            relayed = !from_supernode && (cmn.flags & N2N_FLAGS_RELAYED);
+
+            if(relayed) {
+                /* [PeP] : edge Peer->relaying edge->edge Peer, the last hop is not
+                 * the sender, so treat it like a packet via the supernode */
+                if(is_valid_peer_sock(&pkt.sock))
+                    orig_sender = &(pkt.sock);
+
+                traceEvent(TRACE_DEBUG, "[pEp] from %s via [%s]",
+                           macaddr_str(mac_buf1, pkt.srcMac),
+                           sock_to_cstr(sockbuf1, &sender));
+            } else if(!from_supernode) {
                 /* This is a P2P packet from the peer. We purge a pending
                  * registration towards the possibly nat-ted peer address as we now have
                  * a valid channel. We still use check_peer_registration_needed in
@@ -2430,19 +3550,28 @@ void process_udp (struct n3n_runtime_data *eee,
             }
 
             /* Update the sender in peer table entry */
-            check_peer_registration_needed(eee, from_supernode, via_multicast,
+            check_peer_registration_needed(eee, from_supernode || relayed, via_multicast,
                                            pkt.srcMac,
                                            // REVISIT: also consider PORT_REG_COOKIEs when implemented
-                                           from_supernode ? N2N_FORWARDED_REG_COOKIE : N2N_REGULAR_REG_COOKIE,
+                                           (from_supernode || relayed) ? N2N_FORWARDED_REG_COOKIE : N2N_REGULAR_REG_COOKIE,
                                            NULL, NULL, orig_sender);
 
-            handle_PACKET(eee, from_supernode, &pkt, orig_sender, udp_buf + idx, udp_size - idx);
+            if(!relayed && !from_supernode && eee->conf.relay_for_peers
+               && !is_multi_broadcast(pkt.dstMac)
+               && memcmp(pkt.dstMac, eee->device.mac_addr, N2N_MAC_SIZE)) {
+                /* A peer without a direct path of its own is using us as relay */
+                relay_packet(eee, &cmn, &pkt, &sender, udp_buf, udp_size, idx, stamp);
+                break;
+            }
+
+            handle_PACKET(eee, from_supernode, relayed, &pkt, orig_sender, udp_buf + idx, udp_size - idx);
             break;
         }
 
         case MSG_TYPE_REGISTER: {
             /* Another edge is registering with us */
             n2n_REGISTER_t reg;
+            struct peer_info *peer;
 
             decode_REGISTER(&reg, &cmn, udp_buf, &rem, &idx);
 
@@ -2488,6 +3617,14 @@ void process_udp (struct n3n_runtime_data *eee,
 
                 /* NOTE: only ACK to peers */
                 send_register_ack(eee, orig_sender, &reg);
+
+                if(reg.cookie == N2N_PROBE_REG_COOKIE) {
+                    HASH_FIND_PEER(eee->known_peers, reg.srcMac, peer);
+                    if(peer) {
+                        // only a measurement, it does not keep the peer alive
+                        break;
+                    }
+                }
             } else {
                 traceEvent(TRACE_INFO, "[pSp] Rx REGISTER from %s [%s] to %s via [%s]",
                            macaddr_str(mac_buf1, reg.srcMac), sock_to_cstr(sockbuf2, orig_sender),
@@ -2502,6 +3639,7 @@ void process_udp (struct n3n_runtime_data *eee,
         case MSG_TYPE_REGISTER_ACK: {
             /* Peer edge is acknowledging our register request */
             n2n_REGISTER_ACK_t ra;
+            struct peer_info *peer;
 
             decode_REGISTER_ACK(&ra, &cmn, udp_buf, &rem, &idx);
 
@@ -2528,6 +3666,15 @@ void process_udp (struct n3n_runtime_data *eee,
                        sock_to_cstr(sockbuf1, &sender),
                        (ra.cookie & N2N_LOCAL_REG_COOKIE) ? " (local)" : "");
 
+            if(ra.cookie == N2N_PROBE_REG_COOKIE) {
+                HASH_FIND_PEER(eee->known_peers, ra.srcMac, peer);
+                if(peer && peer->ping_sent) {
+                    sn_selection_rtt_sample(peer, &peer->ping_sent);
+                    peer_probe_result(peer, false);
+                }
+                break;
+            }
+
             peer_set_p2p_confirmed(eee, ra.srcMac,
                                    ra.cookie,
                                    &sender, now);
@@ -2547,6 +3694,10 @@ void process_udp (struct n3n_runtime_data *eee,
 
             // FIXME: fix decode_* functions to not need memsets
             memset(&ra, 0, sizeof(ra));
+            if(eee->conf.shared_secret && (rem >= N2N_REG_SUP_HASH_CHECK_LEN)) {
+                // keep the trailing hash from being taken for optional fields
+                rem -= N2N_REG_SUP_HASH_CHECK_LEN;
+            }
             decode_REGISTER_SUPER_ACK(&ra, &cmn, udp_buf, &rem, &idx, tmpbuf);
 
             if(eee->conf.header_encryption == HEADER_ENCRYPTION_ENABLED) {
@@ -2571,7 +3722,8 @@ void process_udp (struct n3n_runtime_data *eee,
                 }
             }
 
-            if(ra.cookie != eee->curr_sn->last_cookie) {
+            if((ra.cookie != eee->curr_sn->last_cookie)
+               && !(eee->sn_search && sn && (ra.cookie == sn->last_cookie))) {
                 traceEvent(TRACE_INFO, "Rx REGISTER_SUPER_ACK with wrong or old cookie");
                 return;
             }
@@ -2584,6 +3736,19 @@ void process_udp (struct n3n_runtime_data *eee,
                 return;
             }
 
+            if(eee->sn_search) {
+                edge_sn_search_done(
+                    eee,
+                    (ra.cookie == eee->curr_sn->last_cookie) ? eee->curr_sn : sn
+                );
+            }
+            sn_selection_rtt_sample(eee->curr_sn, &eee->curr_sn->reg_sent);
+            if(ra.load) {
+                // supernode reports its load, no need to wait for the next PONG
+                SN_SELECTION_CRITERION_DATA_TYPE sn_sel_tmp = ra.load;
+                sn_selection_criterion_calculate(eee, eee->curr_sn, &sn_sel_tmp);
+            }
+
             if(is_valid_peer_sock(&ra.sock))
                 orig_sender = &(ra.sock);
 
@@ -2694,7 +3859,8 @@ void process_udp (struct n3n_runtime_data *eee,
                 }
             }
 
-            if(nak.cookie != eee->curr_sn->last_cookie) {
+            if((nak.cookie != eee->curr_sn->last_cookie)
+               && !(eee->sn_search && sn && (nak.cookie == sn->last_cookie))) {
                 traceEvent(TRACE_DEBUG, "Rx REGISTER_SUPER_NAK with wrong or old cookie");
                 return;
             }
@@ -2738,6 +3904,7 @@ void process_udp (struct n3n_runtime_data *eee,
             n2n_PEER_INFO_t pi;
             struct peer_info * scan;
             int skip_add;
+            bool pending;
 
             decode_PEER_INFO(&pi, &cmn, udp_buf, &rem, &idx);
 
@@ -2770,6 +3937,7 @@ void process_udp (struct n3n_runtime_data *eee,
                     scan->last_seen = now;
                     scan->uptime = pi.uptime;
                     memcpy(scan->version, pi.version, sizeof(n2n_version_t));
+                    sn_selection_rtt_sample(scan, &scan->ping_sent);
                     /* The data type depends on the actual selection strategy that has been chosen. */
                     SN_SELECTION_CRITERION_DATA_TYPE sn_sel_tmp = pi.load;
                     sn_selection_criterion_calculate(eee, scan, &sn_sel_tmp);
@@ -2783,11 +3951,15 @@ void process_udp (struct n3n_runtime_data *eee,
             } else {
                 // regular PEER_INFO
                 HASH_FIND_PEER(eee->pending_peers, pi.mac, scan);
+                pending = (scan != NULL);
                 if(!scan)
                     // just in case the remote edge has been upgraded by the REG/ACK mechanism in the meantime
                     HASH_FIND_PEER(eee->known_peers, pi.mac, scan);
 
                 if(scan) {
+                    if(pending) {
+                        punch_nat(eee, scan, &pi.sock, now);
+                    }
                     scan->sock = pi.sock;
 
                     traceEvent(TRACE_INFO, "Rx PEER_INFO %s can be found at [%s]",
@@ -2805,6 +3977,21 @@ void process_udp (struct n3n_runtime_data *eee,
 
                     send_register(eee, &scan->sock, scan->mac_addr, N2N_REGULAR_REG_COOKIE);
 
+                } else if(eee->conf.allow_p2p) {
+                    // pushed by the supernode for a flow it relays, start punching right away
+                    traceEvent(TRACE_INFO, "Rx PEER_INFO unasked, %s can be found at [%s]",
+                               macaddr_str(mac_buf1, pi.mac),
+                               sock_to_cstr(sockbuf1, &pi.sock));
+
+                    register_with_new_peer(eee, 1, 0, pi.mac, NULL, NULL, &pi.sock);
+
+                    if(cmn.flags & N2N_FLAGS_SOCKET) {
+                        HASH_FIND_PEER(eee->pending_peers, pi.mac, scan);
+                        if(scan) {
+                            scan->preferred_sock = pi.preferred_sock;
+                        }
+                        send_register(eee, &pi.preferred_sock, pi.mac, N2N_LOCAL_REG_COOKIE);
+                    }
                 } else {
                     traceEvent(TRACE_INFO, "Rx PEER_INFO unknown peer %s",
                                macaddr_str(mac_buf1, pi.mac));
@@ -2813,6 +4000,48 @@ void process_udp (struct n3n_runtime_data *eee,
             break;
         }
 
+        case MSG_TYPE_RELAY_INFO: {
+
+            n2n_RELAY_INFO_t ri;
+
+            if(!from_supernode) {
+                traceEvent(TRACE_DEBUG, "dropped RELAY_INFO not via supernode");
+                return;
+            }
+
+            decode_RELAY_INFO(&ri, &cmn, udp_buf, &rem, &idx);
+
+            if(eee->conf.header_encryption == HEADER_ENCRYPTION_ENABLED) {
+                if(!find_peer_time_stamp_and_verify(
+                       eee->pending_peers,
+                       eee->known_peers,
+                       sn,
+                       ri.srcMac,
+                       stamp,
+                       TIME_STAMP_ALLOW_JITTER)) {
+                    traceEvent(TRACE_DEBUG, "dropped RELAY_INFO due to time stamp error");
+                    return;
+                }
+            }
+
+            if(!eee->conf.relay_via_peers) {
+                break;
+            }
+
+            if(!memcmp(ri.srcMac, eee->device.mac_addr, N2N_MAC_SIZE)) {
+                break;
+            }
+
+            traceEvent(TRACE_INFO, "Rx RELAY_INFO from %s with %u peers",
+                       macaddr_str(mac_buf1, ri.srcMac),
+                       (unsigned int)ri.num_peers);
+
+            relay_info_update(&eee->relays, &ri, now);
+            relay_routes_update(&eee->relay_routes, &eee->relays, eee->known_peers,
+                                eee->device.mac_addr, now);
+            break;
+        }
+
         case MSG_TYPE_RE_REGISTER_SUPER: {
 
             if(eee->conf.header_encryption == HEADER_ENCRYPTION_ENABLED) {
@@ -2853,25 +4082,15 @@ void process_udp (struct n3n_runtime_data *eee,
 
 /* ************************************** */
 
-void edge_read_proto3_udp (struct n3n_runtime_data *eee,
-                           SOCKET sock,
-                           uint8_t *pktbuf,
-                           ssize_t pktbuf_len,
-                           time_t now) {
-    struct sockaddr_storage sas;
-    struct sockaddr *sender_sock = (struct sockaddr*)&sas;
-    socklen_t ss_size = sizeof(sas);
+/* Read a batch of datagrams into the rx_queue and handle them, control first */
+void edge_read_udp_batch (struct n3n_runtime_data *eee,
+                          SOCKET sock,
+                          time_t now) {
+    struct rx_entry *entry;
 
-    ssize_t bread = recvfrom(
-        sock,
-        pktbuf,
-        pktbuf_len,
-        0 /*flags*/,
-        sender_sock,
-        &ss_size
-    );
+    int nread = rx_queue_fill(eee->rx_queue, sock, edge_rx_classify, eee, &eee->stats);
 
-    if(bread < 0) {
+    if(nread < 0) {
 #ifdef _WIN32
         unsigned int wsaerr = WSAGetLastError();
         if(wsaerr == WSAECONNRESET) {
@@ -2880,27 +4099,46 @@ void edge_read_proto3_udp (struct n3n_runtime_data *eee,
         traceEvent(TRACE_ERROR, "WSAGetLastError(): %u", wsaerr);
 #endif
 
-        /* For UDP bread of zero just means no data (unlike TCP). */
         /* The fd is no good now. Maybe we lost our interface. */
-        traceEvent(TRACE_ERROR, "recvfrom() failed %d errno %d (%s)", bread, errno, strerror(errno));
+        traceEvent(TRACE_ERROR, "recvfrom() failed %d errno %d (%s)", nread, errno, strerror(errno));
         *eee->keep_running = false;
         return;
     }
-    if(bread == 0) {
-        return;
-    }
 
     // TODO:
-    // - detect when pktbuf is too small for the packet and add that to stats
-    //   (could switch to using recvmsg() for that)
-
-    // we have a datagram to process...
-    // ...and the datagram has data (not just a header)
-    //
-    process_udp(eee, sender_sock, sock, pktbuf, bread, now, SOCK_DGRAM);
+    // - detect when a buffer is too small for the packet and add that to
+    //   stats (could switch to using recvmsg() for that)
+
+    // the datagrams read, control messages first
+    while((entry = rx_queue_pop(eee->rx_queue))) {
+        process_udp(
+            eee,
+            (struct sockaddr *)&entry->sas,
+            entry->sock,
+            entry->buf,
+            entry->size,
+            now,
+            SOCK_DGRAM,
+            &entry->hdr
+        );
+    }
     return;
 }
 
+/** Read and handle the datagrams waiting on sock.
+ *
+ *    Kept for the existing callers of the public API.  The datagrams are now
+ *    read into the buffers of the edge's rx_queue, so pktbuf is not used.
+ */
+void edge_read_proto3_udp (struct n3n_runtime_data *eee,
+                           SOCKET sock,
+                           uint8_t *pktbuf,
+                           ssize_t pktbuf_len,
+                           time_t now) {
+
+    edge_read_udp_batch(eee, sock, now);
+}
+
 void edge_read_proto3_tcp (struct n3n_runtime_data *eee,
                            SOCKET sock,
                            uint8_t *pktbuf,
@@ -2928,6 +4166,10 @@ void edge_read_proto3_tcp (struct n3n_runtime_data *eee,
     }
 
     // have a valid packet read, handle it
+    struct rx_header hdr = {0};
+    if(edge_header_decrypt(eee, pktbuf, pktbuf_len, &hdr) < 0) {
+        return;
+    }
     process_udp(
         eee,
         NULL,
@@ -2935,7 +4177,8 @@ void edge_read_proto3_tcp (struct n3n_runtime_data *eee,
         pktbuf,
         pktbuf_len,
         now,
-        SOCK_STREAM
+        SOCK_STREAM,
+        &hdr
     );
     return;
 }
@@ -2963,6 +4206,11 @@ int run_edge_loop (struct n3n_runtime_data *eee) {
     time_t lastIfaceCheck = 0;
     time_t last_purge_known = 0;
     time_t last_purge_pending = 0;
+    time_t last_peer_cache_save = time(NULL);
+    time_t last_peer_probe = 0;
+    time_t last_relay_info = 0;
+    time_t last_purge_route = 0;
+    time_t last_purge_neigh = 0;
 #ifdef HAVE_BRIDGING_SUPPORT
     time_t last_purge_host = 0;
 #endif
@@ -2978,8 +4226,10 @@ int run_edge_loop (struct n3n_runtime_data *eee) {
 
     edge_metrics_module1.data = &eee->stats;
     edge_metrics_module2.data = &eee->stats;
+    edge_metrics_module_peers.data = eee;
     n3n_metrics_register(&edge_metrics_module1);
     n3n_metrics_register(&edge_metrics_module2);
+    n3n_metrics_register(&edge_metrics_module_peers);
 
     /* Main loop
      *
@@ -3016,6 +4266,16 @@ int run_edge_loop (struct n3n_runtime_data *eee) {
                                          &last_purge_pending,
                                          PURGE_REGISTRATION_FREQUENCY, REGISTRATION_TIMEOUT);
 
+        probe_known_peers(eee, &last_peer_probe, now);
+        send_relay_info(eee, &last_relay_info, now);
+        send_mcast_groups(eee, now);
+        send_bcast_peers(eee, now);
+
+        if((now - last_peer_cache_save) > PEER_CACHE_SAVE_INTERVAL) {
+            edge_save_peer_cache(eee);
+            last_peer_cache_save = now;
+        }
+
         if(numPurged > 0) {
             traceEvent(
                 TRACE_INFO,
@@ -3039,12 +4299,31 @@ int run_edge_loop (struct n3n_runtime_data *eee) {
         }
 #endif
 
+        if(eee->ip_routes && (now > last_purge_route + SWEEP_TIME)) {
+            ip_routes_purge(eee->ip_routes, now - HOSTINFO_TIMEOUT);
+            last_purge_route = now;
+        }
+
+        if(eee->neigh_cache && (now > last_purge_neigh + SWEEP_TIME)) {
+            neigh_cache_purge(&eee->neigh_cache, now - NEIGH_CACHE_TIMEOUT);
+            last_purge_neigh = now;
+        }
+
+#ifndef _WIN32
+        edge_reopen_tap(eee, now);
+#endif
+
         // TODO:
         // - a static ip address mode
-        // - a notifier so we dont need to poll for changes
         // - ipv6 support
         // - multi-homing support
-        if((eee->conf.tuntap_ip_mode == TUNTAP_IP_MODE_DHCP) &&
+#ifdef __linux__
+        // Changes are normally seen by edge_read_from_tap_monitor()
+        bool iface_poll = (eee->device.nl_fd == -1);
+#else
+        bool iface_poll = true;
+#endif
+        if(iface_poll && (eee->conf.tuntap_ip_mode == TUNTAP_IP_MODE_DHCP) &&
            ((now - lastIfaceCheck) > IFACE_UPDATE_INTERVAL)) {
             traceEvent(TRACE_INFO, "re-checking dynamic IP address");
             tuntap_get_address(&(eee->device));
@@ -3061,7 +4340,7 @@ int run_edge_loop (struct n3n_runtime_data *eee) {
 
     } /* while */
 
-    send_unregister_super(eee);
+    send_unregister_super(eee, eee->curr_sn);
 
 #ifdef _WIN32
     // No, I dont want to wait for the thread to receive a tap packet
@@ -3083,6 +4362,12 @@ int run_edge_loop (struct n3n_runtime_data *eee) {
 /** Deinitialise the edge and deallocate any owned memory. */
 void edge_term (struct n3n_runtime_data * eee) {
 
+    edge_save_peer_cache(eee);
+
+    int resolve_fd = resolve_notify_fd(eee->resolve_parameter);
+    if(resolve_fd != -1) {
+        mainloop_unregister_fd(resolve_fd);
+    }
     resolve_cancel_thread(eee->resolve_parameter);
 
     if(eee->sock >= 0) {
@@ -3102,6 +4387,15 @@ void edge_term (struct n3n_runtime_data * eee) {
     clear_peer_list(&eee->pending_peers);
     clear_peer_list(&eee->known_peers);
     clear_peer_list(&eee->conf.supernodes);
+    relay_clear(&eee->relay_routes, &eee->relays);
+
+    if(eee->ip_routes) {
+        ip_routes_clear(eee->ip_routes);
+        free(eee->ip_routes);
+    }
+    neigh_cache_clear(&eee->neigh_cache);
+    mcast_groups_clear(&eee->mcast_groups);
+    free(eee->rx_queue);
 
 #ifdef HAVE_BRIDGING_SUPPORT
     if(eee->conf.allow_routing) {
@@ -3271,6 +4565,9 @@ void edge_init_conf_defaults (n2n_edge_conf_t *conf, char *sessionname) {
     conf->header_encryption = HEADER_ENCRYPTION_NONE;
     conf->compression = N2N_COMPRESSION_ID_NONE;
     conf->allow_p2p = true;
+    conf->sn_parallel = true;
+    conf->relay_max_rate = RELAY_MAX_RATE_DFL;
+    conf->nat_probe_ports = NAT_PROBE_PORTS_DFL;
     conf->register_interval = REGISTER_SUPER_INTERVAL_DFL;
 
 #ifdef _WIN32
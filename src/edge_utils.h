@@ -6,6 +6,16 @@
 #ifndef _EDGE_UTILS_H_
 #define _EDGE_UTILS_H_
 
+#include <n2n_typedefs.h>   // for SOCKET
+#include <time.h>           // for time_t
+
+struct n3n_runtime_data;
+
+void edge_read_udp_batch (struct n3n_runtime_data *eee, SOCKET sock, time_t now);
 void edge_read_from_tap (struct n3n_runtime_data *eee);
+void edge_read_from_tap_monitor (struct n3n_runtime_data *eee);
+void edge_register_tap (struct n3n_runtime_data *eee);
+void edge_load_peer_cache (struct n3n_runtime_data *eee);
+void edge_save_peer_cache (struct n3n_runtime_data *eee);
 
 #endif
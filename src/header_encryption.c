@@ -170,6 +170,10 @@ void packet_header_change_dynamic_key (uint8_t *key_dynamic,
     uint8_t key[16];
     pearson_hash_128(key, key_dynamic, N2N_AUTH_CHALLENGE_SIZE);
 
+    // the contexts are replaced on every key change, free the ones in use
+    speck_deinit((speck_context_t*)*ctx_dynamic);
+    speck_deinit((speck_context_t*)*ctx_iv_dynamic);
+
     // for REGISTER_SUPER, REGISTER_SUPER_ACK, REGISTER_SUPER_NAK only
     // for all other packets, same as static by default (changed by user/pw auth scheme)
     speck_init((speck_context_t**)ctx_dynamic, key, 128);
@@ -8,6 +8,7 @@
 // prototype any internal (non-public) initfuncs (always sorted!)
 void n3n_initfuncs_conffile_defs ();
 void n3n_initfuncs_mainloop ();
+void n3n_initfuncs_management ();
 void n3n_initfuncs_metrics ();
 void n3n_initfuncs_pearson ();
 void n3n_initfuncs_peer_info ();
@@ -30,6 +31,7 @@ void n3n_initfuncs () {
     // (sorted list)
     n3n_initfuncs_conffile_defs();
     n3n_initfuncs_mainloop();
+    n3n_initfuncs_management();
     n3n_initfuncs_metrics();
     n3n_initfuncs_pearson();
     n3n_initfuncs_peer_info();
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * IPv4 routes to edges for the layer 3 mode
+ *
+ * A TUN interface hands over bare IP packets, so the edge itself has to work
+ * out which edge a packet is for.  The routes are kept in one hash table per
+ * prefix length, and a lookup tries the lengths in use from the longest to
+ * the shortest.  With the handful of lengths seen in practice, this is a few
+ * hash lookups per packet.
+ */
+
+#include <stdlib.h>             // for calloc, free
+#include <string.h>             // for memcpy
+
+#include "ip_routes.h"
+
+
+static uint32_t prefix_mask (uint8_t bitlen) {
+
+    return bitlen ? (uint32_t)(0xffffffffULL << (32 - bitlen)) : 0;
+}
+
+
+/* Add or refresh the route for net/bitlen */
+void ip_routes_add (struct ip_routes *routes,
+                    uint32_t net,
+                    uint8_t bitlen,
+                    const n2n_mac_t mac,
+                    time_t now) {
+
+    struct ip_route *route;
+
+    if(bitlen >= IP_ROUTES_LENS) {
+        return;
+    }
+    net &= prefix_mask(bitlen);
+
+    HASH_FIND(hh, routes->by_len[bitlen], &net, sizeof(net), route);
+    if(!route) {
+        route = calloc(1, sizeof(*route));
+        if(!route) {
+            return;
+        }
+        route->net = net;
+        HASH_ADD(hh, routes->by_len[bitlen], net, sizeof(route->net), route);
+        routes->lens |= (1ULL << bitlen);
+    }
+
+    memcpy(route->mac_addr, mac, sizeof(n2n_mac_t));
+    route->last_seen = now;
+}
+
+
+/* Find the longest prefix match for addr (host byte order), NULL if none */
+struct ip_route *ip_routes_lookup (struct ip_routes *routes, uint32_t addr) {
+
+    struct ip_route *route;
+    uint32_t net;
+    int bitlen;
+
+    for(bitlen = IP_ROUTES_LENS - 1; bitlen >= 0; bitlen--) {
+        if(!(routes->lens & (1ULL << bitlen))) {
+            continue;
+        }
+        net = addr & prefix_mask(bitlen);
+        HASH_FIND(hh, routes->by_len[bitlen], &net, sizeof(net), route);
+        if(route) {
+            return route;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* Remove the routes not refreshed since purge_before, returns their number */
+size_t ip_routes_purge (struct ip_routes *routes, time_t purge_before) {
+
+    struct ip_route *route, *tmp;
+    size_t purged = 0;
+    int bitlen;
+
+    for(bitlen = 0; bitlen < IP_ROUTES_LENS; bitlen++) {
+        HASH_ITER(hh, routes->by_len[bitlen], route, tmp) {
+            if(route->last_seen < purge_before) {
+                HASH_DEL(routes->by_len[bitlen], route);
+                free(route);
+                purged++;
+            }
+        }
+        if(!routes->by_len[bitlen]) {
+            routes->lens &= ~(1ULL << bitlen);
+        }
+    }
+
+    return purged;
+}
+
+
+void ip_routes_clear (struct ip_routes *routes) {
+
+    struct ip_route *route, *tmp;
+    int bitlen;
+
+    for(bitlen = 0; bitlen < IP_ROUTES_LENS; bitlen++) {
+        HASH_ITER(hh, routes->by_len[bitlen], route, tmp) {
+            HASH_DEL(routes->by_len[bitlen], route);
+            free(route);
+        }
+    }
+    routes->lens = 0;
+}
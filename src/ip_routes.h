@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * IPv4 routes to edges for the layer 3 mode, non-public API
+ */
+
+#ifndef _IP_ROUTES_H_
+#define _IP_ROUTES_H_
+
+#include <n3n/ethernet.h>   // for n2n_mac_t
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <uthash.h>         // for UT_hash_handle
+
+#define IP_ROUTES_LENS  33  /* prefix lengths /0 to /32 */
+
+struct ip_route {
+    uint32_t net;           // host byte order, masked to the prefix length
+    n2n_mac_t mac_addr;     // the edge to send the packets to
+    time_t last_seen;
+
+    UT_hash_handle hh;      /* makes this structure hashable */
+};
+
+struct ip_routes {
+    struct ip_route *by_len[IP_ROUTES_LENS];    // one table per prefix length
+    uint64_t lens;                              // bit n set if by_len[n] is in use
+};
+
+void ip_routes_add (struct ip_routes *routes,
+                    uint32_t net,
+                    uint8_t bitlen,
+                    const n2n_mac_t mac,
+                    time_t now);
+
+struct ip_route *ip_routes_lookup (struct ip_routes *routes, uint32_t addr);
+
+size_t ip_routes_purge (struct ip_routes *routes, time_t purge_before);
+
+void ip_routes_clear (struct ip_routes *routes);
+
+#endif
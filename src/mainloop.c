@@ -7,7 +7,7 @@
 #include <assert.h>
 #include <connslot/connslot.h>  // for slots_fdset
 #include <n2n_typedefs.h>       // for n3n_runtime_data
-#include <n3n/edge.h>           // for edge_read_proto3_udp
+#include <n3n/edge.h>           // for edge_read_proto3_tcp
 #include <n3n/logging.h>        // for traceEvent
 #include <n3n/mainloop.h>       // for fd_info_proto
 #include <n3n/metrics.h>
@@ -20,10 +20,11 @@
 #include <unistd.h>             // for close
 #endif
 
-#include "edge_utils.h"         // for edge_read_from_tap
-#include "management.h"         // for readFromMgmtSocket
+#include "edge_utils.h"         // for edge_read_udp_batch, edge_read_from_tap
+#include "management.h"         // for mgmt_api_handler, mgmt_event_closed
 #include "minmax.h"             // for min, max
 #include "portable_endian.h"    // for htobe16
+#include "resolve.h"            // for resolve_notified
 
 #ifndef _WIN32
 // Another wonderful gift from the world of POSIX compliance is not worth much
@@ -79,6 +80,9 @@ static char *proto_str[] = {
     [fd_info_proto_v3udp] = "v3udp",
     [fd_info_proto_v3tcp] = "v3tcp",
     [fd_info_proto_http] = "http",
+    [fd_info_proto_event] = "event",
+    [fd_info_proto_resolve] = "resolve",
+    [fd_info_proto_tuntap_monitor] = "tuntap_monitor",
 };
 
 struct fd_info {
@@ -262,15 +266,19 @@ static int fdlist_fd_set (fd_set *rd, fd_set *wr) {
         // TODO:
         // - if no empty conn, dont FD_SET on proto TCP listen
 
-        FD_SET(fdlist[slot].fd, rd);
         max_sock = MAX(max_sock, fdlist[slot].fd);
 
         if(fdlist[slot].connnr == -1) {
+            FD_SET(fdlist[slot].fd, rd);
             slot++;
             continue;
         }
 
-        if(conn_iswriter(&connlist[fdlist[slot].connnr])) {
+        int events = conn_wants(&connlist[fdlist[slot].connnr]);
+        if(events & CONN_EVENT_READ) {
+            FD_SET(fdlist[slot].fd, rd);
+        }
+        if(events & CONN_EVENT_WRITE) {
             FD_SET(fdlist[slot].fd, wr);
         }
 
@@ -279,6 +287,30 @@ static int fdlist_fd_set (fd_set *rd, fd_set *wr) {
     return max_sock;
 }
 
+// Answer the request on a management connection, along with any that were
+// pipelined behind it, and tidy up once the connection is finished
+static void http_service (struct n3n_runtime_data *eee, struct conn *conn, int fd) {
+    while(conn->state == CONN_READY && conn->proto == CONN_PROTO_HTTP) {
+        mgmt_api_handler(eee, conn);
+    }
+
+    if(conn->proto != CONN_PROTO_HTTP) {
+        // The request turned this into a different kind of connection
+        return;
+    }
+
+    switch(conn->state) {
+        case CONN_ERROR:
+        case CONN_CLOSED:
+            conn_close(conn, fd);
+            // TODO: freefd() is doing a fd search, we could optimise
+            fdlist_freefd(fd);
+            return;
+        default:
+            return;
+    }
+}
+
 static void handle_fd (const time_t now, const struct fd_info info, struct n3n_runtime_data *eee) {
     switch(info.proto) {
         case fd_info_proto_unknown:
@@ -317,12 +349,9 @@ static void handle_fd (const time_t now, const struct fd_info info, struct n3n_r
         }
 
         case fd_info_proto_v3udp: {
-            uint8_t pktbuf[N2N_PKT_BUF_SIZE];
-            edge_read_proto3_udp(
+            edge_read_udp_batch(
                 eee,
                 info.fd,
-                pktbuf,
-                sizeof(pktbuf),
                 now
             );
             return;
@@ -401,27 +430,38 @@ static void handle_fd (const time_t now, const struct fd_info info, struct n3n_r
         case fd_info_proto_http: {
             struct conn *conn = &connlist[info.connnr];
             conn_read(conn, info.fd);
+            http_service(eee, conn, info.fd);
+            return;
+        }
 
-            switch(conn->state) {
-                case CONN_EMPTY:
-                case CONN_READING:
-                    // These states dont require us to do anything
-                    // TODO:
-                    // - handle reading/sending simultaneous?
-                    return;
-
-                case CONN_READY:
-                    mgmt_api_handler(eee, conn);
-                    return;
+        case fd_info_proto_event: {
+            // An event subscriber is not expected to send us anything, so
+            // the only interesting result of a read is finding it closed
+            struct conn *conn = &connlist[info.connnr];
+            conn_read(conn, info.fd);
 
+            switch(conn->state) {
                 case CONN_ERROR:
                 case CONN_CLOSED:
+                    mgmt_event_closed(conn);
                     conn_close(conn, info.fd);
-                    // TODO: freefd() is doing a fd search, we could optimise
                     fdlist_freefd(info.fd);
+                    return;
+
+                default:
+                    return;
             }
-            return;
         }
+
+        case fd_info_proto_tuntap_monitor:
+            // The link or address of the TAP device has changed
+            edge_read_from_tap_monitor(eee);
+            return;
+
+        case fd_info_proto_resolve:
+            // The resolver has finished with some names
+            resolve_notified(eee->resolve_parameter);
+            return;
     }
 }
 
@@ -449,7 +489,21 @@ static void fdlist_check_ready (fd_set *rd, fd_set *wr, const time_t now, struct
             }
 
             // TODO: track the stats on writes?
-            conn_write(&connlist[fdlist[slot].connnr], fd);
+            struct conn *conn = &connlist[fdlist[slot].connnr];
+            conn_write(conn, fd);
+
+            if(fdlist[slot].proto == fd_info_proto_http) {
+                mgmt_api_more(eee, conn);
+                // Finishing a reply might close the connection or start on
+                // a pipelined request
+                http_service(eee, conn, fd);
+            }
+        }
+
+        if(fdlist[slot].fd == -1) {
+            // Closed by the handlers above
+            slot++;
+            continue;
         }
 
         if(fdlist[slot].connnr != -1) {
@@ -486,6 +540,10 @@ int mainloop_runonce (struct n3n_runtime_data *eee) {
     } else {
         wait_time.tv_sec = (SOCKET_TIMEOUT_INTERVAL_SECS);
     }
+    if(eee->tuntap_reopen) {
+        // Wake up in time to retry the failed TAP device
+        wait_time.tv_sec = MIN(wait_time.tv_sec, TUNTAP_REOPEN_INTERVAL);
+    }
     wait_time.tv_usec = 0;
 
     int ready = select(maxfd + 1, &rd, &wr, NULL, &wait_time);
@@ -581,6 +639,18 @@ void mainloop_unregister_fd (int fd) {
     fdlist_freefd(fd);
 }
 
+bool mainloop_set_proto (int fd, enum fd_info_proto proto) {
+    int slot = 0;
+    while(slot < MAX_HANDLES) {
+        if(fdlist[slot].fd == fd) {
+            fdlist[slot].proto = proto;
+            return true;
+        }
+        slot++;
+    }
+    return false;
+}
+
 void n3n_initfuncs_mainloop () {
     connlist_init();
     fdlist_zero();
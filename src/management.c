@@ -9,6 +9,7 @@
 
 #include <connslot/connslot.h>  // for conn_t
 #include <connslot/jsonrpc.h>   // for jsonrpc_t, jsonrpc_parse
+#include <ctype.h>              // for isxdigit
 #include <n3n/ethernet.h>       // for is_null_mac
 #include <n3n/logging.h> // for traceEvent
 #include <n3n/mainloop.h>       // for mainloop_unregister_fd
@@ -19,17 +20,20 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>       // for snprintf, sscanf
 #include <stdlib.h>      // for strtoul
-#include <string.h>      // for strtok, strlen, strncpy
+#include <string.h>      // for strtok, strlen, strncpy, strcpy, strchr
 #include <time.h>
 #include <unistd.h>
 
 #include "base64.h"      // for base64decode
 #include "connslot/strbuf.h"
 #include "management.h"
+#include "mcast_groups.h" // for mcast_group, mcast_group_members
 #include "n2n.h"
 #include "n2n_typedefs.h"
 #include "peer_info.h"   // for peer_info
+#include "sn_state.h"    // for sn_state_save
 #include "uthash.h"
 
 #ifdef _WIN32
@@ -41,9 +45,31 @@
 #endif
 
 static struct metrics {
-    uint32_t event_write_error;
+    uint32_t event_drop;            // events discarded due to a full queue
+    uint32_t event_write_partial;   // events left queued after a write
 } metrics;
 
+static struct n3n_metrics_items_uint32 metrics_items[] = {
+    {
+        .name = "event_drop",
+        .desc = "Events dropped because a subscriber was too slow",
+        .offset = offsetof(struct metrics, event_drop),
+    },
+    {
+        .name = "event_write_partial",
+        .desc = "Events that could not be immediately written in full",
+        .offset = offsetof(struct metrics, event_write_partial),
+    },
+    { },
+};
+
+static struct n3n_metrics_module metrics_module = {
+    .name = "management",
+    .data = &metrics,
+    .items_uint32 = metrics_items,
+    .type = n3n_metrics_type_uint32,
+};
+
 static void generate_http_headers (conn_t *conn, const char *type, int code) {
     strbuf_t **pp = &conn->reply_header;
     sb_reprintf(pp, "HTTP/1.1 %i result\r\n", code);
@@ -51,6 +77,9 @@ static void generate_http_headers (conn_t *conn, const char *type, int code) {
     // - caching
     int len = sb_len(conn->reply);
     sb_reprintf(pp, "Content-Type: %s\r\n", type);
+    if(!conn->http.keepalive) {
+        sb_reprintf(pp, "Connection: close\r\n");
+    }
     sb_reprintf(pp, "Content-Length: %i\r\n\r\n", len);
 }
 
@@ -195,13 +224,6 @@ static void event_peer (strbuf_t *buf, enum n3n_event_topic topic, int data0, co
     // TODO: a generic truncation watcher for these buffers
 }
 
-/* Current subscriber for each event topic */
-static SOCKET mgmt_event_subscribers[] = {
-    [N3N_EVENT_DEBUG] = -1,
-    [N3N_EVENT_TEST] = -1,
-    [N3N_EVENT_PEER] = -1,
-};
-
 struct mgmt_event {
     char *topic;
     char *desc;
@@ -226,6 +248,127 @@ static const struct mgmt_event mgmt_events[] = {
     },
 };
 
+#define NR_EVENT_TOPICS (sizeof(mgmt_events) / sizeof(mgmt_events[0]))
+
+// Each subscriber holds on to one management connection, so this needs to
+// leave room in the mainloop connlist for normal API requests
+#define MGMT_EVENT_SUBSCRIBERS 4
+
+// The most event data that will be queued for a slow subscriber before the
+// oldest events are dropped
+#define MGMT_EVENT_QUEUE_SIZE 8192
+
+struct mgmt_event_subscriber {
+    conn_t *conn;               // NULL if this subscriber entry is unused
+    strbuf_t *queue;            // Events waiting to be written to the conn
+    int fd;
+    enum n3n_event_topic topic;
+    uint32_t dropped;           // Events discarded due to a slow reader
+};
+
+static struct mgmt_event_subscriber mgmt_event_subscribers[MGMT_EVENT_SUBSCRIBERS];
+
+// The number of subscribers for each topic, which allows the posting of
+// events that nobody is listening to to be skipped cheaply
+static uint8_t mgmt_event_topic_subs[NR_EVENT_TOPICS];
+
+static void event_subscriber_release (struct mgmt_event_subscriber *sub) {
+    if(sub->conn->reply == sub->queue) {
+        sub->conn->reply = NULL;
+    }
+    free(sub->queue);
+    mgmt_event_topic_subs[sub->topic]--;
+
+    sub->conn = NULL;
+    sub->queue = NULL;
+    sub->fd = -1;
+}
+
+// Check that the subscriber connection has not been closed underneath us
+// (the supernode slots have no callback to tell us about it)
+static bool event_subscriber_valid (struct mgmt_event_subscriber *sub) {
+    conn_t *conn = sub->conn;
+    if(conn->fd != sub->fd || conn->proto != CONN_PROTO_STREAM) {
+        return false;
+    }
+    if(conn->state == CONN_ERROR || conn->state == CONN_CLOSED) {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Ensure there is enough room in the queue for another event by dropping
+ * the oldest events.  An event that has started to be written (or the
+ * initial HTTP header) is never dropped, as that would corrupt the stream.
+ * Returns false if enough room could not be made.
+ */
+static bool event_queue_make_room (struct mgmt_event_subscriber *sub, size_t needed) {
+    strbuf_t *q = sub->queue;
+    conn_t *conn = sub->conn;
+
+    // First, discard anything that has already been written
+    if(conn->reply_sendpos) {
+        unsigned int sent = conn->reply_sendpos;
+        memmove(q->str, &q->str[sent], sb_len(q) - sent);
+        q->wr_pos -= sent;
+        conn->reply_sendpos = 0;
+    }
+
+    while(sb_avail(q) < (ssize_t)needed) {
+        char *end = &q->str[sb_len(q)];
+
+        // Every event starts with a record separator, so any bytes before
+        // the first one belong to a partially written event
+        char *oldest = memchr(q->str, '\x1e', sb_len(q));
+        if(!oldest) {
+            return false;
+        }
+        char *next = memchr(oldest + 1, '\x1e', end - oldest - 1);
+        if(!next) {
+            next = end;
+        }
+
+        memmove(oldest, next, end - next);
+        q->wr_pos -= next - oldest;
+        sub->dropped++;
+        metrics.event_drop++;
+    }
+    return true;
+}
+
+static void event_queue (struct mgmt_event_subscriber *sub, strbuf_t *buf) {
+    if(!event_subscriber_valid(sub)) {
+        event_subscriber_release(sub);
+        return;
+    }
+
+    size_t len = sb_len(buf);
+    if(sb_avail(sub->queue) < (ssize_t)len) {
+        if(!event_queue_make_room(sub, len)) {
+            sub->dropped++;
+            metrics.event_drop++;
+            return;
+        }
+    }
+    sb_append(sub->queue, buf->str, len);
+
+    // Start sending now, the rest will be written as the socket becomes
+    // writable.  This never blocks as the conn socket is non blocking
+    sub->conn->reply = sub->queue;
+    if(conn_write(sub->conn, sub->fd) < (ssize_t)len) {
+        metrics.event_write_partial++;
+    }
+}
+
+void mgmt_event_closed (conn_t *conn) {
+    for(int i = 0; i < MGMT_EVENT_SUBSCRIBERS; i++) {
+        if(mgmt_event_subscribers[i].conn == conn) {
+            event_subscriber_release(&mgmt_event_subscribers[i]);
+        }
+    }
+}
+
 static void event_subscribe (struct n3n_runtime_data *eee, conn_t *conn) {
     char *match = "GET /events/"; // what we expect to have been called with
     char *urltail = &conn->request->str[strlen(match)];
@@ -233,86 +376,88 @@ static void event_subscribe (struct n3n_runtime_data *eee, conn_t *conn) {
 
     enum n3n_event_topic topicid;
 
-    int nr_topics = sizeof(mgmt_events) / sizeof(mgmt_events[0]);
-    for( topicid=0; topicid < nr_topics; topicid++ ) {
+    for( topicid=0; topicid < NR_EVENT_TOPICS; topicid++ ) {
         if(!strcmp(mgmt_events[topicid].topic,topic)) {
             break;
         }
     }
-    if( topicid >= nr_topics ) {
+    if( topicid >= NR_EVENT_TOPICS ) {
         render_error(conn, "unknown topic");
         return;
     }
 
-    bool replacing = false;
-
-    if(mgmt_event_subscribers[topicid] != -1) {
-        // TODO: send a goodbye message to old subscriber
-        close(mgmt_event_subscribers[topicid]);
-
-        replacing = true;
+    struct mgmt_event_subscriber *sub = NULL;
+    for(int i = 0; i < MGMT_EVENT_SUBSCRIBERS; i++) {
+        struct mgmt_event_subscriber *scan = &mgmt_event_subscribers[i];
+        if(scan->conn && !event_subscriber_valid(scan)) {
+            event_subscriber_release(scan);
+        }
+        if(!scan->conn && !sub) {
+            sub = scan;
+        }
+    }
+    if(!sub) {
+        render_error(conn, "too many subscribers");
+        return;
     }
 
-    // Take the filehandle away from the connslots.
-    mgmt_event_subscribers[topicid] = conn->fd;
-    // TODO:
-    // - Keep these filehandles in the mainloop
-    // - change the mainloop proto mark it as "event"
-    mainloop_unregister_fd(conn->fd);
+    sub->queue = sb_malloc(MGMT_EVENT_QUEUE_SIZE, MGMT_EVENT_QUEUE_SIZE);
+    if(!sub->queue) {
+        render_error(conn, "no memory");
+        return;
+    }
+    sub->conn = conn;
+    sub->fd = conn->fd;
+    sub->topic = topicid;
+    sub->dropped = 0;
+    mgmt_event_topic_subs[topicid]++;
+
+    // Keep the connection in the mainloop, but switch it to only writing
+    // out the queued events
+    mainloop_set_proto(conn->fd, fd_info_proto_event);
+    conn->proto = CONN_PROTO_STREAM;
+    conn->state = CONN_READING;
+    conn->reply_sendpos = 0;
+    sb_zero(conn->request);
+    sb_zero(conn->reply_header);
 
     // TODO: shutdown(fd, SHUT_RD) - but that does nothing for unix domain
 
     // The assigned mime type is actually application/json-seq, but firefox
     // will usefully show you the raw streaming data if we use the wrong
     // content type
-    char *msg1 = "HTTP/1.1 200 event\r\nContent-Type: application/json\r\n\r\n";
-    if(write(mgmt_event_subscribers[topicid], msg1, strlen(msg1))<1) {
-        metrics.event_write_error++;
-    }
-
-    if(replacing) {
-        char *msg2 = "\x1e\"replacing\"\n";
-        if(write(mgmt_event_subscribers[topicid], msg2, strlen(msg2))<1) {
-            metrics.event_write_error++;
-        }
-    }
+    sb_printf(
+        sub->queue,
+        "HTTP/1.1 200 event\r\nContent-Type: application/json\r\n\r\n"
+    );
+    conn->reply = sub->queue;
 }
 
 void mgmt_event_post (const enum n3n_event_topic topic, int data0, const void *data1) {
-    traceEvent(TRACE_DEBUG, "post topic=%i data0=%i", topic, data0);
-
-    SOCKET debug = mgmt_event_subscribers[N3N_EVENT_DEBUG];
-    SOCKET sub = mgmt_event_subscribers[topic];
-
-    if( sub == -1 && debug == -1) {
+    if(!mgmt_event_topic_subs[topic] && !mgmt_event_topic_subs[N3N_EVENT_DEBUG]) {
         // If neither of this topic or the debug topic have a subscriber
         // then we dont need to do any work
         return;
     }
 
+    traceEvent(TRACE_DEBUG, "post topic=%i data0=%i", topic, data0);
+
     char buf_space[200];
     strbuf_t *buf;
     STRBUF_INIT(buf, buf_space);
 
     mgmt_events[topic].func(buf, topic, data0, data1);
 
-    if( sub != -1 ) {
-        if(sb_write(sub, buf, 0, -1) == -1) {
-            mgmt_event_subscribers[topic] = -1;
-            close(sub);
+    for(int i = 0; i < MGMT_EVENT_SUBSCRIBERS; i++) {
+        struct mgmt_event_subscriber *sub = &mgmt_event_subscribers[i];
+        if(!sub->conn) {
+            continue;
         }
-    }
-    if( debug != -1 ) {
-        if(sb_write(debug, buf, 0, -1) == -1) {
-            mgmt_event_subscribers[N3N_EVENT_DEBUG] = -1;
-            close(debug);
+        if(sub->topic != topic && sub->topic != N3N_EVENT_DEBUG) {
+            continue;
         }
+        event_queue(sub, buf);
     }
-    // TODO:
-    // - ideally, we would detect that the far end has gone away and
-    //   set the subscriber socket back to -1
-    // - this all assumes that the socket is set to non blocking
-    // - if the write returns EWOULDBLOCK, increment a metric and return
 }
 
 static void extract_pagination (char *params, int *limit, int *offset) {
@@ -335,6 +480,10 @@ static void extract_pagination (char *params, int *limit, int *offset) {
     }
 }
 
+// The longest request id copied out for the replies, longer ones are refused
+// rather than answered with a truncated id the client cannot match
+#define JSONRPC_ID_SIZE 32
+
 static void jsonrpc_error (char *id, conn_t *conn, int code, char *message, int count) {
     // Reuse the request buffer
     sb_zero(conn->request);
@@ -530,6 +679,93 @@ static void jsonrpc_get_mac (char *id, struct n3n_runtime_data *eee, conn_t *con
     jsonrpc_result_tail(conn, 200);
 }
 
+static void jsonrpc_get_mcast_groups (char *id, struct n3n_runtime_data *eee, conn_t *conn, const char *params) {
+    // The groups joined behind this edge or, on a supernode, the groups
+    // joined in each community with the copies sent and saved for each
+
+    jsonrpc_result_head(id, conn);
+    sb_reprintf(&conn->request, "[");
+
+    struct sn_community *community;
+    struct sn_community *tmp_community;
+    struct mcast_group *group;
+    struct mcast_group *tmp_group;
+    macstr_t mac_buf;
+
+    int limit;      // max number of items to add to this packet
+    int offset = 0; // Number of items to skip before adding
+    extract_pagination((char *)params, &limit, &offset);
+    int count = 0;  // Number of items in this reply packet
+    int index = 0;  // Track the current item number
+
+    if(!eee->communities) {
+        HASH_ITER(hh, eee->mcast_groups, group, tmp_group) {
+            if(index < offset) {
+                index++;
+                continue;
+            }
+            index++;
+
+            sb_reprintf(&conn->request,
+                        "{"
+                        "\"group\":\"%s\","
+                        "\"last_seen\":%u},",
+                        macaddr_str(mac_buf, group->mac),
+                        (uint32_t)group->last_seen
+            );
+
+            if(jsonrpc_error_overflow(id, conn, count)) {
+                return;
+            }
+            count++;
+            if(count >= limit) {
+                break;
+            }
+        }
+
+        jsonrpc_listend_hack(conn, "]");
+        jsonrpc_result_tail(conn, 200);
+        return;
+    }
+
+    HASH_ITER(hh, eee->communities, community, tmp_community) {
+        HASH_ITER(hh, community->mcast_groups, group, tmp_group) {
+            if(index < offset) {
+                index++;
+                continue;
+            }
+            index++;
+
+            sb_reprintf(&conn->request,
+                        "{"
+                        "\"community\":\"%s\","
+                        "\"group\":\"%s\","
+                        "\"members\":%u,"
+                        "\"tx\":%u,"
+                        "\"pruned\":%u,"
+                        "\"last_seen\":%u},",
+                        community->community,
+                        macaddr_str(mac_buf, group->mac),
+                        (uint32_t)mcast_group_members(group),
+                        group->tx,
+                        group->pruned,
+                        (uint32_t)group->last_seen
+            );
+
+            if(jsonrpc_error_overflow(id, conn, count)) {
+                return;
+            }
+            count++;
+            if(count >= limit) {
+                break;
+            }
+        }
+    }
+
+    jsonrpc_listend_hack(conn, "]");
+    jsonrpc_result_tail(conn, 200);
+}
+
 static void jsonrpc_get_communities (char *id, struct n3n_runtime_data *eee, conn_t *conn, const char *params) {
     if(!eee->communities) {
         // This is an edge
@@ -573,11 +809,27 @@ static void jsonrpc_get_communities (char *id, struct n3n_runtime_data *eee, con
                     "\"community\":\"%s\","
                     "\"purgeable\":%i,"
                     "\"is_federation\":%i,"
-                    "\"ip4addr\":\"%s\"},",
+                    "\"ip4addr\":\"%s\","
+                    "\"max_rate\":%u,"
+                    "\"max_pps\":%u,"
+                    "\"edge_max_rate\":%u,"
+                    "\"edge_max_pps\":%u,"
+                    "\"rate_drop\":%u,"
+                    "\"fq_queued\":%u,"
+                    "\"fq_drop\":%u,"
+                    "\"fq_len\":%u},",
                     (community->is_federation) ? "-/-" : community->community,
                     community->purgeable,
                     community->is_federation,
-                    (community->auto_ip_net.net_addr == 0) ? "" : ip_subnet_to_str(ip_bit_str, &community->auto_ip_net));
+                    (community->auto_ip_net.net_addr == 0) ? "" : ip_subnet_to_str(ip_bit_str, &community->auto_ip_net),
+                    community->max_rate ? community->max_rate : eee->conf.sn_community_max_rate,
+                    community->max_pps ? community->max_pps : eee->conf.sn_community_max_pps,
+                    community->edge_max_rate ? community->edge_max_rate : eee->conf.sn_edge_max_rate,
+                    community->edge_max_pps ? community->edge_max_pps : eee->conf.sn_edge_max_pps,
+                    community->rate_drop,
+                    community->fq_queued,
+                    community->fq_drop,
+                    community->fq.len);
 
         if(jsonrpc_error_overflow(id, conn, count)) {
             return;
@@ -615,6 +867,9 @@ static void jsonrpc_get_edges_row (strbuf_t **reply, struct peer_info *peer, con
                 "\"time_alloc\":%u,"
                 "\"last_p2p\":%u,"
                 "\"last_sent_query\":%u,"
+                "\"rtt_usec\":%u,"
+                "\"rtt_var_usec\":%u,"
+                "\"loss_permille\":%u,"
                 "\"last_seen\":%u},",
                 mode,
                 community,
@@ -631,100 +886,472 @@ static void jsonrpc_get_edges_row (strbuf_t **reply, struct peer_info *peer, con
                 (uint32_t)peer->time_alloc,
                 (uint32_t)peer->last_p2p,
                 (uint32_t)peer->last_sent_query,
+                peer->rtt,
+                peer->rtt_var,
+                peer->loss,
                 (uint32_t)peer->last_seen
     );
 
     // TODO: add a proto: TCP|UDP item to the output
 }
 
-static void jsonrpc_get_edges (char *id, struct n3n_runtime_data *eee, conn_t *conn, const char *params) {
-    struct peer_info *peer, *tmpPeer;
+/*
+ * The get_edges list is assembled from several different hash tables, this
+ * iterator walks them all in order: the pending_peers, the known_peers and
+ * then the edges of each community.
+ */
+enum edges_section {
+    edges_section_pending = 0,
+    edges_section_known,
+    edges_section_community,
+    edges_section_end,
+};
 
-    jsonrpc_result_head(id, conn);
-    sb_reprintf(&conn->request, "[");
+struct edges_iter {
+    enum edges_section section;
+    struct sn_community *community;
+    struct peer_info *peer;     // The next peer to output, NULL at the end
+    int index;                  // The position of peer in the whole list
+};
 
-    int limit;      // max number of items to add to this packet
-    int offset = 0; // Number of items to skip before adding
-    extract_pagination((char *)params, &limit, &offset);
-    int count = 0;  // Number of items in this reply packet
-    int index = 0;  // Track the current item number
+static const char *edges_section_mode[] = {
+    [edges_section_pending] = "pSp",
+    [edges_section_known] = "p2p",
+    [edges_section_community] = "sn",
+};
 
-    // dump nodes with forwarding through supernodes
-    HASH_ITER(hh, eee->pending_peers, peer, tmpPeer) {
-        if(index < offset) {
-            index++;
-            continue;
+// Step over any empty lists until a peer is found or the end is reached
+static void edges_iter_settle (struct n3n_runtime_data *eee, struct edges_iter *it) {
+    while(!it->peer) {
+        switch(it->section) {
+            case edges_section_pending:
+                it->section = edges_section_known;
+                it->peer = eee->known_peers;
+                break;
+            case edges_section_known:
+                it->section = edges_section_community;
+                it->community = eee->communities;
+                if(it->community) {
+                    it->peer = it->community->edges;
+                }
+                break;
+            case edges_section_community:
+                if(it->community) {
+                    it->community = it->community->hh.next;
+                }
+                if(!it->community) {
+                    it->section = edges_section_end;
+                    return;
+                }
+                it->peer = it->community->edges;
+                break;
+            case edges_section_end:
+                return;
         }
-        index++;
+    }
+}
 
-        jsonrpc_get_edges_row(
-            &conn->request,
-            peer,
-            "pSp",
-            eee->conf.community_name
-        );
+static void edges_iter_start (struct n3n_runtime_data *eee, struct edges_iter *it) {
+    it->section = edges_section_pending;
+    it->community = NULL;
+    it->peer = eee->pending_peers;
+    it->index = 0;
+    edges_iter_settle(eee, it);
+}
 
-        if(jsonrpc_error_overflow(id, conn, count)) {
-            return;
+static void edges_iter_next (struct n3n_runtime_data *eee, struct edges_iter *it) {
+    it->peer = it->peer->hh.next;
+    it->index++;
+    edges_iter_settle(eee, it);
+}
+
+/*
+ * A cursor records the last peer that was output, so that the next page
+ * can be found with hash lookups instead of walking the whole list again.
+ * The index is only used as a fallback when that peer has gone away.
+ *
+ * As a token, it is "section:index:macaddr:community" with the mac and the
+ * community name both hex encoded.
+ */
+struct edges_cursor {
+    enum edges_section section;
+    int index;
+    n2n_mac_t mac;
+    n2n_community_t community;
+};
+
+typedef char edges_cursor_str_t[2 + 1 + 11 + 1 + 12 + 1 + N2N_COMMUNITY_SIZE * 2 + 1];
+
+static void edges_cursor_save (struct edges_cursor *cursor, struct edges_iter *it) {
+    cursor->section = it->section;
+    cursor->index = it->index;
+    memcpy(cursor->mac, it->peer->mac_addr, sizeof(cursor->mac));
+    memset(cursor->community, 0, sizeof(cursor->community));
+    if(it->community) {
+        memcpy(cursor->community, it->community->community, sizeof(cursor->community));
+    }
+}
+
+static char *edges_cursor_str (edges_cursor_str_t buf, struct edges_cursor *cursor) {
+    char *p = buf;
+    p += sprintf(p, "%i:%i:", cursor->section, cursor->index);
+    for(int i = 0; i < sizeof(cursor->mac); i++) {
+        p += sprintf(p, "%02x", cursor->mac[i]);
+    }
+    *p++ = ':';
+    for(int i = 0; cursor->community[i] && i < sizeof(cursor->community); i++) {
+        p += sprintf(p, "%02x", (uint8_t)cursor->community[i]);
+    }
+    *p = 0;
+    return buf;
+}
+
+static int hexbyte (const char *p) {
+    unsigned int val;
+    if(!isxdigit(p[0]) || !isxdigit(p[1])) {
+        return -1;
+    }
+    sscanf(p, "%2x", &val);
+    return val;
+}
+
+static bool edges_cursor_parse (struct edges_cursor *cursor, const char *token) {
+    int section;
+    int pos;
+
+    memset(cursor, 0, sizeof(*cursor));
+    if(sscanf(token, "%i:%i:%n", &section, &cursor->index, &pos) != 2) {
+        return false;
+    }
+    if(section < edges_section_pending || section >= edges_section_end) {
+        return false;
+    }
+    cursor->section = section;
+    token += pos;
+
+    for(int i = 0; i < sizeof(cursor->mac); i++) {
+        int val = hexbyte(token);
+        if(val < 0) {
+            return false;
         }
-        count++;
-        if(count >= limit) {
+        cursor->mac[i] = val;
+        token += 2;
+    }
+    if(*token++ != ':') {
+        return false;
+    }
+    for(int i = 0; *token && i < sizeof(cursor->community) - 1; i++) {
+        int val = hexbyte(token);
+        if(val < 0) {
+            return false;
+        }
+        cursor->community[i] = val;
+        token += 2;
+    }
+    return true;
+}
+
+// Position the iterator at the peer after the one the cursor refers to
+static void edges_iter_resume (struct n3n_runtime_data *eee, struct edges_iter *it, struct edges_cursor *cursor) {
+    struct peer_info *list = NULL;
+    struct peer_info *peer = NULL;
+    struct sn_community *community = NULL;
+
+    switch(cursor->section) {
+        case edges_section_pending:
+            list = eee->pending_peers;
+            break;
+        case edges_section_known:
+            list = eee->known_peers;
+            break;
+        case edges_section_community:
+            HASH_FIND_STR(eee->communities, cursor->community, community);
+            if(community) {
+                list = community->edges;
+            }
+            break;
+        case edges_section_end:
             break;
+    }
+    HASH_FIND_PEER(list, cursor->mac, peer);
+
+    if(!peer) {
+        // The cursor peer has gone away, fall back to skipping forward by
+        // position, which may repeat or miss a few items
+        edges_iter_start(eee, it);
+        while(it->peer && it->index <= cursor->index) {
+            edges_iter_next(eee, it);
         }
+        return;
     }
 
-    // dump peer-to-peer nodes
-    HASH_ITER(hh, eee->known_peers, peer, tmpPeer) {
-        if(index < offset) {
-            index++;
+    it->section = cursor->section;
+    it->community = community;
+    it->peer = peer;
+    it->index = cursor->index;
+    edges_iter_next(eee, it);
+}
+
+static void jsonrpc_get_edges_iter_row (strbuf_t **reply, struct edges_iter *it, const char *community_name) {
+    const char *community = community_name;
+    if(it->section == edges_section_community) {
+        community = (it->community->is_federation) ? "-/-" : it->community->community;
+    }
+
+    jsonrpc_get_edges_row(
+        reply,
+        it->peer,
+        edges_section_mode[it->section],
+        community
+    );
+}
+
+/*
+ * For large lists, the edges can be streamed as a single chunked reply.  The
+ * reply is generated a chunk at a time, each time the previous chunk has
+ * been written, so the daemon continues forwarding packets while this
+ * happens.
+ */
+#define MGMT_STREAMS 2
+#define MGMT_STREAM_CHUNK 2048
+#define MGMT_STREAM_ROW_MAX 16384   // The most a chunk may grow to for one row
+#define MGMT_STREAM_TAIL 16         // Room to end the chunk and the reply
+
+struct mgmt_stream {
+    conn_t *conn;               // NULL if this stream is unused
+    char id[JSONRPC_ID_SIZE];
+    struct edges_cursor cursor;
+    bool started;               // Has the cursor got a valid position
+    bool listed;                // Has any row been sent
+    unsigned int request_max;   // The request buffer's limit before any growing
+};
+
+static struct mgmt_stream mgmt_streams[MGMT_STREAMS];
+
+// Set while running the members of a batch request, as their replies are
+// gathered into one and so cannot be streamed
+static bool jsonrpc_in_batch;
+
+static struct mgmt_stream *mgmt_stream_alloc (conn_t *conn, const char *id) {
+    for(int i = 0; i < MGMT_STREAMS; i++) {
+        struct mgmt_stream *stream = &mgmt_streams[i];
+
+        // A closed connection will have had its priv cleared
+        if(stream->conn && stream->conn->priv != stream) {
+            stream->conn = NULL;
+        }
+        if(stream->conn) {
             continue;
         }
-        index++;
 
-        jsonrpc_get_edges_row(
+        stream->conn = conn;
+        strncpy(stream->id, id, sizeof(stream->id) - 1);
+        stream->id[sizeof(stream->id) - 1] = 0;
+        stream->started = false;
+        stream->listed = false;
+        stream->request_max = conn->request->capacity_max;
+        conn->priv = stream;
+        // Dont let the connection move on to any next request until the
+        // whole stream has been sent
+        conn->http.partial = true;
+        return stream;
+    }
+    return NULL;
+}
+
+static void mgmt_stream_free (struct mgmt_stream *stream) {
+    stream->conn->request->capacity_max = stream->request_max;
+    stream->conn->priv = NULL;
+    stream->conn->http.partial = false;
+    stream->conn = NULL;
+}
+
+// Wrap the data already in the request buffer (after the size placeholder)
+// up as a HTTP chunk
+static void mgmt_stream_chunk_end (conn_t *conn) {
+    char size[9];
+    int len = sb_len(conn->request) - 10;
+
+    sb_reprintf(&conn->request, "\r\n");
+    snprintf(size, sizeof(size), "%08x", len);
+    memcpy(conn->request->str, size, 8);
+
+    // Update the reply buffer after last potential realloc
+    conn->reply = conn->request;
+}
+
+static void jsonrpc_get_edges_chunk (struct n3n_runtime_data *eee, struct mgmt_stream *stream) {
+    conn_t *conn = stream->conn;
+    struct edges_iter it;
+    int rows = 0;
+
+    sb_zero(conn->request);
+    // A placeholder for the chunk size
+    sb_reprintf(&conn->request, "00000000\r\n");
+
+    if(!stream->started) {
+        sb_reprintf(
             &conn->request,
-            peer,
-            "p2p",
-            eee->conf.community_name
+            "{"
+            "\"jsonrpc\":\"2.0\","
+            "\"id\":\"%s\","
+            "\"result\":[",
+            stream->id
         );
+        edges_iter_start(eee, &it);
+    } else {
+        edges_iter_resume(eee, &it, &stream->cursor);
+    }
 
-        if(jsonrpc_error_overflow(id, conn, count)) {
-            return;
-        }
-        count++;
-        if(count >= limit) {
-            break;
+    while(it.peer && sb_len(conn->request) < MGMT_STREAM_CHUNK) {
+        unsigned int pos = conn->request->wr_pos;
+
+        if(stream->listed) {
+            sb_reprintf(&conn->request, ",");
         }
-    }
+        jsonrpc_get_edges_iter_row(&conn->request, &it, eee->conf.community_name);
+        // Remove the trailing ',' added by the row function
+        conn->request->wr_pos--;
 
-    struct sn_community *community, *tmp;
-    HASH_ITER(hh, eee->communities, community, tmp) {
-        HASH_ITER(hh, community->edges, peer, tmpPeer) {
-            if(index < offset) {
-                index++;
+        if(sb_overflowed(conn->request)
+           || (conn->request->capacity_max - conn->request->wr_pos < MGMT_STREAM_TAIL)) {
+            conn->request->wr_pos = pos;
+            conn->request->overflowed = false;
+            if(rows) {
+                // That row did not fit, so send it in the next chunk
+                break;
+            }
+            // It does not even fit an empty chunk.  Sending no data would
+            // be taken as the end of the reply, so make room for it
+            if(conn->request->capacity_max < MGMT_STREAM_ROW_MAX) {
+                conn->request->capacity_max *= 2;
                 continue;
             }
-            index++;
+            traceEvent(TRACE_WARNING, "get_edges: skipping a row too large to send");
+        } else {
+            stream->listed = true;
+            rows++;
+        }
 
-            jsonrpc_get_edges_row(
-                &conn->request,
-                peer,
-                "sn",
-                (community->is_federation) ? "-/-" : community->community
-            );
+        edges_cursor_save(&stream->cursor, &it);
+        stream->started = true;
+        edges_iter_next(eee, &it);
+    }
 
-            if(jsonrpc_error_overflow(id, conn, count)) {
-                return;
-            }
-            count++;
-            if(count >= limit) {
-                break;
-            }
+    if(it.peer) {
+        mgmt_stream_chunk_end(conn);
+        return;
+    }
+
+    // This is the last of the data
+    sb_reprintf(&conn->request, "]}");
+    mgmt_stream_chunk_end(conn);
+    sb_reprintf(&conn->request, "0\r\n\r\n");
+    conn->reply = conn->request;
+    mgmt_stream_free(stream);
+}
+
+static void jsonrpc_get_edges_stream (char *id, struct n3n_runtime_data *eee, conn_t *conn) {
+    struct mgmt_stream *stream = mgmt_stream_alloc(conn, id);
+    if(!stream) {
+        jsonrpc_error(id, conn, 503, "too many streams", 0);
+        jsonrpc_result_tail(conn, 503);
+        return;
+    }
+
+    strbuf_t **pp = &conn->reply_header;
+    sb_reprintf(pp, "HTTP/1.1 200 result\r\n");
+    sb_reprintf(pp, "Content-Type: application/json\r\n");
+    if(!conn->http.keepalive) {
+        sb_reprintf(pp, "Connection: close\r\n");
+    }
+    sb_reprintf(pp, "Transfer-Encoding: chunked\r\n\r\n");
+
+    jsonrpc_get_edges_chunk(eee, stream);
+}
+
+void mgmt_api_more (struct n3n_runtime_data *eee, conn_t *conn) {
+    struct mgmt_stream *stream = conn->priv;
+    if(!stream) {
+        // Nothing is being streamed on this connection
+        return;
+    }
+    if(conn_iswriter(conn)) {
+        // Wait until the previous chunk has been sent
+        return;
+    }
+    jsonrpc_get_edges_chunk(eee, stream);
+}
+
+static void jsonrpc_get_edges (char *id, struct n3n_runtime_data *eee, conn_t *conn, const char *params) {
+    char *streamstr = json_find_field((char *)params, "\"stream\"");
+    char *cursorstr = json_find_field((char *)params, "\"cursor\"");
+    int limit;      // max number of items to add to this packet
+    int offset = 0; // Number of items to skip before adding
+    extract_pagination((char *)params, &limit, &offset);
+
+    // do all the field finding first, since the value extractor will
+    // insert nulls at the end of its strings
+
+    if(streamstr && !strncmp(streamstr, "true", 4) && !jsonrpc_in_batch) {
+        jsonrpc_get_edges_stream(id, eee, conn);
+        return;
+    }
+
+    struct edges_iter it;
+    struct edges_cursor cursor;
+    if(cursorstr) {
+        cursorstr = json_extract_val(cursorstr);
+    }
+
+    if(cursorstr && *cursorstr) {
+        if(!edges_cursor_parse(&cursor, cursorstr)) {
+            jsonrpc_error(id, conn, 400, "bad cursor", 0);
+            jsonrpc_result_tail(conn, 400);
+            return;
+        }
+        edges_iter_resume(eee, &it, &cursor);
+    } else {
+        edges_iter_start(eee, &it);
+        while(it.peer && it.index < offset) {
+            edges_iter_next(eee, &it);
         }
     }
 
+    jsonrpc_result_head(id, conn);
+    if(cursorstr) {
+        // Cursor based paging returns the list along with the next cursor
+        sb_reprintf(&conn->request, "{\"edges\":");
+    }
+    sb_reprintf(&conn->request, "[");
+
+    int count = 0;  // Number of items in this reply packet
+
+    while(it.peer && count < limit) {
+        jsonrpc_get_edges_iter_row(&conn->request, &it, eee->conf.community_name);
+
+        if(jsonrpc_error_overflow(id, conn, count)) {
+            return;
+        }
+        count++;
+        edges_cursor_save(&cursor, &it);
+        edges_iter_next(eee, &it);
+    }
 
     jsonrpc_listend_hack(conn, "]");
+
+    if(cursorstr) {
+        edges_cursor_str_t buf;
+        if(it.peer) {
+            sb_reprintf(
+                &conn->request,
+                ",\"next\":\"%s\"}",
+                edges_cursor_str(buf, &cursor)
+            );
+        } else {
+            sb_reprintf(&conn->request, ",\"next\":null}");
+        }
+    }
     jsonrpc_result_tail(conn, 200);
 }
 
@@ -787,6 +1414,8 @@ static void jsonrpc_get_supernodes (char *id, struct n3n_runtime_data *eee, conn
                     "\"macaddr\":\"%s\","
                     "\"sockaddr\":\"%s\","
                     "\"selection\":\"%s\","
+                    "\"rtt_usec\":%u,"
+                    "\"rtt_var_usec\":%u,"
                     "\"last_seen\":%u,"
                     "\"uptime\":%u},",
                     peer->version,
@@ -795,6 +1424,8 @@ static void jsonrpc_get_supernodes (char *id, struct n3n_runtime_data *eee, conn
                     is_null_mac(peer->mac_addr) ? "" : macaddr_str(mac_buf, peer->mac_addr),
                     sock_to_cstr(sockbuf, &(peer->sock)),
                     sn_selection_criterion_str(eee, sel_buf, peer),
+                    peer->rtt,
+                    peer->rtt_var,
                     (uint32_t)peer->last_seen,
                     (uint32_t)peer->uptime);
     }
@@ -876,6 +1507,96 @@ static void jsonrpc_get_packetstats (char *id, struct n3n_runtime_data *eee, con
                 eee->stats.tx_multicast_drop,
                 eee->stats.rx_multicast_drop);
 
+    sb_reprintf(&conn->request,
+                "{"
+                "\"type\":\"relay\","
+                "\"tx_pkt\":%u,"
+                "\"rx_pkt\":%u},",
+                eee->stats.tx_relay,
+                eee->stats.rx_relay);
+
+    sb_reprintf(&conn->request,
+                "{"
+                "\"type\":\"relay_fwd\","
+                "\"tx_pkt\":%u,"
+                "\"drop\":%u},",
+                eee->stats.relay_fwd,
+                eee->stats.relay_drop);
+
+    sb_reprintf(&conn->request,
+                "{"
+                "\"type\":\"nat_punch\","
+                "\"tx_pkt\":%u,"
+                "\"attempt\":%u,"
+                "\"success\":%u},",
+                eee->stats.nat_probe,
+                eee->stats.nat_punch,
+                eee->stats.nat_punch_ok);
+
+    sb_reprintf(&conn->request,
+                "{"
+                "\"type\":\"neigh_proxy\","
+                "\"answered\":%u,"
+                "\"miss\":%u},",
+                eee->stats.neigh_proxy,
+                eee->stats.neigh_miss);
+
+    sb_reprintf(&conn->request,
+                "{"
+                "\"type\":\"bcast_p2p\","
+                "\"tx_pkt\":%u,"
+                "\"skip\":%u},",
+                eee->stats.tx_bcast_p2p,
+                eee->stats.sn_bcast_skip);
+
+    sb_reprintf(&conn->request,
+                "{"
+                "\"type\":\"layer3_drop\","
+                "\"tx_pkt\":%u},",
+                eee->stats.tx_layer3_drop);
+
+    sb_reprintf(&conn->request,
+                "{"
+                "\"type\":\"rx_control\","
+                "\"rx_pkt\":%u,"
+                "\"peak\":%u},",
+                eee->stats.rx_ctrl,
+                eee->stats.rx_ctrl_peak);
+
+    sb_reprintf(&conn->request,
+                "{"
+                "\"type\":\"rx_data\","
+                "\"rx_pkt\":%u,"
+                "\"peak\":%u,"
+                "\"drop\":%u},",
+                eee->stats.rx_data,
+                eee->stats.rx_data_peak,
+                eee->stats.rx_data_drop);
+
+    sb_reprintf(&conn->request,
+                "{"
+                "\"type\":\"rx_admit\","
+                "\"rx_pkt\":%u,"
+                "\"peak\":%u,"
+                "\"drop\":%u,"
+                "\"rate_drop\":%u,"
+                "\"source_drop\":%u},",
+                eee->stats.rx_admit,
+                eee->stats.rx_admit_peak,
+                eee->stats.rx_admit_drop,
+                eee->stats.sn_reg_rate_drop,
+                eee->stats.sn_reg_source_drop);
+
+    sb_reprintf(&conn->request,
+                "{"
+                "\"type\":\"sn_limit\","
+                "\"rate_drop\":%u,"
+                "\"fq_queued\":%u,"
+                "\"fq_drop\":%u},",
+                eee->stats.sn_rate_drop,
+                eee->stats.sn_fq_queued,
+                eee->stats.sn_fq_drop);
+
     sb_reprintf(&conn->request,
                 "{"
                 "\"type\":\"sn_fwd\","
@@ -888,6 +1609,12 @@ static void jsonrpc_get_packetstats (char *id, struct n3n_runtime_data *eee, con
                 "\"tx_pkt\":%u},",
                 eee->stats.sn_broadcast);
 
+    sb_reprintf(&conn->request,
+                "{"
+                "\"type\":\"sn_peer_info_push\","
+                "\"tx_pkt\":%u},",
+                eee->stats.sn_peer_info_push);
+
     sb_reprintf(&conn->request,
                 "{"
                 "\"type\":\"sn_reg\","
@@ -938,25 +1665,48 @@ static void jsonrpc_reload_communities (char *id, struct n3n_runtime_data *eee,
     jsonrpc_result_tail(conn, 200);
 }
 
-static void jsonrpc_help_events (char *id, struct n3n_runtime_data *eee, conn_t *conn, const char *params) {
-    int nr_handlers = sizeof(mgmt_events) / sizeof(mgmt_events[0]);
+static void jsonrpc_save_state (char *id, struct n3n_runtime_data *eee, conn_t *conn, const char *params) {
+    if(!auth_check(eee, conn)) {
+        auth_request(conn);
+        return;
+    }
+
+    int count = sn_state_save(eee);
 
+    jsonrpc_result_head(id, conn);
+    sb_reprintf(&conn->request, "%i", count);
+    jsonrpc_result_tail(conn, 200);
+}
+
+static void jsonrpc_help_events (char *id, struct n3n_runtime_data *eee, conn_t *conn, const char *params) {
     jsonrpc_result_head(id, conn);
     sb_reprintf(&conn->request, "[");
-    for( int topic=0; topic < nr_handlers; topic++ ) {
-        int sub = mgmt_event_subscribers[topic];
-        char host[40];
-        char serv[6];
-        host[0] = '?';
-        host[1] = 0;
-        serv[0] = '?';
-        serv[1] = 0;
-
-        if(sub != -1) {
+    for( int topic=0; topic < NR_EVENT_TOPICS; topic++ ) {
+        sb_reprintf(
+            &conn->request,
+            "{"
+            "\"topic\":\"%s\","
+            "\"subscribers\":[",
+            mgmt_events[topic].topic
+        );
+
+        for(int i = 0; i < MGMT_EVENT_SUBSCRIBERS; i++) {
+            struct mgmt_event_subscriber *sub = &mgmt_event_subscribers[i];
+            if(!sub->conn || sub->topic != topic) {
+                continue;
+            }
+
+            char host[40];
+            char serv[6];
+            host[0] = '?';
+            host[1] = 0;
+            serv[0] = '?';
+            serv[1] = 0;
+
             struct sockaddr_storage sa;
             socklen_t sa_size = sizeof(sa);
 
-            if(getpeername(sub, (struct sockaddr *)&sa, &sa_size) == 0) {
+            if(getpeername(sub->fd, (struct sockaddr *)&sa, &sa_size) == 0) {
                 getnameinfo(
                     (struct sockaddr *)&sa, sa_size,
                     host, sizeof(host),
@@ -964,16 +1714,23 @@ static void jsonrpc_help_events (char *id, struct n3n_runtime_data *eee, conn_t
                     NI_NUMERICHOST|NI_NUMERICSERV
                 );
             }
+
+            sb_reprintf(
+                &conn->request,
+                "{"
+                "\"sockaddr\":\"%s:%s\","
+                "\"queued\":%u,"
+                "\"dropped\":%u},",
+                host, serv,
+                (uint32_t)sb_len(sub->queue),
+                sub->dropped
+            );
         }
+        jsonrpc_listend_hack(conn, "],");
 
         sb_reprintf(
             &conn->request,
-            "{"
-            "\"topic\":\"%s\","
-            "\"sockaddr\":\"%s:%s\","
             "\"desc\":\"%s\"},",
-            mgmt_events[topic].topic,
-            host, serv,
             mgmt_events[topic].desc
         );
     }
@@ -995,6 +1752,7 @@ static const struct mgmt_jsonrpc_method jsonrpc_methods[] = {
     { "get_edges", jsonrpc_get_edges, "List current edges/peers" },
     { "get_info", jsonrpc_get_info, "Provide basic edge information" },
     { "get_mac", jsonrpc_get_mac, "Show known mac addresses" },
+    { "get_mcast_groups", jsonrpc_get_mcast_groups, "Show multicast groups joined" },
     { "get_packetstats", jsonrpc_get_packetstats, "traffic counters" },
     { "get_supernodes", jsonrpc_get_supernodes, "List current supernodes" },
     { "get_timestamps", jsonrpc_get_timestamps, "Event timestamps" },
@@ -1003,6 +1761,7 @@ static const struct mgmt_jsonrpc_method jsonrpc_methods[] = {
     { "help.events", jsonrpc_help_events, "Show available event topics" },
     { "post.test", jsonrpc_post_test, "Send a test event" },
     { "reload_communities", jsonrpc_reload_communities, "Reloads communities and user's public keys" },
+    { "save_state", jsonrpc_save_state, "Save the supernode registration state" },
     { "set_verbose", jsonrpc_set_verbose, "Set logging verbosity" },
     { "stop", jsonrpc_stop, "Stop the daemon" },
     // get_last_event?
@@ -1029,40 +1788,31 @@ static void jsonrpc_help (char *id, struct n3n_runtime_data *eee, conn_t *conn,
     jsonrpc_result_tail(conn, 200);
 }
 
-static void handle_jsonrpc (struct n3n_runtime_data *eee, conn_t *conn) {
-    char *body = strstr(conn->request->str, "\r\n\r\n");
-    if(!body) {
-        render_error(conn, "Error: no body");
-        return;
-    }
-    body += 4;
-
-    jsonrpc_t json;
-
-    if(jsonrpc_parse(body, &json) != 0) {
-        render_error(conn, "Error: parsing json");
-        return;
-    }
-
+static void jsonrpc_dispatch (struct n3n_runtime_data *eee, conn_t *conn, jsonrpc_t *json) {
     traceEvent(
         TRACE_DEBUG,
         "jsonrpc id=%s, method=%s, params=%s",
-        json.id,
-        json.method,
-        json.params
+        json->id,
+        json->method,
+        json->params
     );
 
     // Since we are going to reuse the request buffer for the reply, copy
     // the id string out of it as every single reply will need it
-    char idbuf[10];
-    strncpy(idbuf, json.id, sizeof(idbuf)-1);
+    char idbuf[JSONRPC_ID_SIZE];
+    if(strlen(json->id) >= sizeof(idbuf)) {
+        jsonrpc_error("", conn, 400, "id too long", 0);
+        jsonrpc_result_tail(conn, 400);
+        return;
+    }
+    strcpy(idbuf, json->id);
 
     int i;
     int nr_handlers = sizeof(jsonrpc_methods) / sizeof(jsonrpc_methods[0]);
     for( i=0; i < nr_handlers; i++ ) {
         if(!strcmp(
                jsonrpc_methods[i].method,
-               json.method
+               json->method
            )) {
             break;
         }
@@ -1071,11 +1821,151 @@ static void handle_jsonrpc (struct n3n_runtime_data *eee, conn_t *conn) {
         render_error(conn, "Unknown method");
         return;
     } else {
-        jsonrpc_methods[i].func(idbuf, eee, conn, json.params);
+        jsonrpc_methods[i].func(idbuf, eee, conn, json->params);
     }
     return;
 }
 
+// Add the reply generated for one member of a batch to the batch reply.
+// Plain text error pages are converted into error objects
+static void jsonrpc_batch_gather (strbuf_t **out, conn_t *conn, const char *id) {
+    if(conn->reply && sb_len(conn->reply) && conn->reply->str[0] == '{') {
+        sb_reappend(out, conn->reply->str, sb_len(conn->reply));
+        sb_reprintf(out, ",");
+        return;
+    }
+
+    int code = 500;
+    char message[40] = "no reply";
+    if(sb_len(conn->reply_header) > 9) {
+        // Skip the "HTTP/1.1 " protocol version
+        code = atoi(&conn->reply_header->str[9]);
+    }
+    if(conn->reply && sb_len(conn->reply)) {
+        snprintf(message, sizeof(message), "%s", conn->reply->str);
+        message[strcspn(message, "\n")] = 0;
+    }
+
+    sb_reprintf(
+        out,
+        "{"
+        "\"jsonrpc\":\"2.0\","
+        "\"id\":\"%s\","
+        "\"error\":{"
+        "\"code\":%i,"
+        "\"message\":\"%s\""
+        "}},",
+        id,
+        code,
+        message
+    );
+}
+
+static void handle_jsonrpc_batch (struct n3n_runtime_data *eee, conn_t *conn, char *body) {
+    // Each method handler reuses the request buffer for its reply, so work
+    // from a copy of the request and gather the replies separately
+    unsigned int header_len = body - conn->request->str;
+    char *copy = strdup(conn->request->str);
+    strbuf_t *out = sb_malloc(sb_len(conn->request), conn->request->capacity_max);
+
+    if(!copy || !out) {
+        free(copy);
+        free(out);
+        render_error(conn, "no memory");
+        return;
+    }
+
+    // Known to start with the '[', jsonrpc_parse() has checked
+    char *pos = strchr(&copy[header_len], '[') + 1;
+    char *item;
+    int count = 0;
+
+    sb_printf(out, "[");
+    jsonrpc_in_batch = true;
+
+    while((item = jsonrpc_batch_next(&pos))) {
+        jsonrpc_t json;
+        char idbuf[JSONRPC_ID_SIZE] = "";
+
+        // Let the handler see the original headers, eg for authorisation
+        sb_zero(conn->request);
+        sb_reappend(&conn->request, copy, header_len);
+        conn->request->str[header_len] = 0;
+        sb_zero(conn->reply_header);
+        conn->reply = NULL;
+
+        if(*item != '{') {
+            // Not a request at all, but the rest of the batch still is
+            jsonrpc_error("", conn, 400, "Invalid Request", 0);
+            jsonrpc_result_tail(conn, 400);
+        } else if(jsonrpc_parse(item, &json) != 0) {
+            render_error(conn, "Error: parsing json");
+        } else {
+            // An id too long is refused by the dispatch, without an id
+            if(strlen(json.id) < sizeof(idbuf)) {
+                strcpy(idbuf, json.id);
+            }
+            jsonrpc_dispatch(eee, conn, &json);
+        }
+
+        jsonrpc_batch_gather(&out, conn, idbuf);
+        count++;
+    }
+
+    jsonrpc_in_batch = false;
+    sb_zero(conn->reply_header);
+
+    if(!count) {
+        jsonrpc_error("", conn, 400, "empty batch", 0);
+        jsonrpc_result_tail(conn, 400);
+    } else if(sb_overflowed(out)) {
+        jsonrpc_error("", conn, 507, "overflow", count);
+        jsonrpc_result_tail(conn, 507);
+    } else {
+        // HACK: back up over the final ','
+        out->wr_pos--;
+        sb_reprintf(&out, "]");
+
+        sb_zero(conn->request);
+        sb_reappend(&conn->request, out->str, sb_len(out));
+
+        // Update the reply buffer after last potential realloc
+        conn->reply = conn->request;
+        if(sb_overflowed(conn->request)) {
+            jsonrpc_error("", conn, 507, "overflow", count);
+            jsonrpc_result_tail(conn, 507);
+        } else {
+            generate_http_headers(conn, "application/json", 200);
+        }
+    }
+
+    free(out);
+    free(copy);
+}
+
+static void handle_jsonrpc (struct n3n_runtime_data *eee, conn_t *conn) {
+    char *body = strstr(conn->request->str, "\r\n\r\n");
+    if(!body) {
+        render_error(conn, "Error: no body");
+        return;
+    }
+    body += 4;
+
+    jsonrpc_t json;
+
+    switch(jsonrpc_parse(body, &json)) {
+        case 0:
+            jsonrpc_dispatch(eee, conn, &json);
+            return;
+        case JSONRPC_BATCH:
+            handle_jsonrpc_batch(eee, conn, body);
+            return;
+        default:
+            render_error(conn, "Error: parsing json");
+            return;
+    }
+}
+
 static void render_todo_page (struct n3n_runtime_data *eee, conn_t *conn) {
     sb_zero(conn->request);
     sb_printf(conn->request, "TODO\n");
@@ -1176,6 +2066,10 @@ static void render_help_page (struct n3n_runtime_data *eee, conn_t *conn) {
     generate_http_headers(conn, "text/plain", 200);
 }
 
+void n3n_initfuncs_management () {
+    n3n_metrics_register(&metrics_module);
+}
+
 void mgmt_api_handler (struct n3n_runtime_data *eee, conn_t *conn) {
     int i;
     int nr_handlers = sizeof(api_endpoints) / sizeof(api_endpoints[0]);
@@ -1198,6 +2092,15 @@ void mgmt_api_handler (struct n3n_runtime_data *eee, conn_t *conn) {
         api_endpoints[i].func(eee, conn);
     }
 
+    // The request has been consumed, so dont handle it again
+    if(conn->state == CONN_READY) {
+        conn->state = CONN_EMPTY;
+    }
+
     // Try to immediately start sending the reply
     conn_write(conn, conn->fd);
+
+    // If that was the whole of a streamed reply so far, queue up the next
+    // piece so that the loop sees this conn as writable
+    mgmt_api_more(eee, conn);
 }
@@ -30,5 +30,12 @@ struct n3n_runtime_data;
 #endif
 
 void mgmt_event_post (const enum n3n_event_topic topic, const int data0, const void *data1);
+
+// Tell the event subscribers that this connection has been closed
+void mgmt_event_closed (conn_t *);
 void mgmt_api_handler (struct n3n_runtime_data *, conn_t *);
+
+// Called when the conn has finished sending its reply, to allow replies that
+// are too large to buffer to be generated in pieces
+void mgmt_api_more (struct n3n_runtime_data *, conn_t *);
 #endif
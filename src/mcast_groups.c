@@ -0,0 +1,679 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Multicast group membership, IGMP and MLD snooping
+ *
+ * The supernode would otherwise send every multicast frame to every edge of
+ * the community.  Edges with snooping enabled watch the IGMP and MLD reports
+ * of their local hosts and tell the supernode the groups joined.  The
+ * supernode then sends a group's frames only to its members and to the
+ * edges not reporting at all.  Groups nobody joined, the link-local control
+ * groups and broadcasts still go to everyone.
+ *
+ * Groups are tracked by their ethernet address, as that is all the supernode
+ * sees of an encrypted PACKET.
+ */
+
+#include <stdlib.h>             // for calloc, free
+#include <string.h>             // for memcpy, memset, memcmp
+
+#include "mcast_groups.h"
+#include "n2n_define.h"         // for ETH_FRAMESIZE, MCAST_QUERY_INTERVAL, MCAST_QUERY_RESPONSE
+
+#define ETHERTYPE_IP4       0x0800
+#define ETHERTYPE_IP6       0x86dd
+
+#define IGMP_QUERY          0x11
+#define IGMP_V1_REPORT      0x12
+#define IGMP_V2_REPORT      0x16
+#define IGMP_V2_LEAVE       0x17
+#define IGMP_V3_REPORT      0x22
+
+#define MLD_QUERY           130
+#define MLD_V1_REPORT       131
+#define MLD_V1_DONE         132
+#define MLD_V2_REPORT       143
+
+/* IGMPv3 and MLDv2 group record types */
+#define MODE_IS_INCLUDE     1
+#define MODE_IS_EXCLUDE     2
+#define CHANGE_TO_INCLUDE   3
+#define CHANGE_TO_EXCLUDE   4
+#define ALLOW_NEW_SOURCES   5
+#define BLOCK_OLD_SOURCES   6
+
+
+/** Can membership of this group be tracked.
+ *
+ *    The groups in 224.0.0.0/24 and their aliases, and the IPv6 all nodes and
+ *    all routers groups are used by every host without a report, so are
+ *    always sent to all edges.
+ */
+bool mcast_group_snoopable (const n2n_mac_t mac) {
+
+    if((mac[0] == 0x01) && (mac[1] == 0x00) && (mac[2] == 0x5e)) {
+        return ((mac[3] & 0x7f) != 0) || (mac[4] != 0);
+    }
+
+    if((mac[0] == 0x33) && (mac[1] == 0x33)) {
+        return (mac[2] != 0) || (mac[3] != 0) || (mac[4] != 0);
+    }
+
+    return false;
+}
+
+
+struct mcast_group *mcast_group_find (struct mcast_group *groups, const n2n_mac_t mac) {
+
+    struct mcast_group *group;
+
+    HASH_FIND(hh, groups, mac, sizeof(n2n_mac_t), group);
+
+    return group;
+}
+
+
+bool mcast_group_has_member (struct mcast_group *group, const n2n_mac_t edge) {
+
+    struct mcast_member *member;
+
+    HASH_FIND(hh, group->members, edge, sizeof(n2n_mac_t), member);
+
+    return member != NULL;
+}
+
+
+size_t mcast_group_members (struct mcast_group *group) {
+
+    return HASH_COUNT(group->members);
+}
+
+
+static struct mcast_group *mcast_group_add (struct mcast_group **groups, const n2n_mac_t mac) {
+
+    struct mcast_group *group;
+
+    HASH_FIND(hh, *groups, mac, sizeof(n2n_mac_t), group);
+    if(!group) {
+        group = calloc(1, sizeof(*group));
+        if(!group) {
+            return NULL;
+        }
+        memcpy(group->mac, mac, sizeof(n2n_mac_t));
+        HASH_ADD(hh, *groups, mac, sizeof(group->mac), group);
+    }
+
+    return group;
+}
+
+
+static void mcast_group_del (struct mcast_group **groups, struct mcast_group *group) {
+
+    struct mcast_member *member, *tmp;
+
+    HASH_ITER(hh, group->members, member, tmp) {
+        HASH_DEL(group->members, member);
+        free(member);
+    }
+    HASH_DEL(*groups, group);
+    free(group);
+}
+
+
+/* ************************************** */
+
+static void mcast_ip4_mac (n2n_mac_t mac, const uint8_t *addr) {
+
+    mac[0] = 0x01; mac[1] = 0x00; mac[2] = 0x5e;
+    mac[3] = addr[1] & 0x7f;
+    mac[4] = addr[2];
+    mac[5] = addr[3];
+}
+
+
+static void mcast_ip6_mac (n2n_mac_t mac, const uint8_t *addr) {
+
+    mac[0] = 0x33; mac[1] = 0x33;
+    memcpy(&mac[2], &addr[12], 4);
+}
+
+
+/** Find the IGMP or MLD message in an ethernet frame.
+ *
+ *    Returns a pointer to it and sets family and the message size, or NULL
+ *    if frame is something else.  The hop-by-hop options header MLD messages
+ *    carry the router alert in is skipped.
+ */
+static const uint8_t *mcast_message (const uint8_t *frame, size_t len, int *family, size_t *size) {
+
+    uint16_t type;
+
+    if(len < ETH_FRAMESIZE) {
+        return NULL;
+    }
+    type = (frame[12] << 8) | frame[13];
+
+    if(type == ETHERTYPE_IP4) {
+        const uint8_t *ip = frame + ETH_FRAMESIZE;
+        size_t ihl, total;
+
+        if(len < ETH_FRAMESIZE + IP4_MIN_SIZE) {
+            return NULL;
+        }
+        ihl = (ip[0] & 0x0f) * 4;
+        total = (ip[2] << 8) | ip[3];
+        if((ip[9] != 2) || (ihl < IP4_MIN_SIZE) || (total > len - ETH_FRAMESIZE) || (total < ihl + 8)) {
+            return NULL;
+        }
+
+        *family = 4;
+        *size = total - ihl;
+        return ip + ihl;
+    }
+
+    if(type == ETHERTYPE_IP6) {
+        const uint8_t *ip6 = frame + ETH_FRAMESIZE;
+        const uint8_t *end;
+        const uint8_t *p;
+        uint8_t next;
+
+        if(len < ETH_FRAMESIZE + 40) {
+            return NULL;
+        }
+        end = ip6 + 40 + ((ip6[4] << 8) | ip6[5]);
+        if(end > frame + len) {
+            return NULL;
+        }
+        next = ip6[6];
+        p = ip6 + 40;
+
+        if(next == 0) {
+            if(p + 8 > end) {
+                return NULL;
+            }
+            next = p[0];
+            p += (p[1] + 1) * 8;
+        }
+        if((next != 58) || (p + 8 > end)) {
+            return NULL;
+        }
+
+        *family = 6;
+        *size = end - p;
+        return p;
+    }
+
+    return NULL;
+}
+
+
+static int mcast_join (struct mcast_group **groups, const n2n_mac_t mac, time_t now) {
+
+    struct mcast_group *group;
+    int ret = 0;
+
+    if(!mcast_group_snoopable(mac)) {
+        return 0;
+    }
+
+    HASH_FIND(hh, *groups, mac, sizeof(n2n_mac_t), group);
+    if(!group) {
+        group = mcast_group_add(groups, mac);
+        if(!group) {
+            return 0;
+        }
+        ret = MCAST_SNOOP_JOINED;
+    }
+    group->last_seen = now;
+
+    return ret;
+}
+
+
+static int mcast_leave (struct mcast_group **groups, const n2n_mac_t mac, time_t leave_expiry) {
+
+    struct mcast_group *group;
+
+    HASH_FIND(hh, *groups, mac, sizeof(n2n_mac_t), group);
+    if(!group) {
+        return 0;
+    }
+
+    // other local hosts may still be members, they get a query to answer
+    if(group->last_seen > leave_expiry) {
+        group->last_seen = leave_expiry;
+    }
+
+    return MCAST_SNOOP_LEFT;
+}
+
+
+/** Update the groups joined by the local hosts from their IGMP or MLD report.
+ *
+ *    A leave does not remove the group at once, it only makes it expire at
+ *    leave_expiry unless reported again.  Returns MCAST_SNOOP_JOINED if a new
+ *    group was joined and MCAST_SNOOP_LEFT if one was left, or zero.
+ */
+int mcast_snoop_frame (struct mcast_group **groups,
+                       const uint8_t *frame,
+                       size_t len,
+                       time_t now,
+                       time_t leave_expiry) {
+
+    const uint8_t *msg, *rec, *end;
+    size_t size, rec_size;
+    uint16_t num, nsrc;
+    n2n_mac_t mac;
+    int family;
+    int ret = 0;
+
+    msg = mcast_message(frame, len, &family, &size);
+    if(!msg) {
+        return 0;
+    }
+    end = msg + size;
+
+    if(family == 4) {
+        switch(msg[0]) {
+            case IGMP_V1_REPORT:
+            case IGMP_V2_REPORT:
+                mcast_ip4_mac(mac, &msg[4]);
+                return mcast_join(groups, mac, now);
+
+            case IGMP_V2_LEAVE:
+                mcast_ip4_mac(mac, &msg[4]);
+                return mcast_leave(groups, mac, leave_expiry);
+
+            case IGMP_V3_REPORT:
+                break;
+
+            default:
+                return 0;
+        }
+    } else {
+        switch(msg[0]) {
+            case MLD_V1_REPORT:
+                if(size < 24) {
+                    return 0;
+                }
+                mcast_ip6_mac(mac, &msg[8]);
+                return mcast_join(groups, mac, now);
+
+            case MLD_V1_DONE:
+                if(size < 24) {
+                    return 0;
+                }
+                mcast_ip6_mac(mac, &msg[8]);
+                return mcast_leave(groups, mac, leave_expiry);
+
+            case MLD_V2_REPORT:
+                break;
+
+            default:
+                return 0;
+        }
+    }
+
+    // IGMPv3 or MLDv2 report, a list of group records
+    num = (msg[6] << 8) | msg[7];
+    rec = msg + 8;
+    while(num--) {
+        if(rec + 4 > end) {
+            break;
+        }
+        nsrc = (rec[2] << 8) | rec[3];
+        if(family == 4) {
+            rec_size = 8 + 4 * nsrc + 4 * rec[1];
+        } else {
+            rec_size = 20 + 16 * nsrc + 4 * rec[1];
+        }
+        if(rec + rec_size > end) {
+            break;
+        }
+
+        if(family == 4) {
+            mcast_ip4_mac(mac, &rec[4]);
+        } else {
+            mcast_ip6_mac(mac, &rec[4]);
+        }
+
+        switch(rec[0]) {
+            case MODE_IS_INCLUDE:
+            case CHANGE_TO_INCLUDE:
+                // including no source at all is how a v3 host leaves
+                if(nsrc == 0) {
+                    ret |= mcast_leave(groups, mac, leave_expiry);
+                    break;
+                }
+            /* fall through */
+            case MODE_IS_EXCLUDE:
+            case CHANGE_TO_EXCLUDE:
+            case ALLOW_NEW_SOURCES:
+                ret |= mcast_join(groups, mac, now);
+                break;
+        }
+
+        rec += rec_size;
+    }
+
+    return ret;
+}
+
+
+/** Is frame a membership report other members would hold back their own for.
+ *
+ *    IGMPv1, IGMPv2 and MLDv1 hosts do not report a group they heard another
+ *    host report, and the edge would then never learn of them.
+ */
+bool mcast_is_suppressible_report (const uint8_t *frame, size_t len) {
+
+    const uint8_t *msg;
+    size_t size;
+    int family;
+
+    msg = mcast_message(frame, len, &family, &size);
+    if(!msg) {
+        return false;
+    }
+
+    if(family == 4) {
+        return (msg[0] == IGMP_V1_REPORT) || (msg[0] == IGMP_V2_REPORT);
+    }
+
+    return msg[0] == MLD_V1_REPORT;
+}
+
+
+/** Is frame an IGMPv3 or MLDv2 report of the groups a host is in.
+ *
+ *    Hosts only report their current state, as opposed to a change, when
+ *    asked by a query.  These reports go to 224.0.0.22 or ff02::16, which
+ *    cannot be snooped, so would otherwise reach every edge.
+ */
+bool mcast_is_query_answer (const uint8_t *frame, size_t len) {
+
+    const uint8_t *msg, *rec, *end;
+    size_t size, rec_size;
+    uint16_t num, nsrc;
+    int family;
+
+    msg = mcast_message(frame, len, &family, &size);
+    if(!msg || (size < 8)) {
+        return false;
+    }
+    if(msg[0] != ((family == 4) ? IGMP_V3_REPORT : MLD_V2_REPORT)) {
+        return false;
+    }
+    end = msg + size;
+
+    num = (msg[6] << 8) | msg[7];
+    rec = msg + 8;
+    while(num--) {
+        if(rec + 4 > end) {
+            return false;
+        }
+        if((rec[0] != MODE_IS_INCLUDE) && (rec[0] != MODE_IS_EXCLUDE)) {
+            return false;
+        }
+        nsrc = (rec[2] << 8) | rec[3];
+        if(family == 4) {
+            rec_size = 8 + 4 * nsrc + 4 * rec[1];
+        } else {
+            rec_size = 20 + 16 * nsrc + 4 * rec[1];
+        }
+        if(rec + rec_size > end) {
+            return false;
+        }
+        rec += rec_size;
+    }
+
+    return true;
+}
+
+
+/** Copy the group addresses to list, returns their number.
+ *
+ *    If there are more than max, none are copied and overflow is set, as a
+ *    partial list would lose the frames of the groups left out.
+ */
+uint8_t mcast_groups_list (struct mcast_group *groups, n2n_mac_t *list, uint8_t max, bool *overflow) {
+
+    struct mcast_group *group, *tmp;
+    uint8_t num = 0;
+
+    *overflow = (HASH_COUNT(groups) > max);
+    if(*overflow) {
+        return 0;
+    }
+
+    HASH_ITER(hh, groups, group, tmp) {
+        if(num >= max) {
+            break;
+        }
+        memcpy(list[num++], group->mac, sizeof(n2n_mac_t));
+    }
+
+    return num;
+}
+
+
+/* ************************************** */
+
+static uint16_t inet_checksum (const uint8_t *buf, size_t len, uint32_t sum) {
+
+    size_t i;
+
+    for(i = 0; i + 1 < len; i += 2) {
+        sum += (buf[i] << 8) | buf[i + 1];
+    }
+    if(len & 1) {
+        sum += buf[len - 1] << 8;
+    }
+
+    while(sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return ~sum & 0xffff;
+}
+
+
+/** Build an IGMPv3 general query, asking the local hosts for their groups.
+ *
+ *    ip_addr is in network byte order and may be zero if the edge has no
+ *    address yet.  Returns the size of the frame.
+ */
+size_t mcast_igmp_query (uint8_t *buf, size_t size, const n2n_mac_t mac, uint32_t ip_addr) {
+
+    uint8_t *ip = buf + ETH_FRAMESIZE;
+    uint8_t *igmp = ip + 24;
+    uint16_t sum;
+
+    if(size < ETH_FRAMESIZE + 24 + 12) {
+        return 0;
+    }
+    memset(buf, 0, ETH_FRAMESIZE + 24 + 12);
+
+    buf[0] = 0x01; buf[1] = 0x00; buf[2] = 0x5e;        /* 224.0.0.1 */
+    buf[5] = 0x01;
+    memcpy(&buf[6], mac, 6);
+    buf[12] = 0x08; buf[13] = 0x00;
+
+    ip[0] = 0x46;                                       /* with the router alert option */
+    ip[1] = 0xc0;                                       /* internetwork control */
+    ip[3] = 24 + 12;
+    ip[8] = 1;                                          /* TTL */
+    ip[9] = 2;                                          /* IGMP */
+    memcpy(&ip[12], &ip_addr, 4);
+    ip[16] = 224; ip[19] = 1;
+    ip[20] = 0x94; ip[21] = 0x04;                       /* router alert */
+    sum = inet_checksum(ip, 24, 0);
+    ip[10] = sum >> 8; ip[11] = sum & 0xff;
+
+    igmp[0] = IGMP_QUERY;
+    igmp[1] = MCAST_QUERY_RESPONSE * 10;                /* in 1/10 sec */
+    igmp[8] = 2;                                        /* robustness */
+    igmp[9] = MCAST_QUERY_INTERVAL;
+    sum = inet_checksum(igmp, 12, 0);
+    igmp[2] = sum >> 8; igmp[3] = sum & 0xff;
+
+    return ETH_FRAMESIZE + 24 + 12;
+}
+
+
+/** Build an MLDv2 general query, asking the local hosts for their groups.
+ *
+ *    It comes from the link-local address derived from mac.  Returns the
+ *    size of the frame.
+ */
+size_t mcast_mld_query (uint8_t *buf, size_t size, const n2n_mac_t mac) {
+
+    uint8_t *ip6 = buf + ETH_FRAMESIZE;
+    uint8_t *hbh = ip6 + 40;
+    uint8_t *mld = hbh + 8;
+    uint32_t sum = 0;
+    uint16_t csum;
+    size_t i;
+
+    if(size < MCAST_QUERY_SIZE) {
+        return 0;
+    }
+    memset(buf, 0, MCAST_QUERY_SIZE);
+
+    buf[0] = 0x33; buf[1] = 0x33; buf[5] = 0x01;        /* ff02::1 */
+    memcpy(&buf[6], mac, 6);
+    buf[12] = 0x86; buf[13] = 0xdd;
+
+    ip6[0] = 0x60;
+    ip6[5] = 8 + 28;                                    /* payload length */
+    ip6[6] = 0;                                         /* hop-by-hop options */
+    ip6[7] = 1;                                         /* hop limit */
+    ip6[8] = 0xfe; ip6[9] = 0x80;                       /* fe80::EUI-64 */
+    ip6[16] = mac[0] ^ 0x02;
+    ip6[17] = mac[1];
+    ip6[18] = mac[2];
+    ip6[19] = 0xff; ip6[20] = 0xfe;
+    ip6[21] = mac[3];
+    ip6[22] = mac[4];
+    ip6[23] = mac[5];
+    ip6[24] = 0xff; ip6[25] = 0x02; ip6[39] = 0x01;     /* ff02::1 */
+
+    hbh[0] = 58;                                        /* ICMPv6 */
+    hbh[2] = 0x05; hbh[3] = 0x02;                       /* router alert, MLD */
+    hbh[6] = 0x01;                                      /* PadN */
+
+    mld[0] = MLD_QUERY;
+    mld[4] = (MCAST_QUERY_RESPONSE * 1000) >> 8;        /* in msec */
+    mld[5] = (MCAST_QUERY_RESPONSE * 1000) & 0xff;
+    mld[24] = 2;                                        /* robustness */
+    mld[25] = MCAST_QUERY_INTERVAL;
+
+    // pseudo header: addresses, upper layer length and next header
+    for(i = 8; i < 40; i += 2) {
+        sum += (ip6[i] << 8) | ip6[i + 1];
+    }
+    sum += 28 + 58;
+    csum = inet_checksum(mld, 28, sum);
+    mld[2] = csum >> 8; mld[3] = csum & 0xff;
+
+    return MCAST_QUERY_SIZE;
+}
+
+
+/* ************************************** */
+
+/** Record the complete list of groups an edge reported.
+ *
+ *    The edge is removed from the groups it no longer lists, and groups left
+ *    without members are forgotten so their frames go to everyone again.
+ */
+void mcast_groups_report (struct mcast_group **groups,
+                          const n2n_mac_t edge,
+                          const n2n_mac_t *list,
+                          uint8_t num,
+                          time_t now) {
+
+    struct mcast_group *group, *tmp;
+    struct mcast_member *member;
+    uint8_t i;
+
+    HASH_ITER(hh, *groups, group, tmp) {
+        HASH_FIND(hh, group->members, edge, sizeof(n2n_mac_t), member);
+        if(!member) {
+            continue;
+        }
+        for(i = 0; i < num; i++) {
+            if(!memcmp(list[i], group->mac, sizeof(n2n_mac_t))) {
+                break;
+            }
+        }
+        if(i < num) {
+            continue;
+        }
+        HASH_DEL(group->members, member);
+        free(member);
+        if(!group->members) {
+            mcast_group_del(groups, group);
+        }
+    }
+
+    for(i = 0; i < num; i++) {
+        if(!mcast_group_snoopable(list[i])) {
+            continue;
+        }
+        group = mcast_group_add(groups, list[i]);
+        if(!group) {
+            continue;
+        }
+        group->last_seen = now;
+
+        HASH_FIND(hh, group->members, edge, sizeof(n2n_mac_t), member);
+        if(!member) {
+            member = calloc(1, sizeof(*member));
+            if(!member) {
+                continue;
+            }
+            memcpy(member->mac, edge, sizeof(n2n_mac_t));
+            HASH_ADD(hh, group->members, mac, sizeof(member->mac), member);
+        }
+        member->last_seen = now;
+    }
+}
+
+
+/** Forget members and groups not reported since purge_before.
+ *
+ *    Returns the number of groups removed.
+ */
+size_t mcast_groups_purge (struct mcast_group **groups, time_t purge_before) {
+
+    struct mcast_group *group, *tmp;
+    struct mcast_member *member, *tmp_member;
+    size_t purged = 0;
+
+    HASH_ITER(hh, *groups, group, tmp) {
+        HASH_ITER(hh, group->members, member, tmp_member) {
+            if(member->last_seen < purge_before) {
+                HASH_DEL(group->members, member);
+                free(member);
+            }
+        }
+        if(!group->members && (group->last_seen < purge_before)) {
+            mcast_group_del(groups, group);
+            purged++;
+        }
+    }
+
+    return purged;
+}
+
+
+void mcast_groups_clear (struct mcast_group **groups) {
+
+    struct mcast_group *group, *tmp;
+
+    HASH_ITER(hh, *groups, group, tmp) {
+        mcast_group_del(groups, group);
+    }
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Multicast group membership, IGMP and MLD snooping, non-public API
+ */
+
+#ifndef _MCAST_GROUPS_H_
+#define _MCAST_GROUPS_H_
+
+#include <n3n/ethernet.h>   // for n2n_mac_t
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <uthash.h>         // for UT_hash_handle
+
+#define MCAST_QUERY_SIZE    90  /* the larger of an IGMPv3 and an MLDv2 query frame */
+
+#define MCAST_SNOOP_JOINED  1   /* returned by mcast_snoop_frame() */
+#define MCAST_SNOOP_LEFT    2
+
+struct mcast_member {
+    n2n_mac_t mac;          // the edge that reported the group
+    time_t last_seen;
+
+    UT_hash_handle hh;      /* makes this structure hashable */
+};
+
+struct mcast_group {
+    n2n_mac_t mac;          // the ethernet multicast address of the group
+    time_t last_seen;       // last report naming the group
+    struct mcast_member *members;   // supernode only, edges subscribed
+    uint32_t tx;            // supernode only, copies sent to members
+    uint32_t pruned;        // supernode only, copies not sent to other edges
+
+    UT_hash_handle hh;      /* makes this structure hashable */
+};
+
+bool mcast_group_snoopable (const n2n_mac_t mac);
+
+struct mcast_group *mcast_group_find (struct mcast_group *groups, const n2n_mac_t mac);
+
+bool mcast_group_has_member (struct mcast_group *group, const n2n_mac_t edge);
+
+size_t mcast_group_members (struct mcast_group *group);
+
+/* edge side */
+int mcast_snoop_frame (struct mcast_group **groups,
+                       const uint8_t *frame,
+                       size_t len,
+                       time_t now,
+                       time_t leave_expiry);
+
+bool mcast_is_suppressible_report (const uint8_t *frame, size_t len);
+
+bool mcast_is_query_answer (const uint8_t *frame, size_t len);
+
+uint8_t mcast_groups_list (struct mcast_group *groups, n2n_mac_t *list, uint8_t max, bool *overflow);
+
+size_t mcast_igmp_query (uint8_t *buf, size_t size, const n2n_mac_t mac, uint32_t ip_addr);
+
+size_t mcast_mld_query (uint8_t *buf, size_t size, const n2n_mac_t mac);
+
+/* supernode side */
+void mcast_groups_report (struct mcast_group **groups,
+                          const n2n_mac_t edge,
+                          const n2n_mac_t *list,
+                          uint8_t num,
+                          time_t now);
+
+size_t mcast_groups_purge (struct mcast_group **groups, time_t purge_before);
+
+void mcast_groups_clear (struct mcast_group **groups);
+
+#endif
@@ -0,0 +1,364 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * ARP and IPv6 neighbour discovery proxy cache
+ *
+ * Every ARP request and neighbour solicitation from the local host is a
+ * broadcast, which the supernode sends on to every edge of the community.
+ * The edge instead keeps the IP to MAC bindings it sees in the frames coming
+ * from the other edges, and answers the requests for known addresses itself.
+ * Only the requests it cannot answer still go out.
+ */
+
+#include <stdlib.h>             // for calloc, free
+#include <string.h>             // for memcpy, memset, memcmp
+
+#include "n2n_define.h"         // for ETH_FRAMESIZE, IP4_SRCOFFSET
+#include "neigh_cache.h"
+
+#ifdef _WIN32
+#include "win32/defs.h"
+#else
+#include <sys/socket.h>         // for AF_INET, AF_INET6
+#endif
+
+#define ETHERTYPE_IP4       0x0800
+#define ETHERTYPE_ARP       0x0806
+#define ETHERTYPE_IP6       0x86dd
+
+#define ARP_SIZE            28  /* for IPv4 over ethernet */
+#define IP6_HDR_SIZE        40
+#define IP6_SRCOFFSET       8
+#define IP6_DSTOFFSET       24
+#define ICMP6_NS            135
+#define ICMP6_NA            136
+#define ICMP6_NS_SIZE       24  /* without options */
+#define ICMP6_NA_SIZE       32  /* with the target link-layer address option */
+
+static const uint8_t ip6_unspecified[IPV6_SIZE];
+
+
+static void neigh_key_set (struct neigh_key *key, uint8_t family, const uint8_t *addr) {
+
+    memset(key, 0, sizeof(*key));
+    key->family = family;
+    memcpy(key->addr, addr, (family == AF_INET) ? IPV4_SIZE : IPV6_SIZE);
+}
+
+
+void neigh_cache_learn (struct neigh_entry **cache,
+                        uint8_t family,
+                        const uint8_t *addr,
+                        const n2n_mac_t mac,
+                        time_t now) {
+
+    struct neigh_entry *entry;
+    struct neigh_key key;
+
+    // multicast and null MACs do not belong to a host
+    if((mac[0] & 0x01) || is_null_mac(mac)) {
+        return;
+    }
+
+    neigh_key_set(&key, family, addr);
+
+    HASH_FIND(hh, *cache, &key, sizeof(key), entry);
+    if(!entry) {
+        entry = calloc(1, sizeof(*entry));
+        if(!entry) {
+            return;
+        }
+        entry->key = key;
+        HASH_ADD(hh, *cache, key, sizeof(entry->key), entry);
+    }
+
+    memcpy(entry->mac_addr, mac, sizeof(n2n_mac_t));
+    entry->last_seen = now;
+}
+
+
+/* Learn the binding of the sender of an ethernet frame from another edge */
+void neigh_cache_learn_frame (struct neigh_entry **cache,
+                              const uint8_t *frame,
+                              size_t len,
+                              time_t now) {
+
+    const uint8_t *shost = frame + 6;
+    uint16_t type;
+
+    if(len < ETH_FRAMESIZE) {
+        return;
+    }
+    type = (frame[12] << 8) | frame[13];
+
+    switch(type) {
+        case ETHERTYPE_ARP: {
+            const uint8_t *arp = frame + ETH_FRAMESIZE;
+            static const uint8_t zero[IPV4_SIZE];
+
+            // requests, replies and gratuitous ARPs all carry the sender
+            if((len >= ETH_FRAMESIZE + ARP_SIZE) && memcmp(&arp[14], zero, IPV4_SIZE)) {
+                neigh_cache_learn(cache, AF_INET, &arp[14], &arp[8], now);
+            }
+            break;
+        }
+
+        case ETHERTYPE_IP4: {
+            static const uint8_t zero[IPV4_SIZE];
+
+            if((len >= ETH_FRAMESIZE + IP4_MIN_SIZE)
+               && memcmp(&frame[ETH_FRAMESIZE + IP4_SRCOFFSET], zero, IPV4_SIZE)) {
+                neigh_cache_learn(cache, AF_INET, &frame[ETH_FRAMESIZE + IP4_SRCOFFSET], shost, now);
+            }
+            break;
+        }
+
+        case ETHERTYPE_IP6: {
+            if((len >= ETH_FRAMESIZE + IP6_HDR_SIZE)
+               && memcmp(&frame[ETH_FRAMESIZE + IP6_SRCOFFSET], ip6_unspecified, IPV6_SIZE)) {
+                neigh_cache_learn(cache, AF_INET6, &frame[ETH_FRAMESIZE + IP6_SRCOFFSET], shost, now);
+            }
+            break;
+        }
+    }
+}
+
+
+struct neigh_entry *neigh_cache_find (struct neigh_entry *cache,
+                                      uint8_t family,
+                                      const uint8_t *addr) {
+
+    struct neigh_entry *entry;
+    struct neigh_key key;
+
+    neigh_key_set(&key, family, addr);
+    HASH_FIND(hh, cache, &key, sizeof(key), entry);
+
+    return entry;
+}
+
+
+size_t neigh_cache_purge (struct neigh_entry **cache, time_t purge_before) {
+
+    struct neigh_entry *entry, *tmp;
+    size_t purged = 0;
+
+    HASH_ITER(hh, *cache, entry, tmp) {
+        if(entry->last_seen < purge_before) {
+            HASH_DEL(*cache, entry);
+            free(entry);
+            purged++;
+        }
+    }
+
+    return purged;
+}
+
+
+void neigh_cache_clear (struct neigh_entry **cache) {
+
+    struct neigh_entry *entry, *tmp;
+
+    HASH_ITER(hh, *cache, entry, tmp) {
+        HASH_DEL(*cache, entry);
+        free(entry);
+    }
+}
+
+
+/** Build the answer to an ARP request, saying its target is at mac.
+ *
+ *    Returns the size of the reply, zero if request is not an ARP request.
+ */
+size_t neigh_arp_reply (uint8_t *reply,
+                        size_t reply_size,
+                        const uint8_t *request,
+                        size_t len,
+                        const n2n_mac_t mac) {
+
+    const uint8_t *arp = request + ETH_FRAMESIZE;
+
+    if((len < ETH_FRAMESIZE + ARP_SIZE) || (reply_size < ETH_FRAMESIZE + ARP_SIZE)) {
+        return 0;
+    }
+
+    // ethernet, IPv4, a request
+    if((arp[0] != 0x00) || (arp[1] != 0x01) || (arp[2] != 0x08) || (arp[3] != 0x00)
+       || (arp[4] != 6) || (arp[5] != 4) || (arp[6] != 0x00) || (arp[7] != 0x01)) {
+        return 0;
+    }
+
+    memcpy(&reply[0], &arp[8], 6);                      /* dest MAC, the asking host */
+    memcpy(&reply[6], mac, 6);                          /* src MAC */
+    reply[12] = 0x08; reply[13] = 0x06;                 /* ARP */
+    memcpy(&reply[14], arp, 6);                         /* hw and protocol type and size */
+    reply[20] = 0x00; reply[21] = 0x02;                 /* ARP reply */
+    memcpy(&reply[22], mac, 6);                         /* src MAC */
+    memcpy(&reply[28], &arp[24], 4);                    /* src IP, the one asked for */
+    memcpy(&reply[32], &arp[8], 10);                    /* target MAC and IP */
+
+    return ETH_FRAMESIZE + ARP_SIZE;
+}
+
+
+static uint16_t icmp6_checksum (const uint8_t *ip6, const uint8_t *icmp, size_t len) {
+
+    uint32_t sum = 0;
+    size_t i;
+
+    // pseudo header: source, destination, upper layer length and next header
+    for(i = IP6_SRCOFFSET; i < IP6_DSTOFFSET + IPV6_SIZE; i += 2) {
+        sum += (ip6[i] << 8) | ip6[i + 1];
+    }
+    sum += len;
+    sum += 58;
+
+    for(i = 0; i + 1 < len; i += 2) {
+        sum += (icmp[i] << 8) | icmp[i + 1];
+    }
+    if(len & 1) {
+        sum += icmp[len - 1] << 8;
+    }
+
+    while(sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return ~sum & 0xffff;
+}
+
+
+/* Build the neighbour advertisement answering a solicitation */
+static size_t neigh_na_reply (uint8_t *reply,
+                              size_t reply_size,
+                              const uint8_t *request,
+                              const n2n_mac_t mac) {
+
+    const uint8_t *ns_ip6 = request + ETH_FRAMESIZE;
+    const uint8_t *ns = ns_ip6 + IP6_HDR_SIZE;
+    uint8_t *ip6 = reply + ETH_FRAMESIZE;
+    uint8_t *na = ip6 + IP6_HDR_SIZE;
+    uint16_t sum;
+
+    if(reply_size < ETH_FRAMESIZE + IP6_HDR_SIZE + ICMP6_NA_SIZE) {
+        return 0;
+    }
+    memset(reply, 0, ETH_FRAMESIZE + IP6_HDR_SIZE + ICMP6_NA_SIZE);
+
+    memcpy(&reply[0], &request[6], 6);                  /* dest MAC, the asking host */
+    memcpy(&reply[6], mac, 6);                          /* src MAC */
+    reply[12] = 0x86; reply[13] = 0xdd;                 /* IPv6 */
+
+    ip6[0] = 0x60;                                      /* version */
+    ip6[5] = ICMP6_NA_SIZE;                             /* payload length */
+    ip6[6] = 58;                                        /* ICMPv6 */
+    ip6[7] = 255;                                       /* hop limit */
+    memcpy(&ip6[IP6_SRCOFFSET], &ns[8], IPV6_SIZE);     /* src, the target asked for */
+    memcpy(&ip6[IP6_DSTOFFSET], &ns_ip6[IP6_SRCOFFSET], IPV6_SIZE);
+
+    na[0] = ICMP6_NA;
+    na[4] = 0x60;                                       /* solicited, override */
+    memcpy(&na[8], &ns[8], IPV6_SIZE);                  /* target */
+    na[24] = 2;                                         /* target link-layer address */
+    na[25] = 1;                                         /* in units of 8 bytes */
+    memcpy(&na[26], mac, 6);
+
+    sum = icmp6_checksum(ip6, na, ICMP6_NA_SIZE);
+    na[2] = sum >> 8;
+    na[3] = sum & 0xff;
+
+    return ETH_FRAMESIZE + IP6_HDR_SIZE + ICMP6_NA_SIZE;
+}
+
+
+/** Find the address asked for by an ARP request or neighbour solicitation.
+ *
+ *    Probes for duplicate addresses and announcements are not requests, a
+ *    stale entry answering them would make the host give up an address that
+ *    is free.
+ */
+static const uint8_t *neigh_request_target (const uint8_t *frame, size_t len, uint8_t *family) {
+
+    uint16_t type;
+
+    if(len < ETH_FRAMESIZE) {
+        return NULL;
+    }
+    type = (frame[12] << 8) | frame[13];
+
+    if(type == ETHERTYPE_ARP) {
+        const uint8_t *arp = frame + ETH_FRAMESIZE;
+        static const uint8_t zero[IPV4_SIZE];
+
+        if((len < ETH_FRAMESIZE + ARP_SIZE)
+           || (arp[6] != 0x00) || (arp[7] != 0x01)      /* request */
+           || !memcmp(&arp[14], zero, IPV4_SIZE)        /* probe */
+           || !memcmp(&arp[14], &arp[24], IPV4_SIZE)) { /* announcement */
+            return NULL;
+        }
+
+        *family = AF_INET;
+        return &arp[24];
+    }
+
+    if(type == ETHERTYPE_IP6) {
+        const uint8_t *ip6 = frame + ETH_FRAMESIZE;
+        const uint8_t *ns = ip6 + IP6_HDR_SIZE;
+
+        // a solicitation straight after the IPv6 header, not from a probe
+        if((len < ETH_FRAMESIZE + IP6_HDR_SIZE + ICMP6_NS_SIZE)
+           || (ip6[6] != 58) || (ip6[7] != 255)
+           || (ns[0] != ICMP6_NS) || (ns[1] != 0)
+           || !memcmp(&ip6[IP6_SRCOFFSET], ip6_unspecified, IPV6_SIZE)) {
+            return NULL;
+        }
+
+        *family = AF_INET6;
+        return &ns[8];
+    }
+
+    return NULL;
+}
+
+
+/* Is frame an ARP request or neighbour solicitation the cache could answer */
+bool neigh_is_request (const uint8_t *frame, size_t len) {
+
+    uint8_t family;
+
+    return neigh_request_target(frame, len, &family) != NULL;
+}
+
+
+/** Answer an ARP request or neighbour solicitation from the local host.
+ *
+ *    Returns the size of the reply to hand back to the local host, or zero if
+ *    the cache does not know the address asked for.
+ */
+size_t neigh_proxy_answer (struct neigh_entry *cache,
+                           uint8_t *reply,
+                           size_t reply_size,
+                           const uint8_t *frame,
+                           size_t len) {
+
+    struct neigh_entry *entry;
+    const uint8_t *target;
+    uint8_t family;
+
+    target = neigh_request_target(frame, len, &family);
+    if(!target) {
+        return 0;
+    }
+
+    entry = neigh_cache_find(cache, family, target);
+    if(!entry) {
+        return 0;
+    }
+
+    if(family == AF_INET) {
+        return neigh_arp_reply(reply, reply_size, frame, len, entry->mac_addr);
+    }
+
+    return neigh_na_reply(reply, reply_size, frame, entry->mac_addr);
+}
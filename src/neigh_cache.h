@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * ARP and IPv6 neighbour discovery proxy cache, non-public API
+ */
+
+#ifndef _NEIGH_CACHE_H_
+#define _NEIGH_CACHE_H_
+
+#include <n2n_typedefs.h>   // for IPV6_SIZE
+#include <n3n/ethernet.h>   // for n2n_mac_t
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <uthash.h>         // for UT_hash_handle
+
+#define NEIGH_REPLY_SIZE    86  /* the larger of an ARP reply and an IPv6 advertisement */
+
+struct neigh_key {
+    uint8_t family;         // AF_INET or AF_INET6
+    uint8_t addr[IPV6_SIZE];    // network byte order, IPv4 zero padded
+};
+
+struct neigh_entry {
+    struct neigh_key key;
+    n2n_mac_t mac_addr;     // the host's own MAC, as seen in its frames
+    time_t last_seen;
+
+    UT_hash_handle hh;      /* makes this structure hashable */
+};
+
+void neigh_cache_learn (struct neigh_entry **cache,
+                        uint8_t family,
+                        const uint8_t *addr,
+                        const n2n_mac_t mac,
+                        time_t now);
+
+void neigh_cache_learn_frame (struct neigh_entry **cache,
+                              const uint8_t *frame,
+                              size_t len,
+                              time_t now);
+
+struct neigh_entry *neigh_cache_find (struct neigh_entry *cache,
+                                      uint8_t family,
+                                      const uint8_t *addr);
+
+size_t neigh_cache_purge (struct neigh_entry **cache, time_t purge_before);
+
+void neigh_cache_clear (struct neigh_entry **cache);
+
+size_t neigh_arp_reply (uint8_t *reply,
+                        size_t reply_size,
+                        const uint8_t *request,
+                        size_t len,
+                        const n2n_mac_t mac);
+
+bool neigh_is_request (const uint8_t *frame, size_t len);
+
+size_t neigh_proxy_answer (struct neigh_entry *cache,
+                           uint8_t *reply,
+                           size_t reply_size,
+                           const uint8_t *frame,
+                           size_t len);
+
+#endif
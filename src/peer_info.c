@@ -9,9 +9,12 @@
 #include <n2n_define.h> // for TIME_STAMP_FRAME
 #include <n3n/logging.h> // for traceEvent
 #include <n3n/metrics.h> // for traceEvent
+#include <n3n/strings.h> // for sock_to_cstr
 #include <sn_selection.h>   // for sn_selection_criterion_default
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>     // for UINT32_MAX
+#include <stdio.h>      // for fopen, fprintf, fgets, rename
 #include <stdlib.h>
 #include <string.h>
 
@@ -108,6 +111,7 @@ struct peer_info* peer_info_malloc (const n2n_mac_t mac) {
 void peer_info_free (struct peer_info *p) {
     metrics.free++;
     free(p->hostname);
+    free(p->bcast_peers);
     free(p);
 }
 
@@ -396,3 +400,166 @@ int find_peer_time_stamp_and_verify (
     // failure --> 0;    success --> 1
     return time_stamp_verify_and_update(stamp, previous_stamp, allow_jitter);
 }
+
+/* ************************************** */
+
+// The peer cache is a text file with one line for each peer:
+//   <mac> <sock> <preferred_sock or -> <last_p2p> <rtt>
+// Only IPv4 UDP sockets are saved, which is all that edges use for p2p. The
+// rtt, in usec and 0 if never measured, seeds the estimate of a restored
+// peer; files from before it was added lack it
+
+static int str2sock_v4 (n2n_sock_t *sock, const char *str) {
+    unsigned int a[4];
+    unsigned int port;
+    char extra;
+
+    if(sscanf(str, "%u.%u.%u.%u:%u%c", &a[0], &a[1], &a[2], &a[3], &port, &extra) != 5) {
+        return -1;
+    }
+    if(a[0] > 255 || a[1] > 255 || a[2] > 255 || a[3] > 255 || port > 65535) {
+        return -1;
+    }
+
+    memset(sock, 0, sizeof(*sock));
+    sock->family = AF_INET;
+    sock->port = port;
+    for(int i = 0; i < 4; i++) {
+        sock->addr.v4[i] = a[i];
+    }
+    return 0;
+}
+
+static bool peer_sock_cacheable (const n2n_sock_t *sock) {
+    return (sock->family == AF_INET) && (sock->type != SOCK_STREAM);
+}
+
+/*
+ * Write the list to the given path, replacing it atomically.
+ * Returns the number of peers saved or -1 on error
+ */
+int peer_list_save (const char *path, struct peer_info *list) {
+    struct peer_info *peer, *tmp;
+    macstr_t mac_buf;
+    n2n_sock_str_t sock_buf;
+    n2n_sock_str_t preferred_buf;
+    char tmppath[1024];
+    int count = 0;
+
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+    FILE *f = fopen(tmppath, "w");
+    if(!f) {
+        return -1;
+    }
+
+    fprintf(f, "# n3n peer cache\n");
+
+    HASH_ITER(hh, list, peer, tmp) {
+        if(!peer_sock_cacheable(&peer->sock)) {
+            continue;
+        }
+
+        if(peer_sock_cacheable(&peer->preferred_sock)) {
+            sock_to_cstr(preferred_buf, &peer->preferred_sock);
+        } else {
+            strcpy(preferred_buf, "-");
+        }
+
+        fprintf(
+            f,
+            "%s %s %s %lu %lu\n",
+            macaddr_str(mac_buf, peer->mac_addr),
+            sock_to_cstr(sock_buf, &peer->sock),
+            preferred_buf,
+            (unsigned long)peer->last_p2p,
+            (unsigned long)peer->rtt
+        );
+        count++;
+    }
+
+    if(fclose(f) != 0) {
+        remove(tmppath);
+        return -1;
+    }
+
+#ifdef _WIN32
+    // rename() will not replace an existing file
+    remove(path);
+#endif
+    if(rename(tmppath, path) != 0) {
+        remove(tmppath);
+        return -1;
+    }
+
+    return count;
+}
+
+/*
+ * Add the peers from the given path to the list, skipping any last seen
+ * before not_before or already in the list.
+ * Returns the number of peers added or -1 on error
+ */
+int peer_list_load (const char *path, struct peer_info **list, time_t not_before) {
+    char line[256];
+    int count = 0;
+
+    FILE *f = fopen(path, "r");
+    if(!f) {
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), f)) {
+        char mac_str[32];
+        char sock_str[64];
+        char preferred_str[64];
+        unsigned long last_p2p;
+        unsigned long rtt = 0;
+
+        if(line[0] == '#') {
+            continue;
+        }
+
+        if(sscanf(line, "%31s %63s %63s %lu %lu", mac_str, sock_str, preferred_str, &last_p2p, &rtt) < 4) {
+            continue;
+        }
+
+        if((time_t)last_p2p < not_before) {
+            continue;
+        }
+
+        n2n_mac_t mac;
+        n2n_sock_t sock;
+        if((strlen(mac_str) != 17) || str2mac(mac, mac_str) || str2sock_v4(&sock, sock_str)) {
+            continue;
+        }
+
+        struct peer_info *peer;
+        HASH_FIND_PEER(*list, mac, peer);
+        if(peer) {
+            continue;
+        }
+
+        peer = peer_info_malloc(mac);
+        if(!peer) {
+            break;
+        }
+
+        peer->sock = sock;
+        if(str2sock_v4(&peer->preferred_sock, preferred_str)) {
+            peer->preferred_sock.family = AF_INVALID;
+        }
+        peer->last_p2p = last_p2p;
+        if(rtt <= (UINT32_MAX >> 4)) {
+            // the same start as a first sample, see sn_selection_rtt_sample()
+            peer->rtt = rtt;
+            peer->rtt_var = rtt / 2;
+        }
+
+        HASH_ADD_PEER(*list, peer);
+        count++;
+    }
+
+    fclose(f);
+    return count;
+}
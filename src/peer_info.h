@@ -41,6 +41,31 @@ struct peer_info {
     time_t last_sent_query;
     time_t time_alloc;
     SN_SELECTION_CRITERION_DATA_TYPE selection_criterion;
+    // round trip time measurement, all in usec
+    uint64_t ping_sent;     // outstanding PING or peer probe, 0 if none
+    uint64_t reg_sent;      // outstanding REGISTER_SUPER, 0 if none
+    uint32_t rtt;           // smoothed, 0 if not yet measured
+    uint32_t rtt_var;       // mean deviation
+    uint32_t loss;          // smoothed share of lost peer probes, permille
+    // multi-port NAT traversal, see punch_nat()
+    time_t punch_last;      // last traversal attempt, 0 if none yet
+    int32_t punch_delta;    // observed port allocation step, 0 if unknown
+    uint8_t punch_round;    // multi-port probing rounds done
+    // supernode only, last relayed flows of this edge PEER_INFO was pushed for
+    struct {
+        n2n_mac_t mac;
+        time_t last;
+    } push[PEER_INFO_PUSH_SLOTS];
+    // supernode only, last MCAST_GROUPS from this edge, 0 if it does not snoop
+    time_t mcast_report;
+    // edge only, listed in the last BCAST_PEERS, gets our broadcasts directly
+    bool bcast_direct;
+    // supernode only, the peers this edge sends its broadcasts to directly
+    n2n_mac_t *bcast_peers;
+    uint8_t num_bcast_peers;
+    time_t bcast_report;
+    // supernode only, rate limiter for the PACKET data relayed from this edge
+    struct token_bucket limit;
     uint64_t last_valid_time_stamp;
     char *hostname;
     time_t uptime;
@@ -79,6 +104,9 @@ struct peer_info* add_sn_to_list_by_mac_or_sock (
     int *skip_add
 );
 
+int peer_list_save (const char *path, struct peer_info *list);
+int peer_list_load (const char *path, struct peer_info **list, time_t not_before);
+
 int find_and_remove_peer (struct peer_info **, const n2n_mac_t);
 struct peer_info* find_peer_by_sock (const n2n_sock_t *, struct peer_info *);
 
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Relaying through other edges
+ *
+ * When two edges cannot punch a hole to each other, their traffic goes
+ * through the supernode.  An edge that has opted in as a relay advertises,
+ * via the supernode, the peers it has a direct p2p path to along with the
+ * measured round trip time.  The other edges keep the last advertisement
+ * from each relay and, for every peer they cannot reach directly, the relay
+ * with the lowest total round trip time.  The relay itself must be a direct
+ * peer, so a relayed packet takes exactly one extra hop.
+ */
+
+#include <stdlib.h>             // for calloc, free
+#include <string.h>             // for memcpy, memcmp
+
+#include "n2n_define.h"         // for RELAY_INFO_TIMEOUT, RELAY_MAX_LOSS
+#include "peer_info.h"          // for struct peer_info, HASH_FIND_PEER
+#include "relay.h"
+
+/* A direct peer is good enough to relay through or to relay to */
+int relay_peer_usable (const struct peer_info *peer) {
+
+    // the round trip time probes double as the liveness check
+    return (peer->rtt != 0) && (peer->loss < RELAY_MAX_LOSS);
+}
+
+
+/* Fill in the advertisement of our direct peers, returns their number */
+size_t relay_info_build (n2n_RELAY_INFO_t *ri, struct peer_info *known_peers) {
+
+    struct peer_info *peer, *tmp_peer;
+
+    ri->num_peers = 0;
+    HASH_ITER(hh, known_peers, peer, tmp_peer) {
+        if(ri->num_peers >= N2N_RELAY_INFO_MAX_PEERS) {
+            break;
+        }
+        if(!relay_peer_usable(peer)) {
+            continue;
+        }
+        memcpy(ri->peers[ri->num_peers].mac, peer->mac_addr, sizeof(n2n_mac_t));
+        ri->peers[ri->num_peers].rtt = peer->rtt;
+        ri->num_peers++;
+    }
+
+    return ri->num_peers;
+}
+
+
+/* Store the advertisement received from a relaying edge */
+void relay_info_update (struct relay_info **relays, const n2n_RELAY_INFO_t *ri, time_t now) {
+
+    struct relay_info *relay;
+
+    HASH_FIND(hh, *relays, ri->srcMac, sizeof(n2n_mac_t), relay);
+    if(!relay) {
+        relay = calloc(1, sizeof(*relay));
+        if(!relay) {
+            return;
+        }
+        memcpy(relay->mac_addr, ri->srcMac, sizeof(n2n_mac_t));
+        HASH_ADD(hh, *relays, mac_addr, sizeof(n2n_mac_t), relay);
+    }
+
+    relay->last_seen = now;
+    relay->num_peers = ri->num_peers;
+    memcpy(relay->peers, ri->peers, ri->num_peers * sizeof(n2n_RELAY_INFO_peer_t));
+}
+
+
+/** Choose the best relay for every advertised peer.
+ *
+ *    Advertisements that have not been renewed are dropped first.  The cost
+ *    of a route is our round trip time to the relay plus the one the relay
+ *    measured to the peer.  The table is rebuilt from scratch, so relays we
+ *    lost our direct path to disappear from it.
+ */
+void relay_routes_update (struct relay_route **routes,
+                          struct relay_info **relays,
+                          struct peer_info *known_peers,
+                          const n2n_mac_t own_mac,
+                          time_t now) {
+
+    struct relay_info *relay, *tmp_relay;
+    struct relay_route *route, *tmp_route;
+    struct peer_info *peer;
+    uint32_t cost;
+    int i;
+
+    HASH_ITER(hh, *routes, route, tmp_route) {
+        HASH_DEL(*routes, route);
+        free(route);
+    }
+
+    HASH_ITER(hh, *relays, relay, tmp_relay) {
+        if((now - relay->last_seen) > RELAY_INFO_TIMEOUT) {
+            HASH_DEL(*relays, relay);
+            free(relay);
+            continue;
+        }
+
+        HASH_FIND_PEER(known_peers, relay->mac_addr, peer);
+        if(!peer || !relay_peer_usable(peer)) {
+            continue;
+        }
+
+        for(i = 0; i < relay->num_peers; i++) {
+            if(!memcmp(relay->peers[i].mac, own_mac, sizeof(n2n_mac_t))) {
+                continue;
+            }
+            cost = peer->rtt + relay->peers[i].rtt;
+
+            HASH_FIND(hh, *routes, relay->peers[i].mac, sizeof(n2n_mac_t), route);
+            if(!route) {
+                route = calloc(1, sizeof(*route));
+                if(!route) {
+                    return;
+                }
+                memcpy(route->mac_addr, relay->peers[i].mac, sizeof(n2n_mac_t));
+                HASH_ADD(hh, *routes, mac_addr, sizeof(n2n_mac_t), route);
+            } else if(route->cost <= cost) {
+                continue;
+            }
+            memcpy(route->relay, relay->mac_addr, sizeof(n2n_mac_t));
+            route->cost = cost;
+        }
+    }
+}
+
+
+/* Find the relay to send the packets for a peer to, NULL if there is none */
+struct peer_info *relay_find (struct relay_route *routes,
+                              struct peer_info *known_peers,
+                              const n2n_mac_t mac) {
+
+    struct relay_route *route;
+    struct peer_info *peer;
+
+    HASH_FIND(hh, routes, mac, sizeof(n2n_mac_t), route);
+    if(!route) {
+        return NULL;
+    }
+
+    // the relay might have gone away since the routes were built
+    HASH_FIND_PEER(known_peers, route->relay, peer);
+    if(!peer || !relay_peer_usable(peer)) {
+        return NULL;
+    }
+
+    return peer;
+}
+
+
+void relay_clear (struct relay_route **routes, struct relay_info **relays) {
+
+    struct relay_info *relay, *tmp_relay;
+    struct relay_route *route, *tmp_route;
+
+    HASH_ITER(hh, *routes, route, tmp_route) {
+        HASH_DEL(*routes, route);
+        free(route);
+    }
+    HASH_ITER(hh, *relays, relay, tmp_relay) {
+        HASH_DEL(*relays, relay);
+        free(relay);
+    }
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Relaying through other edges, non-public API
+ */
+
+#ifndef _RELAY_H_
+#define _RELAY_H_
+
+#include <n2n_typedefs.h>   // for n2n_RELAY_INFO_t
+#include <n3n/ethernet.h>   // for n2n_mac_t
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <uthash.h>         // for UT_hash_handle
+
+struct peer_info;
+
+/* The last advertisement received from a relaying edge */
+struct relay_info {
+    n2n_mac_t mac_addr;     // the relaying edge
+    time_t last_seen;
+    uint8_t num_peers;
+    n2n_RELAY_INFO_peer_t peers[N2N_RELAY_INFO_MAX_PEERS];
+
+    UT_hash_handle hh;      /* makes this structure hashable */
+};
+
+/* The relay with the lowest total round trip time to a peer */
+struct relay_route {
+    n2n_mac_t mac_addr;     // the peer we have no direct path to
+    n2n_mac_t relay;        // the relaying edge to send its packets to
+    uint32_t cost;          // usec, us to relay plus relay to peer
+
+    UT_hash_handle hh;      /* makes this structure hashable */
+};
+
+int relay_peer_usable (const struct peer_info *peer);
+
+size_t relay_info_build (n2n_RELAY_INFO_t *ri,
+                         struct peer_info *known_peers);
+
+void relay_info_update (struct relay_info **relays,
+                        const n2n_RELAY_INFO_t *ri,
+                        time_t now);
+
+void relay_routes_update (struct relay_route **routes,
+                          struct relay_info **relays,
+                          struct peer_info *known_peers,
+                          const n2n_mac_t own_mac,
+                          time_t now);
+
+struct peer_info *relay_find (struct relay_route *routes,
+                              struct peer_info *known_peers,
+                              const n2n_mac_t mac);
+
+void relay_clear (struct relay_route **routes, struct relay_info **relays);
+
+#endif
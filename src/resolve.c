@@ -9,12 +9,16 @@
 #include <n3n/logging.h>
 #include <n3n/metrics.h>
 #include <n3n/resolve.h>     // for n3n_resolve_parameter_t
+#include <n3n/strings.h>     // for sock_to_cstr
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>            // for time, timespec
 
 #include "config.h"          // for HAVE_LIBPTHREAD
+#include "minmax.h"          // for MIN, MAX
+#include "n2n.h"             // for sock_equal
 #include "resolve.h"
 #include "n2n_define.h"
 #include "n2n_typedefs.h"
@@ -29,14 +33,17 @@ struct peer_info;
 #include "win32/defs.h"
 #include <ws2def.h>
 #else
+#include <fcntl.h>           // for fcntl, F_SETFL, O_NONBLOCK
 #include <netdb.h>           // for addrinfo, freeaddrinfo, gai_strerror
 #include <netinet/in.h>
 #include <sys/socket.h>      // for AF_INET, PF_INET
 #include <sys/time.h>        // for gettimeofday, timersub
+#include <unistd.h>          // for pipe, read, write, close
 #endif
 
 #define N2N_RESOLVE_INTERVAL            300 /* seconds until edge and supernode try to resolve supernode names again */
 #define N2N_RESOLVE_CHECK_INTERVAL       30 /* seconds until main loop checking in on changes from resolver thread */
+#define N2N_RESOLVE_MIN_INTERVAL          5 /* seconds before a requested resolve will repeat a name */
 
 /**********************************************************/
 
@@ -76,10 +83,12 @@ static struct n3n_metrics_module metrics_module = {
 
 /** Resolve the supernode IP address.
  *
+ * The time taken is returned in usec, for the callers metrics
  */
-int supernode2sock (n2n_sock_t *sn, const n2n_sn_name_t addrIn) {
+static int resolve_sock (n2n_sock_t *sn, const n2n_sn_name_t addrIn, uint32_t *usec) {
 
     n2n_sn_name_t addr;
+    char *saveptr;
     char *supernode_host;
     char *supernode_port;
     int nameerr;
@@ -87,6 +96,8 @@ int supernode2sock (n2n_sock_t *sn, const n2n_sn_name_t addrIn) {
     struct addrinfo * ainfo = NULL;
     struct sockaddr_in * saddr;
 
+    *usec = 0;
+
     size_t length = strlen(addrIn);
     if(length >= N2N_EDGE_SN_HOST_SIZE) {
         traceEvent(
@@ -101,7 +112,8 @@ int supernode2sock (n2n_sock_t *sn, const n2n_sn_name_t addrIn) {
     sn->family = AF_INVALID;
 
     memcpy(addr, addrIn, N2N_EDGE_SN_HOST_SIZE);
-    supernode_host = strtok(addr, ":");
+    // The workers and the mainloop may be in here at the same time
+    supernode_host = strtok_r(addr, ":", &saveptr);
 
     if(!supernode_host) {
         traceEvent(
@@ -112,7 +124,7 @@ int supernode2sock (n2n_sock_t *sn, const n2n_sn_name_t addrIn) {
         return -4;
     }
 
-    supernode_port = strtok(NULL, ":");
+    supernode_port = strtok_r(NULL, ":", &saveptr);
 
     if(!supernode_port) {
         traceEvent(
@@ -135,13 +147,7 @@ int supernode2sock (n2n_sock_t *sn, const n2n_sn_name_t addrIn) {
     struct timeval elapsed;
     timersub(&time2, &time1, &elapsed);
 
-    uint64_t elapsed_usec = elapsed.tv_sec * 1000000 + elapsed.tv_usec;
-
-    metrics.count++;
-    metrics.total_usec += elapsed_usec;
-    if(metrics.longest_usec < elapsed_usec) {
-        metrics.longest_usec = elapsed_usec;
-    }
+    *usec = elapsed.tv_sec * 1000000 + elapsed.tv_usec;
 
     if(nameerr != 0) {
         traceEvent(
@@ -183,6 +189,32 @@ int supernode2sock (n2n_sock_t *sn, const n2n_sn_name_t addrIn) {
     return 0;
 }
 
+#ifdef HAVE_LIBPTHREAD
+// Both the mainloop and the resolver workers add to the metrics
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void metrics_account (uint32_t usec) {
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_lock(&metrics_lock);
+#endif
+    metrics.count++;
+    metrics.total_usec += usec;
+    if(metrics.longest_usec < usec) {
+        metrics.longest_usec = usec;
+    }
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_unlock(&metrics_lock);
+#endif
+}
+
+int supernode2sock (n2n_sock_t *sn, const n2n_sn_name_t addrIn) {
+    uint32_t usec;
+    int rv = resolve_sock(sn, addrIn, &usec);
+    metrics_account(usec);
+    return rv;
+}
+
 #ifdef HAVE_LIBPTHREAD
 
 #ifdef _MSC_VER
@@ -195,59 +227,208 @@ int supernode2sock (n2n_sock_t *sn, const n2n_sn_name_t addrIn) {
 #define N2N_THREAD_PARAMETER_DATATYPE     void*
 #endif
 
+// Only one resolver exists in each daemon, remember it for the metrics
+// and the fork handlers
+static n3n_resolve_parameter_t *resolver_param;
+
+static void metrics_callback (strbuf_t **reply, const struct n3n_metrics_module *module) {
+    struct n3n_resolve_ip_sock *entry;
+    struct n3n_resolve_ip_sock *tmp_entry;
+
+    if(!resolver_param) {
+        return;
+    }
+
+    pthread_mutex_lock(&resolver_param->access);
+    HASH_ITER(hh, resolver_param->list, entry, tmp_entry) {
+        // The helper finds the values relative to the module data
+        struct n3n_metrics_module entry_module = *module;
+        entry_module.data = entry;
+
+        n3n_metrics_render_u32tags(
+            reply,
+            &entry_module,
+            "name_count",
+            offsetof(struct n3n_resolve_ip_sock, count),
+            1,  // number of tag+val pairs
+            "name",
+            entry->org_ip
+        );
+        n3n_metrics_render_u32tags(
+            reply,
+            &entry_module,
+            "name_errors",
+            offsetof(struct n3n_resolve_ip_sock, errors),
+            1,  // number of tag+val pairs
+            "name",
+            entry->org_ip
+        );
+        n3n_metrics_render_u32tags(
+            reply,
+            &entry_module,
+            "name_last_usec",
+            offsetof(struct n3n_resolve_ip_sock, last_usec),
+            1,  // number of tag+val pairs
+            "name",
+            entry->org_ip
+        );
+        n3n_metrics_render_u32tags(
+            reply,
+            &entry_module,
+            "name_longest_usec",
+            offsetof(struct n3n_resolve_ip_sock, longest_usec),
+            1,  // number of tag+val pairs
+            "name",
+            entry->org_ip
+        );
+    }
+    pthread_mutex_unlock(&resolver_param->access);
+}
+
+static struct n3n_metrics_module metrics_module_dynamic = {
+    .name = "resolve",
+    .data = NULL,
+    .cb = &metrics_callback,
+    .type = n3n_metrics_type_cb,
+};
+
+// Tell the mainloop that there is a result waiting
+static void resolve_notify (n3n_resolve_parameter_t *param) {
+    if(param->notify[1] == -1) {
+        return;
+    }
+
+    char ch = 0;
+    // If the pipe is full, the mainloop already has a wakeup pending
+    if(write(param->notify[1], &ch, 1) == -1) {
+        return;
+    }
+}
+
+/*
+ * Each worker thread takes the next name whose cached result has expired,
+ * resolves it without holding the lock and stores the result.  With no
+ * work to do, the worker sleeps until the next expiry or until signaled.
+ *
+ * Cancellation is only enabled while in the resolver, so a worker cannot
+ * be cancelled holding the lock
+ */
 N2N_THREAD_RETURN_DATATYPE resolve_thread (N2N_THREAD_PARAMETER_DATATYPE p) {
 
     n3n_resolve_parameter_t *param = (n3n_resolve_parameter_t*)p;
     struct n3n_resolve_ip_sock *entry;
     struct n3n_resolve_ip_sock *tmp_entry;
-    time_t rep_time = N2N_RESOLVE_INTERVAL / 10;
-    time_t now;
 
-    while(1) {
-        sleep(N2N_RESOLVE_INTERVAL / 60); /* wake up in-between to check for signaled requests */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_mutex_lock(&param->access);
 
-        // what's the time?
-        now = time(NULL);
-
-        // lock access
-        pthread_mutex_lock(&param->access);
+    while(!param->stop) {
+        time_t now = time(NULL);
+        time_t next = now + N2N_RESOLVE_INTERVAL;
+        struct n3n_resolve_ip_sock *found = NULL;
 
-        // is it time to resolve yet?
-        if(((param->request)) || ((now - param->last_resolved) > rep_time)) {
-            HASH_ITER(hh, param->list, entry, tmp_entry) {
-                // resolve
-                entry->error_code = supernode2sock(&entry->sock, entry->org_ip);
-                // if socket changed and no error
-                if(!sock_equal(&entry->sock, entry->org_sock)
-                   && (!entry->error_code)) {
-                    // flag the change
-                    param->changed = true;
-                }
+        HASH_ITER(hh, param->list, entry, tmp_entry) {
+            if(entry->busy) {
+                continue;
             }
-            param->last_resolved = now;
-
-            // any request fulfilled
-            param->request = false;
-
-            // determine next resolver repetition (shorter time if resolver errors occured)
-            rep_time = N2N_RESOLVE_INTERVAL;
-            HASH_ITER(hh, param->list, entry, tmp_entry) {
-                if(entry->error_code) {
-                    rep_time = N2N_RESOLVE_INTERVAL / 10;
-                    break;
-                }
+            if(entry->expires <= now) {
+                found = entry;
+                break;
             }
+            next = MIN(next, entry->expires);
         }
 
-        // unlock access
+        if(!found) {
+            struct timespec until = {
+                .tv_sec = next,
+                .tv_nsec = 0,
+            };
+
+            pthread_cond_timedwait(&param->wake, &param->access, &until);
+            continue;
+        }
+
+        found->busy = true;
         pthread_mutex_unlock(&param->access);
+
+        n2n_sock_t sock;
+        uint32_t usec;
+        // A slow name server should not hold up the shutdown
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        int error_code = resolve_sock(&sock, found->org_ip, &usec);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        pthread_mutex_lock(&param->access);
+        now = time(NULL);
+
+        metrics_account(usec);
+        found->busy = false;
+        found->count++;
+        found->last_usec = usec;
+        found->longest_usec = MAX(found->longest_usec, usec);
+        found->last_resolved = now;
+        found->error_code = error_code;
+
+        if(error_code) {
+            // Retry failures sooner, the old address is kept meanwhile
+            found->errors++;
+            found->expires = now + N2N_RESOLVE_INTERVAL / 10;
+            continue;
+        }
+
+        found->expires = now + N2N_RESOLVE_INTERVAL;
+        memcpy(&found->sock, &sock, sizeof(sock));
+        found->fresh = true;
+        param->changed = true;
+        resolve_notify(param);
+    }
+
+    pthread_mutex_unlock(&param->access);
+    return 0;
+}
+
+// The daemon forks after resolve_create_thread() is called and threads do
+// not survive that.  Hold the lock over the fork so the child gets a
+// consistent list and then let the next resolve_check() restart them
+static void resolve_atfork_prepare (void) {
+    if(resolver_param) {
+        pthread_mutex_lock(&resolver_param->access);
+    }
+}
+
+static void resolve_atfork_parent (void) {
+    if(resolver_param) {
+        pthread_mutex_unlock(&resolver_param->access);
     }
 }
 
+static void resolve_atfork_child (void) {
+    n3n_resolve_parameter_t *param = resolver_param;
+    struct n3n_resolve_ip_sock *entry;
+    struct n3n_resolve_ip_sock *tmp_entry;
+
+    if(!param) {
+        return;
+    }
+
+    HASH_ITER(hh, param->list, entry, tmp_entry) {
+        if(entry->busy) {
+            // The lookup was lost with its worker
+            entry->busy = false;
+            entry->expires = 0;
+        }
+    }
+
+    // The condition may still count waiters from the lost workers
+    pthread_cond_init(&param->wake, NULL);
+    param->nr_workers = 0;
+    param->started = false;
+    pthread_mutex_unlock(&param->access);
+}
+
 int resolve_create_thread (n3n_resolve_parameter_t **param, struct peer_info *sn_list) {
     struct peer_info        *sn, *tmp_sn;
     struct n3n_resolve_ip_sock *entry;
-    int ret;
 
     // create parameter structure
     *param = (n3n_resolve_parameter_t*)calloc(1, sizeof(n3n_resolve_parameter_t));
@@ -260,6 +441,12 @@ int resolve_create_thread (n3n_resolve_parameter_t **param, struct peer_info *sn
                     entry->org_ip = sn->hostname;
                     entry->org_sock = &(sn->sock);
                     memcpy(&(entry->sock), &(sn->sock), sizeof(n2n_sock_t));
+                    // The config parser has already resolved the name once,
+                    // so only the failures need resolving straight away
+                    if(sn->sock.family != AF_INVALID) {
+                        entry->last_resolved = time(NULL);
+                        entry->expires = entry->last_resolved + N2N_RESOLVE_INTERVAL;
+                    }
                     HASH_ADD(hh, (*param)->list, org_ip, sizeof(char*), entry);
                 } else
                     traceEvent(
@@ -275,76 +462,189 @@ int resolve_create_thread (n3n_resolve_parameter_t **param, struct peer_info *sn
         return -1;
     }
 
-    // create thread
-    ret = pthread_create(&((*param)->id), NULL, resolve_thread, (void *)*param);
-    if(ret) {
-        traceEvent(TRACE_WARNING, "resolve_create_thread failed to create resolver thread with error number %d", ret);
-        return -1;
+    pthread_mutex_init(&((*param)->access), NULL);
+    pthread_cond_init(&((*param)->wake), NULL);
+
+    (*param)->notify[0] = -1;
+    (*param)->notify[1] = -1;
+#ifndef _WIN32
+    if(pipe((*param)->notify) == 0) {
+        fcntl((*param)->notify[0], F_SETFL, O_NONBLOCK);
+        fcntl((*param)->notify[1], F_SETFL, O_NONBLOCK);
+    } else {
+        // Results will still be found by the resolve_check() polling
+        (*param)->notify[0] = -1;
+        (*param)->notify[1] = -1;
     }
+#endif
 
-    pthread_mutex_init(&((*param)->access), NULL);
+    static bool atfork_done;
+    if(!atfork_done) {
+        pthread_atfork(resolve_atfork_prepare, resolve_atfork_parent, resolve_atfork_child);
+        atfork_done = true;
+    }
 
+    resolver_param = *param;
     return 0;
 }
 
 
+// Workers are started from the mainloop, see the fork handlers above
+static void resolve_start_workers (n3n_resolve_parameter_t *param) {
+    int ret;
+
+    param->started = true;
+
+    // One worker per name, up to a limit, lets a slow name server for one
+    // supernode not delay the others
+    int nr_workers = MIN(HASH_COUNT(param->list), N2N_RESOLVE_WORKERS);
+
+    while(param->nr_workers < nr_workers) {
+        ret = pthread_create(
+            &(param->id[param->nr_workers]),
+            NULL,
+            resolve_thread,
+            (void *)param
+        );
+        if(ret) {
+            traceEvent(TRACE_WARNING, "resolve_start_workers failed to create resolver thread with error number %d", ret);
+            break;
+        }
+        param->nr_workers++;
+    }
+}
+
+
 void resolve_cancel_thread (n3n_resolve_parameter_t *param) {
-    pthread_cancel(param->id);
+    struct n3n_resolve_ip_sock *entry;
+    struct n3n_resolve_ip_sock *tmp_entry;
+
+    if(!param) {
+        return;
+    }
+
+    pthread_mutex_lock(&param->access);
+    param->stop = true;
+    pthread_cond_broadcast(&param->wake);
+    pthread_mutex_unlock(&param->access);
+
+    // Only a worker waiting on the name server can still be busy
+    for(int i = 0; i < param->nr_workers; i++) {
+        pthread_cancel(param->id[i]);
+    }
+    for(int i = 0; i < param->nr_workers; i++) {
+        pthread_join(param->id[i], NULL);
+    }
+
+    resolver_param = NULL;
+
+#ifndef _WIN32
+    if(param->notify[0] != -1) {
+        close(param->notify[0]);
+        close(param->notify[1]);
+    }
+#endif
+
+    HASH_ITER(hh, param->list, entry, tmp_entry) {
+        HASH_DEL(param->list, entry);
+        free(entry);
+    }
+
+    pthread_cond_destroy(&param->wake);
+    pthread_mutex_destroy(&param->access);
     free(param);
 }
 
 
-bool resolve_check (n3n_resolve_parameter_t *param, bool requires_resolution, time_t now) {
+// Copy any new results over to the supernode list
+static void resolve_apply (n3n_resolve_parameter_t *param) {
+    struct n3n_resolve_ip_sock *entry;
+    struct n3n_resolve_ip_sock *tmp_entry;
+    n2n_sock_str_t sock_buf;
 
-    bool ret = requires_resolution; /* if trylock fails, it still requires resolution */
+    pthread_mutex_lock(&param->access);
+
+    if(param->changed) {
+        param->changed = false;
+
+        HASH_ITER(hh, param->list, entry, tmp_entry) {
+            if(!entry->fresh) {
+                continue;
+            }
+            entry->fresh = false;
+
+            if(sock_equal(&entry->sock, entry->org_sock)) {
+                continue;
+            }
+            memcpy(entry->org_sock, &entry->sock, sizeof(n2n_sock_t));
+            traceEvent(TRACE_INFO, "resolve_check renews ip address of supernode '%s' to %s",
+                       entry->org_ip, sock_to_cstr(sock_buf, &(entry->sock)));
+        }
+    }
+
+    pthread_mutex_unlock(&param->access);
+}
+
+
+bool resolve_check (n3n_resolve_parameter_t *param, bool requires_resolution, time_t now) {
 
     struct n3n_resolve_ip_sock *entry;
     struct n3n_resolve_ip_sock *tmp_entry;
-    n2n_sock_str_t sock_buf;
 
     if(NULL == param)
-        return ret;
+        return requires_resolution;
+
+    if(!param->started) {
+        resolve_start_workers(param);
+    }
+
+    if(requires_resolution) {
+        // Expire the cached results, unless they are very recent
+        pthread_mutex_lock(&param->access);
+        HASH_ITER(hh, param->list, entry, tmp_entry) {
+            if(now - entry->last_resolved >= N2N_RESOLVE_MIN_INTERVAL) {
+                entry->expires = 0;
+            }
+        }
+        pthread_cond_broadcast(&param->wake);
+        pthread_mutex_unlock(&param->access);
+    }
 
     // check_interval and last_check do not need to be guarded by the mutex because
-    // their values get changed and evaluated only here
+    // their values get changed and evaluated only here.  Results are normally
+    // delivered by resolve_notified(), this catches any without a notify fd
 
     if((now - param->last_checked > param->check_interval) || (requires_resolution)) {
-        // try to lock access
-        if(pthread_mutex_trylock(&param->access) == 0) {
-            // any changes?
-            if(param->changed) {
-                // reset flag
-                param->changed = false;
-                // unselectively copy all socks (even those with error code, that would be the old one because
-                // sockets do not get overwritten in case of error in resolve_thread) from list to supernode list
-                HASH_ITER(hh, param->list, entry, tmp_entry) {
-                    memcpy(entry->org_sock, &entry->sock, sizeof(n2n_sock_t));
-                    traceEvent(TRACE_INFO, "resolve_check renews ip address of supernode '%s' to %s",
-                               entry->org_ip, sock_to_cstr(sock_buf, &(entry->sock)));
-                }
-            }
+        resolve_apply(param);
+        param->last_checked = now;
+    }
 
-            // let the resolver thread know eventual difficulties in reaching the supernode
-            if(requires_resolution) {
-                param->request = true;
-                ret = false;
-            }
+    // the request has been passed on to the workers
+    return false;
+}
 
-            param->last_checked = now;
 
-            // next appointment
-            if(param->request)
-                // earlier if resolver still working on fulfilling a request
-                param->check_interval = N2N_RESOLVE_CHECK_INTERVAL / 10;
-            else
-                param->check_interval = N2N_RESOLVE_CHECK_INTERVAL;
+int resolve_notify_fd (n3n_resolve_parameter_t *param) {
+    if(!param) {
+        return -1;
+    }
+    return param->notify[0];
+}
 
-            // unlock access
-            pthread_mutex_unlock(&param->access);
-        }
+
+void resolve_notified (n3n_resolve_parameter_t *param) {
+    if(!param) {
+        return;
+    }
+
+#ifndef _WIN32
+    char buf[16];
+    while(read(param->notify[0], buf, sizeof(buf)) > 0) {
+        // Drain all the wakeups, one pass picks up all the results
     }
+#endif
 
-    return ret;
+    resolve_apply(param);
 }
 
 
@@ -367,6 +667,14 @@ bool resolve_check (n3n_resolve_parameter_t *param, bool requires_resolution, ti
     return requires_resolution;
 }
 
+int resolve_notify_fd (n3n_resolve_parameter_t *param) {
+    return -1;
+}
+
+void resolve_notified (n3n_resolve_parameter_t *param) {
+    return;
+}
+
 int maybe_supernode2sock (n2n_sock_t * sn, const n2n_sn_name_t addrIn) {
     return supernode2sock(sn, addrIn);
 }
@@ -374,4 +682,7 @@ int maybe_supernode2sock (n2n_sock_t * sn, const n2n_sn_name_t addrIn) {
 
 void n3n_initfuncs_resolve () {
     n3n_metrics_register(&metrics_module);
+#ifdef HAVE_LIBPTHREAD
+    n3n_metrics_register(&metrics_module_dynamic);
+#endif
 }
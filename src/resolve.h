@@ -12,6 +12,7 @@
 #include <n2n_typedefs.h>   // for n2n_sock_t
 #include <n3n/resolve.h>    // for n2n_resolve_parameter_t
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 #include <uthash.h>         // for UT_hash_handle
 
@@ -26,20 +27,33 @@ struct n3n_resolve_ip_sock {
     n2n_sock_t sock;                  /* resolved socket */
     n2n_sock_t    *org_sock;          /* pointer to original socket where 'sock' gets copied to from time to time */
     int error_code;                   /* result of last resolution attempt */
+    time_t expires;                   /* when the cached result needs resolving again */
+    time_t last_resolved;             /* when the last resolution attempt finished */
+    bool busy;                        /* a worker is resolving this name */
+    bool fresh;                       /* resolved since the main thread last looked */
+    uint32_t count;                   /* metrics: resolution attempts */
+    uint32_t errors;                  /* metrics: failed attempts */
+    uint32_t last_usec;               /* metrics: time taken by the last attempt */
+    uint32_t longest_usec;            /* metrics: time taken by the slowest attempt */
 
     UT_hash_handle hh;                /* makes this structure hashable */
 };
 
-// structure to hold resolver thread's parameters
+#define N2N_RESOLVE_WORKERS 4  /* max number of names being resolved at once */
+
+// structure to hold resolver threads' parameters
 struct n3n_resolve_parameter {
     struct n3n_resolve_ip_sock *list;      /* pointer to list of to be resolved nodes */
     time_t check_interval;                 /* interval to checik resolover results */
     time_t last_checked;                   /* last time the resolver results were cheked */
-    time_t last_resolved;                  /* last time the resolver completed */
     bool changed;                          /* indicates a change */
-    bool request;                          /* flags main thread's need for intermediate resolution */
-    pthread_t id;                          /* thread id */
+    bool started;                          /* the workers have been created */
+    bool stop;                             /* tells the workers to exit */
+    int notify[2];                         /* pipe written to when a result is ready */
+    int nr_workers;                        /* number of running worker threads */
+    pthread_t id[N2N_RESOLVE_WORKERS];     /* worker thread ids */
     pthread_mutex_t access;                /* mutex for shared access */
+    pthread_cond_t wake;                   /* signals the workers to look for work */
 };
 #endif
 
@@ -48,6 +62,13 @@ int resolve_create_thread (n3n_resolve_parameter_t **param, struct peer_info *sn
 bool resolve_check (n3n_resolve_parameter_t *param, bool resolution_request, time_t now);
 void resolve_cancel_thread (n3n_resolve_parameter_t *param);
 
+// The fd that becomes readable when results are ready, or -1 if there is
+// none and the caller must rely on resolve_check() polling
+int resolve_notify_fd (n3n_resolve_parameter_t *param);
+
+// Called when the notify fd is readable, to pick up the results
+void resolve_notified (n3n_resolve_parameter_t *param);
+
 // Internal resolver function, will turn static once supernode.c doesnt use it
 int supernode2sock (n2n_sock_t * sn, const n2n_sn_name_t addrIn);
 
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Control before data receive queue for the UDP socket
+ *
+ * Reading and handling one datagram per select() treats a REGISTER_SUPER
+ * the same as the bulk PACKET data it arrived between. Once the socket
+ * cannot be emptied any more, the registrations wait in the receive buffer
+ * behind the data or are dropped by the kernel along with it, edges time out
+ * and the traffic of the whole community collapses.
+ *
+ * Instead, a batch of datagrams is read at once. Their headers are decrypted
+ * and each is sorted into the control or the data class by its message type,
+ * and all control messages of the batch are handled before the data. Should
+ * the socket stay full for a number of batches in a row, PACKET datagrams
+ * beyond the data queue are dropped right away to get at the control
+ * messages behind them.
+ *
+ * The supernode sorts the registrations of edges it does not know yet into
+ * a third, small class handled after the data. A storm of new or spoofed
+ * registrations then cannot hold up the edges already registered, and what
+ * does not fit the queue is dropped for the edges to retry.
+ */
+
+#include <errno.h>              // for errno, EAGAIN, EWOULDBLOCK
+#include <string.h>             // for memset
+
+#include "minmax.h"             // for MAX
+#include "n2n_typedefs.h"       // for n2n_common_t, MSG_TYPE_PACKET
+#include "n2n_wire.h"           // for decode_common
+#include "rx_queue.h"
+
+#ifdef MSG_DONTWAIT
+#define RX_READ_FLAGS       MSG_DONTWAIT
+#define RX_READ_BUDGET      N2N_RX_QUEUE_BUDGET
+#else
+#define RX_READ_FLAGS       0
+#define RX_READ_BUDGET      1   /* no non-blocking read, one datagram per select() */
+#endif
+
+#define RX_QUEUE_OVERLOAD   8   /* batches in a row not emptying the socket before data is dropped */
+
+static const uint8_t rx_queue_size[RX_CLASS_MAX] = {
+    [RX_CLASS_CONTROL] = N2N_RX_QUEUE_CONTROL,
+    [RX_CLASS_DATA] = N2N_RX_QUEUE_DATA,
+    [RX_CLASS_ADMIT] = N2N_RX_QUEUE_ADMIT,
+};
+
+
+/* the class of a datagram with a decrypted header */
+int rx_queue_class (const uint8_t *buf, size_t size) {
+
+    n2n_common_t cmn;
+    size_t rem = size;
+    size_t idx = 0;
+
+    // anything not decoding is left for the processing to complain about
+    if(decode_common(&cmn, buf, &rem, &idx) < 0) {
+        return RX_CLASS_CONTROL;
+    }
+
+    if(cmn.pc == MSG_TYPE_PACKET) {
+        return RX_CLASS_DATA;
+    }
+
+    return RX_CLASS_CONTROL;
+}
+
+
+/** Read the datagrams waiting in the socket into the empty queue.
+ *
+ *  Stops when the socket is empty, the read budget is used up or the
+ *  control queue is full. A full data queue also stops the reading unless
+ *  the socket has not been emptied for RX_QUEUE_OVERLOAD batches, then
+ *  further PACKET datagrams are counted as dropped instead. Registrations
+ *  beyond a full admit queue are always dropped.
+ *
+ *  Returns the number of datagrams read or -1 if the socket failed, with
+ *  errno set.
+ */
+int rx_queue_fill (struct rx_queue *q,
+                   SOCKET sock,
+                   rx_classify_fn classify,
+                   void *arg,
+                   struct n2n_edge_stats *stats) {
+
+    bool overload = (q->backlog >= RX_QUEUE_OVERLOAD);
+    int nread = 0;
+
+    while(nread < RX_READ_BUDGET) {
+        if(q->count[RX_CLASS_CONTROL] == N2N_RX_QUEUE_CONTROL) {
+            break;
+        }
+        if((q->count[RX_CLASS_DATA] == N2N_RX_QUEUE_DATA) && !overload) {
+            break;
+        }
+
+        uint8_t slot = q->count[RX_CLASS_CONTROL] + q->count[RX_CLASS_DATA] + q->count[RX_CLASS_ADMIT];
+        struct rx_entry *entry = &q->pool[slot];
+
+        entry->sas_size = sizeof(entry->sas);
+        ssize_t bread = recvfrom(
+            sock,
+            (void *)entry->buf,
+            sizeof(entry->buf),
+            RX_READ_FLAGS,
+            (struct sockaddr *)&entry->sas,
+            &entry->sas_size
+        );
+
+        if(bread < 0) {
+            if((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                // the socket is empty
+                q->backlog = 0;
+                return nread;
+            }
+            if(nread == 0) {
+                return -1;
+            }
+            // the next select() brings it up again
+            break;
+        }
+        nread++;
+
+        /* For UDP bread of zero just means no data (unlike TCP). */
+        if(bread == 0) {
+            continue;
+        }
+
+        entry->sock = sock;
+        entry->size = bread;
+        memset(&entry->hdr, 0, sizeof(entry->hdr));
+
+        int cls = classify(arg, entry);
+        if(cls < 0) {
+            continue;
+        }
+
+        if(q->count[cls] == rx_queue_size[cls]) {
+            // the data queue only while overloaded
+            if(cls == RX_CLASS_DATA) {
+                stats->rx_data_drop++;
+            } else {
+                stats->rx_admit_drop++;
+            }
+            continue;
+        }
+
+        q->index[cls][q->count[cls]++] = slot;
+
+        switch(cls) {
+            case RX_CLASS_CONTROL:
+                stats->rx_ctrl++;
+                stats->rx_ctrl_peak = MAX(stats->rx_ctrl_peak, q->count[cls]);
+                break;
+            case RX_CLASS_DATA:
+                stats->rx_data++;
+                stats->rx_data_peak = MAX(stats->rx_data_peak, q->count[cls]);
+                break;
+            default:
+                stats->rx_admit++;
+                stats->rx_admit_peak = MAX(stats->rx_admit_peak, q->count[cls]);
+                break;
+        }
+    }
+
+#ifdef MSG_DONTWAIT
+    // stopped with datagrams possibly left in the socket
+    if(q->backlog < UINT8_MAX) {
+        q->backlog++;
+    }
+#endif
+
+    return nread;
+}
+
+
+/* the next entry to process, by class, NULL once empty */
+struct rx_entry *rx_queue_pop (struct rx_queue *q) {
+
+    for(int cls = 0; cls < RX_CLASS_MAX; cls++) {
+        if(q->next[cls] < q->count[cls]) {
+            return &q->pool[q->index[cls][q->next[cls]++]];
+        }
+    }
+
+    memset(q->count, 0, sizeof(q->count));
+    memset(q->next, 0, sizeof(q->next));
+
+    return NULL;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Control before data receive queue for the UDP socket, non-public API
+ */
+
+#ifndef _RX_QUEUE_H_
+#define _RX_QUEUE_H_
+
+#include <n2n_define.h>     // for N2N_PKT_BUF_SIZE, N2N_RX_QUEUE_*
+#include <n2n_typedefs.h>   // for SOCKET, struct n2n_edge_stats
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include "win32/defs.h"
+#else
+#include <sys/socket.h>     // for sockaddr_storage, socklen_t
+#endif
+
+#define RX_CLASS_CONTROL    0
+#define RX_CLASS_DATA       1
+#define RX_CLASS_ADMIT      2   /* supernode only, registrations of unknown edges */
+#define RX_CLASS_MAX        3
+
+/* The outcome of the header decryption, kept for the processing */
+struct rx_header {
+    void *comm;             // supernode only, the community found
+    uint32_t header_enc;    // 0 none, 1 static key, 2 dynamic key
+    uint64_t stamp;
+    uint8_t hash_buf[16];   // of the still encrypted datagram, for REGISTER_SUPER(_ACK)
+};
+
+struct rx_entry {
+    struct sockaddr_storage sas;    // the sender
+    socklen_t sas_size;
+    SOCKET sock;            // the socket it arrived on
+    size_t size;
+    uint8_t buf[N2N_PKT_BUF_SIZE];
+    struct rx_header hdr;   // filled in by the classify callback
+};
+
+struct rx_queue {
+    struct rx_entry pool[N2N_RX_QUEUE_CONTROL + N2N_RX_QUEUE_DATA + N2N_RX_QUEUE_ADMIT];
+    uint8_t index[RX_CLASS_MAX][N2N_RX_QUEUE_DATA];
+    uint8_t count[RX_CLASS_MAX];
+    uint8_t next[RX_CLASS_MAX];     // the next entry rx_queue_pop() returns
+    uint8_t backlog;        // fills in a row that left datagrams in the socket
+};
+
+/* decrypts the header if needed, returns the RX_CLASS or -1 to discard */
+typedef int (*rx_classify_fn)(void *arg, struct rx_entry *entry);
+
+int rx_queue_class (const uint8_t *buf, size_t size);
+
+int rx_queue_fill (struct rx_queue *q,
+                   SOCKET sock,
+                   rx_classify_fn classify,
+                   void *arg,
+                   struct n2n_edge_stats *stats);
+
+struct rx_entry *rx_queue_pop (struct rx_queue *q);
+
+#endif
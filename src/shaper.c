@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Rate limiting and fair queuing of relayed data
+ *
+ * The supernode used to relay every PACKET in arrival order, with a
+ * blocking sendto(). A single edge pushing bulk data through it could take
+ * all of its bandwidth and stall every other community.
+ *
+ * Each community and each edge now has token buckets for a byte and a
+ * packet rate, and the data over either limit is dropped. If the socket
+ * still cannot take the data, the copies wait in a small queue per
+ * community. These queues are served deficit round robin once the socket
+ * is writable again, so a busy community gets no more than its share.
+ *
+ * The edge uses the same bucket to cap the data it relays for others.
+ */
+
+#include <errno.h>              // for errno, EAGAIN, EWOULDBLOCK, ENOBUFS
+#include <stdlib.h>             // for malloc, free
+#include <string.h>             // for memcpy
+
+#include "n2n_define.h"         // for N2N_SN_FQ_MAX_PKTS
+#include "shaper.h"
+
+#ifndef _WIN32
+#include <sys/socket.h>         // for sendto, MSG_DONTWAIT
+#endif
+
+#ifdef MSG_DONTWAIT
+#define FQ_SEND_FLAGS       MSG_DONTWAIT
+#else
+#define FQ_SEND_FLAGS       0   /* blocking, a queue never builds up */
+#endif
+
+#define PKT_TOKEN           1000000     /* one packet in the pkts bucket */
+#define BYTE_TOKEN          1000000     /* one byte in the bytes bucket */
+
+
+/* top the buckets up for the time passed since the last call */
+static void token_bucket_refill (struct token_bucket *tb,
+                                 uint64_t rate,
+                                 uint64_t pps,
+                                 uint64_t now) {
+
+    uint64_t elapsed;
+
+    if(!tb->refill) {
+        tb->refill = now;
+        tb->bytes = rate * BYTE_TOKEN;
+        tb->pkts = pps;
+    }
+
+    elapsed = now - tb->refill;
+    if(elapsed > 1000000) {
+        elapsed = 1000000;
+    }
+    tb->refill = now;
+
+    // Both buckets count millionths, so that frequent calls with little
+    // time in between still add up to the rates
+    tb->bytes += elapsed * rate;
+    if(tb->bytes > rate * BYTE_TOKEN) {
+        tb->bytes = rate * BYTE_TOKEN;
+    }
+    tb->pkts += elapsed * (pps / PKT_TOKEN);
+    if(tb->pkts > pps) {
+        tb->pkts = pps;
+    }
+}
+
+
+/** Check if the buckets hold enough for a packet of len bytes, without
+ *  taking it.
+ *
+ *  The rates are in KiB and packets per second, zero meaning unlimited.
+ */
+bool token_bucket_check (struct token_bucket *tb,
+                         uint32_t max_rate,
+                         uint32_t max_pps,
+                         size_t len,
+                         uint64_t now) {
+
+    uint64_t rate = (uint64_t)max_rate * 1024;
+    uint64_t pps = (uint64_t)max_pps * PKT_TOKEN;
+
+    if(!rate && !pps) {
+        return true;
+    }
+
+    token_bucket_refill(tb, rate, pps, now);
+
+    if(rate && (tb->bytes < len * BYTE_TOKEN)) {
+        return false;
+    }
+    if(pps && (tb->pkts < PKT_TOKEN)) {
+        return false;
+    }
+
+    return true;
+}
+
+
+/** Take a packet of len bytes from the buckets, if both have enough.
+ *
+ *  The rates are in KiB and packets per second, zero meaning unlimited.
+ *  The buckets hold one second of either and start out full.
+ */
+bool token_bucket_take (struct token_bucket *tb,
+                        uint32_t max_rate,
+                        uint32_t max_pps,
+                        size_t len,
+                        uint64_t now) {
+
+    if(!token_bucket_check(tb, max_rate, max_pps, len, now)) {
+        return false;
+    }
+
+    if(max_rate) {
+        tb->bytes -= len * BYTE_TOKEN;
+    }
+    if(max_pps) {
+        tb->pkts -= PKT_TOKEN;
+    }
+
+    return true;
+}
+
+
+/* did a send fail because the socket is full */
+bool fq_congested (int err) {
+
+    return (err == EAGAIN) || (err == EWOULDBLOCK) || (err == ENOBUFS);
+}
+
+
+/* keep a copy of the datagram for later, false if the queue is full */
+bool fq_enqueue (struct fair_queue *q,
+                 const struct sockaddr_in *dest,
+                 const uint8_t *buf,
+                 size_t size) {
+
+    struct fq_packet *pkt;
+
+    if(q->len >= N2N_SN_FQ_MAX_PKTS) {
+        return false;
+    }
+
+    pkt = malloc(sizeof(*pkt) + size);
+    if(!pkt) {
+        return false;
+    }
+
+    pkt->next = NULL;
+    memcpy(&pkt->dest, dest, sizeof(pkt->dest));
+    pkt->size = size;
+    memcpy(pkt->buf, buf, size);
+
+    if(q->tail) {
+        q->tail->next = pkt;
+    } else {
+        q->head = pkt;
+    }
+    q->tail = pkt;
+    q->len++;
+
+    return true;
+}
+
+
+static void fq_pop (struct fair_queue *q) {
+
+    struct fq_packet *pkt = q->head;
+
+    q->head = pkt->next;
+    if(!q->head) {
+        q->tail = NULL;
+    }
+    q->len--;
+    free(pkt);
+}
+
+
+/** Send this queue's share of one deficit round robin round.
+ *
+ *  The quantum is only added when the deficit left does not cover the next
+ *  packet, so a queue picked up again after the socket blocked does not get
+ *  a second share. Sets blocked if the socket filled up again. Returns the
+ *  number of packets taken off the queue, including any that failed to send
+ *  for good.
+ */
+uint32_t fq_drain (struct fair_queue *q,
+                   SOCKET sock,
+                   uint32_t quantum,
+                   bool *blocked) {
+
+    uint32_t done = 0;
+
+    *blocked = false;
+    if(q->head && (q->head->size > q->deficit)) {
+        q->deficit += quantum;
+    }
+
+    while(q->head && (q->head->size <= q->deficit)) {
+        struct fq_packet *pkt = q->head;
+
+        ssize_t sent = sendto(sock, (void *)pkt->buf, pkt->size, FQ_SEND_FLAGS,
+                              (struct sockaddr *)&pkt->dest, sizeof(pkt->dest));
+
+        if((sent < 0) && fq_congested(errno)) {
+            *blocked = true;
+            return done;
+        }
+
+        q->deficit -= pkt->size;
+        fq_pop(q);
+        done++;
+    }
+
+    if(!q->head) {
+        q->deficit = 0;
+    }
+
+    return done;
+}
+
+
+/* drop everything queued, returns the number of packets dropped */
+uint32_t fq_clear (struct fair_queue *q) {
+
+    uint32_t dropped = q->len;
+
+    while(q->head) {
+        fq_pop(q);
+    }
+    q->deficit = 0;
+
+    return dropped;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Rate limiting and fair queuing of relayed data, non-public API
+ */
+
+#ifndef _SHAPER_H_
+#define _SHAPER_H_
+
+#include <n2n_typedefs.h>   // for struct token_bucket, struct fair_queue, SOCKET
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include "win32/defs.h"
+#else
+#include <netinet/in.h>     // for sockaddr_in
+#endif
+
+struct fq_packet {
+    struct fq_packet *next;
+    struct sockaddr_in dest;
+    size_t size;
+    uint8_t buf[];
+};
+
+bool token_bucket_check (struct token_bucket *tb,
+                         uint32_t max_rate,
+                         uint32_t max_pps,
+                         size_t len,
+                         uint64_t now);
+
+bool token_bucket_take (struct token_bucket *tb,
+                        uint32_t max_rate,
+                        uint32_t max_pps,
+                        size_t len,
+                        uint64_t now);
+
+bool fq_congested (int err);
+
+bool fq_enqueue (struct fair_queue *q,
+                 const struct sockaddr_in *dest,
+                 const uint8_t *buf,
+                 size_t size);
+
+uint32_t fq_drain (struct fair_queue *q,
+                   SOCKET sock,
+                   uint32_t quantum,
+                   bool *blocked);
+
+uint32_t fq_clear (struct fair_queue *q);
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Supernode registration limits per source address
+ *
+ * A new registration costs the supernode a lot more than relaying a packet:
+ * the community may need creating, the edge is added and a user/password
+ * community authenticates it with its Curve25519 derived keys. So does a
+ * datagram that decrypts with none of the communities' header keys, it has
+ * been tried against all of them. A flood of either from one address could
+ * keep the supernode busy for seconds.
+ *
+ * Each source address gets a token bucket, taken from by these datagrams
+ * only. Once it is empty, more of them from that address are dropped, while
+ * the traffic of the edges registered from there is not limited.
+ *
+ * An IPv6 source is tracked by its /64, as a single host can usually send
+ * from all of it. Addresses go into one of a set of slots, picked by a hash
+ * keyed with a random secret so that colliding addresses cannot be chosen.
+ * A new address only gets a full bucket in a slot unused for long enough
+ * to have refilled anyway. Otherwise it takes over the least recently used
+ * slot of the set together with its bucket, so a stream of new or spoofed
+ * addresses shares the buckets they drained.
+ */
+
+#include <n3n/random.h>         // for n3n_rand
+#include <string.h>             // for memcmp, memcpy, memset
+
+#include "pearson.h"            // for pearson_hash_16
+#include "sn_admit.h"
+
+#ifndef _WIN32
+#include <netinet/in.h>         // for sockaddr_in, sockaddr_in6
+#endif
+
+#define ADMIT_WAYS          4           /* slots an address may be in */
+#define ADMIT_SETS          (N2N_SN_ADMIT_SOURCES / ADMIT_WAYS)
+#define ADMIT_IDLE          1000000     /* usec, a bucket is full again after */
+
+
+void admit_table_init (struct admit_table *table) {
+
+    uint64_t rnd;
+    size_t i;
+
+    memset(table, 0, sizeof(*table));
+    for(i = 0; i < sizeof(table->key); i += sizeof(rnd)) {
+        rnd = n3n_rand();
+        memcpy(&table->key[i], &rnd, sizeof(rnd));
+    }
+}
+
+
+/* the first of the slots addr may be in */
+static struct admit_source *admit_set (struct admit_table *table, const uint8_t *addr, size_t len) {
+
+    uint8_t buf[sizeof(table->key) + 16];
+
+    memcpy(buf, table->key, sizeof(table->key));
+    memcpy(&buf[sizeof(table->key)], addr, len);
+
+    return &table->source[(pearson_hash_16(buf, sizeof(table->key) + len) % ADMIT_SETS) * ADMIT_WAYS];
+}
+
+
+/* the slot for the address the datagram came from, NULL for other families */
+struct admit_source *admit_source_find (struct admit_table *table,
+                                        const struct sockaddr *sa,
+                                        uint64_t now) {
+
+    struct admit_source *set, *source, *lru = NULL;
+    const uint8_t *addr;
+    size_t len;
+    int i;
+
+    switch(sa->sa_family) {
+        case AF_INET:
+            addr = (const uint8_t *)&((const struct sockaddr_in *)sa)->sin_addr;
+            len = 4;
+            break;
+        case AF_INET6:
+            addr = (const uint8_t *)&((const struct sockaddr_in6 *)sa)->sin6_addr;
+            len = 8;
+            break;
+        default:
+            return NULL;
+    }
+
+    set = admit_set(table, addr, len);
+
+    for(i = 0; i < ADMIT_WAYS; i++) {
+        source = &set[i];
+        if((source->family == sa->sa_family) && !memcmp(source->addr, addr, len)) {
+            return source;
+        }
+        if(!lru || (source->limit.refill < lru->limit.refill)) {
+            lru = source;
+        }
+    }
+
+    // an idle bucket is as good as a new one, a busy one is taken over as is
+    if(!lru->family || (now - lru->limit.refill >= ADMIT_IDLE)) {
+        memset(&lru->limit, 0, sizeof(lru->limit));
+    }
+    lru->family = sa->sa_family;
+    memset(lru->addr, 0, sizeof(lru->addr));
+    memcpy(lru->addr, addr, len);
+
+    return lru;
+}
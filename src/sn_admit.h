@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Supernode registration limits per source address, non-public API
+ */
+
+#ifndef _SN_ADMIT_H_
+#define _SN_ADMIT_H_
+
+#include <n2n_define.h>     // for N2N_SN_ADMIT_SOURCES
+#include <n2n_typedefs.h>   // for struct token_bucket
+#include <stdint.h>
+
+#ifdef _WIN32
+#include "win32/defs.h"
+#else
+#include <sys/socket.h>     // for sockaddr
+#endif
+
+struct admit_source {
+    uint8_t family;         // AF_INET or AF_INET6, 0 while unused
+    uint8_t addr[16];       // the address, for IPv6 only its /64 prefix
+    struct token_bucket limit;
+};
+
+struct admit_table {
+    uint8_t key[16];        // keeps the slots an address lands in unpredictable
+    struct admit_source source[N2N_SN_ADMIT_SOURCES];
+};
+
+void admit_table_init (struct admit_table *table);
+
+struct admit_source *admit_source_find (struct admit_table *table,
+                                        const struct sockaddr *sa,
+                                        uint64_t now);
+
+#endif
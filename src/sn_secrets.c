@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Keep the shared secrets of the supernode users across restarts
+ *
+ * A user's shared secret only depends on the public key from the community
+ * list and the supernode's private key, which is derived from the
+ * federation name. Still, every start calculated all of them again, and
+ * with a long community list the users could not register for that long.
+ *
+ * The secrets calculated are written to the sessiondir. On the next start
+ * (and on a reload of the community list) the users found there get their
+ * secret right away and only the others are calculated. The file carries a
+ * hash of the private key, a different federation name makes it ignored.
+ * Like the state snapshot, it is only meant to be read by the same build
+ * on the same machine. As it holds the secrets the users authenticate
+ * with, it is only readable by its owner.
+ */
+
+#include <n2n.h>                // for n2n_private_public_key_t
+#include <n3n/logging.h>        // for traceEvent
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>              // for fopen, fwrite, fread, rename
+#include <stdlib.h>             // for malloc, qsort, bsearch, free
+#include <string.h>             // for memcpy, memcmp, memset
+
+#include "n2n_typedefs.h"
+#include "pearson.h"            // for pearson_hash_256
+#include "sn_secrets.h"
+#include "sn_state.h"           // for sn_state_create_private
+#include "uthash.h"
+
+#define SN_SECRETS_MAGIC        "n3nsecr"
+#define SN_SECRETS_VERSION      1
+#define SN_SECRETS_BYTEORDER    0x01020304
+
+struct sn_secrets_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteorder;         // written in host order
+    uint32_t header_size;
+    uint32_t entry_size;
+    uint32_t nr_entries;
+    uint8_t reserved[4];
+    uint8_t key_hash[32];       // of the supernode private key
+};
+
+struct sn_secrets_entry {
+    n2n_private_public_key_t public_key;
+    n2n_private_public_key_t shared_secret;
+};
+
+struct sn_secrets_cache {
+    uint32_t count;
+    struct sn_secrets_entry entry[];    // sorted by public key
+};
+
+
+static void sn_secrets_path (struct n3n_runtime_data *sss, char *buf, size_t size) {
+    snprintf(buf, size, "%s/secrets", sss->conf.sessiondir);
+}
+
+static int sn_secrets_cmp (const void *a, const void *b) {
+    return memcmp(a, b, sizeof(n2n_private_public_key_t));
+}
+
+/*
+ * Write the secrets of all users that have one.
+ * Returns the number of entries written or -1 on error
+ */
+static int sn_secrets_write_entries (struct n3n_runtime_data *sss, FILE *f) {
+    struct sn_secrets_entry entry;
+    struct sn_community *comm, *tmp_comm;
+    sn_user_t *user, *tmp_user;
+    int count = 0;
+
+    HASH_ITER(hh, sss->communities, comm, tmp_comm) {
+        if(comm->is_federation) {
+            continue;
+        }
+        HASH_ITER(hh, comm->allowed_users, user, tmp_user) {
+            if(!user->shared_secret_ctx) {
+                continue;
+            }
+            memcpy(entry.public_key, user->public_key, sizeof(entry.public_key));
+            memcpy(entry.shared_secret, user->shared_secret, sizeof(entry.shared_secret));
+            if(fwrite(&entry, sizeof(entry), 1, f) != 1) {
+                return -1;
+            }
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * Save the shared secrets to the sessiondir.
+ * Returns the number of secrets saved or -1 on error
+ */
+int sn_secrets_save (struct n3n_runtime_data *sss) {
+    struct sn_secrets_header header;
+    char path[1024];
+    char tmppath[sizeof(path) + 4];
+    int nr_entries;
+
+    if(!sss->conf.sessiondir) {
+        return -1;
+    }
+
+    sn_secrets_path(sss, path, sizeof(path));
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+    // created readable by its owner only, not changed to that later
+    FILE *f = sn_state_create_private(tmppath);
+    if(!f) {
+        traceEvent(TRACE_WARNING, "cannot save shared secrets %s", tmppath);
+        return -1;
+    }
+
+    // The count is only known once the entries are written, so the
+    // header is written again at the end
+    memset(&header, 0, sizeof(header));
+    if(fwrite(&header, sizeof(header), 1, f) != 1) {
+        goto err_out;
+    }
+
+    nr_entries = sn_secrets_write_entries(sss, f);
+    if(nr_entries < 0) {
+        goto err_out;
+    }
+
+    memcpy(header.magic, SN_SECRETS_MAGIC, sizeof(header.magic));
+    header.version = SN_SECRETS_VERSION;
+    header.byteorder = SN_SECRETS_BYTEORDER;
+    header.header_size = sizeof(struct sn_secrets_header);
+    header.entry_size = sizeof(struct sn_secrets_entry);
+    header.nr_entries = nr_entries;
+    pearson_hash_256(header.key_hash, sss->private_key, sizeof(n2n_private_public_key_t));
+
+    if((fseek(f, 0, SEEK_SET) != 0) || (fwrite(&header, sizeof(header), 1, f) != 1)) {
+        goto err_out;
+    }
+
+    if(fclose(f) != 0) {
+        remove(tmppath);
+        return -1;
+    }
+
+#ifdef _WIN32
+    // rename() will not replace an existing file
+    remove(path);
+#endif
+    if(rename(tmppath, path) != 0) {
+        remove(tmppath);
+        return -1;
+    }
+
+    traceEvent(TRACE_INFO, "saved %i shared secrets to %s", nr_entries, path);
+    return nr_entries;
+
+err_out:
+    fclose(f);
+    remove(tmppath);
+    traceEvent(TRACE_WARNING, "cannot save shared secrets %s", tmppath);
+    return -1;
+}
+
+static bool sn_secrets_valid (struct n3n_runtime_data *sss, const struct sn_secrets_header *header, size_t size) {
+    uint8_t key_hash[sizeof(header->key_hash)];
+
+    if(memcmp(header->magic, SN_SECRETS_MAGIC, sizeof(header->magic))
+       || (header->version != SN_SECRETS_VERSION)
+       || (header->byteorder != SN_SECRETS_BYTEORDER)
+       || (header->header_size != sizeof(struct sn_secrets_header))
+       || (header->entry_size != sizeof(struct sn_secrets_entry))) {
+        return false;
+    }
+
+    uint64_t expected = (uint64_t)sizeof(struct sn_secrets_header)
+                        + (uint64_t)header->nr_entries * sizeof(struct sn_secrets_entry);
+    if(expected != size) {
+        return false;
+    }
+
+    // Another federation name gives another private key
+    pearson_hash_256(key_hash, sss->private_key, sizeof(n2n_private_public_key_t));
+    if(memcmp(header->key_hash, key_hash, sizeof(key_hash))) {
+        traceEvent(TRACE_INFO, "shared secrets are from another federation");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Read the shared secrets saved in the sessiondir, for the current
+ * private key.  Returns NULL if there are none usable, otherwise the
+ * cache to look them up in, to be freed with sn_secrets_free()
+ */
+struct sn_secrets_cache *sn_secrets_load (struct n3n_runtime_data *sss) {
+    struct sn_secrets_header header;
+    struct sn_secrets_cache *cache = NULL;
+    char path[1024];
+    long len;
+
+    if(!sss->conf.sessiondir) {
+        return NULL;
+    }
+
+    sn_secrets_path(sss, path, sizeof(path));
+    FILE *f = fopen(path, "rb");
+    if(!f) {
+        return NULL;
+    }
+
+    if((fseek(f, 0, SEEK_END) != 0) || ((len = ftell(f)) <= 0) || (fseek(f, 0, SEEK_SET) != 0)) {
+        goto out;
+    }
+    if(((size_t)len < sizeof(header)) || (fread(&header, sizeof(header), 1, f) != 1)) {
+        goto out;
+    }
+    if(!sn_secrets_valid(sss, &header, len)) {
+        traceEvent(TRACE_INFO, "ignoring shared secrets %s", path);
+        goto out;
+    }
+
+    cache = malloc(sizeof(*cache) + header.nr_entries * sizeof(struct sn_secrets_entry));
+    if(!cache) {
+        goto out;
+    }
+    cache->count = header.nr_entries;
+    if(cache->count && (fread(cache->entry, sizeof(struct sn_secrets_entry), cache->count, f) != cache->count)) {
+        free(cache);
+        cache = NULL;
+        goto out;
+    }
+
+    qsort(cache->entry, cache->count, sizeof(struct sn_secrets_entry), sn_secrets_cmp);
+
+out:
+    fclose(f);
+    return cache;
+}
+
+/*
+ * Look up the shared secret of a public key.
+ * Returns true and copies it to shared_secret if found
+ */
+bool sn_secrets_find (const struct sn_secrets_cache *cache,
+                      const n2n_private_public_key_t public_key,
+                      n2n_private_public_key_t shared_secret) {
+
+    const struct sn_secrets_entry *entry;
+
+    if(!cache) {
+        return false;
+    }
+
+    entry = bsearch(public_key, cache->entry, cache->count, sizeof(struct sn_secrets_entry), sn_secrets_cmp);
+    if(!entry) {
+        return false;
+    }
+
+    memcpy(shared_secret, entry->shared_secret, sizeof(n2n_private_public_key_t));
+    return true;
+}
+
+void sn_secrets_free (struct sn_secrets_cache *cache) {
+    free(cache);
+}
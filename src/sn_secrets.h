@@ -0,0 +1,24 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Supernode shared secrets cache, non-public API
+ */
+
+#ifndef _SN_SECRETS_H_
+#define _SN_SECRETS_H_
+
+#include <n2n_typedefs.h>   // for n2n_private_public_key_t
+#include <stdbool.h>
+
+struct n3n_runtime_data;
+struct sn_secrets_cache;
+
+int sn_secrets_save (struct n3n_runtime_data *sss);
+struct sn_secrets_cache *sn_secrets_load (struct n3n_runtime_data *sss);
+bool sn_secrets_find (const struct sn_secrets_cache *cache,
+                      const n2n_private_public_key_t public_key,
+                      n2n_private_public_key_t shared_secret);
+void sn_secrets_free (struct sn_secrets_cache *cache);
+
+#endif
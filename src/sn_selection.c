@@ -23,12 +23,14 @@
 #include <stdint.h>           // for UINT64_MAX, uint32_t, int64_t, uint64_t
 #include <stdio.h>            // for snprintf, NULL
 #include <string.h>           // for memcpy, memset
+#include <sys/time.h>         // for gettimeofday, timeval
+#include "minmax.h"           // for MIN
 #include "n2n.h"              // for n3n_runtime_data, SN_SELECTION_CRIT...
 #include "n2n_define.h"
 #include "n2n_typedefs.h"
 #include "n3n/ethernet.h"
 #include "peer_info.h"        // for peer_info_t
-#include "portable_endian.h"  // for be32toh, be64toh, htobe64
+#include "portable_endian.h"  // for be64toh
 #include "sn_selection.h"     // for selection_criterion_str_t, sn_selection_cr...
 #include "uthash.h"           // for UT_hash_handle, HASH_COUNT, HASH_ITER, HAS...
 
@@ -87,7 +89,8 @@ int sn_selection_criterion_calculate (struct n3n_runtime_data *eee, peer_info_t
     switch(eee->conf.sn_selection_strategy) {
 
         case SN_SELECTION_STRATEGY_LOAD: {
-            peer->selection_criterion = (SN_SELECTION_CRITERION_DATA_TYPE)(be32toh(*data) + common_data);
+            // the reported load has already been converted to host order while decoding
+            peer->selection_criterion = (SN_SELECTION_CRITERION_DATA_TYPE)(*data + common_data);
 
             /* Mitigation of the real supernode load in order to see less oscillations.
              * Edges jump from a supernode to another back and forth due to purging.
@@ -101,7 +104,11 @@ int sn_selection_criterion_calculate (struct n3n_runtime_data *eee, peer_info_t
         }
 
         case SN_SELECTION_STRATEGY_RTT: {
-            peer->selection_criterion = (SN_SELECTION_CRITERION_DATA_TYPE)((uint32_t)time_stamp() >> 22) - common_data;
+            // smoothed round trip time plus its deviation so that a jittery
+            // supernode ranks behind a steady one of the same average
+            if(peer->rtt) {
+                peer->selection_criterion = (SN_SELECTION_CRITERION_DATA_TYPE)peer->rtt + peer->rtt_var;
+            }
             break;
         }
 
@@ -153,7 +160,8 @@ int sn_selection_criterion_common_data_default (struct n3n_runtime_data *eee) {
         }
 
         case SN_SELECTION_STRATEGY_RTT: {
-            eee->sn_selection_criterion_common_data = (SN_SELECTION_CRITERION_DATA_TYPE)((uint32_t)time_stamp() >> 22);
+            // each supernode keeps its own measurement
+            eee->sn_selection_criterion_common_data = 0;
             break;
         }
 
@@ -177,6 +185,75 @@ int sn_selection_criterion_common_data_default (struct n3n_runtime_data *eee) {
 }
 
 
+/* Decide if the candidate is enough of an improvement over the current
+ * supernode to be worth switching to it */
+int sn_selection_criterion_better (struct n3n_runtime_data *eee, peer_info_t *candidate) {
+
+    SN_SELECTION_CRITERION_DATA_TYPE current = eee->curr_sn->selection_criterion;
+    SN_SELECTION_CRITERION_DATA_TYPE margin;
+
+    if(eee->conf.sn_selection_strategy != SN_SELECTION_STRATEGY_RTT) {
+        // the load strategy has its own stickyness, see above
+        return 1;
+    }
+
+    if(current >= (UINT64_MAX >> 2)) {
+        // current supernode has not been measured, so anything measured wins
+        return 1;
+    }
+
+    margin = current / SN_SELECTION_RTT_HYSTERESIS_DIV;
+    if(margin < SN_SELECTION_RTT_HYSTERESIS_MIN) {
+        margin = SN_SELECTION_RTT_HYSTERESIS_MIN;
+    }
+
+    return (candidate->selection_criterion + margin) < current;
+}
+
+
+/* Microseconds since the epoch, only used for differences */
+uint64_t sn_selection_usec_now (void) {
+
+    struct timeval tod;
+
+    gettimeofday(&tod, NULL);
+
+    return (uint64_t)tod.tv_sec * 1000000 + tod.tv_usec;
+}
+
+
+/* Take a round trip time sample for a probe sent at *sent and fold it into
+ * the smoothed estimate the same way as TCP does (RFC 6298) */
+void sn_selection_rtt_sample (peer_info_t *peer, uint64_t *sent) {
+
+    uint64_t now;
+    uint32_t sample;
+    uint32_t delta;
+
+    if(!*sent) {
+        // no probe outstanding
+        return;
+    }
+
+    now = sn_selection_usec_now();
+    sample = (now > *sent) ? MIN(now - *sent, UINT32_MAX >> 4) : 1;
+    *sent = 0;
+
+    if(!peer->rtt) {
+        peer->rtt = sample;
+        peer->rtt_var = sample / 2;
+        return;
+    }
+
+    delta = (peer->rtt > sample) ? peer->rtt - sample : sample - peer->rtt;
+    peer->rtt_var = (3 * peer->rtt_var + delta) / 4;
+    peer->rtt = (7 * peer->rtt + sample) / 8;
+    if(!peer->rtt) {
+        peer->rtt = 1;
+    }
+}
+
+
 /* Return the value of sn_selection_criterion_common_data field. */
 static SN_SELECTION_CRITERION_DATA_TYPE sn_selection_criterion_common_read (struct n3n_runtime_data *eee) {
 
@@ -210,6 +287,10 @@ int sn_selection_sort (peer_info_t **peer_list) {
 
 /* Function that gathers requested data on a supernode.
  * it remains unaffected by selection strategy because it refers to edge behaviour only
+ *
+ * The figure is the smoothed relay load (see sn_selection_load_update) plus
+ * the number of registered nodes, which only decides between idle supernodes.
+ * It is returned in host order, ready to be encoded as an uint32.
  */
 SN_SELECTION_CRITERION_DATA_TYPE sn_selection_criterion_gather_data (struct n3n_runtime_data *sss) {
 
@@ -226,7 +307,55 @@ SN_SELECTION_CRITERION_DATA_TYPE sn_selection_criterion_gather_data (struct n3n_
         data += tmp;
     }
 
-    return htobe64(data);
+    data += sss->load.value;
+
+    return MIN(data, UINT32_MAX);
+}
+
+
+/* Account the time spent handling one round of the supernode loop and, once
+ * a measurement window is complete, fold the loop utilisation and the
+ * relayed packet and byte rates into the smoothed load figure */
+void sn_selection_load_update (struct n3n_runtime_data *sss, uint64_t busy_since) {
+
+    struct sn_load *load = &sss->load;
+    uint64_t now = sn_selection_usec_now();
+    uint64_t elapsed;
+    uint64_t sample;
+
+    if(now < load->window_start) {
+        // clock went backwards, start over
+        load->window_start = 0;
+    }
+
+    if(!load->window_start) {
+        load->window_start = now;
+        load->busy = 0;
+        load->bytes = 0;
+        load->pkts = 0;
+        return;
+    }
+
+    if(now > busy_since) {
+        load->busy += now - busy_since;
+    }
+
+    elapsed = now - load->window_start;
+    if(elapsed < (uint64_t)SN_SELECTION_LOAD_WINDOW * 1000000) {
+        return;
+    }
+
+    sample = MIN(load->busy * 1000 / elapsed, 1000) * SN_SELECTION_LOAD_BUSY_WEIGHT;
+    sample += (uint64_t)load->pkts * 1000000 / elapsed / SN_SELECTION_LOAD_PKTS_PER_POINT;
+    sample += load->bytes * 1000000 / elapsed / SN_SELECTION_LOAD_BYTES_PER_POINT;
+    sample = MIN(sample, UINT32_MAX >> 2);
+
+    load->value = (load->value * (SN_SELECTION_LOAD_SMOOTHING - 1) + sample) / SN_SELECTION_LOAD_SMOOTHING;
+
+    load->window_start = now;
+    load->busy = 0;
+    load->bytes = 0;
+    load->pkts = 0;
 }
 
 
@@ -262,8 +391,9 @@ extern char * sn_selection_criterion_str (struct n3n_runtime_data *eee, selectio
                 chars = snprintf(
                     out,
                     SN_SELECTION_CRITERION_BUF_SIZE,
-                    "rtt = %6u ms",
-                    (uint32_t)peer->selection_criterion
+                    "rtt = %4u.%u ms",
+                    (uint32_t)(peer->selection_criterion / 1000),
+                    (uint32_t)(peer->selection_criterion % 1000) / 100
                 );
                 break;
             }
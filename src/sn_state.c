@@ -0,0 +1,561 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Save and restore the supernode registration state
+ *
+ * When a supernode restarts, every edge would otherwise have to register
+ * again before it can be reached and communities created on demand lose
+ * their auto ip subnet.  A snapshot of the registration state is written
+ * to the sessiondir on shutdown (or when asked to via the management API)
+ * and loaded again on start.
+ *
+ * The file is a fixed size header followed by three arrays of fixed size
+ * records (communities, edges and federation associations).  Each record
+ * is 8 byte aligned, so the file can be used in place once read (or
+ * mapped) into memory.  The edge and association records refer to their
+ * community by its index in the community array.  The file is only meant
+ * to be read by the same build on the same machine, so any change in the
+ * version, the byte order or the record sizes causes it to be ignored.
+ */
+
+#include <n2n.h>                // for sn_community_add, subnet_available
+#include <n3n/logging.h>        // for traceEvent
+#include <n3n/supernode.h>      // for calculate_dynamic_keys
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>              // for fopen, fwrite, fread, rename
+#include <stdlib.h>             // for malloc, calloc, free
+#include <string.h>             // for memcpy, memset, strncmp
+#include <time.h>               // for time
+
+#include "n2n_define.h"         // for REGISTRATION_TIMEOUT
+#include "n2n_typedefs.h"
+#include "n2n_wire.h"           // for fill_n2nsock, fill_sockaddr
+#include "peer_info.h"          // for peer_info_malloc, HASH_ADD_PEER
+#include "sn_state.h"
+#include "uthash.h"
+
+#ifdef _WIN32
+#include "win32/defs.h"
+#else
+#include <fcntl.h>              // for open, O_CREAT, O_EXCL
+#include <sys/socket.h>         // for sockaddr_storage
+#include <sys/stat.h>           // for S_IRUSR, S_IWUSR
+#include <unistd.h>             // for close
+#endif
+
+#define SN_STATE_MAGIC      "n3nstat"
+#define SN_STATE_VERSION    1
+#define SN_STATE_BYTEORDER  0x01020304
+
+struct sn_state_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteorder;         // written in host order
+    uint32_t header_size;
+    uint32_t community_size;
+    uint32_t edge_size;
+    uint32_t assoc_size;
+    uint32_t nr_communities;
+    uint32_t nr_edges;
+    uint32_t nr_assoc;
+    uint32_t dynamic_key_time;
+    uint64_t saved;
+    n2n_community_t federation;
+    uint8_t reserved[4];
+};
+
+struct sn_state_community {
+    n2n_community_t name;
+    uint32_t net_addr;          // auto ip subnet, host order
+    uint8_t net_bitlen;
+    uint8_t purgeable;
+    uint8_t reserved[6];
+};
+
+struct sn_state_edge {
+    uint64_t last_seen;
+    uint64_t last_valid_time_stamp;
+    uint32_t community;
+    uint32_t net_addr;
+    n2n_mac_t mac;
+    uint8_t net_bitlen;
+    uint8_t purgeable;
+    n2n_desc_t desc;
+    n2n_sock_t sock;
+    n2n_sock_t preferred_sock;
+    n2n_auth_t auth;
+    uint8_t reserved[4];
+};
+
+struct sn_state_assoc {
+    uint64_t last_seen;
+    uint32_t community;
+    n2n_mac_t mac;
+    n2n_sock_t sock;
+    uint8_t reserved[2];
+};
+
+static void sn_state_path (struct n3n_runtime_data *sss, char *buf, size_t size) {
+    snprintf(buf, size, "%s/state", sss->conf.sessiondir);
+}
+
+/*
+ * Write all records of one kind, numbering the communities the same way
+ * on every pass.  Returns the number of records written or -1 on error.
+ */
+static int sn_state_write_communities (struct n3n_runtime_data *sss, FILE *f) {
+    struct sn_community *comm, *tmp_comm;
+    struct sn_state_community rec;
+    int count = 0;
+
+    HASH_ITER(hh, sss->communities, comm, tmp_comm) {
+        if(comm->is_federation) {
+            continue;
+        }
+
+        memset(&rec, 0, sizeof(rec));
+        memcpy(rec.name, comm->community, sizeof(rec.name));
+        rec.net_addr = comm->auto_ip_net.net_addr;
+        rec.net_bitlen = comm->auto_ip_net.net_bitlen;
+        rec.purgeable = comm->purgeable;
+
+        if(fwrite(&rec, sizeof(rec), 1, f) != 1) {
+            return -1;
+        }
+        count++;
+    }
+
+    return count;
+}
+
+static int sn_state_write_edges (struct n3n_runtime_data *sss, FILE *f) {
+    struct sn_community *comm, *tmp_comm;
+    struct peer_info *edge, *tmp_edge;
+    struct sn_state_edge rec;
+    uint32_t index = 0;
+    int count = 0;
+
+    HASH_ITER(hh, sss->communities, comm, tmp_comm) {
+        if(comm->is_federation) {
+            continue;
+        }
+
+        HASH_ITER(hh, comm->edges, edge, tmp_edge) {
+            // A TCP connection does not survive the restart
+            if(edge->socket_fd != sss->sock) {
+                continue;
+            }
+
+            memset(&rec, 0, sizeof(rec));
+            rec.last_seen = edge->last_seen;
+            rec.last_valid_time_stamp = edge->last_valid_time_stamp;
+            rec.community = index;
+            rec.net_addr = edge->dev_addr.net_addr;
+            rec.net_bitlen = edge->dev_addr.net_bitlen;
+            memcpy(rec.mac, edge->mac_addr, sizeof(n2n_mac_t));
+            rec.purgeable = edge->purgeable;
+            memcpy(rec.desc, edge->dev_desc, sizeof(n2n_desc_t));
+            memcpy(&rec.sock, &edge->sock, sizeof(n2n_sock_t));
+            memcpy(&rec.preferred_sock, &edge->preferred_sock, sizeof(n2n_sock_t));
+            memcpy(&rec.auth, &edge->auth, sizeof(n2n_auth_t));
+
+            if(fwrite(&rec, sizeof(rec), 1, f) != 1) {
+                return -1;
+            }
+            count++;
+        }
+        index++;
+    }
+
+    return count;
+}
+
+static int sn_state_write_assoc (struct n3n_runtime_data *sss, FILE *f) {
+    struct sn_community *comm, *tmp_comm;
+    node_supernode_association_t *assoc, *tmp_assoc;
+    struct sn_state_assoc rec;
+    uint32_t index = 0;
+    int count = 0;
+
+    HASH_ITER(hh, sss->communities, comm, tmp_comm) {
+        if(comm->is_federation) {
+            continue;
+        }
+
+        HASH_ITER(hh, comm->assoc, assoc, tmp_assoc) {
+            memset(&rec, 0, sizeof(rec));
+            if(fill_n2nsock(&rec.sock, &assoc->sock, SOCK_DGRAM) != 0) {
+                continue;
+            }
+            rec.last_seen = assoc->last_seen;
+            rec.community = index;
+            memcpy(rec.mac, assoc->mac, sizeof(n2n_mac_t));
+
+            if(fwrite(&rec, sizeof(rec), 1, f) != 1) {
+                return -1;
+            }
+            count++;
+        }
+        index++;
+    }
+
+    return count;
+}
+
+/*
+ * Create a new file only readable by its owner, for the files in the
+ * sessiondir holding keys or tokens.  The sessiondir itself is world
+ * readable, so the permissions are set when the file is created, not
+ * afterwards.  A leftover from an interrupted save is replaced.
+ */
+FILE *sn_state_create_private (const char *path) {
+#ifdef _WIN32
+    return fopen(path, "wb");
+#else
+    remove(path);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_EXCL, S_IRUSR | S_IWUSR);
+    if(fd == -1) {
+        return NULL;
+    }
+
+    FILE *f = fdopen(fd, "wb");
+    if(!f) {
+        close(fd);
+    }
+    return f;
+#endif
+}
+
+/*
+ * Save the registration state to the sessiondir.
+ * Returns the number of edges saved or -1 on error
+ */
+int sn_state_save (struct n3n_runtime_data *sss) {
+    struct sn_state_header header;
+    char path[1024];
+    char tmppath[sizeof(path) + 4];
+    int nr_communities;
+    int nr_edges;
+    int nr_assoc;
+
+    if(!sss->conf.is_supernode || !sss->conf.sessiondir) {
+        return -1;
+    }
+
+    sn_state_path(sss, path, sizeof(path));
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+    // The edges' auth tokens are in there
+    FILE *f = sn_state_create_private(tmppath);
+    if(!f) {
+        traceEvent(TRACE_WARNING, "cannot save supernode state %s", tmppath);
+        return -1;
+    }
+
+    // The counts are only known once the records are written, so the
+    // header is written again at the end
+    memset(&header, 0, sizeof(header));
+    if(fwrite(&header, sizeof(header), 1, f) != 1) {
+        goto err_out;
+    }
+
+    nr_communities = sn_state_write_communities(sss, f);
+    nr_edges = sn_state_write_edges(sss, f);
+    nr_assoc = sn_state_write_assoc(sss, f);
+    if((nr_communities < 0) || (nr_edges < 0) || (nr_assoc < 0)) {
+        goto err_out;
+    }
+
+    memcpy(header.magic, SN_STATE_MAGIC, sizeof(header.magic));
+    header.version = SN_STATE_VERSION;
+    header.byteorder = SN_STATE_BYTEORDER;
+    header.header_size = sizeof(struct sn_state_header);
+    header.community_size = sizeof(struct sn_state_community);
+    header.edge_size = sizeof(struct sn_state_edge);
+    header.assoc_size = sizeof(struct sn_state_assoc);
+    header.nr_communities = nr_communities;
+    header.nr_edges = nr_edges;
+    header.nr_assoc = nr_assoc;
+    header.dynamic_key_time = sss->dynamic_key_time;
+    header.saved = time(NULL);
+    memcpy(header.federation, sss->federation->community, sizeof(n2n_community_t));
+
+    if((fseek(f, 0, SEEK_SET) != 0) || (fwrite(&header, sizeof(header), 1, f) != 1)) {
+        goto err_out;
+    }
+
+    if(fclose(f) != 0) {
+        remove(tmppath);
+        return -1;
+    }
+
+#ifdef _WIN32
+    // rename() will not replace an existing file
+    remove(path);
+#endif
+    if(rename(tmppath, path) != 0) {
+        remove(tmppath);
+        return -1;
+    }
+
+    traceEvent(
+        TRACE_NORMAL,
+        "saved %i edges in %i communities to %s",
+        nr_edges,
+        nr_communities,
+        path
+    );
+    return nr_edges;
+
+err_out:
+    fclose(f);
+    remove(tmppath);
+    traceEvent(TRACE_WARNING, "cannot save supernode state %s", tmppath);
+    return -1;
+}
+
+static void *sn_state_read (const char *path, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    if(!f) {
+        return NULL;
+    }
+
+    void *buf = NULL;
+    long len;
+    if((fseek(f, 0, SEEK_END) != 0) || ((len = ftell(f)) <= 0) || (fseek(f, 0, SEEK_SET) != 0)) {
+        goto out;
+    }
+
+    buf = malloc(len);
+    if(!buf) {
+        goto out;
+    }
+
+    if(fread(buf, len, 1, f) != 1) {
+        free(buf);
+        buf = NULL;
+        goto out;
+    }
+    *size = len;
+
+out:
+    fclose(f);
+    return buf;
+}
+
+static bool sn_state_valid (struct n3n_runtime_data *sss, const struct sn_state_header *header, size_t size) {
+    if(size < sizeof(*header)) {
+        return false;
+    }
+
+    if(memcmp(header->magic, SN_STATE_MAGIC, sizeof(header->magic))
+       || (header->version != SN_STATE_VERSION)
+       || (header->byteorder != SN_STATE_BYTEORDER)
+       || (header->header_size != sizeof(struct sn_state_header))
+       || (header->community_size != sizeof(struct sn_state_community))
+       || (header->edge_size != sizeof(struct sn_state_edge))
+       || (header->assoc_size != sizeof(struct sn_state_assoc))) {
+        return false;
+    }
+
+    uint64_t expected = (uint64_t)sizeof(struct sn_state_header)
+                        + (uint64_t)header->nr_communities * sizeof(struct sn_state_community)
+                        + (uint64_t)header->nr_edges * sizeof(struct sn_state_edge)
+                        + (uint64_t)header->nr_assoc * sizeof(struct sn_state_assoc);
+    if(expected != size) {
+        return false;
+    }
+
+    // A different federation has different keys and other supernodes
+    if(strncmp(header->federation, sss->federation->community, sizeof(n2n_community_t))) {
+        traceEvent(TRACE_INFO, "supernode state is from another federation");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Restore the registration state saved in the sessiondir, merging it with
+ * the communities already loaded.
+ * Returns the number of edges restored or -1 if there was no usable state
+ */
+int sn_state_load (struct n3n_runtime_data *sss) {
+    struct sn_state_header *header;
+    struct sn_state_community *communities;
+    struct sn_state_edge *edges;
+    struct sn_state_assoc *assocs;
+    struct sn_community **comms;
+    bool *wanted;
+    struct sn_community *comm;
+    struct peer_info *edge;
+    node_supernode_association_t *assoc;
+    struct sockaddr_storage sas;
+    char path[1024];
+    size_t size;
+    uint32_t i;
+    int nr_edges = 0;
+    int nr_assoc = 0;
+
+    if(!sss->conf.sessiondir) {
+        return -1;
+    }
+
+    sn_state_path(sss, path, sizeof(path));
+
+    header = sn_state_read(path, &size);
+    if(!header) {
+        return -1;
+    }
+
+    if(!sn_state_valid(sss, header, size)) {
+        traceEvent(TRACE_WARNING, "ignoring unusable supernode state %s", path);
+        free(header);
+        return -1;
+    }
+
+    communities = (struct sn_state_community *)(header + 1);
+    edges = (struct sn_state_edge *)(communities + header->nr_communities);
+    assocs = (struct sn_state_assoc *)(edges + header->nr_edges);
+
+    comms = calloc(header->nr_communities + 1, sizeof(*comms));
+    wanted = calloc(header->nr_communities + 1, sizeof(*wanted));
+    if(!comms || !wanted) {
+        free(comms);
+        free(wanted);
+        free(header);
+        return -1;
+    }
+
+    time_t now = time(NULL);
+    time_t edges_after = now - REGISTRATION_TIMEOUT;
+    time_t assoc_after = now - 3 * REGISTRATION_TIMEOUT;
+
+    // Only bring back a community created on demand if it still has edges
+    // that would not be purged straight away
+    for(i = 0; i < header->nr_edges; i++) {
+        if((edges[i].community < header->nr_communities) && (edges[i].last_seen >= edges_after)) {
+            wanted[edges[i].community] = true;
+        }
+    }
+
+    for(i = 0; i < header->nr_communities; i++) {
+        struct sn_state_community *rec = &communities[i];
+
+        rec->name[N2N_COMMUNITY_SIZE - 1] = '\0';
+
+        HASH_FIND_STR(sss->communities, rec->name, comm);
+        if(comm) {
+            comms[i] = comm;
+            continue;
+        }
+
+        if(!wanted[i] || !rec->purgeable || !sn_community_allowed(sss, rec->name)) {
+            continue;
+        }
+
+        comm = sn_community_add(sss, rec->name);
+        if(!comm) {
+            continue;
+        }
+        comms[i] = comm;
+
+        // Keep the subnet, and thus the addresses handed out, if possible
+        if((rec->net_bitlen != 0) && ((comm->auto_ip_net.net_addr != rec->net_addr)
+                                      || (comm->auto_ip_net.net_bitlen != rec->net_bitlen))
+           && subnet_available(sss, comm, rec->net_addr, bitlen2mask(rec->net_bitlen))) {
+            comm->auto_ip_net.net_addr = rec->net_addr;
+            comm->auto_ip_net.net_bitlen = rec->net_bitlen;
+        }
+    }
+
+    for(i = 0; i < header->nr_edges; i++) {
+        struct sn_state_edge *rec = &edges[i];
+
+        if((rec->community >= header->nr_communities) || (rec->last_seen < edges_after)) {
+            continue;
+        }
+        comm = comms[rec->community];
+        if(!comm) {
+            continue;
+        }
+
+        HASH_FIND_PEER(comm->edges, rec->mac, edge);
+        if(edge) {
+            continue;
+        }
+
+        edge = peer_info_malloc(rec->mac);
+        if(!edge) {
+            break;
+        }
+        edge->purgeable = rec->purgeable;
+        edge->dev_addr.net_addr = rec->net_addr;
+        edge->dev_addr.net_bitlen = rec->net_bitlen;
+        memcpy(edge->dev_desc, rec->desc, sizeof(n2n_desc_t));
+        edge->dev_desc[N2N_DESC_SIZE - 1] = '\0';
+        memcpy(&edge->sock, &rec->sock, sizeof(n2n_sock_t));
+        memcpy(&edge->preferred_sock, &rec->preferred_sock, sizeof(n2n_sock_t));
+        memcpy(&edge->auth, &rec->auth, sizeof(n2n_auth_t));
+        edge->socket_fd = sss->sock;
+        edge->last_seen = rec->last_seen;
+        edge->last_valid_time_stamp = rec->last_valid_time_stamp;
+
+        HASH_ADD_PEER(comm->edges, edge);
+        nr_edges++;
+    }
+
+    for(i = 0; i < header->nr_assoc; i++) {
+        struct sn_state_assoc *rec = &assocs[i];
+
+        if((rec->community >= header->nr_communities) || (rec->last_seen < assoc_after)) {
+            continue;
+        }
+        comm = comms[rec->community];
+        if(!comm) {
+            continue;
+        }
+
+        HASH_FIND(hh, comm->assoc, rec->mac, sizeof(n2n_mac_t), assoc);
+        if(assoc) {
+            continue;
+        }
+
+        memset(&sas, 0, sizeof(sas));
+        if(fill_sockaddr((struct sockaddr *)&sas, sizeof(sas), &rec->sock) != 0) {
+            continue;
+        }
+        update_node_supernode_association(
+            comm,
+            &rec->mac,
+            (struct sockaddr *)&sas,
+            (rec->sock.family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6),
+            rec->last_seen
+        );
+        nr_assoc++;
+    }
+
+    // Edges in user/pw communities keep using the dynamic key they were
+    // given, so go back to it
+    if(header->dynamic_key_time) {
+        sss->dynamic_key_time = header->dynamic_key_time;
+        calculate_dynamic_keys(sss);
+    }
+
+    traceEvent(
+        TRACE_NORMAL,
+        "restored %i edges and %i associations from %s",
+        nr_edges,
+        nr_assoc,
+        path
+    );
+
+    free(wanted);
+    free(comms);
+    free(header);
+    return nr_edges;
+}
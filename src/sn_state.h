@@ -0,0 +1,19 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Supernode registration state snapshot, non-public API
+ */
+
+#ifndef _SN_STATE_H_
+#define _SN_STATE_H_
+
+#include <stdio.h>      // for FILE
+
+struct n3n_runtime_data;
+
+FILE *sn_state_create_private (const char *path);
+int sn_state_save (struct n3n_runtime_data *sss);
+int sn_state_load (struct n3n_runtime_data *sss);
+
+#endif
@@ -23,7 +23,7 @@
 #include <errno.h>              // for errno, EAFNOSUPPORT
 #include <n3n/ethernet.h>       // for is_null_mac
 #include <n3n/logging.h>        // for traceEvent
-#include <n3n/random.h>         // for n3n_rand, n3n_rand_sqr
+#include <n3n/random.h>         // for n3n_rand
 #include <n3n/strings.h>        // for ip_subnet_to_str, sock_to_cstr
 #include <n3n/supernode.h>      // for load_allowed_sn_community, calculate_...
 #include <stdbool.h>
@@ -38,6 +38,7 @@
 #include "auth.h"               // for ascii_to_bin, calculate_dynamic_key
 #include "header_encryption.h"  // for packet_header_encrypt, packet_header_...
 #include "management.h"         // for process_mgmt
+#include "mcast_groups.h"       // for mcast_group_find, mcast_groups_report
 #include "minmax.h"                  // for MIN, MAX
 #include "n2n.h"                // for sn_community, n3n_runtime_data
 #include "n2n_define.h"
@@ -48,7 +49,13 @@
 #include "peer_info.h"          // for purge_peer_list, clear_peer_list
 #include "portable_endian.h"    // for be16toh, htobe16
 #include "resolve.h"            // for resolve_create_thread, resolve_cancel...
-#include "sn_selection.h"       // for sn_selection_criterion_gather_data
+#include "rx_queue.h"           // for rx_queue_fill, rx_queue_pop
+#include "shaper.h"             // for token_bucket_take, fq_enqueue, fq_drain
+#include "sn_admit.h"           // for admit_source_find, admit_table_init
+#include "sn_secrets.h"         // for sn_secrets_load, sn_secrets_find, sn_secr...
+#include "sn_selection.h"       // for sn_selection_criterion_gather_data, sn_sel...
+#include "sn_state.h"           // for sn_state_load, sn_state_save
+#include "sn_worker.h"          // for sn_job, sn_worker_submit
 #include "speck.h"              // for speck_128_encrypt, speck_context_t
 #include "uthash.h"             // for UT_hash_handle, HASH_ITER, HASH_DEL
 
@@ -78,6 +85,8 @@ static ssize_t sendto_peer (struct n3n_runtime_data *sss,
                             const uint8_t *pktbuf,
                             size_t pktsize);
 
+static void sn_fq_clear (struct n3n_runtime_data *sss, struct sn_community *comm);
+
 static uint16_t reg_lifetime (struct n3n_runtime_data *sss);
 
 static int update_edge (struct n3n_runtime_data *sss,
@@ -139,29 +148,162 @@ close_conn:
 /* *************************************************** */
 
 
-// generate shared secrets for user authentication; can be done only after
-// federation name is known and community list completely read
-void calculate_shared_secrets (struct n3n_runtime_data *sss) {
+struct sn_secret {
+    n2n_community_t community;
+    n2n_private_public_key_t public_key;
+    n2n_private_public_key_t shared_secret;
+};
+
+struct sn_secrets_job {
+    struct sn_job job;
+    n2n_private_public_key_t private_key;
+    uint32_t count;
+    struct sn_secret secret[];
+};
+
+
+static void sn_user_set_secret (sn_user_t *user, const n2n_private_public_key_t shared_secret) {
+
+    memcpy(user->shared_secret, shared_secret, sizeof(n2n_private_public_key_t));
+    // prepare for use as key
+    speck_deinit((speck_context_t*)user->shared_secret_ctx);
+    speck_init((speck_context_t**)&user->shared_secret_ctx, user->shared_secret, 128);
+}
+
+
+// the ECDH, on the worker thread
+static void shared_secrets_work (struct sn_job *job) {
+
+    struct sn_secrets_job *secrets = (struct sn_secrets_job *)job;
+
+    for(uint32_t i = 0; i < secrets->count; i++) {
+        generate_shared_secret(secrets->secret[i].shared_secret,
+                               secrets->private_key,
+                               secrets->secret[i].public_key);
+    }
+}
+
+
+// hand the secrets to the users still there, unless the private key has changed since
+static void shared_secrets_done (struct n3n_runtime_data *sss, struct sn_job *job) {
+
+    struct sn_secrets_job *secrets = (struct sn_secrets_job *)job;
+    struct sn_community *comm;
+    sn_user_t *user;
+
+    if(memcmp(secrets->private_key, sss->private_key, sizeof(n2n_private_public_key_t))) {
+        free(secrets);
+        return;
+    }
+
+    for(uint32_t i = 0; i < secrets->count; i++) {
+        HASH_FIND_COMMUNITY(sss->communities, secrets->secret[i].community, comm);
+        if(!comm) {
+            continue;
+        }
+        HASH_FIND(hh, comm->allowed_users, secrets->secret[i].public_key, sizeof(n2n_private_public_key_t), user);
+        if(!user) {
+            continue;
+        }
+        sn_user_set_secret(user, secrets->secret[i].shared_secret);
+    }
+
+    traceEvent(TRACE_INFO, "calculated shared secrets for edge authentication");
+    free(secrets);
+
+    // spare the next start the calculation
+    sn_secrets_save(sss);
+}
+
+
+// start the shared secrets calculation for all users or those without one
+// yet. the secrets saved in the sessiondir are used right away, the others
+// are calculated. once the main loop runs, this happens on the worker thread
+// and the users cannot register until their secret is in place
+static void sn_calculate_secrets (struct n3n_runtime_data *sss, bool all) {
 
     struct sn_community *comm, *tmp_comm;
     sn_user_t *user, *tmp_user;
+    struct sn_secrets_cache *cache;
+    struct sn_secrets_job *secrets;
+    n2n_private_public_key_t shared_secret;
+    uint32_t cached = 0;
+    uint32_t count = 0;
 
-    traceEvent(TRACE_INFO, "started shared secrets calculation for edge authentication");
+    cache = sn_secrets_load(sss);
 
-    generate_private_key(sss->private_key, sss->federation->community + 1); /* skip '*' federation leading character */
     HASH_ITER(hh, sss->communities, comm, tmp_comm) {
         if(comm->is_federation) {
             continue;
         }
         HASH_ITER(hh, comm->allowed_users, user, tmp_user) {
-            // calculate common shared secret (ECDH)
-            generate_shared_secret(user->shared_secret, sss->private_key, user->public_key);
-            // prepare for use as key
-            speck_init((speck_context_t**)&user->shared_secret_ctx, user->shared_secret, 128);
+            if(all) {
+                speck_deinit((speck_context_t*)user->shared_secret_ctx);
+                user->shared_secret_ctx = NULL;
+            }
+            if(user->shared_secret_ctx) {
+                continue;
+            }
+            if(sn_secrets_find(cache, user->public_key, shared_secret)) {
+                sn_user_set_secret(user, shared_secret);
+                cached++;
+                continue;
+            }
+            count++;
         }
     }
+    sn_secrets_free(cache);
 
-    traceEvent(TRACE_INFO, "calculated shared secrets for edge authentication");
+    if(cached) {
+        traceEvent(TRACE_INFO, "restored %u shared secrets for edge authentication", cached);
+    }
+    if(!count) {
+        return;
+    }
+
+    traceEvent(TRACE_INFO, "started shared secrets calculation for edge authentication [%u users]", count);
+
+    secrets = calloc(1, sizeof(struct sn_secrets_job) + count * sizeof(struct sn_secret));
+    if(!secrets) {
+        traceEvent(TRACE_ERROR, "cannot allocate the shared secrets calculation");
+        return;
+    }
+    secrets->job.work = shared_secrets_work;
+    secrets->job.done = shared_secrets_done;
+    memcpy(secrets->private_key, sss->private_key, sizeof(n2n_private_public_key_t));
+
+    HASH_ITER(hh, sss->communities, comm, tmp_comm) {
+        if(comm->is_federation) {
+            continue;
+        }
+        HASH_ITER(hh, comm->allowed_users, user, tmp_user) {
+            if(user->shared_secret_ctx) {
+                continue;
+            }
+            memcpy(secrets->secret[secrets->count].community, comm->community, sizeof(n2n_community_t));
+            memcpy(secrets->secret[secrets->count].public_key, user->public_key, sizeof(n2n_private_public_key_t));
+            secrets->count++;
+        }
+    }
+
+    sn_worker_submit(sss->worker, sss, &secrets->job);
+}
+
+
+// generate shared secrets for user authentication; can be done only after
+// federation name is known and community list completely read
+void calculate_shared_secrets (struct n3n_runtime_data *sss) {
+
+    generate_private_key(sss->private_key, sss->federation->community + 1); /* skip '*' federation leading character */
+    sn_calculate_secrets(sss, true);
+}
+
+
+// the same for the users added by a reload of the community list
+static void calculate_new_shared_secrets (struct n3n_runtime_data *sss) {
+
+    generate_private_key(sss->private_key, sss->federation->community + 1); /* skip '*' federation leading character */
+    sn_calculate_secrets(sss, false);
 }
 
 
@@ -235,12 +377,174 @@ void send_re_register_super (struct n3n_runtime_data *sss) {
 }
 
 
-/** Load the list of allowed communities. Existing/previous ones will be removed,
- *  return 0 on success, -1 if file not found, -2 if no valid entries found
+#define COMM_LIST_WORDS_MAX     8   /* name, sub-network and relay limits */
+
+/* the keys of the relay limits that may follow a community's name */
+static const char *comm_limit_keys[] = {
+    "max_rate", "max_pps", "edge_max_rate", "edge_max_pps", NULL
+};
+
+
+/* whether a word of the community list is one of the 'key=value' limits */
+static bool comm_is_limit (const char *word) {
+
+    size_t len;
+    int i;
+
+    for(i = 0; comm_limit_keys[i]; i++) {
+        len = strlen(comm_limit_keys[i]);
+        if(!strncmp(word, comm_limit_keys[i], len) && (word[len] == '=')) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/** Set a community's relay limits from the 'key=value' words following its
+ *  name and sub-network in the community list. */
+static void comm_set_limits (struct sn_community *comm, char **words, int num_words) {
+
+    char *word;
+    char key[32];
+    uint32_t value;
+    int i;
+
+    for(i = 0; i < num_words; i++) {
+        word = words[i];
+        if(sscanf(word, "%31[^=]=%u", key, &value) != 2) {
+            traceEvent(TRACE_WARNING, "bad limit '%s' for community '%s', ignoring",
+                       word, comm->community);
+            continue;
+        }
+
+        if(!strcmp(key, "max_rate")) {
+            comm->max_rate = value;
+        } else if(!strcmp(key, "max_pps")) {
+            comm->max_pps = value;
+        } else if(!strcmp(key, "edge_max_rate")) {
+            comm->edge_max_rate = value;
+        } else if(!strcmp(key, "edge_max_pps")) {
+            comm->edge_max_pps = value;
+        } else {
+            traceEvent(TRACE_WARNING, "unknown limit '%s' for community '%s', ignoring",
+                       key, comm->community);
+            continue;
+        }
+        traceEvent(TRACE_INFO, "set %s=%u for community '%s'", key, value, comm->community);
+    }
+}
+
+
+/* take an edge off its community, closing its TCP connection if there is one */
+static void sn_edge_remove (struct n3n_runtime_data *sss,
+                            struct sn_community *comm,
+                            struct peer_info *edge) {
+
+    n2n_tcp_connection_t *conn = NULL;
+
+    if((edge->socket_fd != sss->sock) && (edge->socket_fd >= 0)) {
+        HASH_FIND_INT(sss->tcp_connections, &(edge->socket_fd), conn);
+    }
+
+    if(conn) {
+        close_tcp_connection(sss, conn); /* also deletes the edge */
+    } else {
+        HASH_DEL(comm->edges, edge);
+        peer_info_free(edge);
+    }
+}
+
+
+/* drop the edges of a community and their associations, they re-register */
+static void sn_community_drop_edges (struct n3n_runtime_data *sss, struct sn_community *comm) {
+
+    struct peer_info *edge, *tmp_edge;
+    node_supernode_association_t *assoc, *tmp_assoc;
+
+    HASH_ITER(hh, comm->edges, edge, tmp_edge) {
+        sn_edge_remove(sss, comm, edge);
+    }
+
+    HASH_ITER(hh, comm->assoc, assoc, tmp_assoc) {
+        HASH_DEL(comm->assoc, assoc);
+        free(assoc);
+    }
+}
+
+
+/* remove a community no longer allowed by the community.list */
+static void sn_community_remove (struct n3n_runtime_data *sss, struct sn_community *comm) {
+
+    sn_user_t *user, *tmp_user;
+
+    traceEvent(TRACE_INFO, "removed community '%s'", comm->community);
+
+    sn_community_drop_edges(sss, comm);
+
+    HASH_ITER(hh, comm->allowed_users, user, tmp_user) {
+        speck_deinit((speck_context_t*)user->shared_secret_ctx);
+        HASH_DEL(comm->allowed_users, user);
+        free(user);
+    }
+
+    mcast_groups_clear(&comm->mcast_groups);
+    sn_fq_clear(sss, comm);
+
+    HASH_DEL(sss->communities, comm);
+    // remove header encryption keys
+    free(comm->header_encryption_ctx_static);
+    free(comm->header_iv_ctx_static);
+    free(comm->header_encryption_ctx_dynamic);
+    free(comm->header_iv_ctx_dynamic);
+    free(comm);
+}
+
+
+/* remove the users no longer listed, along with the edges registered as them */
+static void sn_community_sweep_users (struct n3n_runtime_data *sss, struct sn_community *comm) {
+
+    sn_user_t *user, *tmp_user;
+    struct peer_info *edge, *tmp_edge;
+
+    HASH_ITER(hh, comm->allowed_users, user, tmp_user) {
+        if(!user->reload_unseen) {
+            continue;
+        }
+
+        HASH_ITER(hh, comm->edges, edge, tmp_edge) {
+            if((edge->auth.scheme == n2n_auth_user_password)
+               && !memcmp(edge->auth.token, user->public_key, sizeof(n2n_private_public_key_t))) {
+                sn_edge_remove(sss, comm, edge);
+            }
+        }
+
+        traceEvent(TRACE_INFO, "removed user '%s' from community '%s'",
+                   user->name, comm->community);
+        speck_deinit((speck_context_t*)user->shared_secret_ctx);
+        HASH_DEL(comm->allowed_users, user);
+        free(user);
+    }
+}
+
+
+/** Load the list of allowed communities, return 0 on success, -1 if file not
+ *  found, -2 if no valid entries found.
+ *
+ *  A reload only applies the differences to the communities already there.
+ *  The edges of communities and users still listed stay registered and only
+ *  the users new to the list need their shared secret calculated. Removed
+ *  communities and the edges of removed users are dropped, as are those of
+ *  a community switching to or from user/password authentication.  A new
+ *  sub-network only applies to the edges registering from then on, those
+ *  already running keep the address they were given.
  */
 int load_allowed_sn_community (struct n3n_runtime_data *sss) {
 
     char buffer[4096], *line, *cmn_str, net_str[20], format[20];
+    char *words[COMM_LIST_WORDS_MAX], *word, *saveptr;
+    int num_words, num_limits;
 
     sn_user_t *user, *tmp_user;
     n2n_desc_t username;
@@ -254,12 +558,11 @@ int load_allowed_sn_community (struct n3n_runtime_data *sss) {
     FILE *fd = fopen(sss->conf.community_file, "r");
 
     struct sn_community *comm, *tmp_comm, *last_added_comm = NULL;
-    struct peer_info *edge, *tmp_edge;
-    node_supernode_association_t *assoc, *tmp_assoc;
-    n2n_tcp_connection_t *conn;
     time_t any_time = 0;
+    bool reload = sss->lock_communities;
 
     uint32_t num_communities = 0;
+    uint32_t num_added = 0;
 
     struct sn_community_regular_expression *re, *tmp_re;
     uint32_t num_regex = 0;
@@ -270,55 +573,20 @@ int load_allowed_sn_community (struct n3n_runtime_data *sss) {
         return -1;
     }
 
-    // reset data structures ------------------------------
+    // mark what is there, the entries found in the file are unmarked -----
 
-    // send RE_REGISTER_SUPER to all edges from user/pw auth communites, this is safe because
-    // follow-up REGISTER_SUPER cannot be handled before this function ends
-    send_re_register_super(sss);
-
-    // remove communities (not: federation)
     HASH_ITER(hh, sss->communities, comm, tmp_comm) {
         if(comm->is_federation) {
             continue;
         }
-
-        // remove all edges from community
-        HASH_ITER(hh, comm->edges, edge, tmp_edge) {
-            // remove all edge associations (with other supernodes)
-            HASH_ITER(hh, comm->assoc, assoc, tmp_assoc) {
-                HASH_DEL(comm->assoc, assoc);
-                free(assoc);
-            }
-
-            // close TCP connections, if any (also causes reconnect)
-            // and delete edge from list
-            if((edge->socket_fd != sss->sock) && (edge->socket_fd >= 0)) {
-                HASH_FIND_INT(sss->tcp_connections, &(edge->socket_fd), conn);
-                close_tcp_connection(sss, conn); /* also deletes the edge */
-            } else {
-                HASH_DEL(comm->edges, edge);
-                peer_info_free(edge);
-            }
-        }
-
-        // remove allowed users from community
+        comm->reload_unseen = true;
+        comm->reload_had_users = (comm->allowed_users != NULL);
         HASH_ITER(hh, comm->allowed_users, user, tmp_user) {
-            speck_deinit((speck_context_t*)user->shared_secret_ctx);
-            HASH_DEL(comm->allowed_users, user);
-            free(user);
+            user->reload_unseen = true;
         }
-
-        // remove community
-        HASH_DEL(sss->communities, comm);
-        // remove header encryption keys
-        free(comm->header_encryption_ctx_static);
-        free(comm->header_iv_ctx_static);
-        free(comm->header_encryption_ctx_dynamic);
-        free(comm->header_iv_ctx_dynamic);
-        free(comm);
     }
 
-    // remove all regular expressions for allowed communities
+    // the regular expressions are cheap to compile again
     HASH_ITER(hh, sss->rules, re, tmp_re) {
         HASH_DEL(sss->rules, re);
         free(re);
@@ -326,11 +594,12 @@ int load_allowed_sn_community (struct n3n_runtime_data *sss) {
 
     // prepare reading data -------------------------------
 
-    // new key_time for all communities, requires dynamic keys to be recalculated (see further below),
-    // and  edges to re-register (see above) and ...
-    sss->dynamic_key_time = time(NULL);
-    // ... federated supernodes to re-register
-    re_register_and_purge_supernodes(sss, sss->federation, &any_time, any_time, 1 /* forced */);
+    if(!reload) {
+        // new key_time for all communities, requires dynamic keys to be calculated (see further below),
+        // and federated supernodes to re-register
+        sss->dynamic_key_time = time(NULL);
+        re_register_and_purge_supernodes(sss, sss->federation, &any_time, any_time, 1 /* forced */);
+    }
 
     // format definition for possible user-key entries
     sprintf(
@@ -364,12 +633,19 @@ int load_allowed_sn_community (struct n3n_runtime_data *sss) {
         if(line[0] == N2N_USER_KEY_LINE_STARTER) { /* special first character */
             if(sscanf(line, format, username, ascii_public_key) == 2) { /* correct format */
                 if(last_added_comm) { /* is there a valid community to add users to */
+                    ascii_to_bin(public_key, ascii_public_key);
+                    HASH_FIND(hh, last_added_comm->allowed_users, public_key, sizeof(n2n_private_public_key_t), user);
+                    if(user) {
+                        // still listed, keeps its shared secret
+                        user->reload_unseen = false;
+                        memcpy(user->name, username, sizeof(username));
+                        continue;
+                    }
                     user = (sn_user_t*)calloc(1, sizeof(sn_user_t));
                     if(user) {
                         // username
                         memcpy(user->name, username, sizeof(username));
                         // public key
-                        ascii_to_bin(public_key, ascii_public_key);
                         memcpy(user->public_key, public_key, sizeof(public_key));
                         // common shared secret will be calculated later
                         // add to list
@@ -377,12 +653,18 @@ int load_allowed_sn_community (struct n3n_runtime_data *sss) {
                         traceEvent(TRACE_INFO, "added user '%s' with public key '%s' to community '%s'",
                                    user->name, ascii_public_key, last_added_comm->community);
                         // enable header encryption
-                        last_added_comm->header_encryption = HEADER_ENCRYPTION_ENABLED;
-                        packet_header_setup_key(last_added_comm->community,
-                                                &(last_added_comm->header_encryption_ctx_static),
-                                                &(last_added_comm->header_encryption_ctx_dynamic),
-                                                &(last_added_comm->header_iv_ctx_static),
-                                                &(last_added_comm->header_iv_ctx_dynamic));
+                        if(last_added_comm->header_encryption != HEADER_ENCRYPTION_ENABLED) {
+                            last_added_comm->header_encryption = HEADER_ENCRYPTION_ENABLED;
+                            free(last_added_comm->header_encryption_ctx_static);
+                            free(last_added_comm->header_iv_ctx_static);
+                            free(last_added_comm->header_encryption_ctx_dynamic);
+                            free(last_added_comm->header_iv_ctx_dynamic);
+                            packet_header_setup_key(last_added_comm->community,
+                                                    &(last_added_comm->header_encryption_ctx_static),
+                                                    &(last_added_comm->header_encryption_ctx_dynamic),
+                                                    &(last_added_comm->header_iv_ctx_static),
+                                                    &(last_added_comm->header_iv_ctx_dynamic));
+                        }
                         // dynamic key setup follows at a later point in code
                     }
                     continue;
@@ -392,9 +674,29 @@ int load_allowed_sn_community (struct n3n_runtime_data *sss) {
 
         // --- community name or regular expression
 
-        // cut off any IP sub-network upfront
+        // split into the name, an optional IP sub-network and the relay
+        // limits, only words with a known key count as the latter so that
+        // a name or sub-network containing '=' is still taken as such
+        num_words = 0;
+        for(word = strtok_r(line, " \t", &saveptr); word; word = strtok_r(NULL, " \t", &saveptr)) {
+            if(num_words == COMM_LIST_WORDS_MAX) {
+                traceEvent(TRACE_WARNING, "too many words for community '%s', ignoring '%s' onwards",
+                           words[0], word);
+                break;
+            }
+            words[num_words++] = word;
+        }
+        if(!num_words) {
+            continue;
+        }
+
         cmn_str = (char*)calloc(len + 1, sizeof(char));
-        has_net = (sscanf(line, "%s %s", cmn_str, net_str) == 2);
+        strcpy(cmn_str, words[0]);
+        has_net = (num_words > 1) && !comm_is_limit(words[1]);
+        if(has_net) {
+            snprintf(net_str, sizeof(net_str), "%s", words[1]);
+        }
+        num_limits = num_words - (has_net ? 2 : 1);
 
         // if it contains typical characters...
         if(NULL != strpbrk(cmn_str, ".*+?[]\\")) {
@@ -405,33 +707,62 @@ int load_allowed_sn_community (struct n3n_runtime_data *sss) {
                 HASH_ADD_PTR(sss->rules, rule, re);
                 num_regex++;
                 traceEvent(TRACE_INFO, "added regular expression for allowed communities '%s'", cmn_str);
+                if(num_limits) {
+                    traceEvent(TRACE_WARNING, "relay limits for '%s' ignored, only supported for fixed-name communities", cmn_str);
+                }
                 free(cmn_str);
                 last_added_comm = NULL;
                 continue;
             }
         }
 
-        comm = (struct sn_community*)calloc(1,sizeof(struct sn_community));
+        HASH_FIND_COMMUNITY(sss->communities, cmn_str, comm);
+        if(comm && comm->is_federation) {
+            traceEvent(TRACE_WARNING, "community '%s' is the federation, ignoring", cmn_str);
+            free(cmn_str);
+            last_added_comm = NULL;
+            continue;
+        }
 
-        if(comm != NULL) {
-            comm_init(comm, cmn_str);
+        if(comm) {
+            // still listed, keeps its edges and keys
+            comm->reload_unseen = false;
             /* loaded from file, this community is unpurgeable */
             comm->purgeable = false;
-            /* we do not know if header encryption is used in this community,
-             * first packet will show. just in case, setup the key. */
-            comm->header_encryption = HEADER_ENCRYPTION_UNKNOWN;
-            packet_header_setup_key(comm->community,
-                                    &(comm->header_encryption_ctx_static),
-                                    &(comm->header_encryption_ctx_dynamic),
-                                    &(comm->header_iv_ctx_static),
-                                    &(comm->header_iv_ctx_dynamic));
-            HASH_ADD_STR(sss->communities, community, comm);
+            comm->max_rate = 0;
+            comm->max_pps = 0;
+            comm->edge_max_rate = 0;
+            comm->edge_max_pps = 0;
+        } else {
+            comm = (struct sn_community*)calloc(1,sizeof(struct sn_community));
+            if(comm != NULL) {
+                comm_init(comm, cmn_str);
+                /* loaded from file, this community is unpurgeable */
+                comm->purgeable = false;
+                /* we do not know if header encryption is used in this community,
+                 * first packet will show. just in case, setup the key. */
+                comm->header_encryption = HEADER_ENCRYPTION_UNKNOWN;
+                packet_header_setup_key(comm->community,
+                                        &(comm->header_encryption_ctx_static),
+                                        &(comm->header_encryption_ctx_dynamic),
+                                        &(comm->header_iv_ctx_static),
+                                        &(comm->header_iv_ctx_dynamic));
+                HASH_ADD_STR(sss->communities, community, comm);
+                num_added++;
+            }
+        }
+
+        if(comm != NULL) {
             last_added_comm = comm;
 
             num_communities++;
             traceEvent(TRACE_INFO, "added allowed community '%s' [total: %u]",
                        (char*)comm->community, num_communities);
 
+            if(num_limits) {
+                comm_set_limits(comm, &words[num_words - num_limits], num_limits);
+            }
+
             // check for sub-network address
             if(has_net) {
                 if(sscanf(net_str, "%15[^/]/%hhu", ip_str, &bitlen) != 2) {
@@ -454,6 +785,12 @@ int load_allowed_sn_community (struct n3n_runtime_data *sss) {
                 }
             }
             if(has_net) {
+                if(comm->auto_ip_net.net_addr
+                   && ((comm->auto_ip_net.net_addr != ntohl(net)) || (comm->auto_ip_net.net_bitlen != bitlen))) {
+                    traceEvent(TRACE_WARNING, "community '%s' moved to a new sub-network, its edges "
+                               "already registered keep their addresses until they restart",
+                               comm->community);
+                }
                 comm->auto_ip_net.net_addr = ntohl(net);
                 comm->auto_ip_net.net_bitlen = bitlen;
                 struct in_addr *tmp = (struct in_addr *)&net;
@@ -461,7 +798,7 @@ int load_allowed_sn_community (struct n3n_runtime_data *sss) {
                            inet_ntoa(*tmp),
                            comm->auto_ip_net.net_bitlen,
                            comm->community);
-            } else {
+            } else if(!comm->auto_ip_net.net_addr) {
                 assign_one_ip_subnet(sss, comm);
             }
         }
@@ -470,26 +807,68 @@ int load_allowed_sn_community (struct n3n_runtime_data *sss) {
 
     fclose(fd);
 
+    // sweep what is no longer listed -----------------------
+
+    // no new communities will be allowed
+    sss->lock_communities = true;
+
+    HASH_ITER(hh, sss->communities, comm, tmp_comm) {
+        if(comm->is_federation) {
+            continue;
+        }
+        if(comm->reload_unseen) {
+            // one brought up by an edge stays if a rule still allows it
+            if(comm->purgeable && sn_community_allowed(sss, comm->community)) {
+                comm->reload_unseen = false;
+                continue;
+            }
+            sn_community_remove(sss, comm);
+            continue;
+        }
+
+        sn_community_sweep_users(sss, comm);
+
+        if(reload && (comm->reload_had_users != (comm->allowed_users != NULL))) {
+            // the edges need to register with the other kind of authentication
+            traceEvent(TRACE_INFO, "community '%s' changed its authentication, dropping its edges",
+                       comm->community);
+            sn_community_drop_edges(sss, comm);
+            if(!comm->allowed_users) {
+                // back to the static key only, the first packet will show
+                comm->header_encryption = HEADER_ENCRYPTION_UNKNOWN;
+                free(comm->header_encryption_ctx_static);
+                free(comm->header_iv_ctx_static);
+                free(comm->header_encryption_ctx_dynamic);
+                free(comm->header_iv_ctx_dynamic);
+                packet_header_setup_key(comm->community,
+                                        &(comm->header_encryption_ctx_static),
+                                        &(comm->header_encryption_ctx_dynamic),
+                                        &(comm->header_iv_ctx_static),
+                                        &(comm->header_iv_ctx_dynamic));
+            }
+        }
+    }
+
     if((num_regex + num_communities) == 0) {
         traceEvent(TRACE_WARNING, "file %s does not contain any valid community names or regular expressions", sss->conf.community_file);
         return -2;
     }
 
-    traceEvent(TRACE_NORMAL, "loaded %u fixed-name communities from %s",
-               num_communities, sss->conf.community_file);
+    traceEvent(TRACE_NORMAL, "loaded %u fixed-name communities (%u new) from %s",
+               num_communities, num_added, sss->conf.community_file);
 
     traceEvent(TRACE_NORMAL, "loaded %u regular expressions for community name matching from %s",
                num_regex, sss->conf.community_file);
 
-    // calculate allowed user's shared secrets (shared with federation)
-    calculate_shared_secrets(sss);
+    // calculate the shared secrets (shared with federation) of the users new to the list,
+    // on the first load the caller does that for all once the sessiondir is set up
+    if(reload) {
+        calculate_new_shared_secrets(sss);
+    }
 
-    // calculcate communties' dynamic keys
+    // calculcate communties' dynamic keys, unchanged for those already there
     calculate_dynamic_keys(sss);
 
-    // no new communities will be allowed
-    sss->lock_communities = true;
-
     return 0;
 }
 
@@ -618,21 +997,160 @@ static ssize_t sendto_peer (struct n3n_runtime_data *sss,
 }
 
 
+/** Send a message to an edge of a community, PACKET data fair queued.
+ *
+ *    PACKET data for an edge reached over the UDP socket is sent without
+ *    blocking. While the socket is congested, or data of any community is
+ *    still waiting, it goes into the community's fair queue instead. Other
+ *    messages are sent straight away, ahead of any queued data.
+ *
+ *    @return -1 on error, 0 if dropped with the queue full, otherwise the
+ *    number of bytes sent or queued
+ */
+static ssize_t sendto_edge (struct n3n_runtime_data *sss,
+                            struct sn_community *comm,
+                            const n2n_common_t *cmn,
+                            const struct peer_info *peer,
+                            const uint8_t *pktbuf,
+                            size_t pktsize) {
+
+    struct sockaddr_in socket;
+    ssize_t sent;
+
+    if((cmn->pc != MSG_TYPE_PACKET)
+       || ((peer->socket_fd >= 0) && (peer->socket_fd != sss->sock))
+       || (peer->sock.family != AF_INET)) {
+        return sendto_peer(sss, peer, pktbuf, pktsize);
+    }
+
+    fill_sockaddr((struct sockaddr *)&socket, sizeof(socket), &(peer->sock));
+
+    if(!sss->fq_backlog) {
+        sent = sendto(sss->sock, (void *)pktbuf, pktsize,
+#ifdef MSG_DONTWAIT
+                      MSG_DONTWAIT,
+#else
+                      0 /* flags */,
+#endif
+                      (const struct sockaddr *)&socket, sizeof(socket));
+
+        if((sent >= 0) || !fq_congested(errno)) {
+            return sent;
+        }
+    }
+
+    if(!fq_enqueue(&comm->fq, &socket, pktbuf, pktsize)) {
+        ++(comm->fq_drop);
+        ++(sss->stats.sn_fq_drop);
+        return 0;
+    }
+    ++(comm->fq_queued);
+    ++(sss->stats.sn_fq_queued);
+    ++(sss->fq_backlog);
+
+    return pktsize;
+}
+
+
+/** Send the queued PACKET data, deficit round robin between the
+ *  communities, until all is sent or the socket is full again. */
+static void sn_fq_service (struct n3n_runtime_data *sss) {
+
+    struct sn_community *comm = sss->fq_next ? sss->fq_next : sss->communities;
+    bool blocked;
+
+    while(sss->fq_backlog && comm) {
+        if(comm->fq.len) {
+            sss->fq_backlog -= fq_drain(&comm->fq, sss->sock, N2N_SN_FQ_QUANTUM, &blocked);
+            if(blocked) {
+                sss->fq_next = comm;
+                return;
+            }
+        }
+        comm = comm->hh.next ? (struct sn_community *)comm->hh.next : sss->communities;
+    }
+
+    sss->fq_next = NULL;
+}
+
+
+/* drop the PACKET data a community has queued, before it is freed */
+static void sn_fq_clear (struct n3n_runtime_data *sss, struct sn_community *comm) {
+
+    sss->fq_backlog -= fq_clear(&comm->fq);
+    if(sss->fq_next == comm) {
+        sss->fq_next = NULL;
+    }
+}
+
+
+/** Police the PACKET data an edge sends through the supernode, against the
+ *  limits of its community and its own. Data from other supernodes has been
+ *  policed by the supernode the edge is registered with. */
+static bool sn_rate_admit (struct n3n_runtime_data *sss,
+                           struct sn_community *comm,
+                           const n2n_mac_t srcMac,
+                           size_t pktsize) {
+
+    struct peer_info *edge;
+    uint64_t now = sn_selection_usec_now();
+
+    HASH_FIND_PEER(comm->edges, srcMac, edge);
+    if(edge && !token_bucket_take(&edge->limit,
+                                  comm->edge_max_rate ? comm->edge_max_rate : sss->conf.sn_edge_max_rate,
+                                  comm->edge_max_pps ? comm->edge_max_pps : sss->conf.sn_edge_max_pps,
+                                  pktsize, now)) {
+        ++(comm->rate_drop);
+        ++(sss->stats.sn_rate_drop);
+        return false;
+    }
+
+    if(!token_bucket_take(&comm->limit,
+                          comm->max_rate ? comm->max_rate : sss->conf.sn_community_max_rate,
+                          comm->max_pps ? comm->max_pps : sss->conf.sn_community_max_pps,
+                          pktsize, now)) {
+        ++(comm->rate_drop);
+        ++(sss->stats.sn_rate_drop);
+        return false;
+    }
+
+    return true;
+}
+
+
+/* Did the sender of a broadcast say it sends its broadcasts to edge itself */
+static bool bcast_peer_listed (const struct peer_info *sender, const n2n_mac_t edge) {
+
+    int i;
+
+    for(i = 0; i < sender->num_bcast_peers; i++) {
+        if(!memcmp(sender->bcast_peers[i], edge, sizeof(n2n_mac_t))) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
 /** Try and broadcast a message to all edges in the community.
  *
  *    This will send the exact same datagram to zero or more edges registered to
  *    the supernode.
  */
 static void try_broadcast (struct n3n_runtime_data * sss,
-                           const struct sn_community *comm,
+                           struct sn_community *comm,
                            const n2n_common_t * cmn,
                            const n2n_mac_t srcMac,
+                           const n2n_mac_t dstMac,
                            bool from_supernode,
                            const uint8_t * pktbuf,
                            size_t pktsize,
                            time_t now) {
 
     struct peer_info        *scan, *tmp;
+    struct peer_info        *sender = NULL;
+    struct mcast_group      *group = NULL;
     macstr_t mac_buf;
     n2n_sock_str_t sockbuf;
 
@@ -663,6 +1181,8 @@ static void try_broadcast (struct n3n_runtime_data * sss,
                                strerror(errno));
                 } else {
                     ++(sss->stats.sn_broadcast);
+                    ++(sss->load.pkts);
+                    sss->load.bytes += pktsize;
                     traceEvent(TRACE_DEBUG, "multicast %lu to supernode [%s] %s",
                                pktsize,
                                sock_to_cstr(sockbuf, &(scan->sock)),
@@ -674,15 +1194,45 @@ static void try_broadcast (struct n3n_runtime_data * sss,
 
     if(comm) {
         // If we know this community, send the broadcast to all known edges
+        // but for a group some edges joined, only to these and to the edges
+        // not telling their groups
+
+        if(dstMac) {
+            group = mcast_group_find(comm->mcast_groups, dstMac);
+        }
+
+        // and not to the edges the sender has sent it to directly
+        if(dstMac && !from_supernode) {
+            HASH_FIND_PEER(comm->edges, srcMac, sender);
+            if(sender && (sender->bcast_report + BCAST_PEERS_TIMEOUT <= now)) {
+                sender = NULL;
+            }
+        }
 
         HASH_ITER(hh, comm->edges, scan, tmp) {
             if(memcmp(srcMac, scan->mac_addr, sizeof(n2n_mac_t)) != 0) {
                 /* REVISIT: exclude if the destination socket is where the packet came from. */
                 int data_sent_len;
 
-                data_sent_len = sendto_peer(sss, scan, pktbuf, pktsize);
+                if(sender && bcast_peer_listed(sender, scan->mac_addr)) {
+                    ++(sss->stats.sn_bcast_skip);
+                    continue;
+                }
 
-                if(data_sent_len != pktsize) {
+                if(group && (scan->mcast_report + MCAST_GROUP_TIMEOUT > now)) {
+                    if(!mcast_group_has_member(group, scan->mac_addr)) {
+                        ++(group->pruned);
+                        continue;
+                    }
+                    ++(group->tx);
+                }
+
+                data_sent_len = sendto_edge(sss, comm, cmn, scan, pktbuf, pktsize);
+
+                if(data_sent_len == 0) {
+                    // dropped, the community's queue is full
+                    continue;
+                } else if(data_sent_len != pktsize) {
                     ++(sss->stats.sn_errors);
                     traceEvent(TRACE_WARNING, "multicast %lu to [%s] %s failed %s",
                                pktsize,
@@ -691,6 +1241,8 @@ static void try_broadcast (struct n3n_runtime_data * sss,
                                strerror(errno));
                 } else {
                     ++(sss->stats.sn_broadcast);
+                    ++(sss->load.pkts);
+                    sss->load.bytes += pktsize;
                     traceEvent(TRACE_DEBUG, "multicast %lu to [%s] %s",
                                pktsize,
                                sock_to_cstr(sockbuf, &(scan->sock)),
@@ -705,7 +1257,7 @@ static void try_broadcast (struct n3n_runtime_data * sss,
 
 
 static void try_forward (struct n3n_runtime_data * sss,
-                         const struct sn_community *comm,
+                         struct sn_community *comm,
                          const n2n_common_t * cmn,
                          const n2n_mac_t dstMac,
                          bool from_supernode,
@@ -724,10 +1276,15 @@ static void try_forward (struct n3n_runtime_data * sss,
         // We found an edge matching the dest mac
 
         int data_sent_len;
-        data_sent_len = sendto_peer(sss, scan, pktbuf, pktsize);
+        data_sent_len = sendto_edge(sss, comm, cmn, scan, pktbuf, pktsize);
 
-        if(data_sent_len == pktsize) {
+        if(data_sent_len == 0) {
+            // dropped, the community's queue is full
+            return;
+        } else if(data_sent_len == pktsize) {
             ++(sss->stats.sn_fwd);
+            ++(sss->load.pkts);
+            sss->load.bytes += pktsize;
             traceEvent(TRACE_DEBUG, "unicast %lu to [%s] %s",
                        pktsize,
                        sock_to_cstr(sockbuf, &(scan->sock)),
@@ -756,6 +1313,8 @@ static void try_forward (struct n3n_runtime_data * sss,
             sendto_sock(sss, sss->sock,
                         &(assoc->sock),
                         pktbuf, pktsize);
+            ++(sss->load.pkts);
+            sss->load.bytes += pktsize;
             return;
         } else {
             // otherwise, forwarding packet to all federated supernodes
@@ -768,6 +1327,7 @@ static void try_forward (struct n3n_runtime_data * sss,
                 NULL,
                 cmn,
                 sss->conf.sn_mac_addr,
+                NULL,
                 from_supernode,
                 pktbuf,
                 pktsize,
@@ -788,6 +1348,143 @@ static void try_forward (struct n3n_runtime_data * sss,
 }
 
 
+/** Send an edge the socket of another edge, as if it had asked for it. */
+static void send_peer_info (struct n3n_runtime_data *sss,
+                            const struct sn_community *comm,
+                            const struct peer_info *to,
+                            const struct peer_info *about) {
+
+    n2n_common_t cmn;
+    n2n_PEER_INFO_t pi;
+    uint8_t encbuf[N2N_SN_PKTBUF_SIZE];
+    size_t encx = 0;
+
+    memset(&cmn, 0, sizeof(cmn));
+    cmn.ttl = N2N_DEFAULT_TTL;
+    cmn.pc = MSG_TYPE_PEER_INFO;
+    cmn.flags = N2N_FLAGS_FROM_SUPERNODE;
+    memcpy(cmn.community, comm->community, sizeof(n2n_community_t));
+
+    memset(&pi, 0, sizeof(pi));
+    memcpy(pi.srcMac, to->mac_addr, sizeof(n2n_mac_t));
+    memcpy(pi.mac, about->mac_addr, sizeof(n2n_mac_t));
+    pi.sock = about->sock;
+    if(about->preferred_sock.family != (uint8_t)AF_INVALID) {
+        cmn.flags |= N2N_FLAGS_SOCKET;
+        pi.preferred_sock = about->preferred_sock;
+    }
+
+    encode_PEER_INFO(encbuf, &encx, &cmn, &pi);
+
+    if(comm->header_encryption == HEADER_ENCRYPTION_ENABLED) {
+        packet_header_encrypt(encbuf, encx, encx, comm->header_encryption_ctx_dynamic,
+                              comm->header_iv_ctx_dynamic,
+                              time_stamp());
+    }
+
+    if(sendto_peer(sss, to, encbuf, encx) == (ssize_t)encx) {
+        ++(sss->stats.sn_peer_info_push);
+    }
+}
+
+
+/* whether PEER_INFO for the flow between edge and mac went out recently */
+static bool push_peer_info_recent (const struct peer_info *edge,
+                                   const n2n_mac_t mac,
+                                   time_t now) {
+
+    int i;
+
+    for(i = 0; i < PEER_INFO_PUSH_SLOTS; i++) {
+        if(!memcmp(edge->push[i].mac, mac, sizeof(n2n_mac_t))
+           && ((now - edge->push[i].last) < PEER_INFO_PUSH_INTERVAL)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/* note the push for the flow between edge and mac, over its oldest slot */
+static void push_peer_info_note (struct peer_info *edge,
+                                 const n2n_mac_t mac,
+                                 time_t now) {
+
+    int i, oldest = 0;
+
+    for(i = 0; i < PEER_INFO_PUSH_SLOTS; i++) {
+        if(!memcmp(edge->push[i].mac, mac, sizeof(n2n_mac_t))) {
+            oldest = i;
+            break;
+        }
+        if(edge->push[i].last < edge->push[oldest].last) {
+            oldest = i;
+        }
+    }
+
+    memcpy(edge->push[oldest].mac, mac, sizeof(n2n_mac_t));
+    edge->push[oldest].last = now;
+}
+
+
+/** Tell both edges of a flow we relay where to find each other.
+ *
+ *    Without this, the sending edge only learns its peer's socket once its
+ *    rate limited QUERY_PEER is answered, and the receiving edge only has the
+ *    socket we saw the packet coming from.  Pushing PEER_INFO to both lets
+ *    them start hole punching, to public and local sockets alike, with the
+ *    first packets of the flow.  Each flow gets at most one push every
+ *    PEER_INFO_PUSH_INTERVAL, and each community sn_peer_info_push per second.
+ *    Both edges remember their last PEER_INFO_PUSH_SLOTS flows, either of
+ *    them having this one means it was pushed already.
+ *    Edges connected by TCP cannot go p2p and are left alone.
+ */
+static void push_peer_info (struct n3n_runtime_data *sss,
+                            struct sn_community *comm,
+                            const n2n_mac_t srcMac,
+                            const n2n_mac_t dstMac,
+                            time_t now) {
+
+    struct peer_info *src, *dst;
+
+    if(!sss->conf.sn_peer_info_push || comm->is_federation) {
+        return;
+    }
+
+    HASH_FIND_PEER(comm->edges, srcMac, src);
+    HASH_FIND_PEER(comm->edges, dstMac, dst);
+    if(!src || !dst) {
+        return;
+    }
+
+    if(((src->socket_fd >= 0) && (src->socket_fd != sss->sock))
+       || ((dst->socket_fd >= 0) && (dst->socket_fd != sss->sock))) {
+        return;
+    }
+
+    if(push_peer_info_recent(src, dstMac, now)
+       || push_peer_info_recent(dst, srcMac, now)) {
+        return;
+    }
+
+    if(comm->peer_info_push_second != now) {
+        comm->peer_info_push_second = now;
+        comm->peer_info_push_count = 0;
+    }
+    if(comm->peer_info_push_count >= sss->conf.sn_peer_info_push) {
+        return;
+    }
+    comm->peer_info_push_count++;
+
+    push_peer_info_note(src, dstMac, now);
+    push_peer_info_note(dst, srcMac, now);
+
+    send_peer_info(sss, comm, src, dst);
+    send_peer_info(sss, comm, dst, src);
+}
+
+
 /** Initialise some fields of the community structure **/
 int comm_init (struct sn_community *comm, char *cmn) {
 
@@ -799,6 +1496,60 @@ int comm_init (struct sn_community *comm, char *cmn) {
 }
 
 
+/** Check if a community not (yet) known to the supernode may be used */
+bool sn_community_allowed (struct n3n_runtime_data *sss, const char *name) {
+
+    struct sn_community_regular_expression *re, *tmp_re;
+    int allowed_match;
+    int match_length = 0;
+
+    if(!sss->lock_communities) {
+        return true;
+    }
+
+    HASH_ITER(hh, sss->rules, re, tmp_re) {
+        allowed_match = re_matchp(re->rule, name, &match_length);
+
+        if((allowed_match != -1)
+           && (match_length == strlen(name)) // --- only full matches allowed (remove, if also partial matches wanted)
+           && (allowed_match == 0)) {        // --- only full matches allowed (remove, if also partial matches wanted)
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/** Add a purgeable community as introduced by a REGISTER_SUPER */
+struct sn_community *sn_community_add (struct n3n_runtime_data *sss, const char *name) {
+
+    struct sn_community *comm;
+
+    comm = (struct sn_community*)calloc(1, sizeof(struct sn_community));
+    if(!comm) {
+        return NULL;
+    }
+
+    comm_init(comm, (char *)name);
+    /* new communities introduced by REGISTERs could not have had encrypted header... */
+    comm->header_encryption = HEADER_ENCRYPTION_NONE;
+    free(comm->header_encryption_ctx_static);
+    comm->header_encryption_ctx_static = NULL;
+    free(comm->header_encryption_ctx_dynamic);
+    comm->header_encryption_ctx_dynamic = NULL;
+    /* ... and also are purgeable during periodic purge */
+    comm->purgeable = true;
+    comm->number_enc_packets = 0;
+    HASH_ADD_STR(sss->communities, community, comm);
+
+    traceEvent(TRACE_INFO, "new community: %s", comm->community);
+    assign_one_ip_subnet(sss, comm);
+
+    return comm;
+}
+
+
 /** Initialise the supernode structure */
 void sn_init_conf_defaults (struct n3n_runtime_data *sss, char *sessionname) {
     // TODO: this should accept a conf parameter, not a sss
@@ -815,6 +1566,8 @@ void sn_init_conf_defaults (struct n3n_runtime_data *sss, char *sessionname) {
 
     conf->is_supernode = true;
     conf->spoofing_protection = true;
+    conf->sn_peer_info_push = PEER_INFO_PUSH_RATE_DFL;
+    conf->sn_register_source_max_pps = REGISTER_SOURCE_RATE_DFL;
 
     strncpy(conf->version, VERSION, sizeof(n2n_version_t));
     conf->version[sizeof(n2n_version_t) - 1] = '\0';
@@ -902,6 +1655,8 @@ void sn_init_conf_defaults (struct n3n_runtime_data *sss, char *sessionname) {
 
 /** Initialise the supernode */
 void sn_init (struct n3n_runtime_data *sss) {
+    sn_state_load(sss);
+
     if(resolve_create_thread(&(sss->resolve_parameter), sss->federation->edges) == 0) {
         traceEvent(TRACE_INFO, "successfully created resolver thread");
     }
@@ -919,6 +1674,8 @@ void sn_term (struct n3n_runtime_data *sss) {
 
     resolve_cancel_thread(sss->resolve_parameter);
 
+    sn_state_save(sss);
+
     if(sss->sock >= 0) {
         closesocket(sss->sock);
     }
@@ -958,6 +1715,9 @@ void sn_term (struct n3n_runtime_data *sss) {
             free(user);
         }
 
+        mcast_groups_clear(&community->mcast_groups);
+        sn_fq_clear(sss, community);
+
         HASH_DEL(sss->communities, community);
         free(community);
     }
@@ -1075,7 +1835,7 @@ static int auth_edge (const n2n_auth_t *present, const n2n_auth_t *presented, n2
     if((present->scheme == n2n_auth_user_password) && (presented->scheme == n2n_auth_user_password)) {
         // check if submitted public key is in list of allowed users
         HASH_FIND(hh, community->allowed_users, &presented->token, sizeof(n2n_private_public_key_t), user);
-        if(user) {
+        if(user && user->shared_secret_ctx) {
             if(answer) {
                 memcpy(answer, presented, sizeof(n2n_auth_t));
 
@@ -1143,7 +1903,7 @@ static int handle_remote_auth (struct n3n_runtime_data *sss, const n2n_auth_t *r
         case n2n_auth_user_password:
             // check if submitted public key is in list of allowed users
             HASH_FIND(hh, community->allowed_users, &remote_auth->token, sizeof(n2n_private_public_key_t), user);
-            if(user) {
+            if(user && user->shared_secret_ctx) {
                 memcpy(answer_auth, remote_auth, sizeof(n2n_auth_t));
 
                 // return a double-encrypted challenge (just encrypt again) in the (first half of) public key field so edge can verify
@@ -1562,6 +2322,8 @@ static int purge_expired_communities (struct n3n_runtime_data *sss,
         // purge the community's local peers
         num_reg += purge_peer_list(&comm->edges, sss->sock, &sss->tcp_connections, now - REGISTRATION_TIMEOUT);
 
+        mcast_groups_purge(&comm->mcast_groups, now - MCAST_GROUP_TIMEOUT);
+
         // purge the community's associated peers (connected to other supernodes)
         HASH_ITER(hh, comm->assoc, assoc, tmp_assoc) {
             if(comm->assoc->last_seen < (now - 3 * REGISTRATION_TIMEOUT)) {
@@ -1585,6 +2347,8 @@ static int purge_expired_communities (struct n3n_runtime_data *sss,
                 HASH_DEL(comm->assoc, assoc);
                 free(assoc);
             }
+            mcast_groups_clear(&comm->mcast_groups);
+            sn_fq_clear(sss, comm);
             HASH_DEL(sss->communities, comm);
             free(comm);
         }
@@ -1628,45 +2392,21 @@ static int sort_communities (struct n3n_runtime_data *sss,
 
     (*p_last_sort) = now;
 
-    return 0;
-}
-
-
-/** Examine a datagram and determine what to do with it.
- *
- */
-static int process_udp (struct n3n_runtime_data * sss,
-                        const struct sockaddr *sender_sock, socklen_t sock_size,
-                        const SOCKET socket_fd,
-                        uint8_t * udp_buf,
-                        size_t udp_size,
-                        time_t now,
-                        int type) {
-
-    n2n_common_t cmn;        /* common fields in the packet header */
-    size_t rem;
-    size_t idx;
-    size_t msg_type;
-    bool from_supernode;
-    struct peer_info *sn = NULL;
-    n2n_sock_t sender;
-    n2n_sock_t          *orig_sender;
-    macstr_t mac_buf;
-    macstr_t mac_buf2;
-    n2n_sock_str_t sockbuf;
-    uint8_t hash_buf[16] = {0};             /* always size of 16 (max) despite the actual value of N2N_REG_SUP_HASH_CHECK_LEN (<= 16) */
-
-    struct sn_community *comm, *tmp;
-    uint32_t header_enc = 0;            /* 1 == encrypted by static key, 2 == encrypted by dynamic key */
-    uint64_t stamp;
-    int skip_add;
-    time_t any_time = 0;
+    return 0;
+}
 
-    fill_n2nsock(&sender, sender_sock, SOCK_DGRAM);
-    orig_sender = &sender;
 
-    traceEvent(TRACE_DEBUG, "processing incoming UDP packet [len: %lu][sender: %s]",
-               udp_size, sock_to_cstr(sockbuf, &sender));
+/** Decrypt the header of a datagram in place and find its community.
+ *
+ *  Returns -1 if the datagram is to be dropped.
+ */
+static int sn_header_decrypt (struct n3n_runtime_data *sss,
+                              uint8_t *udp_buf,
+                              size_t udp_size,
+                              struct rx_header *hdr) {
+
+    struct sn_community *comm, *tmp;
+    uint32_t header_enc = 0;            /* 1 == encrypted by static key, 2 == encrypted by dynamic key */
 
     /* check if header is unencrypted. the following check is around 99.99962 percent reliable.
      * it heavily relies on the structure of packet's common part
@@ -1681,6 +2421,8 @@ static int process_udp (struct n3n_runtime_data * sss,
        && (udp_buf[00] == N2N_PKT_VERSION) // correct packet version
        && ((be16toh(*(uint16_t*)&(udp_buf[02])) & N2N_FLAGS_TYPE_MASK) <= MSG_TYPE_MAX_TYPE) // message type
        && ( be16toh(*(uint16_t*)&(udp_buf[02])) < N2N_FLAGS_OPTIONS_MAX) // flags
+       // relayed PACKETs only go between edges, keeping the range what it was before
+       && !(be16toh(*(uint16_t*)&(udp_buf[02])) & N2N_FLAGS_RELAYED)
     ) {
         /* most probably unencrypted */
         /* make sure, no downgrading happens here and no unencrypted packets can be
@@ -1718,13 +2460,13 @@ static int process_udp (struct n3n_runtime_data * sss,
             if(packet_header_decrypt(udp_buf, udp_size,
                                      comm->community,
                                      comm->header_encryption_ctx_dynamic, comm->header_iv_ctx_dynamic,
-                                     &stamp)) {
+                                     &hdr->stamp)) {
                 header_enc = 2;
             }
             if(!header_enc) {
-                pearson_hash_128(hash_buf, udp_buf, MAX(0, (int)udp_size - (int)N2N_REG_SUP_HASH_CHECK_LEN));
+                pearson_hash_128(hdr->hash_buf, udp_buf, MAX(0, (int)udp_size - (int)N2N_REG_SUP_HASH_CHECK_LEN));
                 header_enc = packet_header_decrypt(udp_buf, MAX(0, (int)udp_size - (int)N2N_REG_SUP_HASH_CHECK_LEN), comm->community,
-                                                   comm->header_encryption_ctx_static, comm->header_iv_ctx_static, &stamp);
+                                                   comm->header_encryption_ctx_static, comm->header_iv_ctx_static, &hdr->stamp);
             }
 
             if(header_enc) {
@@ -1753,6 +2495,140 @@ static int process_udp (struct n3n_runtime_data * sss,
         }
     }
 
+    hdr->comm = comm;
+    hdr->header_enc = header_enc;
+
+    return 0;
+}
+
+
+/* is the datagram a REGISTER_SUPER from an edge not registered yet */
+static bool sn_rx_new_registration (const struct rx_entry *entry) {
+
+    struct sn_community *comm = entry->hdr.comm;
+    n2n_REGISTER_SUPER_t reg;
+    n2n_common_t cmn;
+    struct peer_info *peer;
+    size_t rem = entry->size;
+    size_t idx = 0;
+
+    if(decode_common(&cmn, entry->buf, &rem, &idx) < 0) {
+        return false;
+    }
+    if(cmn.pc != MSG_TYPE_REGISTER_SUPER) {
+        return false;
+    }
+    if(!comm) {
+        return true;
+    }
+    if(decode_REGISTER_SUPER(&reg, &cmn, entry->buf, &rem, &idx) < 0) {
+        return false;
+    }
+
+    HASH_FIND_PEER(comm->edges, reg.edgeMac, peer);
+
+    return !peer;
+}
+
+
+/* take from the bucket of the address the datagram came from, false if empty */
+static bool sn_rx_source_take (struct n3n_runtime_data *sss, const struct rx_entry *entry, uint64_t now) {
+
+    uint32_t source_pps = sss->conf.sn_register_source_max_pps;
+    struct admit_source *source;
+
+    if(!source_pps || !sss->admit) {
+        return true;
+    }
+
+    source = admit_source_find(sss->admit, (const struct sockaddr *)&entry->sas, now);
+    if(!source) {
+        return true;
+    }
+
+    return token_bucket_take(&source->limit, 0, source_pps, 0, now);
+}
+
+
+/** Sorts a datagram read into the rx_queue, see rx_queue_fill().
+ *
+ *  Only the datagrams that are costly for the supernode are charged to
+ *  the limit of their source address: those decrypting with no community's
+ *  key and the registrations of unknown edges.  The latter are dropped
+ *  once their source is over the limit, otherwise go into the admit class,
+ *  behind the traffic of the edges already registered.  That traffic is
+ *  never limited here, however many bad datagrams share its address.
+ */
+static int sn_rx_classify (void *arg, struct rx_entry *entry) {
+
+    struct n3n_runtime_data *sss = (struct n3n_runtime_data *)arg;
+    uint64_t now;
+    int cls;
+
+    if(sn_header_decrypt(sss, entry->buf, entry->size, &entry->hdr) < 0) {
+        sn_rx_source_take(sss, entry, sn_selection_usec_now());
+        return -1;
+    }
+
+    cls = rx_queue_class(entry->buf, entry->size);
+    if((cls != RX_CLASS_CONTROL) || !sn_rx_new_registration(entry)) {
+        return cls;
+    }
+
+    now = sn_selection_usec_now();
+    if(!sn_rx_source_take(sss, entry, now)) {
+        sss->stats.sn_reg_source_drop++;
+        return -1;
+    }
+    if(sss->conf.sn_register_max_pps) {
+        if(!token_bucket_take(&sss->reg_limit, 0, sss->conf.sn_register_max_pps, 0, now)) {
+            sss->stats.sn_reg_rate_drop++;
+            return -1;
+        }
+    }
+
+    return RX_CLASS_ADMIT;
+}
+
+
+/** Examine a datagram with a decrypted header and determine what to do
+ *  with it.
+ */
+static int process_udp (struct n3n_runtime_data * sss,
+                        const struct sockaddr *sender_sock, socklen_t sock_size,
+                        const SOCKET socket_fd,
+                        uint8_t * udp_buf,
+                        size_t udp_size,
+                        time_t now,
+                        int type,
+                        const struct rx_header *hdr) {
+
+    n2n_common_t cmn;        /* common fields in the packet header */
+    size_t rem;
+    size_t idx;
+    size_t msg_type;
+    bool from_supernode;
+    struct peer_info *sn = NULL;
+    n2n_sock_t sender;
+    n2n_sock_t          *orig_sender;
+    macstr_t mac_buf;
+    macstr_t mac_buf2;
+    n2n_sock_str_t sockbuf;
+    uint8_t hash_buf[16];                   /* always size of 16 (max) despite the actual value of N2N_REG_SUP_HASH_CHECK_LEN (<= 16) */
+
+    struct sn_community *comm = (struct sn_community *)hdr->comm;
+    uint32_t header_enc = hdr->header_enc;
+    uint64_t stamp = hdr->stamp;
+    int skip_add;
+    time_t any_time = 0;
+
+    fill_n2nsock(&sender, sender_sock, SOCK_DGRAM);
+    orig_sender = &sender;
+    memcpy(hash_buf, hdr->hash_buf, sizeof(hash_buf));
+
+    traceEvent(TRACE_DEBUG, "processing incoming UDP packet [len: %lu][sender: %s]",
+               udp_size, sock_to_cstr(sockbuf, &sender));
+
     /* Use decode_common() to determine the kind of packet then process it:
      *
      * REGISTER_SUPER adds an edge and generate a return REGISTER_SUPER_ACK
@@ -1847,6 +2723,11 @@ static int process_udp (struct n3n_runtime_data * sss,
                        macaddr_str(mac_buf2, pkt.dstMac),
                        (from_supernode ? "from sn" : "local"));
 
+            if(!from_supernode && !sn_rate_admit(sss, comm, pkt.srcMac, udp_size)) {
+                traceEvent(TRACE_DEBUG, "dropped PACKET over the rate limit");
+                return 0;
+            }
+
             if(!from_supernode) {
                 memcpy(&cmn2, &cmn, sizeof(n2n_common_t));
 
@@ -1890,8 +2771,11 @@ static int process_udp (struct n3n_runtime_data * sss,
             /* Common section to forward the final product. */
             if(unicast) {
                 try_forward(sss, comm, &cmn, pkt.dstMac, from_supernode, rec_buf, encx, now);
+                if(!from_supernode) {
+                    push_peer_info(sss, comm, pkt.srcMac, pkt.dstMac, now);
+                }
             } else {
-                try_broadcast(sss, comm, &cmn, pkt.srcMac, from_supernode, rec_buf, encx, now);
+                try_broadcast(sss, comm, &cmn, pkt.srcMac, pkt.dstMac, from_supernode, rec_buf, encx, now);
             }
             return 0;
         }
@@ -1982,14 +2866,9 @@ static int process_udp (struct n3n_runtime_data * sss,
             uint8_t payload_buf[REG_SUPER_ACK_PAYLOAD_SPACE];
             n2n_REGISTER_SUPER_ACK_payload_t       *payload;
             size_t encx = 0;
-            struct sn_community_regular_expression *re, *tmp_re;
             struct peer_info                       *peer, *tmp_peer, *p;
-            int8_t allowed_match = -1;
-            uint8_t match = 0;
-            int match_length = 0;
             n2n_ip_subnet_t ipaddr;
             int num = 0;
-            int skip;
             int ret_value;
             sn_user_t                              *user = NULL;
 
@@ -2023,43 +2902,14 @@ static int process_udp (struct n3n_runtime_data * sss,
                 existance (better from the security standpoint)
              */
 
-            if(!comm && sss->lock_communities) {
-                HASH_ITER(hh, sss->rules, re, tmp_re) {
-                    allowed_match = re_matchp(re->rule, (const char *)cmn.community, &match_length);
-
-                    if((allowed_match != -1)
-                       && (match_length == strlen((const char *)cmn.community)) // --- only full matches allowed (remove, if also partial matches wanted)
-                       && (allowed_match == 0)) { // --- only full matches allowed (remove, if also partial matches wanted)
-                        match = 1;
-                        break;
-                    }
-                }
-                if(match != 1) {
-                    traceEvent(TRACE_INFO, "discarded registration with unallowed community '%s'",
-                               (char*)cmn.community);
-                    return -1;
-                }
+            if(!comm && !sn_community_allowed(sss, (char *)cmn.community)) {
+                traceEvent(TRACE_INFO, "discarded registration with unallowed community '%s'",
+                           (char*)cmn.community);
+                return -1;
             }
 
-            if(!comm && (!sss->lock_communities || (match == 1))) {
-                comm = (struct sn_community*)calloc(1, sizeof(struct sn_community));
-
-                if(comm) {
-                    comm_init(comm, (char *)cmn.community);
-                    /* new communities introduced by REGISTERs could not have had encrypted header... */
-                    comm->header_encryption = HEADER_ENCRYPTION_NONE;
-                    free(comm->header_encryption_ctx_static);
-                    comm->header_encryption_ctx_static = NULL;
-                    free(comm->header_encryption_ctx_dynamic);
-                    comm->header_encryption_ctx_dynamic = NULL;
-                    /* ... and also are purgeable during periodic purge */
-                    comm->purgeable = true;
-                    comm->number_enc_packets = 0;
-                    HASH_ADD_STR(sss->communities, community, comm);
-
-                    traceEvent(TRACE_INFO, "new community: %s", comm->community);
-                    assign_one_ip_subnet(sss, comm);
-                }
+            if(!comm) {
+                comm = sn_community_add(sss, (char *)cmn.community);
             }
 
             if(!comm) {
@@ -2072,6 +2922,11 @@ static int process_udp (struct n3n_runtime_data * sss,
             if(comm->allowed_users) {
                 // check if submitted public key is in list of allowed users
                 HASH_FIND(hh, comm->allowed_users, &reg.auth.token, sizeof(n2n_private_public_key_t), user);
+                if(user && !user->shared_secret_ctx) {
+                    // no NAK, the edge retries once the secret is in place
+                    traceEvent(TRACE_DEBUG, "dropped REGISTER_SUPER, the user's shared secret is still being calculated");
+                    return -1;
+                }
                 if(user) {
                     speck_128_encrypt(hash_buf, (speck_context_t*)user->shared_secret_ctx);
                     if(memcmp(hash_buf, udp_buf + udp_size - N2N_REG_SUP_HASH_CHECK_LEN /* length has already been checked */, N2N_REG_SUP_HASH_CHECK_LEN)) {
@@ -2120,18 +2975,13 @@ static int process_udp (struct n3n_runtime_data * sss,
                 p->socket_fd = sss->sock;
             }
 
-            /* Skip random numbers of supernodes before payload assembling, calculating an appropriate random_number.
-             * That way, all supernodes have a chance to be propagated with REGISTER_SUPER_ACK. */
-            skip = HASH_COUNT(sss->federation->edges) - (int)(REG_SUPER_ACK_PAYLOAD_ENTRY_SIZE / REG_SUPER_ACK_PAYLOAD_ENTRY_SIZE);
-            skip = (skip < 0) ? 0 : n3n_rand_sqr(skip);
-
-            /* Assembling supernode list for REGISTER_SUPER_ACK payload */
+            /* Assembling supernode list for REGISTER_SUPER_ACK payload. The federation list is kept
+             * in ascending order of the load the supernodes report (see REGISTER_SUPER_ACK below),
+             * so the least loaded are listed first and, should they not all fit, the most loaded
+             * are left out instead of random ones. Those still learn about the others from the
+             * ACKs they receive, so the federation keeps growing together. */
             payload = (n2n_REGISTER_SUPER_ACK_payload_t*)payload_buf;
             HASH_ITER(hh, sss->federation->edges, peer, tmp_peer) {
-                if(skip) {
-                    skip--;
-                    continue;
-                }
                 if(peer->sock.family == (uint8_t)AF_INVALID)
                     continue; /* do not add unresolved supernodes to payload */
                 if(memcmp(&(peer->sock), &(ack.sock), sizeof(n2n_sock_t)) == 0) continue; /* a supernode doesn't add itself to the payload */
@@ -2217,11 +3067,12 @@ static int process_udp (struct n3n_runtime_data * sss,
                         }
                     }
 
-                    try_broadcast(sss, NULL, &cmn, reg.edgeMac, from_supernode, ackbuf, encx, now);
+                    try_broadcast(sss, NULL, &cmn, reg.edgeMac, NULL, from_supernode, ackbuf, encx, now);
                 }
 
                 // dynamic key time handling if appropriate
                 ack.key_time = 0;
+                ack.load = sn_selection_criterion_gather_data(sss);
                 if(comm->is_federation) {
                     if(reg.key_time > sss->dynamic_key_time) {
                         traceEvent(TRACE_DEBUG, "setting new key time");
@@ -2275,7 +3126,7 @@ static int process_udp (struct n3n_runtime_data * sss,
                         close_tcp_connection(sss, conn); /* also deletes the peer */
                     } else {
                         HASH_DEL(comm->edges, peer);
-                        free(peer);
+                        peer_info_free(peer);
                     }
                 }
             }
@@ -2390,6 +3241,12 @@ static int process_udp (struct n3n_runtime_data * sss,
 
             if(ack.cookie == scan->last_cookie) {
 
+                // older supernodes do not report their load, they stay sorted last
+                if(ack.load) {
+                    scan->selection_criterion = ack.load;
+                    sn_selection_sort(&(sss->federation->edges));
+                }
+
                 payload = (n2n_REGISTER_SUPER_ACK_payload_t *)dec_tmpbuf;
                 for(i = 0; i < ack.num_sn; i++) {
                     skip_add = SN_ADD;
@@ -2506,30 +3363,9 @@ static int process_udp (struct n3n_runtime_data * sss,
             size_t encx = 0;
             n2n_common_t cmn2;
             n2n_PEER_INFO_t pi;
-            struct sn_community_regular_expression *re, *tmp_re;
-            int8_t allowed_match = -1;
-            uint8_t match = 0;
-            int match_length = 0;
-
-            if(!comm && sss->lock_communities) {
-                HASH_ITER(hh, sss->rules, re, tmp_re) {
-                    allowed_match = re_matchp(re->rule, (const char *)cmn.community, &match_length);
-
-                    if((allowed_match != -1)
-                       && (match_length == strlen((const char *)cmn.community)) // --- only full matches allowed (remove, if also partial matches wanted)
-                       && (allowed_match == 0)) {                               // --- only full matches allowed (remove, if also partial matches wanted)
-                        match = 1;
-                        break;
-                    }
-                }
-                if(match != 1) {
-                    traceEvent(TRACE_DEBUG, "QUERY_PEER from unknown community %s", cmn.community);
-                    return -1;
-                }
-            }
 
-            if(!comm && sss->lock_communities && (match == 0)) {
-                traceEvent(TRACE_DEBUG, "QUERY_PEER from not allowed community %s", cmn.community);
+            if(!comm && !sn_community_allowed(sss, (char *)cmn.community)) {
+                traceEvent(TRACE_DEBUG, "QUERY_PEER from unknown community %s", cmn.community);
                 return -1;
             }
 
@@ -2654,7 +3490,7 @@ static int process_udp (struct n3n_runtime_data * sss,
                                                   time_stamp());
                         }
 
-                        try_broadcast(sss, NULL, &cmn, query.srcMac, from_supernode, encbuf, encx, now);
+                        try_broadcast(sss, NULL, &cmn, query.srcMac, NULL, from_supernode, encbuf, encx, now);
                     }
                 }
             }
@@ -2717,6 +3553,179 @@ static int process_udp (struct n3n_runtime_data * sss,
             return 0;
         }
 
+        case MSG_TYPE_RELAY_INFO: {
+            /* Direct peers of a relaying edge, passed on to the whole community */
+            n2n_RELAY_INFO_t ri;
+            n2n_common_t cmn2;
+            uint8_t encbuf[N2N_SN_PKTBUF_SIZE];
+            size_t encx = 0;
+            uint8_t *rec_buf;  /* either udp_buf or encbuf */
+            struct peer_info *peer;
+
+            if(!comm) {
+                traceEvent(TRACE_DEBUG, "RELAY_INFO with unknown community %s", cmn.community);
+                return -1;
+            }
+
+            decode_RELAY_INFO(&ri, &cmn, udp_buf, &rem, &idx);
+
+            if(comm->header_encryption == HEADER_ENCRYPTION_ENABLED) {
+                if(!find_peer_time_stamp_and_verify(
+                       comm->edges,
+                       NULL,
+                       sn,
+                       ri.srcMac,
+                       stamp,
+                       TIME_STAMP_ALLOW_JITTER)) {
+                    traceEvent(TRACE_DEBUG, "dropped RELAY_INFO due to time stamp error");
+                    return -1;
+                }
+            }
+
+            traceEvent(TRACE_DEBUG, "Rx RELAY_INFO from %s with %u peers %s",
+                       macaddr_str(mac_buf, ri.srcMac),
+                       (unsigned int)ri.num_peers,
+                       (from_supernode ? "from sn" : "local"));
+
+            if(!from_supernode) {
+                // only registered edges get to offer themselves as relay
+                HASH_FIND_PEER(comm->edges, ri.srcMac, peer);
+                if(!peer) {
+                    traceEvent(TRACE_DEBUG, "dropped RELAY_INFO from unregistered edge");
+                    return -1;
+                }
+
+                memcpy(&cmn2, &cmn, sizeof(n2n_common_t));
+                cmn2.flags |= N2N_FLAGS_FROM_SUPERNODE;
+
+                /* Re-encode the header. */
+                encode_RELAY_INFO(encbuf, &encx, &cmn2, &ri);
+                rec_buf = encbuf;
+            } else {
+                /* Already from a supernode. Nothing to modify, just pass on. */
+                rec_buf = udp_buf;
+                encx = udp_size;
+            }
+
+            if(comm->header_encryption == HEADER_ENCRYPTION_ENABLED) {
+                packet_header_encrypt(rec_buf, encx, encx,
+                                      comm->header_encryption_ctx_dynamic, comm->header_iv_ctx_dynamic,
+                                      time_stamp());
+            }
+
+            try_broadcast(sss, comm, &cmn, ri.srcMac, NULL, from_supernode, rec_buf, encx, now);
+            return 0;
+        }
+
+        case MSG_TYPE_MCAST_GROUPS: {
+            /* Multicast groups joined behind an edge, kept by this supernode only */
+            n2n_MCAST_GROUPS_t mg;
+            struct peer_info *peer;
+
+            if(!comm) {
+                traceEvent(TRACE_DEBUG, "MCAST_GROUPS with unknown community %s", cmn.community);
+                return -1;
+            }
+
+            decode_MCAST_GROUPS(&mg, &cmn, udp_buf, &rem, &idx);
+
+            if(comm->header_encryption == HEADER_ENCRYPTION_ENABLED) {
+                if(!find_peer_time_stamp_and_verify(
+                       comm->edges,
+                       NULL,
+                       sn,
+                       mg.srcMac,
+                       stamp,
+                       TIME_STAMP_ALLOW_JITTER)) {
+                    traceEvent(TRACE_DEBUG, "dropped MCAST_GROUPS due to time stamp error");
+                    return -1;
+                }
+            }
+
+            traceEvent(TRACE_DEBUG, "Rx MCAST_GROUPS from %s with %u groups%s",
+                       macaddr_str(mac_buf, mg.srcMac),
+                       (unsigned int)mg.num_groups,
+                       (mg.flags & N2N_MCAST_GROUPS_OVERFLOW) ? " (overflow)" : "");
+
+            if(from_supernode) {
+                // the groups only matter to the supernode the edge is registered at
+                return -1;
+            }
+
+            HASH_FIND_PEER(comm->edges, mg.srcMac, peer);
+            if(!peer) {
+                traceEvent(TRACE_DEBUG, "dropped MCAST_GROUPS from unregistered edge");
+                return -1;
+            }
+
+            if(mg.flags & N2N_MCAST_GROUPS_OVERFLOW) {
+                // the edge could not list all its groups, it gets every frame
+                peer->mcast_report = 0;
+                mcast_groups_report(&comm->mcast_groups, mg.srcMac, NULL, 0, now);
+                return 0;
+            }
+
+            peer->mcast_report = now;
+            mcast_groups_report(&comm->mcast_groups, mg.srcMac, mg.groups, mg.num_groups, now);
+            return 0;
+        }
+
+        case MSG_TYPE_BCAST_PEERS: {
+            /* Peers an edge sends its broadcasts to directly, not to send them again */
+            n2n_BCAST_PEERS_t bp;
+            struct peer_info *peer;
+            n2n_mac_t *list;
+
+            if(!comm) {
+                traceEvent(TRACE_DEBUG, "BCAST_PEERS with unknown community %s", cmn.community);
+                return -1;
+            }
+
+            decode_BCAST_PEERS(&bp, &cmn, udp_buf, &rem, &idx);
+
+            if(comm->header_encryption == HEADER_ENCRYPTION_ENABLED) {
+                if(!find_peer_time_stamp_and_verify(
+                       comm->edges,
+                       NULL,
+                       sn,
+                       bp.srcMac,
+                       stamp,
+                       TIME_STAMP_ALLOW_JITTER)) {
+                    traceEvent(TRACE_DEBUG, "dropped BCAST_PEERS due to time stamp error");
+                    return -1;
+                }
+            }
+
+            traceEvent(TRACE_DEBUG, "Rx BCAST_PEERS from %s with %u peers",
+                       macaddr_str(mac_buf, bp.srcMac),
+                       (unsigned int)bp.num_peers);
+
+            if(from_supernode) {
+                // edges registered elsewhere get the copy from their own supernode
+                return -1;
+            }
+
+            HASH_FIND_PEER(comm->edges, bp.srcMac, peer);
+            if(!peer) {
+                traceEvent(TRACE_DEBUG, "dropped BCAST_PEERS from unregistered edge");
+                return -1;
+            }
+
+            list = NULL;
+            if(bp.num_peers) {
+                list = malloc(bp.num_peers * sizeof(n2n_mac_t));
+                if(!list) {
+                    return -1;
+                }
+                memcpy(list, bp.peers, bp.num_peers * sizeof(n2n_mac_t));
+            }
+            free(peer->bcast_peers);
+            peer->bcast_peers = list;
+            peer->num_bcast_peers = bp.num_peers;
+            peer->bcast_report = now;
+            return 0;
+        }
+
         default:
             /* Not a known message type */
             traceEvent(TRACE_WARNING, "unable to handle packet type %d: ignored", (signed int)msg_type);
@@ -2730,13 +3739,31 @@ static int process_udp (struct n3n_runtime_data * sss,
  *  daemonisation on some platforms. */
 int run_sn_loop (struct n3n_runtime_data *sss) {
 
-    uint8_t pktbuf[N2N_SN_PKTBUF_SIZE];
     time_t last_purge_edges = 0;
     time_t last_sort_communities = 0;
     time_t last_re_reg_and_purge = 0;
 
     sss->start_time = time(NULL);
 
+    sss->rx_queue = calloc(1, sizeof(struct rx_queue));
+    if(!sss->rx_queue) {
+        traceEvent(TRACE_ERROR, "cannot allocate the receive queue");
+        return -1;
+    }
+
+    // without it, no limits per source address
+    sss->admit = malloc(sizeof(struct admit_table));
+    if(sss->admit) {
+        admit_table_init(sss->admit);
+    } else {
+        traceEvent(TRACE_WARNING, "cannot allocate the registration limits per source address");
+    }
+
+    // without it, the costly control work is done right in the loop
+    if(sn_worker_create(&sss->worker) != 0) {
+        traceEvent(TRACE_INFO, "no worker thread, the control work is done in the main loop");
+    }
+
     while(*sss->keep_running) {
         int rc;
         int max_sock;
@@ -2748,6 +3775,7 @@ int run_sn_loop (struct n3n_runtime_data *sss) {
         struct timeval wait_time;
         time_t before;
         time_t now;
+        uint64_t busy_since;
 
         FD_ZERO(&readers);
         FD_ZERO(&writers);
@@ -2755,6 +3783,23 @@ int run_sn_loop (struct n3n_runtime_data *sss) {
         FD_SET(sss->sock, &readers);
         max_sock = sss->sock;
 
+        // queued PACKET data waits for the socket to take more
+        if(sss->fq_backlog) {
+            FD_SET(sss->sock, &writers);
+        }
+
+        int resolve_fd = resolve_notify_fd(sss->resolve_parameter);
+        if(resolve_fd != -1) {
+            FD_SET(resolve_fd, &readers);
+            max_sock = MAX(max_sock, resolve_fd);
+        }
+
+        int worker_fd = sn_worker_notify_fd(sss->worker);
+        if(worker_fd != -1) {
+            FD_SET(worker_fd, &readers);
+            max_sock = MAX(max_sock, worker_fd);
+        }
+
 #ifdef N2N_HAVE_TCP
         n2n_sock_str_t sockbuf;
         FD_SET(sss->tcp_sock, &readers);
@@ -2787,6 +3832,7 @@ int run_sn_loop (struct n3n_runtime_data *sss) {
         rc = select(max_sock + 1, &readers, &writers, NULL, &wait_time);
 
         now = time(NULL);
+        busy_since = sn_selection_usec_now();
 
         if(rc == 0) {
             if(((now - before) < wait_time.tv_sec) && (*sss->keep_running)) {
@@ -2804,19 +3850,30 @@ int run_sn_loop (struct n3n_runtime_data *sss) {
 
         if(rc > 0) {
 
+            // name resolution results
+            if((resolve_fd != -1) && FD_ISSET(resolve_fd, &readers)) {
+                resolve_notified(sss->resolve_parameter);
+            }
+
+            // results of the control work done in the background
+            if((worker_fd != -1) && FD_ISSET(worker_fd, &readers)) {
+                sn_worker_notified(sss->worker, sss);
+            }
+
+            if(FD_ISSET(sss->sock, &writers)) {
+                sn_fq_service(sss);
+            }
+
             // external udp
             if(FD_ISSET(sss->sock, &readers)) {
-                struct sockaddr_storage sas;
-                struct sockaddr *sender_sock = (struct sockaddr*)&sas;
-                socklen_t ss_size = sizeof(sas);
+                struct rx_entry *entry;
 
-                bread = recvfrom(
+                bread = rx_queue_fill(
+                    sss->rx_queue,
                     sss->sock,
-                    (void *)pktbuf,
-                    N2N_SN_PKTBUF_SIZE,
-                    0 /*flags*/,
-                    sender_sock,
-                    &ss_size
+                    sn_rx_classify,
+                    sss,
+                    &sss->stats
                 );
 
                 if((bread < 0)
@@ -2827,7 +3884,6 @@ int run_sn_loop (struct n3n_runtime_data *sss) {
                     // FIXME: when would we get a WSAECONNRESET on a UDP read
                     // of a non connected socket
 
-                    /* For UDP bread of zero just means no data (unlike TCP). */
                     /* The fd is no good now. Maybe we lost our interface. */
                     traceEvent(TRACE_ERROR, "recvfrom() failed %d errno %d (%s)", bread, errno, strerror(errno));
 #ifdef _WIN32
@@ -2836,18 +3892,18 @@ int run_sn_loop (struct n3n_runtime_data *sss) {
                     *sss->keep_running = false;
                 }
 
-                // we have a datagram to process...
-                if(bread > 0) {
-                    // ...and the datagram has data (not just a header)
+                // the datagrams read, control messages first
+                while((entry = rx_queue_pop(sss->rx_queue))) {
                     process_udp(
                         sss,
-                        sender_sock,
-                        ss_size,
-                        sss->sock,
-                        pktbuf,
-                        bread,
+                        (struct sockaddr *)&entry->sas,
+                        entry->sas_size,
+                        entry->sock,
+                        entry->buf,
+                        entry->size,
                         now,
-                        SOCK_DGRAM
+                        SOCK_DGRAM,
+                        &entry->hdr
                     );
                 }
             }
@@ -2904,16 +3960,23 @@ int run_sn_loop (struct n3n_runtime_data *sss) {
                             }
                         } else {
                             // full packet read, handle it
-                            process_udp(
-                                sss,
-                                &(conn->sock),
-                                conn->sock_len,
-                                conn->socket_fd,
-                                conn->buffer + sizeof(uint16_t),
-                                conn->position - sizeof(uint16_t),
-                                now,
-                                SOCK_STREAM
-                            );
+                            struct rx_header hdr = {0};
+                            uint8_t *buf = conn->buffer + sizeof(uint16_t);
+                            size_t size = conn->position - sizeof(uint16_t);
+
+                            if(sn_header_decrypt(sss, buf, size, &hdr) == 0) {
+                                process_udp(
+                                    sss,
+                                    &(conn->sock),
+                                    conn->sock_len,
+                                    conn->socket_fd,
+                                    buf,
+                                    size,
+                                    now,
+                                    SOCK_STREAM,
+                                    &hdr
+                                );
+                            }
 
                             // reset, await new prepended length
                             conn->expected = sizeof(uint16_t);
@@ -2983,16 +4046,20 @@ int run_sn_loop (struct n3n_runtime_data *sss) {
                     TRACE_ERROR,
                     "error: slots_fdset_loop = %i", slots_ready
                 );
-            } else if(slots_ready > 0) {
-                // see edge_utils for note about linear scan
-                for(int i=0; i<slots->nr_slots; i++) {
-                    if(slots->conn[i].fd == -1) {
-                        continue;
-                    }
+            }
 
-                    if(slots->conn[i].state == CONN_READY) {
-                        mgmt_api_handler(sss, &slots->conn[i]);
-                    }
+            // see edge_utils for note about linear scan
+            for(int i=0; i<slots->nr_slots; i++) {
+                if(slots->conn[i].fd == -1) {
+                    continue;
+                }
+
+                // Continue any replies that are being generated in pieces
+                mgmt_api_more(sss, &slots->conn[i]);
+
+                // Sending a reply at once can expose a pipelined request
+                while(slots->conn[i].state == CONN_READY) {
+                    mgmt_api_handler(sss, &slots->conn[i]);
                 }
             }
 
@@ -3027,8 +4094,17 @@ int run_sn_loop (struct n3n_runtime_data *sss) {
             false /* presumably, no special resolution requirement */,
             now
         );
+
+        sn_selection_load_update(sss, busy_since);
     } /* while */
 
+    free(sss->rx_queue);
+    sss->rx_queue = NULL;
+    free(sss->admit);
+    sss->admit = NULL;
+    sn_worker_cancel(sss->worker);
+    sss->worker = NULL;
+
     sn_term(sss);
 
     return 0;
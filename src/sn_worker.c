@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Supernode background worker
+ *
+ * Forwarding and all the control work share the supernode's main loop, so
+ * anything taking long in there delays the relayed data. Most control work
+ * is cheap per message, but some is not bounded: reloading the communities
+ * computes a Curve25519 shared secret for every user.
+ *
+ * Such work is handed to a single worker thread. It gets a copy of its
+ * input with the job and leaves the result in the job too, the tables
+ * stay with the main loop. Once done, the worker wakes the loop through a
+ * pipe and the loop publishes the result. As only the loop thread ever
+ * changes the tables, the forwarding reading them needs no locks.
+ *
+ * This is not a split of the forwarding from the control work: both still
+ * run in the main loop, the worker only takes the calculations off it.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>          // for calloc, free
+
+#include "config.h"          // for HAVE_LIBPTHREAD
+#include "sn_worker.h"
+
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>           // for fcntl, F_SETFL, O_NONBLOCK
+#include <unistd.h>          // for pipe, read, write, close
+#endif
+
+
+#if defined(HAVE_LIBPTHREAD) && !defined(_WIN32)
+
+struct sn_worker {
+    struct sn_job *todo;            /* jobs waiting for the worker */
+    struct sn_job *todo_tail;
+    struct sn_job *done;            /* finished jobs, for the main loop */
+    struct sn_job *done_tail;
+    bool stop;                      /* tells the worker to exit */
+    int notify[2];                  /* pipe written to when a job is done */
+    pthread_t id;
+    pthread_mutex_t access;         /* guards the lists and stop */
+    pthread_cond_t wake;            /* signals the worker to look for work */
+};
+
+
+static void sn_job_append (struct sn_job **head, struct sn_job **tail, struct sn_job *job) {
+
+    job->next = NULL;
+    if(*tail) {
+        (*tail)->next = job;
+    } else {
+        *head = job;
+    }
+    *tail = job;
+}
+
+
+static void sn_job_free_list (struct sn_job *job) {
+
+    struct sn_job *next;
+
+    for(; job; job = next) {
+        next = job->next;
+        free(job);
+    }
+}
+
+
+static void *sn_worker_thread (void *p) {
+
+    struct sn_worker *worker = (struct sn_worker *)p;
+    struct sn_job *job;
+    char ch = 0;
+
+    pthread_mutex_lock(&worker->access);
+
+    while(!worker->stop) {
+        job = worker->todo;
+        if(!job) {
+            pthread_cond_wait(&worker->wake, &worker->access);
+            continue;
+        }
+        worker->todo = job->next;
+        if(!worker->todo) {
+            worker->todo_tail = NULL;
+        }
+
+        pthread_mutex_unlock(&worker->access);
+        job->work(job);
+        pthread_mutex_lock(&worker->access);
+
+        sn_job_append(&worker->done, &worker->done_tail, job);
+
+        // If the pipe is full, the mainloop already has a wakeup pending
+        if(write(worker->notify[1], &ch, 1) == -1) {
+            continue;
+        }
+    }
+
+    pthread_mutex_unlock(&worker->access);
+
+    return NULL;
+}
+
+
+int sn_worker_create (struct sn_worker **worker) {
+
+    struct sn_worker *w;
+
+    *worker = NULL;
+
+    w = calloc(1, sizeof(struct sn_worker));
+    if(!w) {
+        return -1;
+    }
+
+    // results are only ever picked up through the notify fd
+    if(pipe(w->notify) != 0) {
+        free(w);
+        return -1;
+    }
+    fcntl(w->notify[0], F_SETFL, O_NONBLOCK);
+    fcntl(w->notify[1], F_SETFL, O_NONBLOCK);
+
+    pthread_mutex_init(&w->access, NULL);
+    pthread_cond_init(&w->wake, NULL);
+
+    if(pthread_create(&w->id, NULL, sn_worker_thread, w)) {
+        pthread_cond_destroy(&w->wake);
+        pthread_mutex_destroy(&w->access);
+        close(w->notify[0]);
+        close(w->notify[1]);
+        free(w);
+        return -1;
+    }
+
+    *worker = w;
+
+    return 0;
+}
+
+
+void sn_worker_cancel (struct sn_worker *worker) {
+
+    if(!worker) {
+        return;
+    }
+
+    pthread_mutex_lock(&worker->access);
+    worker->stop = true;
+    pthread_cond_broadcast(&worker->wake);
+    pthread_mutex_unlock(&worker->access);
+
+    // a job being worked on is finished first
+    pthread_join(worker->id, NULL);
+
+    sn_job_free_list(worker->todo);
+    sn_job_free_list(worker->done);
+
+    close(worker->notify[0]);
+    close(worker->notify[1]);
+    pthread_cond_destroy(&worker->wake);
+    pthread_mutex_destroy(&worker->access);
+    free(worker);
+}
+
+
+void sn_worker_submit (struct sn_worker *worker,
+                       struct n3n_runtime_data *sss,
+                       struct sn_job *job) {
+
+    if(!worker) {
+        job->work(job);
+        job->done(sss, job);
+        return;
+    }
+
+    pthread_mutex_lock(&worker->access);
+    sn_job_append(&worker->todo, &worker->todo_tail, job);
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->access);
+}
+
+
+int sn_worker_notify_fd (struct sn_worker *worker) {
+
+    if(!worker) {
+        return -1;
+    }
+
+    return worker->notify[0];
+}
+
+
+void sn_worker_notified (struct sn_worker *worker, struct n3n_runtime_data *sss) {
+
+    struct sn_job *job, *next;
+    char buf[16];
+
+    if(!worker) {
+        return;
+    }
+
+    while(read(worker->notify[0], buf, sizeof(buf)) > 0) {
+        // Drain all the wakeups, one pass picks up all the results
+    }
+
+    pthread_mutex_lock(&worker->access);
+    job = worker->done;
+    worker->done = NULL;
+    worker->done_tail = NULL;
+    pthread_mutex_unlock(&worker->access);
+
+    // in the order submitted, so a later job's result is published last
+    for(; job; job = next) {
+        next = job->next;
+        job->done(sss, job);
+    }
+}
+
+#else // HAVE_LIBPTHREAD
+
+int sn_worker_create (struct sn_worker **worker) {
+
+    *worker = NULL;
+
+    return -1;
+}
+
+
+void sn_worker_cancel (struct sn_worker *worker) {
+    return;
+}
+
+
+void sn_worker_submit (struct sn_worker *worker,
+                       struct n3n_runtime_data *sss,
+                       struct sn_job *job) {
+
+    job->work(job);
+    job->done(sss, job);
+}
+
+
+int sn_worker_notify_fd (struct sn_worker *worker) {
+    return -1;
+}
+
+
+void sn_worker_notified (struct sn_worker *worker, struct n3n_runtime_data *sss) {
+    return;
+}
+
+#endif
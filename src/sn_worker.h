@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Supernode background worker, non-public API
+ */
+
+#ifndef _SN_WORKER_H_
+#define _SN_WORKER_H_
+
+struct n3n_runtime_data;
+struct sn_worker;
+
+/* A piece of work, allocated in one go as it is released with free() if
+ * the worker is stopped before the done callback has run */
+struct sn_job {
+    struct sn_job *next;
+    // runs on the worker thread, must not touch the supernode's tables
+    void (*work)(struct sn_job *job);
+    // runs on the main loop thread, publishes the result and frees the job
+    void (*done)(struct n3n_runtime_data *sss, struct sn_job *job);
+};
+
+int sn_worker_create (struct sn_worker **worker);
+void sn_worker_cancel (struct sn_worker *worker);
+
+// Without a worker, the job is run and completed right away
+void sn_worker_submit (struct sn_worker *worker,
+                       struct n3n_runtime_data *sss,
+                       struct sn_job *job);
+
+// The fd that becomes readable when results are ready, or -1
+int sn_worker_notify_fd (struct sn_worker *worker);
+
+// Called when the notify fd is readable, to complete the finished jobs
+void sn_worker_notified (struct sn_worker *worker, struct n3n_runtime_data *sss);
+
+#endif
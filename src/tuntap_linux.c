@@ -26,13 +26,15 @@
 #include <sys/uio.h>                  // for iovec
 #include <errno.h>                    // for errno
 #include <fcntl.h>                    // for open, O_RDWR
-#include <linux/if_tun.h>             // for IFF_NO_PI, IFF_TAP, TUNSETIFF
+#include <linux/if_tun.h>             // for IFF_NO_PI, IFF_TAP, IFF_TUN, TUNSETIFF
 #include <linux/netlink.h>            // for sockaddr_nl, nlmsghdr, NETLINK_...
 #include <linux/rtnetlink.h>          // for ifinfomsg, RTMGRP_LINK
 #include <n3n/logging.h>              // for traceEvent
 #include <net/if.h>                   // for ifreq, IFNAMSIZ, ifr_name, ifr_...
 #include <net/if_arp.h>               // for ARPHRD_ETHER
 #include <netinet/in.h>               // for sockaddr_in, IPPROTO_IP, in_addr
+#include <poll.h>                     // for poll, pollfd, POLLIN
+#include <stdbool.h>                  // for bool
 #include <stdint.h>                   // for uint8_t
 #include <string.h>                   // for strerror, memset, strncpy, memcpy
 #include <sys/ioctl.h>                // for ioctl, SIOCGIFADDR, SIOCGIFFLAGS
@@ -45,6 +47,8 @@
 #include "n2n_typedefs.h"
 #include "n3n/ethernet.h"
 
+#define TUNTAP_UP_TIMEOUT   2000    /* msec to wait for the link to come up */
+
 
 static int setup_ifname (int fd, const char *ifname,
                          struct n2n_ip_subnet v4subnet,
@@ -57,12 +61,15 @@ static int setup_ifname (int fd, const char *ifname,
     strncpy(ifr.ifr_name, ifname, IFNAMSIZ);
     ifr.ifr_name[IFNAMSIZ-1] = '\0';
 
-    ifr.ifr_hwaddr.sa_family = ARPHRD_ETHER;
-    memcpy(ifr.ifr_hwaddr.sa_data, mac, 6);
+    // a TUN interface has no hardware address
+    if(mac) {
+        ifr.ifr_hwaddr.sa_family = ARPHRD_ETHER;
+        memcpy(ifr.ifr_hwaddr.sa_data, mac, 6);
 
-    if(ioctl(fd, SIOCSIFHWADDR, &ifr) == -1) {
-        traceEvent(TRACE_ERROR, "ioctl(SIOCSIFHWADDR) failed [%d]: %s", errno, strerror(errno));
-        return -1;
+        if(ioctl(fd, SIOCSIFHWADDR, &ifr) == -1) {
+            traceEvent(TRACE_ERROR, "ioctl(SIOCSIFHWADDR) failed [%d]: %s", errno, strerror(errno));
+            return -1;
+        }
     }
 
     ifr.ifr_addr.sa_family = AF_INET;
@@ -112,7 +119,8 @@ static int setup_ifname (int fd, const char *ifname,
  *  This routine creates the interface via the tuntap driver and then
  *  configures it.
  *
- *  @param device      - [inout] a device info holder object
+ *  @param device      - [inout] a device info holder object, its layer3
+ *                       field selects a TUN instead of a TAP interface
  *  @param dev         - user-defined name for the new iface,
  *                       if NULL system will assign a name
  *  @param v4subnet    - address and netmask of iface
@@ -134,12 +142,9 @@ int tuntap_open (tuntap_dev *device,
     struct ifreq ifr;
     int rc;
     int nl_fd;
-    char nl_buf[8192]; /* >= 8192 to avoid truncation, see "man 7 netlink" */
-    struct iovec iov;
     struct sockaddr_nl sa;
-    int up_and_running = 0;
-    struct msghdr msg;
 
+    device->nl_fd = -1;
     device->fd = open(tuntap_device, O_RDWR);
     if(device->fd < 0) {
         traceEvent(TRACE_ERROR, "tuntap open() error: %s[%d]. Is the tun kernel module loaded?\n", strerror(errno), errno);
@@ -148,15 +153,17 @@ int tuntap_open (tuntap_dev *device,
 
     memset(&ifr, 0, sizeof(ifr));
 
-    // want a TAP device for layer 2 frames
-    ifr.ifr_flags = IFF_TAP|IFF_NO_PI;
+    // want a TAP device for layer 2 frames, or a TUN device for bare IP
+    // packets in layer 3 mode
+    ifr.ifr_flags = (device->layer3 ? IFF_TUN : IFF_TAP) | IFF_NO_PI;
 
     strncpy(ifr.ifr_name, dev, IFNAMSIZ-1);
     ifr.ifr_name[IFNAMSIZ-1] = '\0';
     rc = ioctl(device->fd, TUNSETIFF, (void *)&ifr);
 
     if(rc < 0) {
-        traceEvent(TRACE_ERROR, "tuntap ioctl(TUNSETIFF, IFF_TAP) error: %s[%d]\n", strerror(errno), rc);
+        traceEvent(TRACE_ERROR, "tuntap ioctl(TUNSETIFF, %s) error: %s[%d]\n",
+                   device->layer3 ? "IFF_TUN" : "IFF_TAP", strerror(errno), rc);
         close(device->fd);
         return -1;
     }
@@ -181,78 +188,74 @@ int tuntap_open (tuntap_dev *device,
         device->mac_addr[0] |= 0x02;
     }
 
-    // initialize netlink socket
-    if((nl_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE)) == -1) {
+    // initialize netlink socket, it is kept open afterwards to report
+    // link and address changes to the mainloop
+    if((nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK, NETLINK_ROUTE)) == -1) {
         traceEvent(TRACE_ERROR, "netlink socket creation failed [%d]: %s", errno, strerror(errno));
+        close(device->fd);
         return -1;
     }
 
-    iov.iov_base = nl_buf;
-    iov.iov_len = sizeof(nl_buf);
-
     memset(&sa, 0, sizeof(sa));
     sa.nl_family = PF_NETLINK;
-    sa.nl_groups = RTMGRP_LINK;
-
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_name = &sa;
-    msg.msg_namelen = sizeof(sa);
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
+    sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
 
     // subscribe to interface events
     if(bind(nl_fd, (struct sockaddr*)&sa, sizeof(sa)) == -1) {
         traceEvent(TRACE_ERROR, "netlink socket bind failed [%d]: %s", errno, strerror(errno));
+        close(nl_fd);
+        close(device->fd);
         return -1;
     }
 
+    device->nl_fd = nl_fd;
+    device->if_index = if_nametoindex(device->dev_name);
+    device->link_up = false;
+
     if((ioctl_fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP)) < 0) {
         traceEvent(TRACE_ERROR, "socket creation failed [%d]: %s", errno, strerror(errno));
-        close(nl_fd);
+        tuntap_close(device);
         return -1;
     }
 
-    if(setup_ifname(ioctl_fd, device->dev_name, v4subnet, device->mac_addr, mtu) < 0) {
-        close(nl_fd);
+    if(setup_ifname(ioctl_fd, device->dev_name, v4subnet,
+                    device->layer3 ? NULL : device->mac_addr, mtu) < 0) {
         close(ioctl_fd);
-        close(device->fd);
+        tuntap_close(device);
         return -1;
     }
 
     close(ioctl_fd);
 
-    // wait for the up and running notification
-    traceEvent(TRACE_INFO, "Waiting for TAP interface to be up and running...");
-
-    while(!up_and_running) {
-        ssize_t len = recvmsg(nl_fd, &msg, 0);
-        struct nlmsghdr *nh;
+    device->ip_addr = v4subnet.net_addr;
 
-        for(nh = (struct nlmsghdr *)nl_buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
-            if(nh->nlmsg_type == NLMSG_ERROR) {
-                traceEvent(TRACE_DEBUG, "nh->nlmsg_type == NLMSG_ERROR");
-                break;
-            }
+    // wait for the up and running notification, but not forever as this
+    // could also be a reopen from within the running mainloop.  If it has
+    // not arrived in time, the mainloop will see it later
+    traceEvent(TRACE_INFO, "Waiting for TAP interface to be up and running...");
 
-            if(nh->nlmsg_type == NLMSG_DONE)
-                break;
+    struct pollfd pfd = {
+        .fd = nl_fd,
+        .events = POLLIN,
+    };
+    int waited = 0;
 
-            if(nh->nlmsg_type == NETLINK_GENERIC) {
-                struct ifinfomsg *ifi = NLMSG_DATA(nh);
+    while(!device->link_up && waited < TUNTAP_UP_TIMEOUT) {
+        if(poll(&pfd, 1, 100) == 0) {
+            waited += 100;
+            continue;
+        }
 
-                // NOTE: skipping interface name check, assuming it's our TAP
-                if((ifi->ifi_flags & IFF_UP) && (ifi->ifi_flags & IFF_RUNNING)) {
-                    up_and_running = 1;
-                    traceEvent(TRACE_INFO, "Interface is up and running");
-                    break;
-                }
-            }
+        if(tuntap_monitor_read(device) == -1) {
+            break;
         }
     }
 
-    close(nl_fd);
-
-    device->ip_addr = v4subnet.net_addr;
+    if(device->link_up) {
+        traceEvent(TRACE_INFO, "Interface is up and running");
+    } else {
+        traceEvent(TRACE_WARNING, "Interface is not yet up and running");
+    }
 
     return device->fd;
 }
@@ -273,6 +276,12 @@ int tuntap_write (struct tuntap_dev *tuntap, unsigned char *buf, int len) {
 void tuntap_close (struct tuntap_dev *tuntap) {
 
     close(tuntap->fd);
+    tuntap->fd = -1;
+
+    if(tuntap->nl_fd != -1) {
+        close(tuntap->nl_fd);
+        tuntap->nl_fd = -1;
+    }
 }
 
 
@@ -298,4 +307,131 @@ void tuntap_get_address (struct tuntap_dev *tuntap) {
 }
 
 
+static int monitor_link (struct tuntap_dev *tuntap, struct nlmsghdr *nh) {
+
+    struct ifinfomsg *ifi = NLMSG_DATA(nh);
+
+    if(ifi->ifi_index != tuntap->if_index) {
+        return 0;
+    }
+
+    if(nh->nlmsg_type == RTM_DELLINK) {
+        tuntap->link_up = false;
+        return TUNTAP_EVENT_GONE;
+    }
+
+    bool link_up = (ifi->ifi_flags & IFF_UP) && (ifi->ifi_flags & IFF_RUNNING);
+    if(link_up == tuntap->link_up) {
+        return 0;
+    }
+
+    tuntap->link_up = link_up;
+    return TUNTAP_EVENT_LINK;
+}
+
+
+static int monitor_addr (struct tuntap_dev *tuntap, struct nlmsghdr *nh) {
+
+    struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+
+    if((ifa->ifa_index != tuntap->if_index) || (ifa->ifa_family != AF_INET)) {
+        return 0;
+    }
+
+    // Like SIOCGIFADDR, only the primary address is used
+    if(ifa->ifa_flags & IFA_F_SECONDARY) {
+        return 0;
+    }
+
+    in_addr_t addr = 0;
+    int len = IFA_PAYLOAD(nh);
+    struct rtattr *rta;
+
+    for(rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        // prefer the local address, it differs on point-to-point links
+        if(rta->rta_type == IFA_LOCAL) {
+            memcpy(&addr, RTA_DATA(rta), sizeof(addr));
+            break;
+        }
+        if(rta->rta_type == IFA_ADDRESS) {
+            memcpy(&addr, RTA_DATA(rta), sizeof(addr));
+        }
+    }
+
+    if(nh->nlmsg_type == RTM_DELADDR) {
+        if(addr != tuntap->ip_addr) {
+            return 0;
+        }
+        addr = 0;
+    }
+
+    if(addr == tuntap->ip_addr) {
+        return 0;
+    }
+
+    tuntap->ip_addr = addr;
+    return TUNTAP_EVENT_ADDRESS;
+}
+
+
+/** @brief  Process any pending link and address notifications
+ *
+ *  Called when the netlink socket is readable.  The link_up and ip_addr
+ *  values of the device are updated to match.
+ *
+ *  @return - -1 on error
+ *          - a bitmask of TUNTAP_EVENT_* for the changes seen
+ */
+int tuntap_monitor_read (struct tuntap_dev *tuntap) {
+
+    char nl_buf[8192]; /* >= 8192 to avoid truncation, see "man 7 netlink" */
+    int events = 0;
+
+    if(tuntap->nl_fd == -1) {
+        return -1;
+    }
+
+    while(1) {
+        ssize_t len = recv(tuntap->nl_fd, nl_buf, sizeof(nl_buf), 0);
+
+        if(len == -1) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return events;
+            }
+            if(errno == ENOBUFS) {
+                // Some notifications were dropped, so go and ask
+                in_addr_t old = tuntap->ip_addr;
+                tuntap_get_address(tuntap);
+                if(old != tuntap->ip_addr) {
+                    events |= TUNTAP_EVENT_ADDRESS;
+                }
+                continue;
+            }
+            traceEvent(TRACE_ERROR, "netlink recv failed [%d]: %s", errno, strerror(errno));
+            return -1;
+        }
+
+        struct nlmsghdr *nh;
+
+        for(nh = (struct nlmsghdr *)nl_buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+            switch(nh->nlmsg_type) {
+                case RTM_NEWLINK:
+                case RTM_DELLINK:
+                    events |= monitor_link(tuntap, nh);
+                    break;
+
+                case RTM_NEWADDR:
+                case RTM_DELADDR:
+                    events |= monitor_addr(tuntap, nh);
+                    break;
+
+                case NLMSG_ERROR:
+                    traceEvent(TRACE_DEBUG, "nh->nlmsg_type == NLMSG_ERROR");
+                    break;
+            }
+        }
+    }
+}
+
+
 #endif /* #ifdef __linux__ */
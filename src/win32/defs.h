@@ -34,6 +34,9 @@ void fill_timersub (struct timeval *, struct timeval *, struct timeval *);
 #define gettimeofday fill_gettimeofday
 #define timersub fill_timersub
 
+// The same as strtok_r(), under its windows name
+#define strtok_r strtok_s
+
 extern void destroyWin32 ();
 
 #endif
@@ -583,6 +583,7 @@ int encode_REGISTER_SUPER_ACK (uint8_t *base,
     retval += encode_buf(base, idx, tmpbuf, (reg->num_sn*REG_SUPER_ACK_PAYLOAD_ENTRY_SIZE));
 
     retval += encode_uint32(base, idx, reg->key_time);
+    retval += encode_uint32(base, idx, reg->load);
 
     return retval;
 }
@@ -617,6 +618,9 @@ int decode_REGISTER_SUPER_ACK (n2n_REGISTER_SUPER_ACK_t *reg,
 
     retval += decode_uint32(&(reg->key_time), base, rem, idx);
 
+    // older supernodes do not report their load
+    retval += decode_uint32(&(reg->load), base, rem, idx);
+
     return retval;
 }
 
@@ -840,3 +844,145 @@ int decode_QUERY_PEER (n2n_QUERY_PEER_t * pkt,
 
     return retval;
 }
+
+
+int encode_RELAY_INFO (uint8_t * base,
+                       size_t * idx,
+                       const n2n_common_t * common,
+                       const n2n_RELAY_INFO_t * pkt) {
+
+    int retval = 0;
+    int i;
+
+    retval += encode_common(base, idx, common);
+    retval += encode_mac(base, idx, pkt->srcMac);
+    retval += encode_uint8(base, idx, pkt->num_peers);
+    for(i = 0; i < pkt->num_peers; i++) {
+        retval += encode_mac(base, idx, pkt->peers[i].mac);
+        retval += encode_uint32(base, idx, pkt->peers[i].rtt);
+    }
+
+    return retval;
+}
+
+int decode_RELAY_INFO (n2n_RELAY_INFO_t * pkt,
+                       const n2n_common_t * cmn, /* info on how to interpret it */
+                       const uint8_t * base,
+                       size_t * rem,
+                       size_t * idx) {
+
+    size_t retval = 0;
+    int i;
+    memset(pkt, 0, sizeof(n2n_RELAY_INFO_t));
+
+    retval += decode_mac(pkt->srcMac, base, rem, idx);
+    retval += decode_uint8(&(pkt->num_peers), base, rem, idx);
+
+    // only keep the entries that fit and are actually present
+    if(pkt->num_peers > N2N_RELAY_INFO_MAX_PEERS) {
+        pkt->num_peers = N2N_RELAY_INFO_MAX_PEERS;
+    }
+    if(pkt->num_peers > *rem / (N2N_MAC_SIZE + sizeof(uint32_t))) {
+        pkt->num_peers = *rem / (N2N_MAC_SIZE + sizeof(uint32_t));
+    }
+    for(i = 0; i < pkt->num_peers; i++) {
+        retval += decode_mac(pkt->peers[i].mac, base, rem, idx);
+        retval += decode_uint32(&(pkt->peers[i].rtt), base, rem, idx);
+    }
+
+    return retval;
+}
+
+
+int encode_MCAST_GROUPS (uint8_t * base,
+                         size_t * idx,
+                         const n2n_common_t * common,
+                         const n2n_MCAST_GROUPS_t * pkt) {
+
+    int retval = 0;
+    int i;
+
+    retval += encode_common(base, idx, common);
+    retval += encode_mac(base, idx, pkt->srcMac);
+    retval += encode_uint8(base, idx, pkt->flags);
+    retval += encode_uint8(base, idx, pkt->num_groups);
+    for(i = 0; i < pkt->num_groups; i++) {
+        retval += encode_mac(base, idx, pkt->groups[i]);
+    }
+
+    return retval;
+}
+
+int decode_MCAST_GROUPS (n2n_MCAST_GROUPS_t * pkt,
+                         const n2n_common_t * cmn, /* info on how to interpret it */
+                         const uint8_t * base,
+                         size_t * rem,
+                         size_t * idx) {
+
+    size_t retval = 0;
+    int i;
+    memset(pkt, 0, sizeof(n2n_MCAST_GROUPS_t));
+
+    retval += decode_mac(pkt->srcMac, base, rem, idx);
+    retval += decode_uint8(&(pkt->flags), base, rem, idx);
+    retval += decode_uint8(&(pkt->num_groups), base, rem, idx);
+
+    // only keep the entries that fit and are actually present
+    if(pkt->num_groups > N2N_MCAST_MAX_GROUPS) {
+        pkt->num_groups = N2N_MCAST_MAX_GROUPS;
+    }
+    if(pkt->num_groups > *rem / N2N_MAC_SIZE) {
+        pkt->num_groups = *rem / N2N_MAC_SIZE;
+    }
+    for(i = 0; i < pkt->num_groups; i++) {
+        retval += decode_mac(pkt->groups[i], base, rem, idx);
+    }
+
+    return retval;
+}
+
+
+int encode_BCAST_PEERS (uint8_t * base,
+                        size_t * idx,
+                        const n2n_common_t * common,
+                        const n2n_BCAST_PEERS_t * pkt) {
+
+    int retval = 0;
+    int i;
+
+    retval += encode_common(base, idx, common);
+    retval += encode_mac(base, idx, pkt->srcMac);
+    retval += encode_uint8(base, idx, pkt->num_peers);
+    for(i = 0; i < pkt->num_peers; i++) {
+        retval += encode_mac(base, idx, pkt->peers[i]);
+    }
+
+    return retval;
+}
+
+int decode_BCAST_PEERS (n2n_BCAST_PEERS_t * pkt,
+                        const n2n_common_t * cmn, /* info on how to interpret it */
+                        const uint8_t * base,
+                        size_t * rem,
+                        size_t * idx) {
+
+    size_t retval = 0;
+    int i;
+    memset(pkt, 0, sizeof(n2n_BCAST_PEERS_t));
+
+    retval += decode_mac(pkt->srcMac, base, rem, idx);
+    retval += decode_uint8(&(pkt->num_peers), base, rem, idx);
+
+    // only keep the entries that fit and are actually present
+    if(pkt->num_peers > N2N_BCAST_MAX_PEERS) {
+        pkt->num_peers = N2N_BCAST_MAX_PEERS;
+    }
+    if(pkt->num_peers > *rem / N2N_MAC_SIZE) {
+        pkt->num_peers = *rem / N2N_MAC_SIZE;
+    }
+    for(i = 0; i < pkt->num_peers; i++) {
+        retval += decode_mac(pkt->peers[i], base, rem, idx);
+    }
+
+    return retval;
+}
@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Load a community list, change it and reload it, and check that only the
+ * differences are applied: which communities, users and edges stay, go or
+ * are added, and which keep their keys and shared secrets.
+ */
+
+#include <n3n/logging.h>    // for setTraceLevel
+#include <n3n/supernode.h>  // for load_allowed_sn_community, calculate_shared_...
+#include <stdio.h>          // for printf, fprintf, fopen, fputs, remove
+#include <stdlib.h>         // for calloc
+#include <string.h>         // for memcpy, memcmp
+#include "auth.h"           // for ascii_to_bin
+#include "n2n.h"            // for comm_init, sn_community
+#include "../src/peer_info.h"   // for peer_info_malloc, HASH_ADD_PEER
+
+#define LIST_FILE   "tests-community_list.list"
+
+#define KEY_ALICE   "A000000000000000000000000000000000000000000"
+#define KEY_BOB     "B000000000000000000000000000000000000000000"
+#define KEY_CAROL   "C000000000000000000000000000000000000000000"
+#define KEY_DAVE    "D000000000000000000000000000000000000000000"
+
+
+static const char *list_before =
+    "keep\n"
+    "keep_net 10.20.0.0/16\n"
+    "gone\n"
+    "users\n"
+    "* alice " KEY_ALICE "\n"
+    "* bob " KEY_BOB "\n"
+    "to_users\n"
+    "from_users\n"
+    "* dave " KEY_DAVE "\n";
+
+static const char *list_after =
+    "keep max_rate=10\n"
+    "keep_net 10.30.0.0/16\n"
+    "users\n"
+    "* alice " KEY_ALICE "\n"
+    "* carol " KEY_CAROL "\n"
+    "to_users\n"
+    "* dave " KEY_DAVE "\n"
+    "from_users\n"
+    "new\n";
+
+
+static void write_list (const char *list) {
+
+    FILE *f = fopen(LIST_FILE, "w");
+
+    if(!f) {
+        fprintf(stderr, "cannot write %s\n", LIST_FILE);
+        exit(1);
+    }
+    fputs(list, f);
+    fclose(f);
+}
+
+
+/* register an edge, as a user if ascii_key is given */
+static void add_edge (struct n3n_runtime_data *sss, const char *name, uint8_t id, char *ascii_key) {
+
+    struct sn_community *comm;
+    struct peer_info *edge;
+    n2n_mac_t mac = {0x02, 0x00, 0x00, 0x00, 0x00, id};
+
+    HASH_FIND_STR(sss->communities, name, comm);
+    edge = peer_info_malloc(mac);
+    edge->socket_fd = -1;
+    if(ascii_key) {
+        edge->auth.scheme = n2n_auth_user_password;
+        ascii_to_bin(edge->auth.token, ascii_key);
+    }
+    HASH_ADD_PEER(comm->edges, edge);
+}
+
+
+static void print_communities (char *test_name, struct n3n_runtime_data *sss) {
+
+    struct sn_community *comm, *tmp_comm;
+    struct peer_info *edge, *tmp_edge;
+    sn_user_t *user, *tmp_user;
+
+    HASH_ITER(hh, sss->communities, comm, tmp_comm) {
+        if(comm->is_federation) {
+            continue;
+        }
+        printf("%s: '%s' net 0x%08x/%u max_rate %u header_encryption %u\n",
+               test_name, comm->community,
+               comm->auto_ip_net.net_addr, comm->auto_ip_net.net_bitlen,
+               comm->max_rate, comm->header_encryption);
+        HASH_ITER(hh, comm->allowed_users, user, tmp_user) {
+            printf("%s:   user '%s'%s\n", test_name, user->name,
+                   user->shared_secret_ctx ? " with secret" : "");
+        }
+        HASH_ITER(hh, comm->edges, edge, tmp_edge) {
+            printf("%s:   edge %02x\n", test_name, edge->mac_addr[5]);
+        }
+    }
+}
+
+
+/* the state of a community to compare after the reload */
+struct snapshot {
+    struct sn_community *comm;
+    struct speck_context_t *ctx_static;
+    uint8_t dynamic_key[N2N_AUTH_CHALLENGE_SIZE];
+    void *alice_secret;
+};
+
+
+static void take_snapshot (struct n3n_runtime_data *sss, const char *name, struct snapshot *snap) {
+
+    sn_user_t *user, *tmp_user;
+
+    memset(snap, 0, sizeof(*snap));
+    HASH_FIND_STR(sss->communities, name, snap->comm);
+    snap->ctx_static = snap->comm->header_encryption_ctx_static;
+    memcpy(snap->dynamic_key, snap->comm->dynamic_key, sizeof(snap->dynamic_key));
+    HASH_ITER(hh, snap->comm->allowed_users, user, tmp_user) {
+        if(!strcmp((char *)user->name, "alice")) {
+            snap->alice_secret = user->shared_secret_ctx;
+        }
+    }
+}
+
+
+static void compare_snapshot (char *test_name, struct n3n_runtime_data *sss, const char *name, struct snapshot *snap) {
+
+    struct sn_community *comm;
+    sn_user_t *user, *tmp_user;
+    void *alice_secret = NULL;
+
+    HASH_FIND_STR(sss->communities, name, comm);
+    HASH_ITER(hh, comm->allowed_users, user, tmp_user) {
+        if(!strcmp((char *)user->name, "alice")) {
+            alice_secret = user->shared_secret_ctx;
+        }
+    }
+
+    printf("%s: '%s' same community %d, same static key %d, same dynamic key %d, same secret for alice %d\n",
+           test_name, name,
+           comm == snap->comm,
+           comm->header_encryption_ctx_static == snap->ctx_static,
+           !memcmp(comm->dynamic_key, snap->dynamic_key, sizeof(snap->dynamic_key)),
+           alice_secret && (alice_secret == snap->alice_secret));
+}
+
+
+void test_load (struct n3n_runtime_data *sss) {
+    char *test_name = "load";
+
+    write_list(list_before);
+    printf("%s: ret = %d\n", test_name, load_allowed_sn_community(sss));
+    // as the supernode does once the list is read for the first time
+    calculate_shared_secrets(sss);
+    print_communities(test_name, sss);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+
+void test_reload (struct n3n_runtime_data *sss) {
+    char *test_name = "reload";
+    struct snapshot keep, users;
+
+    add_edge(sss, "keep", 0x01, NULL);
+    add_edge(sss, "keep_net", 0x02, NULL);
+    add_edge(sss, "gone", 0x03, NULL);
+    add_edge(sss, "users", 0x04, KEY_ALICE);
+    add_edge(sss, "users", 0x05, KEY_BOB);
+    add_edge(sss, "to_users", 0x06, NULL);
+    add_edge(sss, "from_users", 0x07, KEY_DAVE);
+
+    take_snapshot(sss, "keep", &keep);
+    take_snapshot(sss, "users", &users);
+
+    write_list(list_after);
+    printf("%s: ret = %d\n", test_name, load_allowed_sn_community(sss));
+    print_communities(test_name, sss);
+
+    compare_snapshot(test_name, sss, "keep", &keep);
+    compare_snapshot(test_name, sss, "users", &users);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+
+int main (int argc, char * argv[]) {
+
+    struct n3n_runtime_data sss;
+
+    setTraceLevel(0);
+
+    sn_init_conf_defaults(&sss, NULL);
+    sss.conf.community_file = LIST_FILE;
+    sss.sock = -1;
+
+    sss.federation = calloc(1, sizeof(struct sn_community));
+    comm_init(sss.federation, "*Federation");
+    sss.federation->is_federation = true;
+    HASH_ADD_STR(sss.communities, community, sss.federation);
+
+    test_load(&sss);
+    test_reload(&sss);
+
+    remove(LIST_FILE);
+
+    return 0;
+}
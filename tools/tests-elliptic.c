@@ -20,7 +20,7 @@
 
 
 #include <stdio.h>       // for printf, fprintf, stdout, stderr
-#include <string.h>      // for memset
+#include <string.h>      // for memset, memcpy, memcmp
 #include "curve25519.h"  // for curve25519
 #include "hexdump.h"     // for fhexdump
 
@@ -38,6 +38,41 @@ void test_curve25519 (unsigned char *pkt_input, unsigned char *key) {
     printf("\n");
 }
 
+// the iterated test of RFC 7748, cross checked against the reference code
+void test_curve25519_iterated (void) {
+    char *test_name = "curve25519 iterated";
+    unsigned char k[32], u[32], r[32], k_ref[32], u_ref[32];
+    int i;
+
+    memset(k, 0, sizeof(k));
+    k[0] = 9;
+    memcpy(u, k, sizeof(u));
+    memcpy(k_ref, k, sizeof(k_ref));
+    memcpy(u_ref, u, sizeof(u_ref));
+
+    for(i = 0; i < 1000; i++) {
+        curve25519(r, k, u);
+        memcpy(u, k, sizeof(u));
+        memcpy(k, r, sizeof(k));
+
+        curve25519_ref(r, k_ref, u_ref);
+        memcpy(u_ref, k_ref, sizeof(u_ref));
+        memcpy(k_ref, r, sizeof(k_ref));
+
+        if(memcmp(k, k_ref, sizeof(k))) {
+            fprintf(stderr, "%s: differs from the reference code after %i iterations\n", test_name, i + 1);
+            break;
+        }
+    }
+
+    printf("%s: output\n", test_name);
+    fhexdump(0, k, sizeof(k), stdout);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+
 int main (int argc, char * argv[]) {
     char *test_name = "environment";
 
@@ -56,6 +91,7 @@ int main (int argc, char * argv[]) {
     printf("\n");
 
     test_curve25519(pkt_input, key);
+    test_curve25519_iterated();
 
     return 0;
 }
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Check the longest prefix matching of the layer 3 routes with overlapping
+ * prefixes of mixed lengths, as they are added, refreshed and purged.
+ */
+
+#include <stdint.h>     // for uint32_t, uint8_t
+#include <stdio.h>      // for printf, fprintf, stderr
+#include <string.h>     // for memset
+#include "../src/ip_routes.h"  // for ip_routes_add, ip_routes_lookup, ip_ro...
+
+
+static uint32_t ip (uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+
+    return ((uint32_t)a << 24) | ((uint32_t)b << 16) | ((uint32_t)c << 8) | d;
+}
+
+
+static void init_mac (n2n_mac_t mac, uint8_t last) {
+
+    memset(mac, 0, sizeof(n2n_mac_t));
+    mac[0] = 0x02;
+    mac[5] = last;
+}
+
+
+static void print_lookup (char *test_name, struct ip_routes *routes, uint32_t addr) {
+
+    struct ip_route *route = ip_routes_lookup(routes, addr);
+
+    printf("%s: %u.%u.%u.%u -> ",
+           test_name,
+           addr >> 24, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff);
+    if(route) {
+        printf("%02x:%02x:%02x:%02x:%02x:%02x (net 0x%08x)\n",
+               route->mac_addr[0], route->mac_addr[1], route->mac_addr[2],
+               route->mac_addr[3], route->mac_addr[4], route->mac_addr[5],
+               route->net);
+    } else {
+        printf("none\n");
+    }
+}
+
+
+static void print_lens (char *test_name, struct ip_routes *routes) {
+
+    printf("%s: lens = 0x%09llx\n", test_name, (unsigned long long)routes->lens);
+}
+
+
+void test_insert (struct ip_routes *routes) {
+    char *test_name = "insert";
+    n2n_mac_t mac;
+
+    init_mac(mac, 1);
+    ip_routes_add(routes, ip(0, 0, 0, 0), 0, mac, 100);        // default route
+    init_mac(mac, 2);
+    ip_routes_add(routes, ip(10, 0, 0, 0), 8, mac, 100);
+    init_mac(mac, 3);
+    ip_routes_add(routes, ip(10, 1, 0, 0), 16, mac, 200);
+    init_mac(mac, 4);
+    ip_routes_add(routes, ip(10, 1, 2, 0), 24, mac, 100);
+    init_mac(mac, 5);
+    ip_routes_add(routes, ip(10, 1, 2, 3), 32, mac, 200);
+    init_mac(mac, 6);
+    ip_routes_add(routes, ip(10, 1, 2, 99), 24, mac, 200);     // host bits are masked, refreshes the /24
+    init_mac(mac, 7);
+    ip_routes_add(routes, ip(10, 1, 2, 3), 33, mac, 200);      // bad prefix length, ignored
+
+    print_lens(test_name, routes);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+
+void test_lookup (struct ip_routes *routes) {
+    char *test_name = "lookup";
+
+    print_lookup(test_name, routes, ip(10, 1, 2, 3));
+    print_lookup(test_name, routes, ip(10, 1, 2, 4));
+    print_lookup(test_name, routes, ip(10, 1, 3, 1));
+    print_lookup(test_name, routes, ip(10, 2, 0, 1));
+    print_lookup(test_name, routes, ip(192, 168, 1, 1));
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+
+void test_expiry (struct ip_routes *routes) {
+    char *test_name = "expiry";
+    size_t purged;
+
+    // the default and the /8 were last seen at 100
+    purged = ip_routes_purge(routes, 150);
+    printf("%s: purged = %u\n", test_name, (unsigned int)purged);
+    print_lens(test_name, routes);
+
+    print_lookup(test_name, routes, ip(10, 1, 2, 3));
+    print_lookup(test_name, routes, ip(10, 1, 2, 4));
+    print_lookup(test_name, routes, ip(10, 2, 0, 1));
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+
+void test_delete (struct ip_routes *routes) {
+    char *test_name = "delete";
+    n2n_mac_t mac;
+    size_t purged;
+
+    // refresh the /32 only, so the /16 and the /24 go next
+    init_mac(mac, 8);
+    ip_routes_add(routes, ip(10, 1, 2, 3), 32, mac, 300);
+    purged = ip_routes_purge(routes, 250);
+    printf("%s: purged = %u\n", test_name, (unsigned int)purged);
+    print_lens(test_name, routes);
+
+    print_lookup(test_name, routes, ip(10, 1, 2, 3));
+    print_lookup(test_name, routes, ip(10, 1, 2, 4));
+
+    ip_routes_clear(routes);
+    print_lens(test_name, routes);
+    print_lookup(test_name, routes, ip(10, 1, 2, 3));
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+
+int main (int argc, char * argv[]) {
+
+    struct ip_routes routes;
+
+    memset(&routes, 0, sizeof(routes));
+
+    test_insert(&routes);
+    test_lookup(&routes);
+    test_expiry(&routes);
+    test_delete(&routes);
+
+    return 0;
+}
@@ -0,0 +1,384 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Feed crafted IGMP and MLD reports to the multicast snooping and check the
+ * groups it ends up with, including the reports cut short or claiming more
+ * records than they carry, and the list overflowing an MCAST_GROUPS.
+ */
+
+#include <stdbool.h>    // for bool
+#include <stdint.h>     // for uint8_t, uint16_t
+#include <stdio.h>      // for printf, fprintf, stderr
+#include <string.h>     // for memset
+#include "n2n_define.h" // for N2N_MCAST_MAX_GROUPS
+#include "../src/mcast_groups.h"  // for mcast_snoop_frame, mcast_groups_list
+
+#define NOW         1000
+#define LEAVE       900     /* when a group left expires */
+
+#define IGMP3_OFFSET    (14 + 20)       /* ethernet and IPv4 header */
+#define MLD2_OFFSET     (14 + 40 + 8)   /* ethernet, IPv6 and hop-by-hop header */
+
+
+/* An IGMPv3 record for 239.1.x.y with nsrc sources and aux_len words of aux data */
+static size_t igmp3_record (uint8_t *rec, uint8_t type, uint8_t x, uint8_t y,
+                            uint16_t nsrc, uint8_t aux_len) {
+
+    size_t len = 8 + 4 * nsrc + 4 * aux_len;
+
+    memset(rec, 0, len);
+    rec[0] = type;
+    rec[1] = aux_len;
+    rec[2] = nsrc >> 8;
+    rec[3] = nsrc & 0xff;
+    rec[4] = 239; rec[5] = 1; rec[6] = x; rec[7] = y;
+    while(nsrc--) {
+        rec[8 + 4 * nsrc] = 10;
+        rec[11 + 4 * nsrc] = nsrc + 1;
+    }
+
+    return len;
+}
+
+
+/* An MLDv2 record for ff15::x:y with nsrc sources and aux_len words of aux data */
+static size_t mld2_record (uint8_t *rec, uint8_t type, uint8_t x, uint8_t y,
+                           uint16_t nsrc, uint8_t aux_len) {
+
+    size_t len = 20 + 16 * nsrc + 4 * aux_len;
+
+    memset(rec, 0, len);
+    rec[0] = type;
+    rec[1] = aux_len;
+    rec[2] = nsrc >> 8;
+    rec[3] = nsrc & 0xff;
+    rec[4] = 0xff; rec[5] = 0x15; rec[17] = x; rec[19] = y;
+    while(nsrc--) {
+        rec[20 + 16 * nsrc] = 0xfe;
+        rec[21 + 16 * nsrc] = 0x80;
+        rec[35 + 16 * nsrc] = nsrc + 1;
+    }
+
+    return len;
+}
+
+
+/* Wrap len bytes of IGMP message into a frame to 224.0.0.22 */
+static size_t igmp_frame (uint8_t *frame, size_t len) {
+
+    uint8_t *ip = frame + 14;
+    size_t total = 20 + len;
+
+    memset(frame, 0, IGMP3_OFFSET);
+    frame[0] = 0x01; frame[1] = 0x00; frame[2] = 0x5e; frame[5] = 0x16;
+    frame[6] = 0x02; frame[11] = 0x0a;
+    frame[12] = 0x08; frame[13] = 0x00;
+    ip[0] = 0x45;
+    ip[2] = total >> 8;
+    ip[3] = total & 0xff;
+    ip[8] = 1;
+    ip[9] = 2;
+    ip[12] = 10; ip[15] = 1;
+    ip[16] = 224; ip[19] = 22;
+
+    return 14 + total;
+}
+
+
+/* Wrap len bytes of MLD message into a frame to ff02::16 */
+static size_t mld_frame (uint8_t *frame, size_t len) {
+
+    uint8_t *ip6 = frame + 14;
+    uint8_t *hbh = ip6 + 40;
+    size_t payload = 8 + len;
+
+    memset(frame, 0, MLD2_OFFSET);
+    frame[0] = 0x33; frame[1] = 0x33; frame[5] = 0x16;
+    frame[6] = 0x02; frame[11] = 0x0a;
+    frame[12] = 0x86; frame[13] = 0xdd;
+    ip6[0] = 0x60;
+    ip6[4] = payload >> 8;
+    ip6[5] = payload & 0xff;
+    ip6[6] = 0;                                 /* hop-by-hop options */
+    ip6[7] = 1;
+    ip6[8] = 0xfe; ip6[9] = 0x80; ip6[23] = 0x0a;
+    ip6[24] = 0xff; ip6[25] = 0x02; ip6[39] = 0x16;
+    hbh[0] = 58;
+    hbh[2] = 0x05; hbh[3] = 0x02;               /* router alert, MLD */
+    hbh[6] = 0x01;                              /* PadN */
+
+    return 14 + 40 + payload;
+}
+
+
+/* The IGMPv3 or MLDv2 report header for num records */
+static void report_header (uint8_t *msg, uint8_t type, uint16_t num) {
+
+    memset(msg, 0, 8);
+    msg[0] = type;
+    msg[6] = num >> 8;
+    msg[7] = num & 0xff;
+}
+
+
+static void print_groups (char *test_name, struct mcast_group *groups) {
+
+    struct mcast_group *group, *tmp;
+
+    printf("%s: %u groups\n", test_name, HASH_COUNT(groups));
+    HASH_ITER(hh, groups, group, tmp) {
+        printf("%s:   %02x:%02x:%02x:%02x:%02x:%02x last_seen = %u\n",
+               test_name,
+               group->mac[0], group->mac[1], group->mac[2],
+               group->mac[3], group->mac[4], group->mac[5],
+               (unsigned int)group->last_seen);
+    }
+}
+
+
+void test_igmp_mix (void) {
+    char *test_name = "igmp mix";
+    struct mcast_group *groups = NULL;
+    uint8_t frame[1500];
+    uint8_t *msg = frame + IGMP3_OFFSET;
+    size_t len = 8;
+    int ret;
+
+    // joins .1 with a source, .2 and .3, the latter with aux data, and
+    // leaves .1 again; blocking sources and 224.0.0.251 change nothing
+    len += igmp3_record(msg + len, 1 /* MODE_IS_INCLUDE */, 0, 1, 1, 0);
+    len += igmp3_record(msg + len, 2 /* MODE_IS_EXCLUDE */, 0, 2, 0, 0);
+    len += igmp3_record(msg + len, 5 /* ALLOW_NEW_SOURCES */, 0, 3, 2, 1);
+    len += igmp3_record(msg + len, 6 /* BLOCK_OLD_SOURCES */, 0, 4, 1, 0);
+    len += igmp3_record(msg + len, 3 /* CHANGE_TO_INCLUDE */, 0, 1, 0, 0);
+    len += igmp3_record(msg + len, 4 /* CHANGE_TO_EXCLUDE */, 0, 0, 0, 0);
+    msg[len - 4] = 224; msg[len - 3] = 0; msg[len - 2] = 0; msg[len - 1] = 251;
+    report_header(msg, 0x22, 6);
+
+    ret = mcast_snoop_frame(&groups, frame, igmp_frame(frame, len), NOW, LEAVE);
+    printf("%s: ret = %d\n", test_name, ret);
+    print_groups(test_name, groups);
+
+    // IGMPv2 join and leave of 239.2.2.2
+    memset(msg, 0, 8);
+    msg[0] = 0x16;
+    msg[4] = 239; msg[5] = 2; msg[6] = 2; msg[7] = 2;
+    ret = mcast_snoop_frame(&groups, frame, igmp_frame(frame, 8), NOW, LEAVE);
+    printf("%s: v2 report = %d\n", test_name, ret);
+    msg[0] = 0x17;
+    ret = mcast_snoop_frame(&groups, frame, igmp_frame(frame, 8), NOW, LEAVE);
+    printf("%s: v2 leave = %d\n", test_name, ret);
+    print_groups(test_name, groups);
+
+    mcast_groups_clear(&groups);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+
+void test_igmp_truncated (void) {
+    char *test_name = "igmp truncated";
+    struct mcast_group *groups = NULL;
+    uint8_t frame[1500];
+    uint8_t *msg = frame + IGMP3_OFFSET;
+    size_t len = 8, flen;
+    int ret;
+
+    // claims five records, but only carries two
+    len += igmp3_record(msg + len, 2, 0, 1, 0, 0);
+    len += igmp3_record(msg + len, 2, 0, 2, 0, 0);
+    report_header(msg, 0x22, 5);
+    ret = mcast_snoop_frame(&groups, frame, igmp_frame(frame, len), NOW, LEAVE);
+    printf("%s: too many records = %d\n", test_name, ret);
+    print_groups(test_name, groups);
+    mcast_groups_clear(&groups);
+
+    // the last record claims three sources, only one is there
+    len = 8;
+    len += igmp3_record(msg + len, 2, 0, 1, 0, 0);
+    len += igmp3_record(msg + len, 1, 0, 2, 3, 0) - 8;
+    report_header(msg, 0x22, 2);
+    ret = mcast_snoop_frame(&groups, frame, igmp_frame(frame, len), NOW, LEAVE);
+    printf("%s: short record = %d\n", test_name, ret);
+    print_groups(test_name, groups);
+    mcast_groups_clear(&groups);
+
+    // the last record's aux data is missing
+    len = 8;
+    len += igmp3_record(msg + len, 2, 0, 1, 0, 0);
+    len += igmp3_record(msg + len, 2, 0, 2, 0, 2) - 8;
+    report_header(msg, 0x22, 2);
+    ret = mcast_snoop_frame(&groups, frame, igmp_frame(frame, len), NOW, LEAVE);
+    printf("%s: short aux data = %d\n", test_name, ret);
+    print_groups(test_name, groups);
+    mcast_groups_clear(&groups);
+
+    // the IP total length is larger than the frame
+    len = 8;
+    len += igmp3_record(msg + len, 2, 0, 1, 0, 0);
+    report_header(msg, 0x22, 1);
+    flen = igmp_frame(frame, len);
+    ret = mcast_snoop_frame(&groups, frame, flen - 1, NOW, LEAVE);
+    printf("%s: short frame = %d\n", test_name, ret);
+
+    // not even the IP header
+    ret = mcast_snoop_frame(&groups, frame, 14 + 19, NOW, LEAVE);
+    printf("%s: no header = %d\n", test_name, ret);
+    print_groups(test_name, groups);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+
+void test_mld (void) {
+    char *test_name = "mld";
+    struct mcast_group *groups = NULL;
+    uint8_t frame[1500];
+    uint8_t *msg = frame + MLD2_OFFSET;
+    size_t len = 8;
+    int ret;
+
+    // joins ff15::1:1 with a source and ff15::1:2 with aux data, leaves
+    // ff15::1:1 again, and ff15::1:3 is cut short
+    len += mld2_record(msg + len, 1 /* MODE_IS_INCLUDE */, 1, 1, 1, 0);
+    len += mld2_record(msg + len, 2 /* MODE_IS_EXCLUDE */, 1, 2, 0, 1);
+    len += mld2_record(msg + len, 3 /* CHANGE_TO_INCLUDE */, 1, 1, 0, 0);
+    len += mld2_record(msg + len, 4 /* CHANGE_TO_EXCLUDE */, 1, 3, 1, 0) - 1;
+    report_header(msg, 143, 4);
+
+    ret = mcast_snoop_frame(&groups, frame, mld_frame(frame, len), NOW, LEAVE);
+    printf("%s: ret = %d\n", test_name, ret);
+    print_groups(test_name, groups);
+
+    // MLDv1 report and done for ff15::2:2
+    memset(msg, 0, 24);
+    msg[0] = 131;
+    msg[8] = 0xff; msg[9] = 0x15; msg[21] = 2; msg[23] = 2;
+    ret = mcast_snoop_frame(&groups, frame, mld_frame(frame, 24), NOW, LEAVE);
+    printf("%s: v1 report = %d\n", test_name, ret);
+    msg[0] = 132;
+    ret = mcast_snoop_frame(&groups, frame, mld_frame(frame, 24), NOW, LEAVE);
+    printf("%s: v1 done = %d\n", test_name, ret);
+    ret = mcast_snoop_frame(&groups, frame, mld_frame(frame, 23), NOW, LEAVE);
+    printf("%s: v1 short = %d\n", test_name, ret);
+    print_groups(test_name, groups);
+
+    mcast_groups_clear(&groups);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+
+void test_query_answer (void) {
+    char *test_name = "query answer";
+    uint8_t frame[1500];
+    uint8_t *msg = frame + IGMP3_OFFSET;
+    uint8_t *mld = frame + MLD2_OFFSET;
+    size_t len;
+
+    // only the current state, as asked for by a query
+    len = 8;
+    len += igmp3_record(msg + len, 1, 0, 1, 1, 0);
+    len += igmp3_record(msg + len, 2, 0, 2, 0, 1);
+    report_header(msg, 0x22, 2);
+    printf("%s: igmp include/exclude = %d\n", test_name,
+           mcast_is_query_answer(frame, igmp_frame(frame, len)));
+
+    // a change is not an answer
+    len = 8;
+    len += igmp3_record(msg + len, 2, 0, 1, 0, 0);
+    len += igmp3_record(msg + len, 4, 0, 2, 0, 0);
+    report_header(msg, 0x22, 2);
+    printf("%s: igmp with a change = %d\n", test_name,
+           mcast_is_query_answer(frame, igmp_frame(frame, len)));
+
+    // cut short
+    len = 8;
+    len += igmp3_record(msg + len, 2, 0, 1, 0, 0);
+    len += igmp3_record(msg + len, 1, 0, 2, 2, 0) - 4;
+    report_header(msg, 0x22, 2);
+    printf("%s: igmp truncated = %d\n", test_name,
+           mcast_is_query_answer(frame, igmp_frame(frame, len)));
+
+    // no records
+    report_header(msg, 0x22, 0);
+    printf("%s: igmp empty = %d\n", test_name,
+           mcast_is_query_answer(frame, igmp_frame(frame, 8)));
+
+    len = 8;
+    len += mld2_record(mld + len, 2, 1, 1, 0, 0);
+    len += mld2_record(mld + len, 1, 1, 2, 1, 0);
+    report_header(mld, 143, 2);
+    printf("%s: mld include/exclude = %d\n", test_name,
+           mcast_is_query_answer(frame, mld_frame(frame, len)));
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+
+void test_overflow (void) {
+    char *test_name = "overflow";
+    struct mcast_group *groups = NULL;
+    struct mcast_group *sn_groups = NULL;
+    n2n_mac_t list[N2N_MCAST_MAX_GROUPS];
+    n2n_mac_t edge = {0x02, 0x00, 0x00, 0x00, 0x00, 0x0a};
+    uint8_t frame[1500];
+    uint8_t *msg = frame + IGMP3_OFFSET;
+    size_t len;
+    uint8_t num;
+    bool overflow;
+    int i;
+
+    // as many groups as fit in one MCAST_GROUPS
+    len = 8;
+    for(i = 0; i < N2N_MCAST_MAX_GROUPS; i++) {
+        len += igmp3_record(msg + len, 2, 0, i + 1, 0, 0);
+    }
+    report_header(msg, 0x22, N2N_MCAST_MAX_GROUPS);
+    mcast_snoop_frame(&groups, frame, igmp_frame(frame, len), NOW, LEAVE);
+
+    num = mcast_groups_list(groups, list, N2N_MCAST_MAX_GROUPS, &overflow);
+    printf("%s: %u groups listed = %u, overflow = %d\n",
+           test_name, HASH_COUNT(groups), num, overflow);
+
+    // the supernode takes them
+    mcast_groups_report(&sn_groups, edge, list, num, NOW);
+    printf("%s: supernode has %u groups\n", test_name, HASH_COUNT(sn_groups));
+
+    // one more
+    len = 8;
+    len += igmp3_record(msg + len, 2, 1, 1, 0, 0);
+    report_header(msg, 0x22, 1);
+    mcast_snoop_frame(&groups, frame, igmp_frame(frame, len), NOW, LEAVE);
+
+    num = mcast_groups_list(groups, list, N2N_MCAST_MAX_GROUPS, &overflow);
+    printf("%s: %u groups listed = %u, overflow = %d\n",
+           test_name, HASH_COUNT(groups), num, overflow);
+
+    // the supernode drops the edge from all groups and sends it every frame
+    mcast_groups_report(&sn_groups, edge, NULL, 0, NOW);
+    printf("%s: supernode has %u groups\n", test_name, HASH_COUNT(sn_groups));
+
+    mcast_groups_clear(&groups);
+    mcast_groups_clear(&sn_groups);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+
+int main (int argc, char * argv[]) {
+
+    test_igmp_mix();
+    test_igmp_truncated();
+    test_mld();
+    test_query_answer();
+    test_overflow();
+
+    return 0;
+}
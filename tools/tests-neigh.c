@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2024 Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Check the ARP replies and IPv6 neighbour advertisements the proxy cache
+ * answers with against known-good frames, and that it leaves the probes,
+ * announcements and unknown addresses alone.
+ */
+
+#include <stdint.h>     // for uint8_t
+#include <stdio.h>      // for printf, fprintf, stderr, stdout
+#include <stdlib.h>     // for exit
+#include <string.h>     // for memcmp, memcpy, memset
+#include "hexdump.h"    // for fhexdump
+#include "../src/neigh_cache.h"  // for neigh_cache_learn_frame, neigh_proxy_...
+
+#ifdef _WIN32
+#include "../src/win32/defs.h"
+#else
+#include <sys/socket.h> // for AF_INET, AF_INET6
+#endif
+
+
+// 10.0.0.1 at 02:00:00:00:00:0a asks for 10.0.0.2
+static const uint8_t arp_request[] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x02, 0x00, 0x00, 0x00, 0x00, 0x0a, 0x08, 0x06,
+    0x00, 0x01, 0x08, 0x00, 0x06, 0x04, 0x00, 0x01,
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x0a, 0x0a, 0x00, 0x00, 0x01,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x02
+};
+
+// 10.0.0.2 is at 02:00:00:00:00:0b
+static const uint8_t arp_reply[] = {
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x0a, 0x02, 0x00, 0x00, 0x00, 0x00, 0x0b, 0x08, 0x06,
+    0x00, 0x01, 0x08, 0x00, 0x06, 0x04, 0x00, 0x02,
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x0b, 0x0a, 0x00, 0x00, 0x02,
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x0a, 0x0a, 0x00, 0x00, 0x01
+};
+
+// fe80::a at 02:00:00:00:00:0a solicits fe80::2
+static const uint8_t ns_request[] = {
+    0x33, 0x33, 0xff, 0x00, 0x00, 0x02, 0x02, 0x00, 0x00, 0x00, 0x00, 0x0a, 0x86, 0xdd,
+    0x60, 0x00, 0x00, 0x00, 0x00, 0x20, 0x3a, 0xff,
+    0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0a,
+    0xff, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0xff, 0x00, 0x00, 0x02,
+    0x87, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02,
+    0x01, 0x01, 0x02, 0x00, 0x00, 0x00, 0x00, 0x0a
+};
+
+// fe80::2 is at 02:00:00:00:00:0b, solicited and override, checksum 0x1808
+static const uint8_t na_reply[] = {
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x0a, 0x02, 0x00, 0x00, 0x00, 0x00, 0x0b, 0x86, 0xdd,
+    0x60, 0x00, 0x00, 0x00, 0x00, 0x20, 0x3a, 0xff,
+    0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02,
+    0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0a,
+    0x88, 0x00, 0x18, 0x08, 0x60, 0x00, 0x00, 0x00,
+    0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02,
+    0x02, 0x01, 0x02, 0x00, 0x00, 0x00, 0x00, 0x0b
+};
+
+static const n2n_mac_t mac_b = {0x02, 0x00, 0x00, 0x00, 0x00, 0x0b};
+static const uint8_t ip4_b[] = {0x0a, 0x00, 0x00, 0x02};
+static const uint8_t ip6_b[] = {
+    0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02
+};
+
+
+static void check_answer (char *test_name,
+                          struct neigh_entry *cache,
+                          const uint8_t *request,
+                          size_t request_len,
+                          const uint8_t *expected,
+                          size_t expected_len) {
+
+    uint8_t reply[NEIGH_REPLY_SIZE];
+    size_t len;
+
+    len = neigh_proxy_answer(cache, reply, sizeof(reply), request, request_len);
+
+    printf("%s: reply size = %u\n", test_name, (unsigned int)len);
+    fhexdump(0, reply, len, stdout);
+
+    if((len != expected_len) || memcmp(reply, expected, len)) {
+        fprintf(stderr, "%s: reply mismatch\n", test_name);
+        exit(1);
+    }
+}
+
+
+void test_arp (struct neigh_entry **cache) {
+    char *test_name = "arp";
+    uint8_t request[sizeof(arp_request)];
+    uint8_t reply[NEIGH_REPLY_SIZE];
+
+    neigh_cache_learn(cache, AF_INET, ip4_b, mac_b, 100);
+    check_answer(test_name, *cache, arp_request, sizeof(arp_request), arp_reply, sizeof(arp_reply));
+
+    // the reply alone, for a MAC not taken from the cache
+    printf("%s: neigh_arp_reply = %u\n", test_name,
+           (unsigned int)neigh_arp_reply(reply, sizeof(reply), arp_request, sizeof(arp_request), mac_b));
+    if(memcmp(reply, arp_reply, sizeof(arp_reply))) {
+        fprintf(stderr, "%s: reply mismatch\n", test_name);
+        exit(1);
+    }
+
+    // a probe, from 0.0.0.0
+    memcpy(request, arp_request, sizeof(request));
+    memset(&request[28], 0, 4);
+    printf("%s: probe = %u\n", test_name,
+           (unsigned int)neigh_proxy_answer(*cache, reply, sizeof(reply), request, sizeof(request)));
+
+    // an announcement, asking for its own address
+    memcpy(&request[28], ip4_b, 4);
+    memcpy(&request[38], ip4_b, 4);
+    printf("%s: announcement = %u\n", test_name,
+           (unsigned int)neigh_proxy_answer(*cache, reply, sizeof(reply), request, sizeof(request)));
+
+    // an address not in the cache
+    memcpy(request, arp_request, sizeof(request));
+    request[41] = 0x03;
+    printf("%s: unknown = %u\n", test_name,
+           (unsigned int)neigh_proxy_answer(*cache, reply, sizeof(reply), request, sizeof(request)));
+
+    // cut short
+    printf("%s: truncated = %u\n", test_name,
+           (unsigned int)neigh_proxy_answer(*cache, reply, sizeof(reply), arp_request, sizeof(arp_request) - 1));
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+
+void test_na (struct neigh_entry **cache) {
+    char *test_name = "na";
+    uint8_t request[sizeof(ns_request)];
+    uint8_t reply[NEIGH_REPLY_SIZE];
+
+    neigh_cache_learn(cache, AF_INET6, ip6_b, mac_b, 100);
+    check_answer(test_name, *cache, ns_request, sizeof(ns_request), na_reply, sizeof(na_reply));
+
+    // duplicate address detection, from ::
+    memcpy(request, ns_request, sizeof(request));
+    memset(&request[22], 0, 16);
+    printf("%s: probe = %u\n", test_name,
+           (unsigned int)neigh_proxy_answer(*cache, reply, sizeof(reply), request, sizeof(request)));
+
+    // not from a neighbour, the hop limit was decremented
+    memcpy(request, ns_request, sizeof(request));
+    request[21] = 254;
+    printf("%s: routed = %u\n", test_name,
+           (unsigned int)neigh_proxy_answer(*cache, reply, sizeof(reply), request, sizeof(request)));
+
+    // an address not in the cache
+    memcpy(request, ns_request, sizeof(request));
+    request[77] = 0x03;
+    printf("%s: unknown = %u\n", test_name,
+           (unsigned int)neigh_proxy_answer(*cache, reply, sizeof(reply), request, sizeof(request)));
+
+    // no room for the reply
+    printf("%s: short buffer = %u\n", test_name,
+           (unsigned int)neigh_proxy_answer(*cache, reply, sizeof(na_reply) - 1, ns_request, sizeof(ns_request)));
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+
+void test_learn (struct neigh_entry **cache) {
+    char *test_name = "learn";
+    struct neigh_entry *entry;
+    uint8_t reply[NEIGH_REPLY_SIZE];
+
+    neigh_cache_clear(cache);
+
+    // the reply frames carry the bindings the requests are then answered from
+    neigh_cache_learn_frame(cache, arp_reply, sizeof(arp_reply), 200);
+    neigh_cache_learn_frame(cache, na_reply, sizeof(na_reply), 200);
+
+    entry = neigh_cache_find(*cache, AF_INET, ip4_b);
+    printf("%s: 10.0.0.2 %s\n", test_name, entry ? "found" : "missing");
+    entry = neigh_cache_find(*cache, AF_INET6, ip6_b);
+    printf("%s: fe80::2 %s\n", test_name, entry ? "found" : "missing");
+
+    printf("%s: arp = %u\n", test_name,
+           (unsigned int)neigh_proxy_answer(*cache, reply, sizeof(reply), arp_request, sizeof(arp_request)));
+    printf("%s: na = %u\n", test_name,
+           (unsigned int)neigh_proxy_answer(*cache, reply, sizeof(reply), ns_request, sizeof(ns_request)));
+
+    printf("%s: purged = %u\n", test_name, (unsigned int)neigh_cache_purge(cache, 300));
+    printf("%s: arp after purge = %u\n", test_name,
+           (unsigned int)neigh_proxy_answer(*cache, reply, sizeof(reply), arp_request, sizeof(arp_request)));
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+
+int main (int argc, char * argv[]) {
+
+    struct neigh_entry *cache = NULL;
+
+    test_arp(&cache);
+    test_na(&cache);
+    test_learn(&cache);
+
+    neigh_cache_clear(&cache);
+
+    return 0;
+}
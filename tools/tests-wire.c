@@ -19,6 +19,7 @@
  */
 
 
+#include <stddef.h>    // for offsetof
 #include <stdint.h>    // for uint8_t
 #include <stdio.h>     // for printf, fprintf, size_t, stderr, stdout
 #include <string.h>    // for memset, strcpy, strncpy
@@ -522,6 +523,105 @@ void pattern_QUERY_PEER_print () {
     printf("\n");
 }
 
+void pattern_RELAY_INFO_prep1 () {
+    printf("%s:\n", __func__);
+    fprintf(stderr,"%s:\n", __func__);
+
+    pattern_init_out_buffers();
+    pattern_memset(&in_common, sizeof(in_common), 0);
+    pattern_memset(&in_data, sizeof(n2n_RELAY_INFO_t), sizeof(in_common));
+
+    n2n_RELAY_INFO_t *ri = (n2n_RELAY_INFO_t *)&in_data;
+    ri->num_peers = 2;
+}
+
+void pattern_RELAY_INFO_codec () {
+    encode_RELAY_INFO(pktbuf, &pktbuf_size, &in_common, (n2n_RELAY_INFO_t *)&in_data);
+
+    size_t rem = pktbuf_size;
+    size_t idx = 0;
+    decode_common(&out_common, pktbuf, &rem, &idx);
+    decode_RELAY_INFO((n2n_RELAY_INFO_t *)&out_data, &out_common, pktbuf, &rem, &idx);
+
+}
+
+void pattern_RELAY_INFO_print () {
+    pattern_print_pktbuf();
+    pattern_print_common();
+
+    // Only the peers that are in use
+    printf("out_data:\n");
+    fhexdump(0, (void *)&out_data, offsetof(n2n_RELAY_INFO_t, peers[2]), stdout);
+
+    printf("\n");
+}
+
+void pattern_MCAST_GROUPS_prep1 () {
+    printf("%s:\n", __func__);
+    fprintf(stderr,"%s:\n", __func__);
+
+    pattern_init_out_buffers();
+    pattern_memset(&in_common, sizeof(in_common), 0);
+    pattern_memset(&in_data, sizeof(n2n_MCAST_GROUPS_t), sizeof(in_common));
+
+    n2n_MCAST_GROUPS_t *mg = (n2n_MCAST_GROUPS_t *)&in_data;
+    mg->num_groups = 2;
+}
+
+void pattern_MCAST_GROUPS_codec () {
+    encode_MCAST_GROUPS(pktbuf, &pktbuf_size, &in_common, (n2n_MCAST_GROUPS_t *)&in_data);
+
+    size_t rem = pktbuf_size;
+    size_t idx = 0;
+    decode_common(&out_common, pktbuf, &rem, &idx);
+    decode_MCAST_GROUPS((n2n_MCAST_GROUPS_t *)&out_data, &out_common, pktbuf, &rem, &idx);
+
+}
+
+void pattern_MCAST_GROUPS_print () {
+    pattern_print_pktbuf();
+    pattern_print_common();
+
+    // Only the groups that are in use
+    printf("out_data:\n");
+    fhexdump(0, (void *)&out_data, offsetof(n2n_MCAST_GROUPS_t, groups[2]), stdout);
+
+    printf("\n");
+}
+
+void pattern_BCAST_PEERS_prep1 () {
+    printf("%s:\n", __func__);
+    fprintf(stderr,"%s:\n", __func__);
+
+    pattern_init_out_buffers();
+    pattern_memset(&in_common, sizeof(in_common), 0);
+    pattern_memset(&in_data, sizeof(n2n_BCAST_PEERS_t), sizeof(in_common));
+
+    n2n_BCAST_PEERS_t *bp = (n2n_BCAST_PEERS_t *)&in_data;
+    bp->num_peers = 2;
+}
+
+void pattern_BCAST_PEERS_codec () {
+    encode_BCAST_PEERS(pktbuf, &pktbuf_size, &in_common, (n2n_BCAST_PEERS_t *)&in_data);
+
+    size_t rem = pktbuf_size;
+    size_t idx = 0;
+    decode_common(&out_common, pktbuf, &rem, &idx);
+    decode_BCAST_PEERS((n2n_BCAST_PEERS_t *)&out_data, &out_common, pktbuf, &rem, &idx);
+
+}
+
+void pattern_BCAST_PEERS_print () {
+    pattern_print_pktbuf();
+    pattern_print_common();
+
+    // Only the peers that are in use
+    printf("out_data:\n");
+    fhexdump(0, (void *)&out_data, offsetof(n2n_BCAST_PEERS_t, peers[2]), stdout);
+
+    printf("\n");
+}
+
 void pattern_tests () {
     pattern_REGISTER_prep1();
     pattern_REGISTER_codec();
@@ -563,6 +663,18 @@ void pattern_tests () {
     pattern_QUERY_PEER_codec();
     pattern_QUERY_PEER_print();
 
+    pattern_RELAY_INFO_prep1();
+    pattern_RELAY_INFO_codec();
+    pattern_RELAY_INFO_print();
+
+    pattern_MCAST_GROUPS_prep1();
+    pattern_MCAST_GROUPS_codec();
+    pattern_MCAST_GROUPS_print();
+
+    pattern_BCAST_PEERS_prep1();
+    pattern_BCAST_PEERS_codec();
+    pattern_BCAST_PEERS_print();
+
 }
 
 int main (int argc, char * argv[]) {
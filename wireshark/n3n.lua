@@ -18,6 +18,9 @@ PKT_TYPE_FEDERATION         = 9
 PKT_TYPE_PEER_INFO          = 10
 PKT_TYPE_QUERY_PEER         = 11
 PKT_TYPE_RE_REGISTER_SUPER  = 12
+PKT_TYPE_RELAY_INFO         = 13
+PKT_TYPE_MCAST_GROUPS       = 14
+PKT_TYPE_BCAST_PEERS        = 15
 
 PKT_TRANSFORM_NULL      = 1
 PKT_TRANSFORM_TWOFISH   = 2
@@ -29,6 +32,7 @@ PKT_COMPRESSION_ZSTD    = 3
 
 FLAG_FROM_SUPERNODE   = 0x0020
 FLAG_SOCKET           = 0x0040
+FLAG_RELAYED          = 0x0080
 
 SOCKET_FLAG_AF_INET  = 0x0000
 -- SOCKET_FLAG_?     = 0x2000
@@ -53,6 +57,9 @@ pkt_type_2_str = {
   [PKT_TYPE_FEDERATION] = "federation",
   [PKT_TYPE_PEER_INFO] = "peer_info",
   [PKT_TYPE_QUERY_PEER] = "query_peer",
+  [PKT_TYPE_RELAY_INFO] = "relay_info",
+  [PKT_TYPE_MCAST_GROUPS] = "mcast_groups",
+  [PKT_TYPE_BCAST_PEERS] = "bcast_peers",
 }
 packet_type = ProtoField.uint8("n3n.packet_type", "packetType", base.HEX, pkt_type_2_str, packet_type_mask)
 